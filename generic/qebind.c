@@ -1265,6 +1265,24 @@ int QE_BindEvent(QE_BindingTable bindingTable, QE_Event *eventPtr)
 	return BindEventWrapper(bindingTable, eventPtr, NULL);
 }
 
+/* Returns TRUE if any binding exists for the given event type and detail,
+ * or for the event type without a detail. Scripts may only be evaluated
+ * by QE_BindEvent() for such an event when this returns TRUE. */
+int QE_IsBound(QE_BindingTable bindingTable, int eventType, int detail)
+{
+	BindingTable *bindPtr = (BindingTable *) bindingTable;
+	PatternTableKey key;
+
+	key.type = eventType;
+	key.detail = detail;
+	if (Tcl_FindHashEntry(&bindPtr->patternTable, (char *) &key) != NULL)
+		return 1;
+	if (detail == 0)
+		return 0;
+	key.detail = 0;
+	return Tcl_FindHashEntry(&bindPtr->patternTable, (char *) &key) != NULL;
+}
+
 static char *GetField(char *p, char *copy, int size)
 {
 	int ch = *p;
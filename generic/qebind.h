@@ -64,6 +64,7 @@ MODULE_SCOPE int QE_GetAllBindings(QE_BindingTable bindingTable,
 MODULE_SCOPE int QE_GetEventNames(QE_BindingTable bindingTable);
 MODULE_SCOPE int QE_GetDetailNames(QE_BindingTable bindingTable, char *eventName);
 MODULE_SCOPE int QE_BindEvent(QE_BindingTable bindingTable, QE_Event *eventPtr);
+MODULE_SCOPE int QE_IsBound(QE_BindingTable bindingTable, int eventType, int detail);
 MODULE_SCOPE void QE_ExpandDouble(double number, Tcl_DString *result);
 MODULE_SCOPE void QE_ExpandNumber(long number, Tcl_DString *result);
 MODULE_SCOPE void QE_ExpandString(char *string, Tcl_DString *result);
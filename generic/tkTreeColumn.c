@@ -76,6 +76,10 @@ struct TreeColumnPriv_
 				 * update. */
     int allSpansAreOne;		/* TRUE if all spans cover exactly one column,
 				 * otherwise FALSE. */
+    int allWidthsInvalid;	/* TRUE if TreeColumn.widthOfItems is
+				 * out-of-date for every column but hasn't
+				 * been set to -1 yet. Used inside
+				 * [$T batch] scripts. */
 };
 
 #ifdef UNIFORM_GROUP
@@ -1714,8 +1718,7 @@ Column_Move(
 {
     TreeCtrl *tree = move->tree;
     TreeColumn column, prev, next, last;
-    Tcl_HashEntry *hPtr;
-    Tcl_HashSearch search;
+    int search;
     TreeItem item;
     int index;
 #ifdef DEPRECATED
@@ -1735,11 +1738,10 @@ Column_Move(
     }
 
     /* Move the column in every item */
-    hPtr = Tcl_FirstHashEntry(&tree->itemHash, &search);
-    while (hPtr != NULL) {
-	item = (TreeItem) Tcl_GetHashValue(hPtr);
+    item = Tree_FirstItem(tree, &search);
+    while (item != NULL) {
 	TreeItem_MoveColumn(tree, item, move->index, before->index);
-	hPtr = Tcl_NextHashEntry(&search);
+	item = Tree_NextItem(tree, &search);
     }
 
     /* Indicate that all items must recalculate their list of spans. */
@@ -3267,8 +3269,7 @@ TreeColumnCmd(
 	    TreeColumn prev, next;
 	    int flags = CFO_NOT_NULL | CFO_NOT_TAIL;
 	    TreeItem item;
-	    Tcl_HashEntry *hPtr;
-	    Tcl_HashSearch search;
+	    int search;
 	    int index;
 
 	    if (objc < 4 || objc > 5) {
@@ -3318,11 +3319,10 @@ TreeColumnCmd(
 		    }
 
 		    /* Delete all TreeItemColumns */
-		    hPtr = Tcl_FirstHashEntry(&tree->itemHash, &search);
-		    while (hPtr != NULL) {
-			item = (TreeItem) Tcl_GetHashValue(hPtr);
+		    item = Tree_FirstItem(tree, &search);
+		    while (item != NULL) {
 			TreeItem_RemoveAllColumns(tree, item);
-			hPtr = Tcl_NextHashEntry(&search);
+			item = Tree_NextItem(tree, &search);
 		    }
 
 		    tree->columnTree = NULL;
@@ -3338,12 +3338,11 @@ TreeColumnCmd(
 		}
 
 		/* Delete all TreeItemColumns */
-		hPtr = Tcl_FirstHashEntry(&tree->itemHash, &search);
-		while (hPtr != NULL) {
-		    item = (TreeItem) Tcl_GetHashValue(hPtr);
+		item = Tree_FirstItem(tree, &search);
+		while (item != NULL) {
 		    TreeItem_RemoveColumns(tree, item, column->index,
 			    column->index);
-		    hPtr = Tcl_NextHashEntry(&search);
+		    item = Tree_NextItem(tree, &search);
 		}
 
 		TreeDisplay_ColumnDeleted(tree, column);
@@ -4140,7 +4139,7 @@ TreeItem_RequestWidthInColumns(
 	    }
 	    treeColumn = TreeColumn_Next(treeColumn);
 	    if (itemColumn != NULL)
-		itemColumn = TreeItemColumn_GetNext(tree, itemColumn);
+		itemColumn = TreeItemColumn_GetNext(tree, item, itemColumn);
 	}
 	return;
     }
@@ -4189,7 +4188,7 @@ TreeItem_RequestWidthInColumns(
 	    break;
 	while (/*(itemColumn != NULL) && */(columnIndex < TreeColumn_Index(treeColumn))) {
 	    if (itemColumn != NULL)
-	    itemColumn = TreeItemColumn_GetNext(tree, itemColumn);
+	    itemColumn = TreeItemColumn_GetNext(tree, item, itemColumn);
 	    ++columnIndex;
 	}
     }
@@ -4373,6 +4372,14 @@ TreeColumn_WidthOfItems(
     if (IS_TAIL(column))
 	return 0;
 
+    if (priv->allWidthsInvalid) {
+	TreeColumn column2;
+	for (column2 = tree->columns; column2 != NULL;
+		column2 = column2->next)
+	    column2->widthOfItems = -1;
+	priv->allWidthsInvalid = FALSE;
+    }
+
     if (priv->spansInvalid) {
 	columnMin = tree->columns;
 	columnMax = tree->columnLast;
@@ -4547,7 +4554,13 @@ TreeColumns_InvalidateWidthOfItems(
      * header width, there is no need to invalidate widthOfItems unless the
      * column is covered by a span > 1 in one or more items. */
 
-    if (column == NULL) {
+    /* Inside [$T batch] the columns are marked only once, when the
+     * width is next needed. */
+    if (priv->allWidthsInvalid) {
+	/* Nothing */
+    } else if (column == NULL && tree->batchDepth > 0) {
+	priv->allWidthsInvalid = TRUE;
+    } else if (column == NULL) {
 	column = tree->columns;
 	while (column != NULL) {
 	    column->widthOfItems = -1;
@@ -158,6 +158,9 @@ static Tk_OptionSpec optionSpecs[] = {
 #endif /* DEPRECATED */
     {TK_OPTION_SYNONYM, "-fg", (char *) NULL, (char *) NULL,
      (char *) NULL, 0, -1, 0, (ClientData) "-foreground"},
+    {TK_OPTION_BOOLEAN, "-findindex", "findIndex", "FindIndex",
+     "0", -1, Tk_Offset(TreeCtrl, findIndexOn),
+     0, (ClientData) NULL, TREE_CONF_FINDINDEX},
     {TK_OPTION_FONT, "-font", "font", "Font",
      DEF_LISTBOX_FONT, Tk_Offset(TreeCtrl, fontObj),
      Tk_Offset(TreeCtrl, tkfont),
@@ -194,6 +197,12 @@ static Tk_OptionSpec optionSpecs[] = {
      "19", Tk_Offset(TreeCtrl, indentObj),
      Tk_Offset(TreeCtrl, indent),
      0, (ClientData) NULL, TREE_CONF_INDENT | TREE_CONF_RELAYOUT},
+    {TK_OPTION_INT, "-itemdatacachesize", "itemDataCacheSize",
+     "ItemDataCacheSize", "0", -1, Tk_Offset(TreeCtrl, itemDataCacheSize),
+     0, (ClientData) NULL, 0},
+    {TK_OPTION_STRING, "-itemdatacommand", "itemDataCommand",
+     "ItemDataCommand", (char *) NULL, -1, Tk_Offset(TreeCtrl, itemDataCmd),
+     TK_OPTION_NULL_OK, 0, 0},
     {TK_OPTION_PIXELS, "-itemgapx", "itemGapX", "ItemGapX",
      "0",
      Tk_Offset(TreeCtrl, itemGapXObj),
@@ -274,6 +283,9 @@ static Tk_OptionSpec optionSpecs[] = {
     {TK_OPTION_BOOLEAN, "-showrootlines", "showRootLines",
      "ShowRootLines", "1", -1, Tk_Offset(TreeCtrl, showRootLines),
      0, (ClientData) NULL, TREE_CONF_RELAYOUT},
+    {TK_OPTION_BOOLEAN, "-tagindex", "tagIndex", "TagIndex",
+     "0", -1, Tk_Offset(TreeCtrl, tagIndexOn),
+     0, (ClientData) NULL, TREE_CONF_TAGINDEX},
     {TK_OPTION_STRING, "-takefocus", "takeFocus", "TakeFocus",
      DEF_LISTBOX_TAKE_FOCUS, -1, Tk_Offset(TreeCtrl, takeFocus),
      TK_OPTION_NULL_OK, 0, 0},
@@ -358,6 +370,7 @@ static void TreeDestroy(char *memPtr);
 static void TreeCmdDeletedProc(ClientData clientData);
 static void TreeWorldChanged(ClientData instanceData);
 static void TreeComputeGeometry(TreeCtrl *tree);
+static int TreeBatchCmd(TreeCtrl *tree, int objc, Tcl_Obj *CONST objv[]);
 static int TreeIdentifyCmd(TreeCtrl *tree, int objc, Tcl_Obj *CONST objv[]);
 static int TreeSeeCmd(TreeCtrl *tree, int objc, Tcl_Obj *CONST objv[]);
 static int TreeSelectionCmd(Tcl_Interp *interp, TreeCtrl *tree, int objc,
@@ -452,8 +465,6 @@ TreeObjCmd(
 
     tree->configStateDomain = -1;
 
-    Tcl_InitHashTable(&tree->selection, TCL_ONE_WORD_KEYS);
-
     /* Do this before Tree_InitColumns() which does Tk_InitOptions(), which
      * calls Tk_GetOption() which relies on the window class */
     Tk_SetClass(tkwin, "TreeCtrl");
@@ -463,7 +474,6 @@ TreeObjCmd(
     (void) Tk_InitOptions(interp, (char *) tree, tree->debug.optionTable,
 	    tkwin);
 
-    Tcl_InitHashTable(&tree->itemHash, TCL_ONE_WORD_KEYS);
     Tcl_InitHashTable(&tree->itemSpansHash, TCL_ONE_WORD_KEYS);
     Tcl_InitHashTable(&tree->elementHash, TCL_STRING_KEYS);
     Tcl_InitHashTable(&tree->styleHash, TCL_STRING_KEYS);
@@ -472,6 +482,9 @@ TreeObjCmd(
     Tcl_InitHashTable(&tree->gradientHash, TCL_STRING_KEYS);
 
     TreeItemList_Init(tree, &tree->preserveItemList, 0);
+    TreeItemList_Init(tree, &tree->deadItemList, 0);
+    TreeItemList_Init(tree, &tree->sortPendingList, 0);
+    tree->visEpoch = 1;
 
 #ifdef ALLOC_HAX
     tree->allocData = TreeAlloc_Init();
@@ -597,7 +610,7 @@ static int TreeWidgetCmd(
     TreeCtrl *tree = clientData;
     int result = TCL_OK;
     static CONST char *commandName[] = {
-	"activate", "bbox", "canvasx", "canvasy", "cget",
+	"activate", "batch", "bbox", "canvasx", "canvasy", "cget",
 #ifdef DEPRECATED
 	"collapse",
 #endif
@@ -625,7 +638,7 @@ static int TreeWidgetCmd(
 	"xview", "yview", (char *) NULL
     };
     enum {
-	COMMAND_ACTIVATE, COMMAND_BBOX, COMMAND_CANVASX, COMMAND_CANVASY,
+	COMMAND_ACTIVATE, COMMAND_BATCH, COMMAND_BBOX, COMMAND_CANVASX, COMMAND_CANVASY,
 	COMMAND_CGET,
 #ifdef DEPRECATED
 	COMMAND_COLLAPSE,
@@ -702,6 +715,11 @@ static int TreeWidgetCmd(
 	    break;
 	}
 
+	case COMMAND_BATCH: {
+	    result = TreeBatchCmd(tree, objc, objv);
+	    break;
+	}
+
 	/* .t bbox ?area? */
 	case COMMAND_BBOX: {
 	    TreeRectangle tr;
@@ -809,7 +827,7 @@ static int TreeWidgetCmd(
 	    char *s;
 	    int recurse = 0;
 	    int mode = 0; /* lint */
-	    int i, j, count, len;
+	    int i, len;
 	    TreeItemList items, item2s;
 	    TreeItem _item;
 	    ItemForEach iter;
@@ -850,11 +868,7 @@ static int TreeWidgetCmd(
 			TreeItem_ListDescendants(tree, _item, &item2s);
 		    }
 		}
-		count = TreeItemList_Count(&item2s);
-		for (j = 0; j < count; j++) {
-		    _item = TreeItemList_Nth(&item2s, j);
-		    TreeItem_OpenClose(tree, _item, mode);
-		}
+		TreeItem_OpenCloseList(tree, &item2s, mode);
 		TreeItemList_Free(&items);
 		TreeItemList_Free(&item2s);
 	    }
@@ -1015,8 +1029,7 @@ static int TreeWidgetCmd(
 #endif /* DEPRECATED */
 
 	case COMMAND_ORPHANS: {
-	    Tcl_HashEntry *hPtr;
-	    Tcl_HashSearch search;
+	    int search;
 	    Tcl_Obj *listObj;
 	    TreeItem item;
 
@@ -1027,15 +1040,14 @@ static int TreeWidgetCmd(
 
 	    /* Pretty slow. Could keep a hash table of orphans */
 	    listObj = Tcl_NewListObj(0, NULL);
-	    hPtr = Tcl_FirstHashEntry(&tree->itemHash, &search);
-	    while (hPtr != NULL) {
-		item = (TreeItem) Tcl_GetHashValue(hPtr);
+	    item = Tree_FirstItem(tree, &search);
+	    while (item != NULL) {
 		if ((item != tree->root) &&
 			(TreeItem_GetParent(tree, item) == NULL)) {
 		    Tcl_ListObjAppendElement(interp, listObj,
 			    TreeItem_ToObj(tree, item));
 		}
-		hPtr = Tcl_NextHashEntry(&search);
+		item = Tree_NextItem(tree, &search);
 	    }
 	    Tcl_SetObjResult(interp, listObj);
 	    break;
@@ -1203,6 +1215,10 @@ TreeConfigure(
     TreeCtrl saved;
     Tk_SavedOptions savedOptions;
     int oldShowRoot = tree->showRoot;
+    int oldItemDataCacheSize = tree->itemDataCacheSize;
+    char *oldItemPrefix = tree->itemPrefix;
+    int oldItemTagExpr = tree->itemTagExpr;
+    int descChanged = createFlag;
     int buttonWidth, buttonHeight;
     int mask, maskFree = 0;
     XGCValues gcValues;
@@ -1417,6 +1433,10 @@ badWrap:
 		    ckfree((char *) saved.defaultStyle.styles);
 	    }
 #endif
+	    /* The old -itemprefix is freed with the saved options. */
+	    if (!createFlag && ((oldItemTagExpr != tree->itemTagExpr) ||
+		    strcmp(oldItemPrefix, tree->itemPrefix) != 0))
+		descChanged = TRUE;
 	    Tk_FreeSavedOptions(&savedOptions);
 	    break;
 	} else {
@@ -1463,6 +1483,11 @@ badWrap:
     tree->itemPrefixLen = (int) strlen(tree->itemPrefix);
     tree->columnPrefixLen = (int) strlen(tree->columnPrefix);
 
+    if (createFlag || (mask & TREE_CONF_FINDINDEX))
+	TreeItem_FindIndexConfigure(tree);
+    if (createFlag || (mask & TREE_CONF_TAGINDEX))
+	TreeItem_TagIndexConfigure(tree);
+
     Tk_SetWindowBackground(tree->tkwin,
 	    Tk_3DBorderColor(tree->border)->pixel);
 
@@ -1563,11 +1588,24 @@ badWrap:
 	}
     }
 
+    /* -itemprefix and -itemtagexpr change how descriptions are parsed. */
+    if (descChanged)
+	TreeItem_InvalidateDescriptions(tree);
+
     if (oldShowRoot != tree->showRoot) {
 	TreeItem_InvalidateHeight(tree, tree->root);
 	tree->updateIndex = 1;
+	Tree_VisibilityChanged(tree);
+#ifdef SELECTION_VISIBLE
+	if (oldShowRoot)
+	    Tree_SubtreeHidden(tree, tree->root);
+#endif
+	Tree_DInfoChanged(tree, DINFO_REDO_SELECTION);
     }
 
+    if (oldItemDataCacheSize != tree->itemDataCacheSize)
+	TreeItem_DataCacheSizeChanged(tree, oldItemDataCacheSize);
+
     TreeStyle_TreeChanged(tree, mask);
     TreeHeader_TreeChanged(tree, mask);
 
@@ -1789,15 +1827,32 @@ TreeDestroy(
     Tcl_HashEntry *hPtr;
     Tcl_HashSearch search;
     TreeStateDomain *domainPtr;
-    int i, count;
+    int i, count, itemSearch;
 
-    hPtr = Tcl_FirstHashEntry(&tree->itemHash, &search);
-    while (hPtr != NULL) {
-	item = (TreeItem) Tcl_GetHashValue(hPtr);
+    TreeItem_FreeDeadItems(tree);
+
+    item = Tree_FirstItem(tree, &itemSearch);
+    while (item != NULL) {
 	TreeItem_FreeResources(tree, item);
-	hPtr = Tcl_NextHashEntry(&search);
+	item = Tree_NextItem(tree, &itemSearch);
+    }
+    if (tree->itemTable != NULL) {
+	ckfree((char *) tree->itemTable);
+	ckfree((char *) tree->itemTableUsed);
+    }
+    if (tree->itemSparse != NULL) {
+	ckfree((char *) tree->itemSparseIds);
+	ckfree((char *) tree->itemSparse);
+    }
+    for (i = 0; i < 32; i++) {
+	if (tree->itemStateBits[i] != NULL)
+	    ckfree((char *) tree->itemStateBits[i]);
     }
-    Tcl_DeleteHashTable(&tree->itemHash);
+    if (tree->hiddenIds != NULL)
+	ckfree((char *) tree->hiddenIds);
+    if (tree->batchDeleted != NULL)
+	ckfree((char *) tree->batchDeleted);
+    TreeItem_FreeDataCache(tree);
 
     TreeHeader_FreeWidget(tree);
 
@@ -1866,8 +1921,6 @@ TreeDestroy(
     Tcl_DeleteHashTable(&tree->imageNameHash);
     Tcl_DeleteHashTable(&tree->imageTokenHash);
 
-    Tcl_DeleteHashTable(&tree->selection);
-
     /* Must be done after all gradient users are freed */
     TreeGradient_FreeWidget(tree);
 
@@ -2032,19 +2085,241 @@ TreeComputeGeometry(
 	    tree->height + tree->inset.top + tree->inset.bottom);
 }
 
+/*
+ * Item ids are handed out sequentially, so the id -> item lookup is a
+ * plain array indexed by id. A bitmap of the slots in use lets a walk over
+ * all the items skip runs of deleted ids quickly.
+ *
+ * The array only covers the ids from itemTableBase up. When most of its
+ * slots are empty the few items left in the low part are moved to a
+ * sorted list (itemSparseIds/itemSparse) and the array is moved up, so
+ * creating and deleting items for a long time doesn't keep a slot for
+ * every id ever used.
+ */
+#define ITEM_TABLE_BITS (sizeof(unsigned int) * 8)
+#define ITEM_TABLE_WORDS(n) (((n) + ITEM_TABLE_BITS - 1) / ITEM_TABLE_BITS)
+#define ITEM_TABLE_MIN 64
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ItemSparse_Search --
+ *
+ *	Binary search of the sorted list of items below the item table.
+ *
+ * Results:
+ *	The index of the first entry whose id is >= the given id.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ItemSparse_Search(
+    TreeCtrl *tree,		/* Widget info. */
+    int id			/* Item id to look for. */
+    )
+{
+    int lo = 0, hi = tree->itemSparseCount, mid;
+
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (tree->itemSparseIds[mid] < id)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ItemSparse_Append --
+ *
+ *	Add an item to the end of the list of items below the item
+ *	table. Its id must be larger than any id in the list.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Memory may be allocated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ItemSparse_Append(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item		/* Item to add. */
+    )
+{
+    if (tree->itemSparseCount == tree->itemSparseAlloc) {
+	tree->itemSparseAlloc = tree->itemSparseAlloc ?
+		tree->itemSparseAlloc * 2 : 16;
+	tree->itemSparseIds = (int *) ckrealloc(
+		(char *) tree->itemSparseIds,
+		sizeof(int) * tree->itemSparseAlloc);
+	tree->itemSparse = (TreeItem *) ckrealloc(
+		(char *) tree->itemSparse,
+		sizeof(TreeItem) * tree->itemSparseAlloc);
+    }
+    tree->itemSparseIds[tree->itemSparseCount] = TreeItem_GetID(tree, item);
+    tree->itemSparse[tree->itemSparseCount++] = item;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ItemSparse_Remove --
+ *
+ *	Remove an item from the list of items below the item table.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The list is squeezed once half of its entries are removed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ItemSparse_Remove(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item		/* Item to remove. */
+    )
+{
+    int i = ItemSparse_Search(tree, TreeItem_GetID(tree, item)), j;
+
+    if ((i == tree->itemSparseCount) || (tree->itemSparse[i] != item))
+	return;
+    tree->itemSparse[i] = NULL;
+    if (++tree->itemSparseDead * 2 < tree->itemSparseCount)
+	return;
+    for (i = j = 0; i < tree->itemSparseCount; i++) {
+	if (tree->itemSparse[i] == NULL)
+	    continue;
+	tree->itemSparseIds[j] = tree->itemSparseIds[i];
+	tree->itemSparse[j++] = tree->itemSparse[i];
+    }
+    tree->itemSparseCount = j;
+    tree->itemSparseDead = 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ItemTable_Resize --
+ *
+ *	Make the table of items hold every id up to the given one. The
+ *	table is moved up past as much of its sparse low part as saves
+ *	memory, and the items left there go to the list of items below
+ *	the table.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The table and the per-state bitmaps are reallocated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ItemTable_Resize(
+    TreeCtrl *tree,		/* Widget info. */
+    int lastId			/* Largest id the table must hold. */
+    )
+{
+    int oldWords = ITEM_TABLE_WORDS(tree->itemTableSize);
+    int w, wMax, best = 0, below = 0, cost, bestCost, count, slot;
+    int base, size, words, copy;
+    unsigned int bits, *newBits;
+    TreeItem *table;
+    int i;
+
+    /* Each item below the table costs about as much as two slots. Pick
+     * the word to start the table at that uses the least memory. */
+    wMax = MIN(oldWords, (lastId + 1 - tree->itemTableBase) /
+	    (int) ITEM_TABLE_BITS);
+    bestCost = lastId + 1 - tree->itemTableBase;
+    for (w = 0; w < wMax; w++) {
+	for (count = 0, bits = tree->itemTableUsed[w]; bits != 0;
+		bits &= bits - 1)
+	    count++;
+	below += count;
+	cost = lastId + 1 - (tree->itemTableBase +
+		(w + 1) * (int) ITEM_TABLE_BITS) + 2 * below;
+	if (cost < bestCost) {
+	    bestCost = cost;
+	    best = w + 1;
+	}
+    }
+
+    for (slot = 0; slot < best * (int) ITEM_TABLE_BITS; slot++) {
+	if (tree->itemTable[slot] != NULL) {
+	    ItemSparse_Append(tree, tree->itemTable[slot]);
+	    tree->itemTableCount--;
+	}
+    }
+
+    base = tree->itemTableBase + best * ITEM_TABLE_BITS;
+    size = ITEM_TABLE_MIN;
+    while (size < (lastId + 1 - base) + (lastId + 1 - base) / 2)
+	size *= 2;
+    words = ITEM_TABLE_WORDS(size);
+    copy = MIN(oldWords - best, words);
+
+    table = (TreeItem *) ckalloc(sizeof(TreeItem) * size);
+    memset(table, '\0', sizeof(TreeItem) * size);
+    if (copy > 0) {
+	memcpy(table, tree->itemTable + best * ITEM_TABLE_BITS,
+		sizeof(TreeItem) * MIN(size,
+		tree->itemTableSize - best * (int) ITEM_TABLE_BITS));
+    }
+    if (tree->itemTable != NULL)
+	ckfree((char *) tree->itemTable);
+    tree->itemTable = table;
+
+    for (i = -1; i < 32; i++) {
+	unsigned int **bitsPtr = (i == -1) ? &tree->itemTableUsed :
+		&tree->itemStateBits[i];
+
+	if ((i != -1) && (*bitsPtr == NULL))
+	    continue;
+	newBits = (unsigned int *) ckalloc(sizeof(unsigned int) * words);
+	memset(newBits, '\0', sizeof(unsigned int) * words);
+	if (copy > 0) {
+	    memcpy(newBits, *bitsPtr + best,
+		    sizeof(unsigned int) * copy);
+	}
+	if (*bitsPtr != NULL)
+	    ckfree((char *) *bitsPtr);
+	*bitsPtr = newBits;
+    }
+
+    tree->itemTableBase = base;
+    tree->itemTableSize = size;
+    tree->itemTableRemoved = 0;
+}
+
 /*
  *----------------------------------------------------------------------
  *
  * Tree_AddItem --
  *
- *	Add an item to the hash table of items. Also set the unique item
+ *	Add an item to the table of items. Also set the unique item
  *	id and increment the number of items.
  *
  * Results:
  *	None.
  *
  * Side effects:
- *	None.
+ *	The table of items may be reallocated.
  *
  *----------------------------------------------------------------------
  */
@@ -2055,13 +2330,348 @@ Tree_AddItem(
     TreeItem item		/* Item that was created. */
     )
 {
-    Tcl_HashEntry *hPtr;
-    int id, isNew;
+    int id, slot;
 
     id = TreeItem_SetID(tree, item, tree->nextItemId++);
-    hPtr = Tcl_CreateHashEntry(&tree->itemHash, (char *) INT2PTR(id), &isNew);
-    Tcl_SetHashValue(hPtr, item);
+    if (id - tree->itemTableBase >= tree->itemTableSize)
+	ItemTable_Resize(tree, id);
+    slot = id - tree->itemTableBase;
+    tree->itemTable[slot] = item;
+    tree->itemTableUsed[slot / ITEM_TABLE_BITS] |=
+	    1U << (slot % ITEM_TABLE_BITS);
+    tree->itemTableCount++;
     tree->itemCount++;
+    Tree_ItemStateChanged(tree, item, 0, TreeItem_GetState(tree, item));
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Tree_FindItem --
+ *
+ *	Get the item with the given unique id.
+ *
+ * Results:
+ *	The item, or NULL if no item has that id.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+TreeItem
+Tree_FindItem(
+    TreeCtrl *tree,		/* Widget info. */
+    int id			/* Unique item id. */
+    )
+{
+    int i;
+
+    if (id < tree->itemTableBase) {
+	if (id < 0)
+	    return NULL;
+	i = ItemSparse_Search(tree, id);
+	if ((i == tree->itemSparseCount) || (tree->itemSparseIds[i] != id))
+	    return NULL;
+	return tree->itemSparse[i];
+    }
+    if (id - tree->itemTableBase >= tree->itemTableSize)
+	return NULL;
+    return tree->itemTable[id - tree->itemTableBase];
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Tree_FirstItem --
+ * Tree_NextItem --
+ *
+ *	Walk the table of items in order of increasing item id. Items
+ *	may be removed while walking the table.
+ *
+ * Results:
+ *	The next item, or NULL when all the items have been seen.
+ *
+ * Side effects:
+ *	The search cursor is updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+TreeItem
+Tree_FirstItem(
+    TreeCtrl *tree,		/* Widget info. */
+    int *searchPtr		/* Search cursor to initialize. */
+    )
+{
+    (*searchPtr) = 0;
+    return Tree_NextItem(tree, searchPtr);
+}
+
+TreeItem
+Tree_NextItem(
+    TreeCtrl *tree,		/* Widget info. */
+    int *searchPtr		/* Search cursor initialized by
+				 * Tree_FirstItem(). */
+    )
+{
+    int states[2];
+
+    states[STATE_OP_ON] = states[STATE_OP_OFF] = 0;
+    return Tree_NextItemInState(tree, searchPtr, states);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Tree_NextItemInState --
+ *
+ *	Like Tree_NextItem, but skip items that don't have all the
+ *	states in states[STATE_OP_ON] or that have any of the states in
+ *	states[STATE_OP_OFF]. Whole words of the item table are tested
+ *	at once using the per-state bitmaps.
+ *
+ * Results:
+ *	The next item with the states, or NULL when all the items have
+ *	been seen.
+ *
+ * Side effects:
+ *	The search cursor is updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+TreeItem
+Tree_NextItemInState(
+    TreeCtrl *tree,		/* Widget info. */
+    int *searchPtr,		/* Search cursor initialized to zero. */
+    int states[2]		/* States that must be on and off. */
+    )
+{
+    int id = (*searchPtr), slot, word, state;
+    int words = ITEM_TABLE_WORDS(tree->itemTableSize);
+    int end = tree->itemTableBase + tree->itemTableSize;
+    int i, on = states[STATE_OP_ON], off = states[STATE_OP_OFF];
+    unsigned int bits, mask;
+    TreeItem item;
+
+    if (id >= end)
+	return NULL;
+
+    /* No item has a state without a bitmap. */
+    for (i = 0; (i < 32) && (((on | off) >> i) != 0); i++) {
+	if ((on & (1 << i)) && (tree->itemStateBits[i] == NULL)) {
+	    (*searchPtr) = end;
+	    return NULL;
+	}
+	if ((off & (1 << i)) && (tree->itemStateBits[i] == NULL))
+	    off &= ~(1 << i);
+    }
+    mask = (unsigned int) (on | off);
+
+    /* The items below the table are checked one at a time. */
+    if (id < tree->itemTableBase) {
+	for (i = ItemSparse_Search(tree, id); i < tree->itemSparseCount;
+		i++) {
+	    item = tree->itemSparse[i];
+	    if (item == NULL)
+		continue;
+	    state = TreeItem_GetState(tree, item);
+	    if (((state & on) == on) && !(state & off)) {
+		(*searchPtr) = tree->itemSparseIds[i] + 1;
+		return item;
+	    }
+	}
+	id = tree->itemTableBase;
+    }
+
+    slot = id - tree->itemTableBase;
+    word = slot / ITEM_TABLE_BITS;
+
+    /* Ignore slots before the cursor in the first word. */
+    bits = tree->itemTableUsed[word] & (~0U << (slot % ITEM_TABLE_BITS));
+    while (1) {
+	for (i = 0; (bits != 0) && (i < 32) && ((mask >> i) != 0); i++) {
+	    if (on & (1 << i))
+		bits &= tree->itemStateBits[i][word];
+	    else if (off & (1 << i))
+		bits &= ~tree->itemStateBits[i][word];
+	}
+	if (bits != 0)
+	    break;
+	if (++word >= words) {
+	    (*searchPtr) = end;
+	    return NULL;
+	}
+	bits = tree->itemTableUsed[word];
+    }
+    slot = word * ITEM_TABLE_BITS;
+    while ((bits & 1) == 0) {
+	bits >>= 1;
+	slot++;
+    }
+    (*searchPtr) = tree->itemTableBase + slot + 1;
+    return tree->itemTable[slot];
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Tree_FirstSelected --
+ * Tree_NextSelected --
+ *
+ *	Walk the selected items in order of increasing item id, using
+ *	the STATE_ITEM_SELECTED bitmap. Items may be removed from the
+ *	selection while walking.
+ *
+ * Results:
+ *	The next selected item, or NULL when all the selected items
+ *	have been seen.
+ *
+ * Side effects:
+ *	The search cursor is updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+TreeItem
+Tree_FirstSelected(
+    TreeCtrl *tree,		/* Widget info. */
+    int *searchPtr		/* Search cursor to initialize. */
+    )
+{
+    (*searchPtr) = 0;
+    return Tree_NextSelected(tree, searchPtr);
+}
+
+TreeItem
+Tree_NextSelected(
+    TreeCtrl *tree,		/* Widget info. */
+    int *searchPtr		/* Search cursor initialized by
+				 * Tree_FirstSelected(). */
+    )
+{
+    int states[2];
+
+    states[STATE_OP_ON] = STATE_ITEM_SELECTED;
+    states[STATE_OP_OFF] = 0;
+    return Tree_NextItemInState(tree, searchPtr, states);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Tree_ItemStateChanged --
+ *
+ *	Update the per-state bitmaps after the state of an item (not a
+ *	header) changes. Items that are not in the table of items are
+ *	ignored.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	A bitmap is allocated the first time an item gets a state.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+Tree_ItemStateChanged(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item,		/* Item in the table of items. */
+    int oldState,		/* STATE_xxx flags before the change. */
+    int newState		/* STATE_xxx flags after the change. */
+    )
+{
+    int i, slot = TreeItem_GetID(tree, item) - tree->itemTableBase;
+    int words = ITEM_TABLE_WORDS(tree->itemTableSize);
+    unsigned int changed = oldState ^ newState;
+    unsigned int bit = 1U << (slot % ITEM_TABLE_BITS);
+    int sparse = (slot < 0);
+
+    /* A deleted item is no longer in the table. */
+    if (sparse) {
+	if (Tree_FindItem(tree, TreeItem_GetID(tree, item)) != item)
+	    return;
+    } else if ((slot >= tree->itemTableSize) ||
+	    (tree->itemTable[slot] != item))
+	return;
+
+    for (i = 0; changed != 0; i++, changed >>= 1) {
+	if (!(changed & 1))
+	    continue;
+	if (newState & (1 << i)) {
+	    if (tree->itemStateBits[i] == NULL) {
+		tree->itemStateBits[i] = (unsigned int *) ckalloc(
+			sizeof(unsigned int) * words);
+		memset(tree->itemStateBits[i], '\0',
+			sizeof(unsigned int) * words);
+	    }
+	    /* Items below the table are tested one at a time, but
+	     * the bitmap must exist for them to be found. */
+	    if (!sparse)
+		tree->itemStateBits[i][slot / ITEM_TABLE_BITS] |= bit;
+	} else if (!sparse) {
+	    tree->itemStateBits[i][slot / ITEM_TABLE_BITS] &= ~bit;
+	}
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ItemTable_Reset --
+ *
+ *	Shrink the table of items to hold just the root item, when every
+ *	other item has been deleted. Reset the unique item id allocator.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Memory is deallocated and allocated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ItemTable_Reset(
+    TreeCtrl *tree		/* Widget info. */
+    )
+{
+    TreeItem root = tree->root;
+    int i, id = TreeItem_GetID(tree, root);
+
+    if (tree->itemSparse != NULL) {
+	ckfree((char *) tree->itemSparseIds);
+	ckfree((char *) tree->itemSparse);
+	tree->itemSparseIds = NULL;
+	tree->itemSparse = NULL;
+    }
+    tree->itemSparseCount = tree->itemSparseAlloc = 0;
+    tree->itemSparseDead = 0;
+    ckfree((char *) tree->itemTable);
+    ckfree((char *) tree->itemTableUsed);
+    tree->itemTable = NULL;
+    tree->itemTableUsed = NULL;
+    for (i = 0; i < 32; i++) {
+	if (tree->itemStateBits[i] != NULL) {
+	    ckfree((char *) tree->itemStateBits[i]);
+	    tree->itemStateBits[i] = NULL;
+	}
+    }
+    tree->itemTableBase = id - (id % ITEM_TABLE_BITS);
+    tree->itemTableSize = tree->itemTableCount = 0;
+    ItemTable_Resize(tree, id);
+
+    tree->itemTable[id - tree->itemTableBase] = root;
+    tree->itemTableUsed[(id - tree->itemTableBase) / ITEM_TABLE_BITS] |=
+	    1U << ((id - tree->itemTableBase) % ITEM_TABLE_BITS);
+    tree->itemTableCount = 1;
+    Tree_ItemStateChanged(tree, root, 0, TreeItem_GetState(tree, root));
+    tree->nextItemId = id + 1;
 }
 
 /*
@@ -2070,7 +2680,7 @@ Tree_AddItem(
  * Tree_RemoveItem --
  *
  *	Remove an item from the selection, if selected.
- *	Remove an item from the hash table of items.
+ *	Remove an item from the table of items.
  *	Decrement the number of items.
  *	Reset the unique item id allocator if the last item is removed.
  *
@@ -2078,7 +2688,7 @@ Tree_AddItem(
  *	None.
  *
  * Side effects:
- *	None.
+ *	The table of items may be reallocated.
  *
  *----------------------------------------------------------------------
  */
@@ -2090,6 +2700,10 @@ Tree_RemoveItem(
     )
 {
     Tcl_HashEntry *hPtr;
+    int id, slot;
+
+    if (tree->batchDepth > 0)
+	Tree_BatchItemDeleted(tree, item);
 
     if (TreeItem_GetSelected(tree, item))
 	Tree_RemoveFromSelection(tree, item);
@@ -2098,12 +2712,31 @@ Tree_RemoveItem(
     if (hPtr != NULL)
 	Tcl_DeleteHashEntry(hPtr);
 
-    hPtr = Tcl_FindHashEntry(&tree->itemHash,
-	    (char *) INT2PTR(TreeItem_GetID(tree, item)));
-    Tcl_DeleteHashEntry(hPtr);
+    Tree_ItemStateChanged(tree, item, TreeItem_GetState(tree, item), 0);
+
+    id = TreeItem_GetID(tree, item);
+    slot = id - tree->itemTableBase;
+    if (slot < 0) {
+	ItemSparse_Remove(tree, item);
+    } else {
+	tree->itemTable[slot] = NULL;
+	tree->itemTableUsed[slot / ITEM_TABLE_BITS] &=
+		~(1U << (slot % ITEM_TABLE_BITS));
+	tree->itemTableCount--;
+	tree->itemTableRemoved++;
+    }
     tree->itemCount--;
-    if (tree->itemCount == 1)
-	tree->nextItemId = TreeItem_GetID(tree, tree->root) + 1;
+    if (tree->itemCount == 1) {
+	ItemTable_Reset(tree);
+	return;
+    }
+
+    /* Move the table up once it is mostly empty. Waiting for half of
+     * it to be removed keeps the cost of this constant per item. */
+    if ((tree->itemTableSize > ITEM_TABLE_MIN) &&
+	    (tree->itemTableCount * 4 < tree->itemTableSize) &&
+	    (tree->itemTableRemoved * 2 >= tree->itemTableSize))
+	ItemTable_Resize(tree, tree->nextItemId - 1);
 }
 
 /*
@@ -2991,6 +3624,7 @@ Tree_StateCmd(
 	    }
 	    domainPtr->stateNames[slot] = ckalloc(length + 1);
 	    strcpy(domainPtr->stateNames[slot], string);
+	    TreeItem_InvalidateDescriptions(tree);
 	    break;
 	}
 
@@ -3041,6 +3675,7 @@ Tree_StateCmd(
 			domain, 1L << index);
 		ckfree(domainPtr->stateNames[index]);
 		domainPtr->stateNames[index] = NULL;
+		TreeItem_InvalidateDescriptions(tree);
 	    }
 	    break;
 	}
@@ -3054,7 +3689,7 @@ Tree_StateCmd(
  *
  * Tree_AddToSelection --
  *
- *	Add an item to the hash table of selected items. Turn on the
+ *	Add an item to the selection by turning on the
  *	STATE_ITEM_SELECTED state for the item.
  *
  * Results:
@@ -3072,8 +3707,6 @@ Tree_AddToSelection(
     TreeItem item		/* Item to add to the selection. */
     )
 {
-    int isNew;
-
 #ifdef SELECTION_VISIBLE
     if (!TreeItem_ReallyVisible(tree, item))
 	panic("Tree_AddToSelection: item %d not ReallyVisible",
@@ -3086,10 +3719,6 @@ Tree_AddToSelection(
 	panic("Tree_AddToSelection: item %d not enabled",
 		TreeItem_GetID(tree, item));
     TreeItem_ChangeState(tree, item, 0, STATE_ITEM_SELECTED);
-    Tcl_CreateHashEntry(&tree->selection, (char *) item, &isNew);
-    if (!isNew)
-	panic("Tree_AddToSelection: item %d already in selection hash table",
-		TreeItem_GetID(tree, item));
     tree->selectCount++;
 }
 
@@ -3098,7 +3727,7 @@ Tree_AddToSelection(
  *
  * Tree_RemoveFromSelection --
  *
- *	Remove an item from the hash table of selected items. Turn off the
+ *	Remove an item from the selection by turning off the
  *	STATE_ITEM_SELECTED state for the item.
  *
  * Results:
@@ -3116,20 +3745,238 @@ Tree_RemoveFromSelection(
     TreeItem item		/* Item to remove from the selection. */
     )
 {
-    Tcl_HashEntry *hPtr;
-
     if (!TreeItem_GetSelected(tree, item))
 	panic("Tree_RemoveFromSelection: item %d isn't selected",
 		TreeItem_GetID(tree, item));
     TreeItem_ChangeState(tree, item, STATE_ITEM_SELECTED, 0);
-    hPtr = Tcl_FindHashEntry(&tree->selection, (char *) item);
-    if (hPtr == NULL)
-	panic("Tree_RemoveFromSelection: item %d not found in selection hash table",
-		TreeItem_GetID(tree, item));
-    Tcl_DeleteHashEntry(hPtr);
     tree->selectCount--;
 }
 
+/*
+ *--------------------------------------------------------------
+ *
+ * Tree_BatchSelection --
+ *
+ *	Remember which items were selected before a [$T batch] script
+ *	changed their selection, so one <Selection> event can be
+ *	generated when the script is done.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Memory may be allocated.
+ *
+ *--------------------------------------------------------------
+ */
+
+void
+Tree_BatchSelection(
+    TreeCtrl *tree,		/* Widget info */
+    TreeItemList *select,	/* Newly-selected items or NULL. */
+    TreeItemList *deselect	/* Newly-deselected items or NULL. */
+    )
+{
+    Tcl_HashEntry *hPtr;
+    TreeItem item;
+    int i, isNew;
+
+    /* Only the first change to an item tells whether it was selected
+     * before the script began. */
+    for (i = 0; select != NULL && i < TreeItemList_Count(select); i++) {
+	item = TreeItemList_Nth(select, i);
+	hPtr = Tcl_CreateHashEntry(&tree->batchSelection,
+		(char *) INT2PTR(TreeItem_GetID(tree, item)), &isNew);
+	if (isNew)
+	    Tcl_SetHashValue(hPtr, (ClientData) INT2PTR(FALSE));
+    }
+    for (i = 0; deselect != NULL && i < TreeItemList_Count(deselect); i++) {
+	item = TreeItemList_Nth(deselect, i);
+	hPtr = Tcl_CreateHashEntry(&tree->batchSelection,
+		(char *) INT2PTR(TreeItem_GetID(tree, item)), &isNew);
+	if (isNew)
+	    Tcl_SetHashValue(hPtr, (ClientData) INT2PTR(TRUE));
+    }
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * Tree_BatchItemDeleted --
+ *
+ *	Called when an item is deleted during a [$T batch] script.
+ *	If the item was selected when the script began its id is kept
+ *	so the <Selection> event at the end can report it deselected.
+ *	The item is forgotten otherwise, so an item created later with
+ *	the same id is not mistaken for it.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Memory may be allocated.
+ *
+ *--------------------------------------------------------------
+ */
+
+void
+Tree_BatchItemDeleted(
+    TreeCtrl *tree,		/* Widget info */
+    TreeItem item		/* Item being deleted. */
+    )
+{
+    Tcl_HashEntry *hPtr;
+    int wasSelected = TreeItem_GetSelected(tree, item);
+
+    hPtr = Tcl_FindHashEntry(&tree->batchSelection,
+	    (char *) INT2PTR(TreeItem_GetID(tree, item)));
+    if (hPtr != NULL) {
+	wasSelected = PTR2INT(Tcl_GetHashValue(hPtr));
+	Tcl_DeleteHashEntry(hPtr);
+    }
+    if (!wasSelected)
+	return;
+    if (tree->batchDeletedCount == tree->batchDeletedAlloc) {
+	tree->batchDeletedAlloc = tree->batchDeletedAlloc ?
+		tree->batchDeletedAlloc * 2 : 16;
+	tree->batchDeleted = (int *) ckrealloc((char *) tree->batchDeleted,
+		sizeof(int) * tree->batchDeletedAlloc);
+    }
+    tree->batchDeleted[tree->batchDeletedCount++] =
+	    TreeItem_GetID(tree, item);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * BatchIdCompare --
+ *
+ *	qsort() callback to sort items by increasing id.
+ *
+ * Results:
+ *	Standard qsort() result.
+ *
+ * Side effects:
+ *	None.
+ *
+ *--------------------------------------------------------------
+ */
+
+static int
+BatchIdCompare(
+    CONST VOID *a,
+    CONST VOID *b
+    )
+{
+    TreeItem first = *(TreeItem *) a;
+    TreeItem second = *(TreeItem *) b;
+
+    return TreeItem_GetID(NULL, first) - TreeItem_GetID(NULL, second);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * TreeBatchCmd --
+ *
+ *	This procedure is invoked to process the [batch] widget
+ *	command.  See the user documentation for details on what
+ *	it does.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	See the user documentation.
+ *
+ *--------------------------------------------------------------
+ */
+
+static int
+TreeBatchCmd(
+    TreeCtrl *tree,		/* Widget info. */
+    int objc,			/* Number of arguments. */
+    Tcl_Obj *CONST objv[]	/* Argument values. */
+    )
+{
+    Tcl_Interp *interp = tree->interp;
+    Tcl_SavedResult state;
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+    TreeItemList select, deselect;
+    TreeItem item;
+    int result, wasSelected;
+
+    if (objc != 3) {
+	Tcl_WrongNumArgs(interp, 2, objv, "script");
+	return TCL_ERROR;
+    }
+
+    if (tree->batchDepth++ == 0)
+	Tcl_InitHashTable(&tree->batchSelection, TCL_ONE_WORD_KEYS);
+
+    result = Tcl_EvalObjEx(interp, objv[2], 0);
+    if (result == TCL_ERROR)
+	Tcl_AddErrorInfo(interp, "\n    (\"batch\" script)");
+
+    if (tree->batchDepth > 1) {
+	tree->batchDepth--;
+	return result;
+    }
+
+    /* The widget may have been destroyed by the script. */
+    if (tree->deleted) {
+	tree->batchDepth--;
+	Tcl_DeleteHashTable(&tree->batchSelection);
+	tree->batchDeletedCount = 0;
+	return result;
+    }
+
+    Tcl_SaveResult(interp, &state);
+
+    /* Items hidden by the script are deselected now, while changes to
+     * the selection are still being gathered. */
+#ifdef SELECTION_VISIBLE
+    Tree_DeselectHiddenNow(tree);
+#endif
+    tree->batchDepth--;
+
+    TreeItemList_Init(tree, &select, 0);
+    TreeItemList_Init(tree, &deselect, 0);
+    hPtr = Tcl_FirstHashEntry(&tree->batchSelection, &search);
+    while (hPtr != NULL) {
+	/* Deleted items were moved to tree->batchDeleted. */
+	item = Tree_FindItem(tree,
+		PTR2INT(Tcl_GetHashKey(&tree->batchSelection, hPtr)));
+	wasSelected = PTR2INT(Tcl_GetHashValue(hPtr));
+	if (TreeItem_GetSelected(tree, item) != wasSelected) {
+	    TreeItemList_Append(wasSelected ? &deselect : &select, item);
+	}
+	hPtr = Tcl_NextHashEntry(&search);
+    }
+    Tcl_DeleteHashTable(&tree->batchSelection);
+
+    if (TreeItemList_Count(&select) || TreeItemList_Count(&deselect) ||
+	    tree->batchDeletedCount) {
+	qsort((VOID *) TreeItemList_Items(&select),
+		(size_t) TreeItemList_Count(&select),
+		sizeof(TreeItem), BatchIdCompare);
+	qsort((VOID *) TreeItemList_Items(&deselect),
+		(size_t) TreeItemList_Count(&deselect),
+		sizeof(TreeItem), BatchIdCompare);
+	TreeNotify_BatchSelection(tree,
+		TreeItemList_Count(&select) ? &select : NULL,
+		TreeItemList_Count(&deselect) ? &deselect : NULL,
+		tree->batchDeleted, tree->batchDeletedCount);
+    }
+    TreeItemList_Free(&select);
+    TreeItemList_Free(&deselect);
+    tree->batchDeletedCount = 0;
+
+    Tcl_RestoreResult(interp, &state);
+    return result;
+}
+
 /*
  *--------------------------------------------------------------
  *
@@ -3181,8 +4028,7 @@ TreeSelectionCmd(
 	case COMMAND_ADD: {
 	    int i, count;
 	    TreeItemList items;
-	    Tcl_HashEntry *hPtr;
-	    Tcl_HashSearch search;
+	    int search;
 
 	    if (objc < 4 || objc > 5) {
 		Tcl_WrongNumArgs(interp, 3, objv, "first ?last?");
@@ -3205,14 +4051,13 @@ TreeSelectionCmd(
 			tree->itemCount - tree->selectCount);
 
 		/* Include orphans. */
-		hPtr = Tcl_FirstHashEntry(&tree->itemHash, &search);
-		while (hPtr != NULL) {
-		    item = (TreeItem) Tcl_GetHashValue(hPtr);
+		item = Tree_FirstItem(tree, &search);
+		while (item != NULL) {
 		    if (TreeItem_CanAddToSelection(tree, item)) {
 			Tree_AddToSelection(tree, item);
 			TreeItemList_Append(&items, item);
 		    }
-		    hPtr = Tcl_NextHashEntry(&search);
+		    item = Tree_NextItem(tree, &search);
 		}
 		goto doneADD;
 	    }
@@ -3270,8 +4115,7 @@ doneADD:
 	case COMMAND_CLEAR: {
 	    int i, count;
 	    TreeItemList items;
-	    Tcl_HashEntry *hPtr;
-	    Tcl_HashSearch search;
+	    int search;
 
 	    if (objc > 5) {
 		Tcl_WrongNumArgs(interp, 3, objv, "?first? ?last?");
@@ -3299,11 +4143,10 @@ doneADD:
 		if (objc >= 4) TreeItemList_Free(&itemsFirst);
 		if (objc == 5) TreeItemList_Free(&itemsLast);
 		TreeItemList_Init(tree, &items, tree->selectCount);
-		hPtr = Tcl_FirstHashEntry(&tree->selection, &search);
-		while (hPtr != NULL) {
-		    item = (TreeItem) Tcl_GetHashKey(&tree->selection, hPtr);
+		item = Tree_FirstSelected(tree, &search);
+		while (item != NULL) {
 		    TreeItemList_Append(&items, item);
-		    hPtr = Tcl_NextHashEntry(&search);
+		    item = Tree_NextSelected(tree, &search);
 		}
 		count = TreeItemList_Count(&items);
 		for (i = 0; i < count; i++)
@@ -3358,8 +4201,7 @@ doneCLEAR:
 	case COMMAND_GET: {
 	    TreeItem item;
 	    Tcl_Obj *listObj;
-	    Tcl_HashEntry *hPtr;
-	    Tcl_HashSearch search;
+	    int search;
 
 #ifdef SELECTION_VISIBLE
 	    if (objc < 3 || objc > 5) {
@@ -3390,11 +4232,10 @@ doneCLEAR:
 
 		/* Build a list of selected items. */
 		TreeItemList_Init(tree, &items, tree->selectCount);
-		hPtr = Tcl_FirstHashEntry(&tree->selection, &search);
-		while (hPtr != NULL) {
-		    item = (TreeItem) Tcl_GetHashKey(&tree->selection, hPtr);
+		item = Tree_FirstSelected(tree, &search);
+		while (item != NULL) {
 		    TreeItemList_Append(&items, item);
-		    hPtr = Tcl_NextHashEntry(&search);
+		    item = Tree_NextSelected(tree, &search);
 		}
 
 		/* Sort it. */
@@ -3428,12 +4269,11 @@ doneCLEAR:
 	    if (tree->selectCount < 1)
 		break;
 	    listObj = Tcl_NewListObj(0, NULL);
-	    hPtr = Tcl_FirstHashEntry(&tree->selection, &search);
-	    while (hPtr != NULL) {
-		item = (TreeItem) Tcl_GetHashKey(&tree->selection, hPtr);
+	    item = Tree_FirstSelected(tree, &search);
+	    while (item != NULL) {
 		Tcl_ListObjAppendElement(interp, listObj,
 			TreeItem_ToObj(tree, item));
-		hPtr = Tcl_NextHashEntry(&search);
+		item = Tree_NextSelected(tree, &search);
 	    }
 	    Tcl_SetObjResult(interp, listObj);
 	    break;
@@ -3454,8 +4294,10 @@ doneCLEAR:
 	case COMMAND_MODIFY: {
 	    int i, j, k, objcS, objcD;
 	    Tcl_Obj **objvS, **objvD;
-	    Tcl_HashEntry *hPtr;
-	    Tcl_HashSearch search;
+	    int search;
+#ifndef SELECTION_VISIBLE
+	    int itemSearch;
+#endif
 	    TreeItem item;
 	    TreeItemList items;
 	    TreeItemList itemS, itemD, newS, newD;
@@ -3548,13 +4390,12 @@ doneCLEAR:
 		}
 #else
 		/* Include detached items */
-		hPtr = Tcl_FirstHashEntry(&tree->itemHash, &search);
-		while (hPtr != NULL) {
-		    item = (TreeItem) Tcl_GetHashValue(hPtr);
+		item = Tree_FirstItem(tree, &itemSearch);
+		while (item != NULL) {
 		    if (TreeItem_CanAddToSelection(tree, item)) {
 			TreeItemList_Append(&newS, item);
 		    }
-		    hPtr = Tcl_NextHashEntry(&search);
+		    item = Tree_NextItem(tree, &itemSearch);
 		}
 #endif
 		/* Ignore the deselect list. */
@@ -3575,9 +4416,8 @@ doneCLEAR:
 	    /* Deselect all */
 	    if (allD) {
 		TreeItemList_Init(tree, &newD, tree->selectCount);
-		hPtr = Tcl_FirstHashEntry(&tree->selection, &search);
-		while (hPtr != NULL) {
-		    item = (TreeItem) Tcl_GetHashKey(&tree->selection, hPtr);
+		item = Tree_FirstSelected(tree, &search);
+		while (item != NULL) {
 		    /* Don't deselect an item in the select list */
 		    for (j = 0; j < TreeItemList_Count(&itemS); j++) {
 			if (item == TreeItemList_Nth(&itemS, j))
@@ -3586,7 +4426,7 @@ doneCLEAR:
 		    if (j == TreeItemList_Count(&itemS)) {
 			TreeItemList_Append(&newD, item);
 		    }
-		    hPtr = Tcl_NextHashEntry(&search);
+		    item = Tree_NextSelected(tree, &search);
 		}
 	    }
 
@@ -3684,15 +4524,15 @@ TreeDebugCmd(
     switch (index) {
 	/* T debug alloc */
 	case COMMAND_ALLOC: {
-#ifdef ALLOC_HAX
-#ifdef TREECTRL_DEBUG
+	    Tcl_DString dString;
+
+	    Tcl_DStringInit(&dString);
+#if defined(ALLOC_HAX) && defined(TREECTRL_DEBUG)
 	    TreeAlloc_Stats(interp, tree->allocData);
-#else
-	    FormatResult(interp, "TREECTRL_DEBUG is not defined");
-#endif
-#else
-	    FormatResult(interp, "ALLOC_HAX is not defined");
+	    Tcl_DStringAppend(&dString, Tcl_GetStringResult(interp), -1);
 #endif
+	    TreeItem_AllocStats(tree, &dString);
+	    Tcl_DStringResult(interp, &dString);
 	    break;
 	}
 
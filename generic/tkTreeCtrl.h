@@ -97,6 +97,8 @@ typedef struct TreeThemeData_ *TreeThemeData;
 typedef struct TreeGradient_ *TreeGradient;
 typedef struct TreeHeader_ *TreeHeader;
 typedef struct TreeHeaderColumn_ *TreeHeaderColumn;
+typedef struct TreeFindIndex_ *TreeFindIndex;
+typedef struct TreeTagIndex_ *TreeTagIndex;
 
 typedef struct StyleDrawArgs StyleDrawArgs;
 typedef struct TagInfo TagInfo;
@@ -375,6 +377,17 @@ struct TreeCtrl
     Tcl_Obj *itemHeightObj;	/* -itemheight: Fixed height for all items
                                     (unless overridden) */
     int itemHeight;		/* -itemheight */
+    char *itemDataCmd;		/* -itemdatacommand: Script to call for
+				 * onscreen items that have no data yet */
+    int itemDataCacheSize;	/* -itemdatacachesize: Max number of items
+				 * whose data is kept, 0 for unlimited */
+    struct {
+	int *ids;		/* Ring of ids of items that have data,
+				 * oldest first. */
+	int alloc;		/* Size of ids[]. */
+	int first;		/* Index of the oldest id in ids[]. */
+	int count;		/* Number of ids in the ring. */
+    } itemData;
     Tcl_Obj *minItemHeightObj;	/* -minitemheight: Minimum height for all items */
     int minItemHeight;		/* -minitemheight */
     Tcl_Obj *itemWidthObj;	/* -itemwidth */
@@ -449,6 +462,10 @@ struct TreeCtrl
     int gotFocus;		/* flag */
     int deleted;		/* flag */
     int updateIndex;		/* flag */
+    int populating;		/* Depth of nested <Populate> events */
+    unsigned int visEpoch;	/* Incremented when the result of
+				 * TreeItem_ReallyVisible() may change for
+				 * any item. Never zero. */
     int isActive;		/* flag: mac & win "active" toplevel */
     struct {
 	int left;
@@ -521,7 +538,27 @@ struct TreeCtrl
     TreeItem anchorItem;
     int nextItemId;
     int nextColumnId;
-    Tcl_HashTable itemHash;	/* TreeItem.id -> TreeItem */
+    TreeItem *itemTable;	/* TreeItem.id - itemTableBase -> TreeItem,
+				 * NULL if no item has that id. */
+    unsigned int *itemTableUsed; /* One bit per itemTable slot, set if
+				 * the slot is in use. */
+    int itemTableBase;		/* Id of the first slot in itemTable. A
+				 * multiple of the bits in a bitmap word. */
+    int itemTableSize;		/* Number of slots in itemTable. */
+    int itemTableCount;		/* Number of items in itemTable. */
+    int itemTableRemoved;	/* Items removed from itemTable since it
+				 * was last reallocated. */
+    int *itemSparseIds;		/* Ids of the items below itemTableBase,
+				 * in increasing order. */
+    TreeItem *itemSparse;	/* The items with those ids, NULL if
+				 * deleted. */
+    int itemSparseCount;	/* Number of ids in itemSparseIds. */
+    int itemSparseAlloc;	/* Number of slots in itemSparseIds. */
+    int itemSparseDead;		/* Number of NULLs in itemSparse. */
+    unsigned int *itemStateBits[32]; /* One bitmap like itemTableUsed for
+				 * each item state, set if the item in
+				 * the slot has the state. NULL if no
+				 * item ever had the state. */
     Tcl_HashTable itemSpansHash; /* TreeItem -> nothing */
     Tcl_HashTable elementHash;	/* Element.name -> Element */
     Tcl_HashTable styleHash;	/* Style.name -> Style */
@@ -535,8 +572,30 @@ struct TreeCtrl
     TreeDragImage dragImage;
     TreeMarquee marquee;
     TreeDInfo dInfo;
-    int selectCount;		/* Number of selected items */
-    Tcl_HashTable selection;	/* Selected items */
+    int selectCount;		/* Number of selected items. The selected
+				 * items are the ones set in the
+				 * STATE_ITEM_SELECTED bitmap of
+				 * itemStateBits[]. */
+    int *hiddenIds;		/* Ids of items whose descendants (or the
+				 * item itself) may have been hidden since
+				 * the last Tree_DeselectHidden(). */
+    int hiddenCount;		/* Number of ids in hiddenIds. */
+    int hiddenAlloc;		/* Number of slots in hiddenIds. */
+    int hiddenAll;		/* TRUE if Tree_DeselectHidden() should
+				 * check every selected item instead of
+				 * the subtrees in hiddenIds. */
+    int itemDescEpoch;		/* Compiled item descriptions made before
+				 * this changed must be parsed again. */
+    int batchDepth;		/* Nesting level of [$T batch] scripts. */
+    Tcl_HashTable batchSelection; /* TreeItem.id -> TRUE if the item was
+				 * selected when the outermost [$T batch]
+				 * script began. Holds only the items whose
+				 * selection changed during the script. */
+    int *batchDeleted;		/* Ids of items deleted during the outermost
+				 * [$T batch] script that were selected
+				 * when it began. */
+    int batchDeletedCount;	/* Number of ids in batchDeleted. */
+    int batchDeletedAlloc;	/* Number of slots in batchDeleted. */
 
 #define TREE_WRAP_NONE 0
 #define TREE_WRAP_ITEMS 1
@@ -582,6 +641,20 @@ struct TreeCtrl
     int preserveItemRefCnt;	/* Ref count so items-in-use aren't freed. */
     TreeItemList preserveItemList;	/* List of items to be deleted when
 				 * preserveItemRefCnt==0. */
+    TreeItemList deadItemList;	/* Deleted items whose styles have not
+				 * been freed yet. They are freed a few at
+				 * a time when idle. */
+    TreeItemList sortPendingList; /* Children of items with an
+				 * [item sortspec] that are placed in
+				 * sorted order when the current [item]
+				 * command finishes. */
+    int findIndexOn;		/* -findindex */
+    TreeFindIndex findIndex;	/* Text index for [item find], NULL
+				 * unless -findindex is true. */
+    int tagIndexOn;		/* -tagindex */
+    TreeTagIndex tagIndex;	/* Tag -> item index for item
+				 * descriptions, NULL unless -tagindex
+				 * is true. */
 
     struct {
 	Tcl_Obj *yObj;
@@ -668,9 +741,20 @@ struct TreeCtrl
 #define TREE_CONF_DEFSTYLE 0x4000
 #define TREE_CONF_BG_IMAGE 0x8000
 #define TREE_CONF_THEME 0x00010000
+#define TREE_CONF_FINDINDEX 0x00020000
+#define TREE_CONF_TAGINDEX 0x00040000
 
 MODULE_SCOPE void Tree_AddItem(TreeCtrl *tree, TreeItem item);
 MODULE_SCOPE void Tree_RemoveItem(TreeCtrl *tree, TreeItem item);
+MODULE_SCOPE TreeItem Tree_FindItem(TreeCtrl *tree, int id);
+MODULE_SCOPE TreeItem Tree_FirstItem(TreeCtrl *tree, int *searchPtr);
+MODULE_SCOPE TreeItem Tree_NextItem(TreeCtrl *tree, int *searchPtr);
+MODULE_SCOPE TreeItem Tree_NextItemInState(TreeCtrl *tree, int *searchPtr,
+    int states[2]);
+MODULE_SCOPE void Tree_ItemStateChanged(TreeCtrl *tree, TreeItem item,
+    int oldState, int newState);
+MODULE_SCOPE TreeItem Tree_FirstSelected(TreeCtrl *tree, int *searchPtr);
+MODULE_SCOPE TreeItem Tree_NextSelected(TreeCtrl *tree, int *searchPtr);
 MODULE_SCOPE void Tree_AddHeader(TreeCtrl *tree, TreeItem item);
 MODULE_SCOPE void Tree_RemoveHeader(TreeCtrl *tree, TreeItem item);
 MODULE_SCOPE Tk_Image Tree_GetImage(TreeCtrl *tree, char *imageName);
@@ -679,6 +763,9 @@ MODULE_SCOPE void Tree_UpdateScrollbarX(TreeCtrl *tree);
 MODULE_SCOPE void Tree_UpdateScrollbarY(TreeCtrl *tree);
 MODULE_SCOPE void Tree_AddToSelection(TreeCtrl *tree, TreeItem item);
 MODULE_SCOPE void Tree_RemoveFromSelection(TreeCtrl *tree, TreeItem item);
+MODULE_SCOPE void Tree_BatchSelection(TreeCtrl *tree, TreeItemList *select,
+    TreeItemList *deselect);
+MODULE_SCOPE void Tree_BatchItemDeleted(TreeCtrl *tree, TreeItem item);
 MODULE_SCOPE void Tree_PreserveItems(TreeCtrl *tree);
 MODULE_SCOPE void Tree_ReleaseItems(TreeCtrl *tree);
 
@@ -696,6 +783,9 @@ MODULE_SCOPE int Tree_StateFromListObj(TreeCtrl *tree, int domain, Tcl_Obj *obj,
 
 MODULE_SCOPE int Tree_StateCmd(TreeCtrl *tree, int domain, int objc, Tcl_Obj *CONST objv[]);
 
+#define Tree_VisibilityChanged(tree) \
+    do { if (++(tree)->visEpoch == 0) (tree)->visEpoch = 1; } while (0)
+
 #define Tree_BorderLeft(tree) \
     tree->inset.left
 #define Tree_BorderTop(tree) \
@@ -772,6 +862,8 @@ MODULE_SCOPE TreeHeaderColumn TreeHeaderColumn_CreateWithItemColumn(
     TreeHeader header, TreeItemColumn itemColumn);
 MODULE_SCOPE void TreeHeaderColumn_FreeResources(TreeCtrl *tree,
     TreeHeaderColumn column);
+MODULE_SCOPE void TreeHeaderColumn_SetItemColumn(TreeHeaderColumn column,
+    TreeItemColumn itemColumn);
 MODULE_SCOPE int TreeHeaderColumn_StateChanged(TreeHeader header,
     TreeHeaderColumn column, TreeColumn treeColumn, int state1, int state2);
 MODULE_SCOPE int TreeHeaderColumn_DragBounds(TreeHeader header,
@@ -806,7 +898,7 @@ struct ItemForEach {
     TreeCtrl *tree;
     int error;
     int all;
-    Tcl_HashSearch search;
+    int search;
     TreeItem last;
     TreeItem item;
     TreeItemList *items;
@@ -832,9 +924,12 @@ MODULE_SCOPE void DStringAppendf(Tcl_DString *dString, char *fmt, ...);
 MODULE_SCOPE void Tree_Debug(TreeCtrl *tree);
 
 MODULE_SCOPE int TreeItem_InitWidget(TreeCtrl *tree);
+MODULE_SCOPE void TreeItem_InvalidateDescriptions(TreeCtrl *tree);
 MODULE_SCOPE void TreeItem_FreeWidget(TreeCtrl *tree);
 MODULE_SCOPE int TreeItem_Debug(TreeCtrl *tree, TreeItem item);
 MODULE_SCOPE void TreeItem_OpenClose(TreeCtrl *tree, TreeItem item, int mode);
+MODULE_SCOPE void TreeItem_OpenCloseList(TreeCtrl *tree, TreeItemList *items,
+    int mode);
 MODULE_SCOPE void TreeItem_Delete(TreeCtrl *tree, TreeItem item);
 MODULE_SCOPE int TreeItem_Deleted(TreeCtrl *tree, TreeItem item);
 
@@ -930,6 +1025,7 @@ MODULE_SCOPE void TreeItem_DrawButton(TreeCtrl *tree, TreeItem self, int x, int
 MODULE_SCOPE int TreeItem_ReallyVisible(TreeCtrl *tree, TreeItem self);
 MODULE_SCOPE void TreeItem_FreeResources(TreeCtrl *tree, TreeItem self);
 MODULE_SCOPE void TreeItem_Release(TreeCtrl *tree, TreeItem item);
+MODULE_SCOPE void TreeItem_FreeDeadItems(TreeCtrl *tree);
 MODULE_SCOPE TreeItem TreeItem_RootAncestor(TreeCtrl *tree, TreeItem item_);
 MODULE_SCOPE int TreeItem_IsAncestor(TreeCtrl *tree, TreeItem item1, TreeItem item2);
 MODULE_SCOPE Tcl_Obj *TreeItem_ToObj(TreeCtrl *tree, TreeItem item);
@@ -946,15 +1042,26 @@ MODULE_SCOPE int TreeItem_GetRects(TreeCtrl *tree, TreeItem item_,
 MODULE_SCOPE int TreeItem_Indent(TreeCtrl *tree, TreeColumn column, TreeItem item_);
 MODULE_SCOPE void Tree_UpdateItemIndex(TreeCtrl *tree);
 MODULE_SCOPE void Tree_DeselectHidden(TreeCtrl *tree);
+MODULE_SCOPE void Tree_DeselectHiddenNow(TreeCtrl *tree);
+MODULE_SCOPE void Tree_SubtreeHidden(TreeCtrl *tree, TreeItem item_);
 MODULE_SCOPE int TreeItemCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
 MODULE_SCOPE void TreeItem_UpdateWindowPositions(TreeCtrl *tree, TreeItem item_,
     int lock, int x, int y, int width, int height);
 MODULE_SCOPE void TreeItem_GetOnScreenColumns(TreeCtrl *tree, TreeItem item_,
     int lock, int x, int y, int width, int height, TreeColumnList *columns);
 MODULE_SCOPE void TreeItem_OnScreen(TreeCtrl *tree, TreeItem item_, int onScreen);
+MODULE_SCOPE int TreeItem_NeedsData(TreeCtrl *tree, TreeItem item);
+MODULE_SCOPE void TreeItem_RequestData(TreeCtrl *tree, TreeItemList *items);
+MODULE_SCOPE void TreeItem_DataCacheSizeChanged(TreeCtrl *tree, int oldSize);
+MODULE_SCOPE void TreeItem_FreeDataCache(TreeCtrl *tree);
+MODULE_SCOPE void TreeItem_AllocStats(TreeCtrl *tree, Tcl_DString *dString);
+MODULE_SCOPE void TreeItem_FindIndexConfigure(TreeCtrl *tree);
+MODULE_SCOPE void TreeItem_FindTextChanged(TreeCtrl *tree, TreeItem item);
+MODULE_SCOPE void TreeItem_FindIndexInvalidate(TreeCtrl *tree);
+MODULE_SCOPE void TreeItem_TagIndexConfigure(TreeCtrl *tree);
 
 MODULE_SCOPE TreeItemColumn TreeItem_GetFirstColumn(TreeCtrl *tree, TreeItem item);
-MODULE_SCOPE TreeItemColumn TreeItemColumn_GetNext(TreeCtrl *tree, TreeItemColumn column);
+MODULE_SCOPE TreeItemColumn TreeItemColumn_GetNext(TreeCtrl *tree, TreeItem item, TreeItemColumn column);
 MODULE_SCOPE void TreeItemColumn_InvalidateSize(TreeCtrl *tree, TreeItemColumn column);
 MODULE_SCOPE TreeStyle TreeItemColumn_GetStyle(TreeCtrl *tree, TreeItemColumn column);
 MODULE_SCOPE void TreeItemColumn_SetStyle(TreeCtrl *tree, TreeItemColumn column, TreeStyle style);
@@ -1042,6 +1149,7 @@ MODULE_SCOPE void TreeStyle_TreeChanged(TreeCtrl *tree, int flagT);
 #define SORT_LONG 3
 #define SORT_COMMAND 4
 MODULE_SCOPE int TreeStyle_GetSortData(TreeCtrl *tree, TreeStyle style_, int elemIndex, int type, long *lv, double *dv, char **sv);
+MODULE_SCOPE void TreeStyle_AppendTexts(TreeCtrl *tree, TreeStyle style_, Tcl_DString *dString);
 #if 0
 MODULE_SCOPE int TreeStyle_ValidateElements(TreeCtrl *tree, TreeStyle style_, int objc, Tcl_Obj *CONST objv[]);
 #endif
@@ -1051,6 +1159,7 @@ MODULE_SCOPE int TreeStyleCmd(ClientData clientData, Tcl_Interp *interp, int obj
 MODULE_SCOPE int TreeStyle_ChangeState(TreeCtrl *tree, TreeStyle style_, int state1, int state2);
 MODULE_SCOPE void Tree_UndefineState(TreeCtrl *tree, int domain, int state);
 MODULE_SCOPE int TreeStyle_NumElements(TreeCtrl *tree, TreeStyle style_);
+MODULE_SCOPE int TreeStyle_NeedsPromptFree(TreeCtrl *tree, TreeStyle style_);
 MODULE_SCOPE int TreeStyle_IsHeaderStyle(TreeCtrl *tree, TreeStyle style);
 MODULE_SCOPE int TreeStyle_HasHeaderElement(TreeCtrl *tree, TreeStyle style);
 MODULE_SCOPE TreeStyle Tree_MakeHeaderStyle(TreeCtrl *tree, HeaderStyleParams *params);
@@ -1063,7 +1172,10 @@ MODULE_SCOPE int Tree_ButtonHeight(TreeCtrl *tree, int state);
 /* tkTreeNotify.c */
 MODULE_SCOPE int TreeNotify_InitWidget(TreeCtrl *tree);
 MODULE_SCOPE void TreeNotify_OpenClose(TreeCtrl *tree, TreeItem item, int isOpen, int before);
+MODULE_SCOPE void TreeNotify_Populate(TreeCtrl *tree, TreeItem item);
+MODULE_SCOPE int TreeNotify_OpenCloseBound(TreeCtrl *tree);
 MODULE_SCOPE void TreeNotify_Selection(TreeCtrl *tree, TreeItemList *select, TreeItemList *deselect);
+MODULE_SCOPE void TreeNotify_BatchSelection(TreeCtrl *tree, TreeItemList *select, TreeItemList *deselect, int *deletedIds, int deletedCount);
 MODULE_SCOPE int TreeNotifyCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
 MODULE_SCOPE void TreeNotify_ActiveItem(TreeCtrl *tree, TreeItem itemOld, TreeItem itemNew);
 MODULE_SCOPE void TreeNotify_Scroll(TreeCtrl *tree, double fractions[2], int vertical);
@@ -1376,6 +1488,7 @@ MODULE_SCOPE int Tree_ScrollWindow(TreeCtrl *tree, GC gc, int x, int y,
 MODULE_SCOPE void Tree_UnsetClipMask(TreeCtrl *tree, Drawable drawable, GC gc);
 MODULE_SCOPE void Tree_XImage2Photo(Tcl_Interp *interp, Tk_PhotoHandle photoH,
     XImage *ximage, unsigned long trans, int alpha);
+MODULE_SCOPE int Tree_NumProcessors(void);
 
 #define PAD_TOP_LEFT     0
 #define PAD_BOTTOM_RIGHT 1
@@ -1548,6 +1661,9 @@ typedef struct TagExpr {
 MODULE_SCOPE int TagExpr_Init(TreeCtrl *tree, Tcl_Obj *exprObj, TagExpr *expr);
 MODULE_SCOPE int TagExpr_Scan(TagExpr *expr);
 MODULE_SCOPE int TagExpr_Eval(TagExpr *expr, TagInfo *tags);
+#define TAG_EXPR_COVER_MAX 8
+MODULE_SCOPE int TagExpr_Cover(TagExpr *expr, Tk_Uid uids[], int *numUidsPtr,
+    int masks[], int *numMasksPtr);
 MODULE_SCOPE void TagExpr_Free(TagExpr *expr);
 
 MODULE_SCOPE Tk_OptionSpec *Tree_FindOptionSpec(Tk_OptionSpec *optionTable, CONST char *optionName);
@@ -6916,6 +6916,63 @@ TrackItemVisibility(
     return DISPLAY_OK;
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * RequestItemData --
+ *
+ *	Call the -itemdatacommand for every onscreen item that doesn't
+ *	have its data yet.
+ *
+ * Results:
+ *	DISPLAY_OK, or DISPLAY_RETRY if the command caused a redisplay
+ *	to be requested, or DISPLAY_EXIT if the widget was deleted or
+ *	unmapped.
+ *
+ * Side effects:
+ *	A Tcl command may be invoked.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+RequestItemData(
+    TreeCtrl *tree,		/* Widget info. */
+    DItem *dItemHead		/* Linked list of onscreen item info. */
+    )
+{
+    DItem *dItem;
+    TreeItemList items;
+    int requests;
+
+    if (tree->itemDataCmd == NULL)
+	return DISPLAY_OK;
+
+    TreeItemList_Init(tree, &items, 0);
+    for (dItem = dItemHead;
+	dItem != NULL;
+	dItem = dItem->next) {
+	if (TreeItem_NeedsData(tree, dItem->item))
+	    TreeItemList_Append(&items, dItem->item);
+    }
+    if (TreeItemList_Count(&items) == 0) {
+	TreeItemList_Free(&items);
+	return DISPLAY_OK;
+    }
+
+    TreeDisplay_GetReadyForTrouble(tree, &requests);
+    TreeItem_RequestData(tree, &items);
+    TreeItemList_Free(&items);
+
+    if (tree->deleted || !Tk_IsMapped(tree->tkwin))
+	return DISPLAY_EXIT;
+
+    if (TreeDisplay_WasThereTrouble(tree, requests))
+	return DISPLAY_RETRY;
+
+    return DISPLAY_OK;
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -7187,6 +7244,13 @@ displayRetry:
 	case DISPLAY_EXIT: goto displayExit; break;
     }
 
+    /* Styles for items in virtual mode are assigned by the
+     * -itemdatacommand just before the items are displayed. */
+    switch (RequestItemData(tree, dInfo->dItem)) {
+	case DISPLAY_RETRY: goto displayRetry; break;
+	case DISPLAY_EXIT: goto displayExit; break;
+    }
+
     /* Also track visibility of header items, but don't generate an
      * <ItemVisibility> event.  Just make sure that window elements
      * in any displayed styles in the headers know when they go offscreen. */
@@ -8568,8 +8632,7 @@ Tree_FocusChanged(
 {
     TreeDInfo dInfo = tree->dInfo;
     TreeItem item;
-    Tcl_HashEntry *hPtr;
-    Tcl_HashSearch search;
+    int search;
     int stateOn, stateOff;
 
     tree->gotFocus = gotFocus;
@@ -8592,11 +8655,10 @@ Tree_FocusChanged(
 	stateOff = STATE_ITEM_FOCUS, stateOn = 0;
 
     /* Slow. Change state of every item */
-    hPtr = Tcl_FirstHashEntry(&tree->itemHash, &search);
-    while (hPtr != NULL) {
-	item = (TreeItem) Tcl_GetHashValue(hPtr);
+    item = Tree_FirstItem(tree, &search);
+    while (item != NULL) {
 	TreeItem_ChangeState(tree, item, stateOff, stateOn);
-	hPtr = Tcl_NextHashEntry(&search);
+	item = Tree_NextItem(tree, &search);
     }
 
 #ifdef USE_TTK
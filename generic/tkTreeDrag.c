@@ -925,7 +925,7 @@ TreeDragImageCmd(
 			}
 		    }
 		    treeColumn = TreeColumn_Next(treeColumn);
-		    itemColumn = TreeItemColumn_GetNext(tree, itemColumn);
+		    itemColumn = TreeItemColumn_GetNext(tree, item, itemColumn);
 		}
 
 	    } else {
@@ -3367,7 +3367,6 @@ typedef struct ElementTextVar {
     Tcl_Obj *varNameObj;		/* -textvariable */
     TreeCtrl *tree;			/* needed to redisplay */
     TreeItem item;			/* needed to redisplay */
-    TreeItemColumn column;		/* needed to redisplay */
 } ElementTextVar;
 #endif
 
@@ -3865,7 +3864,7 @@ static char *VarTraceProc_Text(ClientData clientData, Tcl_Interp *interp,
     }
 
     elemX->textLen = STRINGREP_INVALID;
-    Tree_ElementChangedItself(etv->tree, etv->item, etv->column,
+    Tree_ElementChangedItself(etv->tree, etv->item, NULL,
 	(TreeElement) elemX, TEXT_CONF_LAYOUT | TEXT_CONF_TEXTVAR,
 	CS_LAYOUT | CS_DISPLAY);
     return (char *) NULL;
@@ -3927,7 +3926,6 @@ static int ConfigProcText(TreeElementArgs *args)
 	    if (etv != NULL) {
 		etv->tree = tree;
 		etv->item = args->config.item;
-		etv->column = args->config.column;
 		varNameObj = etv->varNameObj;
 	    } else
 		varNameObj = NULL;
@@ -4496,6 +4494,58 @@ TreeElement_GetSortData(
     return TCL_OK;
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeElement_GetText --
+ *
+ *	Return the string a text element displays, which comes from its
+ *	-text, -textvariable or -data option or that of its master.
+ *
+ * Results:
+ *	Pointer to the UTF-8 string, which is not NUL-terminated, or NULL
+ *	if the element displays no text. The length in bytes is stored in
+ *	lengthPtr.
+ *
+ * Side effects:
+ *	The string may be recalculated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+char *
+TreeElement_GetText(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeElement elem,		/* Text element. */
+    int *lengthPtr		/* Returned number of bytes. */
+    )
+{
+    ElementText *elemX = (ElementText *) elem;
+    ElementText *masterX = (ElementText *) elem->master;
+    TreeElementArgs args;
+
+    args.tree = tree;
+    if ((masterX != NULL) && (masterX->textLen == STRINGREP_INVALID)) {
+	args.elem = (TreeElement) masterX;
+	TextUpdateStringRep(&args);
+    }
+    if (elemX->textLen == STRINGREP_INVALID) {
+	args.elem = elem;
+	TextUpdateStringRep(&args);
+    }
+
+    if (elemX->text != NULL) {
+	(*lengthPtr) = elemX->textLen;
+	return elemX->text;
+    }
+    if ((masterX != NULL) && (masterX->text != NULL)) {
+	(*lengthPtr) = masterX->textLen;
+	return masterX->text;
+    }
+    (*lengthPtr) = 0;
+    return NULL;
+}
+
 static int StateProcText(TreeElementArgs *args)
 {
     TreeCtrl *tree = args->tree;
@@ -4631,7 +4681,6 @@ struct ElementWindow
 #endif
     TreeCtrl *tree;
     TreeItem item; 		/* Needed if window changes size */
-    TreeItemColumn column; 	/* Needed if window changes size */
     Tk_Window tkwin;		/* Window associated with item.  NULL means
 				 * window has been destroyed. */
     int destroy;		/* Destroy window when element
@@ -4684,7 +4733,7 @@ WinItemStructureProc(
 
     if (eventPtr->type == DestroyNotify) {
 	elemX->tkwin = elemX->child = NULL;
-	Tree_ElementChangedItself(elemX->tree, elemX->item, elemX->column,
+	Tree_ElementChangedItself(elemX->tree, elemX->item, NULL,
 	    (TreeElement) elemX, EWIN_CONF_WINDOW, CS_LAYOUT | CS_DISPLAY);
     }
 }
@@ -4702,7 +4751,7 @@ WinItemRequestProc(
     if (elemX->child != NULL && tkwin != elemX->child)
 	return;
 #endif
-    Tree_ElementChangedItself(elemX->tree, elemX->item, elemX->column,
+    Tree_ElementChangedItself(elemX->tree, elemX->item, NULL,
 	(TreeElement) elemX, EWIN_CONF_WINDOW, CS_LAYOUT | CS_DISPLAY);
 }
 
@@ -4750,7 +4799,7 @@ WinItemLostSlaveProc(
     Tk_UnmapWindow(elemX->tkwin);
     elemX->tkwin = NULL;
 #endif
-    Tree_ElementChangedItself(elemX->tree, elemX->item, elemX->column,
+    Tree_ElementChangedItself(elemX->tree, elemX->item, NULL,
 	(TreeElement) elemX, EWIN_CONF_WINDOW, CS_LAYOUT | CS_DISPLAY);
 }
 
@@ -4945,7 +4994,6 @@ static int CreateProcWindow(TreeElementArgs *args)
 
     elemX->tree = tree;
     elemX->item = args->create.item;
-    elemX->column = args->create.column;
     elemX->destroy = -1;
 #ifdef CLIP_WINDOW
     elemX->clip = -1;
@@ -4953,6 +5001,42 @@ static int CreateProcWindow(TreeElementArgs *args)
     return TCL_OK;
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeElement_NeedsPromptDelete --
+ *
+ *	Determine if an element instance is tied to something outside
+ *	the widget that must be let go of as soon as its item is
+ *	deleted: a window, or a -textvariable trace.
+ *
+ * Results:
+ *	TRUE or FALSE.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TreeElement_NeedsPromptDelete(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeElement elem		/* Element instance. */
+    )
+{
+    if (ELEMENT_TYPE_MATCHES(elem->typePtr, &treeElemTypeWindow))
+	return ((ElementWindow *) elem)->tkwin != NULL;
+#ifdef TEXTVAR
+    if (ELEMENT_TYPE_MATCHES(elem->typePtr, &treeElemTypeText)) {
+	ElementTextVar *etv = DynamicOption_FindData(elem->options,
+	    DOID_TEXT_VAR);
+	return (etv != NULL) && (etv->varNameObj != NULL);
+    }
+#endif
+    return FALSE;
+}
+
 static void DisplayProcWindow(TreeElementArgs *args)
 {
     TreeCtrl *tree = args->tree;
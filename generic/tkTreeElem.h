@@ -131,6 +131,8 @@ MODULE_SCOPE TreeElementType treeElemTypeWindow;
 /***** ***** *****/
 
 MODULE_SCOPE int TreeElement_GetSortData(TreeCtrl *tree, TreeElement elem, int type, long *lv, double *dv, char **sv);
+MODULE_SCOPE char *TreeElement_GetText(TreeCtrl *tree, TreeElement elem, int *lengthPtr);
+MODULE_SCOPE int TreeElement_NeedsPromptDelete(TreeCtrl *tree, TreeElement elem);
 
 typedef struct TreeIterate_ *TreeIterate;
 
@@ -1761,6 +1761,32 @@ TreeHeaderColumn_CreateWithItemColumn(
     return column;
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeHeaderColumn_SetItemColumn --
+ *
+ *	Called when the item-column of a header-column has moved in
+ *	memory.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TreeHeaderColumn_SetItemColumn(
+    TreeHeaderColumn column,		/* Header-column token. */
+    TreeItemColumn itemColumn		/* New address of the item-column. */
+    )
+{
+    column->itemColumn = itemColumn;
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -1835,7 +1861,7 @@ FreeDragImages(
 	    item = TreeItem_GetNextSibling(tree, item)) {
 	for (itemColumn = TreeItem_GetFirstColumn(tree, item);
 		itemColumn != NULL;
-		itemColumn = TreeItemColumn_GetNext(tree, itemColumn)) {
+		itemColumn = TreeItemColumn_GetNext(tree, item, itemColumn)) {
 	    TreeHeaderColumn column = TreeItemColumn_GetHeaderColumn(tree,
 		itemColumn);
 	    if (column->dragImage != NULL) {
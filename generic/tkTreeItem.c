@@ -22,9 +22,42 @@ struct TreeItemColumn_ {
     TreeStyle style;	/* Instance style. */
     TreeHeaderColumn headerColumn; /* The header-column if the parent item
 			 * is actually a header, otherwise NULL. */
-    TreeItemColumn next;/* Column to the right of this one */
 };
 
+/* This is the roundUp argument to TreeAlloc_CAlloc. */
+#define ITEM_COLUMN_ROUND 1
+
+/*
+ * A data structure of the following type is kept for each item with an
+ * [item sortspec]. The children of the item are placed in sorted order
+ * when they are created or their sort key changes.
+ */
+typedef struct ItemSortSpec {
+    Tcl_Obj *specObj;	/* [item sort] options describing the order. */
+    TreeItem *children;	/* The children in order, except those waiting
+			 * to be placed. Valid while epoch equals
+			 * TreeCtrl.visEpoch. */
+    int count;		/* Number of children[]. */
+    unsigned int epoch;	/* See children[]. */
+} ItemSortSpec;
+
+/*
+ * A data structure of the following type holds the fields of an item that
+ * are NULL for most items. It is allocated only while one of them is
+ * in use, keeping TreeItem_ small for lists with many items.
+ */
+typedef struct ItemExtra {
+    TreeItemDInfo dInfo; /* display info, or NULL */
+    int *spans;		/* 1 per tree-column. spans[N] is the column index of
+			 * the item-column displayed in column N. If this
+			 * item's columns all have a span of 1, this field
+			 * is NULL (unless it was previously allocated
+			 * because some spans were > 1). */
+    int spanAlloc;	/* Size of spans[]. */
+    TreeHeader header;	/* The header or NULL */
+    ItemSortSpec *sortSpec; /* [item sortspec], or NULL */
+} ItemExtra;
+
 /*
  * A data structure of the following type is kept for each item.
  */
@@ -37,20 +70,6 @@ struct TreeItem_ {
     int index;		/* "row" in flattened tree */
     int indexVis;	/* visible "row" in flattened tree, -1 if hidden */
     int state;		/* STATE_xxx flags */
-    TreeItem parent;
-    TreeItem firstChild;
-    TreeItem lastChild;
-    TreeItem prevSibling;
-    TreeItem nextSibling;
-    TreeItemDInfo dInfo; /* display info, or NULL */
-    TreeItemRInfo rInfo; /* range info, or NULL */
-    TreeItemColumn columns;
-    int *spans;		/* 1 per tree-column. spans[N] is the column index of
-			 * the item-column displayed in column N. If this
-			 * item's columns all have a span of 1, this field
-			 * is NULL (unless it was previously allocated
-			 * because some spans were > 1). */
-    int spanAlloc;	/* Size of spans[]. */
 #define ITEM_FLAG_DELETED	0x0001 /* Item is being deleted */
 #define ITEM_FLAG_SPANS_SIMPLE	0x0002 /* All spans are 1 */
 #define ITEM_FLAG_SPANS_VALID	0x0004 /* Some spans are > 1, but we don't
@@ -64,17 +83,43 @@ struct TreeItem_ {
 
 #define ITEM_FLAG_BUTTONSTATE_ACTIVE	0x0080 /* buttonstate "active" */
 #define ITEM_FLAG_BUTTONSTATE_PRESSED	0x0100 /* buttonstate "pressed" */
+#define ITEM_FLAG_DATA		0x0200 /* -itemdatacommand was called */
+#define ITEM_FLAG_POPULATE	0x0400 /* -populate */
+#define ITEM_FLAG_MOVING	0x0800 /* Item is being moved by [item move] */
+#define ITEM_FLAG_REALLY_VISIBLE 0x1000 /* Cached TreeItem_ReallyVisible()
+					 * result, valid when visEpoch equals
+					 * TreeCtrl.visEpoch */
+#define ITEM_FLAG_SORT_PENDING	0x2000 /* Item is on
+					* TreeCtrl.sortPendingList */
+#define ITEM_FLAG_SORT_NEW	0x4000 /* Item is on
+					* TreeCtrl.sortPendingList because
+					* it was just added to its parent */
+#define ITEM_FLAG_FILTER_MATCH	0x8000 /* Item matched [item filter], only
+					* set while the command runs */
+#define ITEM_FLAG_FIND_DIRTY	0x10000 /* Item is on
+					* TreeFindIndex.dirty */
     int flags;
+    TreeItem parent;
+    TreeItem firstChild;
+    TreeItem lastChild;
+    TreeItem prevSibling;
+    TreeItem nextSibling;
+    TreeItemRInfo rInfo; /* range info, or NULL */
+    TreeItemColumn columns; /* Array of columnCount Column records, or
+			 * NULL. */
+    int columnCount;	/* Size of columns[]. */
+    unsigned int visEpoch; /* See ITEM_FLAG_REALLY_VISIBLE. */
     TagInfo *tagInfo;	/* Tags. May be NULL. */
-
-    TreeHeader header;	/* The header or NULL */
+    ItemExtra *extra;	/* Rarely-used fields, or NULL */
 };
 
 #define ITEM_FLAGS_BUTTONSTATE (ITEM_FLAG_BUTTONSTATE_ACTIVE | \
     ITEM_FLAG_BUTTONSTATE_PRESSED)
+#define ITEM_FLAGS_SORT (ITEM_FLAG_SORT_PENDING | ITEM_FLAG_SORT_NEW)
 
 #ifdef ALLOC_HAX
-static CONST char *ItemUid = "Item", *ItemColumnUid = "ItemColumn";
+static CONST char *ItemUid = "Item", *ItemColumnUid = "ItemColumn",
+    *ItemExtraUid = "ItemExtra";
 #endif
 
 /*
@@ -85,6 +130,15 @@ static CONST char *ItemUid = "Item", *ItemColumnUid = "ItemColumn";
 #define IS_ALL(i) ((i) == ITEM_ALL)
 
 #define IS_DELETED(i) (((i)->flags & ITEM_FLAG_DELETED) != 0)
+#define ITEM_HEADER(i) ((i)->extra ? (i)->extra->header : NULL)
+#define ITEM_DINFO(i) ((i)->extra ? (i)->extra->dInfo : NULL)
+#define ITEM_SORTSPEC(i) ((i)->extra ? (i)->extra->sortSpec : NULL)
+
+/*
+ * Macro to return the Column to the right of the given one, or NULL.
+ */
+#define ITEM_COLUMN_NEXT(i, c) \
+    (((c) + 1 < (i)->columns + (i)->columnCount) ? (c) + 1 : NULL)
 #define IS_VISIBLE(i) (((i)->flags & ITEM_FLAG_VISIBLE) != 0)
 #define IS_WRAP(i) (((i)->flags & ITEM_FLAG_WRAP) != 0)
 
@@ -106,6 +160,9 @@ static Tk_OptionSpec itemOptionSpecs[] = {
     {TK_OPTION_PIXELS, "-height", (char *) NULL, (char *) NULL,
      (char *) NULL, -1, Tk_Offset(TreeItem_, fixedHeight),
      TK_OPTION_NULL_OK, (ClientData) NULL, ITEM_CONF_SIZE},
+    {TK_OPTION_CUSTOM, "-populate", (char *) NULL, (char *) NULL,
+     "0", -1, Tk_Offset(TreeItem_, flags),
+     0, (ClientData) NULL, ITEM_CONF_BUTTON},
     {TK_OPTION_CUSTOM, "-tags", (char *) NULL, (char *) NULL,
      (char *) NULL, -1, Tk_Offset(TreeItem_, tagInfo),
      TK_OPTION_NULL_OK, (ClientData) &TreeCtrlCO_tagInfo, 0},
@@ -122,45 +179,319 @@ static Tk_OptionSpec itemOptionSpecs[] = {
 /*
  *----------------------------------------------------------------------
  *
- * Column_Alloc --
+ * Item_GetExtra --
  *
- *	Allocate and initialize a new Column record.
+ *	Return the record holding the rarely-used fields of an item,
+ *	allocating it if needed.
  *
  * Results:
- *	Pointer to allocated Column.
+ *	Pointer to the ItemExtra record.
  *
  * Side effects:
- *	Memory is allocated.
+ *	Memory may be allocated.
  *
  *----------------------------------------------------------------------
  */
 
-static TreeItemColumn
-Column_Alloc(
+static ItemExtra *
+Item_GetExtra(
     TreeCtrl *tree,		/* Widget info. */
-    TreeItem item
+    TreeItem item		/* Item record. */
+    )
+{
+    if (item->extra == NULL) {
+#ifdef ALLOC_HAX
+	item->extra = (ItemExtra *) TreeAlloc_Alloc(tree->allocData,
+		ItemExtraUid, sizeof(ItemExtra));
+#else
+	item->extra = (ItemExtra *) ckalloc(sizeof(ItemExtra));
+#endif
+	memset(item->extra, '\0', sizeof(ItemExtra));
+    }
+    return item->extra;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Item_FreeExtraIfUnused --
+ *
+ *	Free the record holding the rarely-used fields of an item if
+ *	none of those fields is in use.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Memory may be freed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+Item_FreeExtraIfUnused(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item		/* Item record. */
     )
 {
+    ItemExtra *extra = item->extra;
+
+    if (extra == NULL || extra->dInfo != NULL || extra->spans != NULL ||
+	    extra->header != NULL || extra->sortSpec != NULL)
+	return;
 #ifdef ALLOC_HAX
-    TreeItemColumn column = (TreeItemColumn) TreeAlloc_Alloc(tree->allocData, ItemColumnUid,
-	    sizeof(TreeItemColumn_));
+    TreeAlloc_Free(tree->allocData, ItemExtraUid, (char *) extra,
+	    sizeof(ItemExtra));
 #else
-    TreeItemColumn column = (TreeItemColumn) ckalloc(sizeof(TreeItemColumn_));
+    WFREE(extra, ItemExtra);
 #endif
+    item->extra = NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Item_SortKeyChanged --
+ *
+ *	Called when an item is added to a parent with an [item sortspec]
+ *	or when the text it is sorted by may have changed.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The item is queued so Item_PlaceSorted() moves it to its sorted
+ *	position when the current [item] command finishes.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+Item_SortKeyChanged(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item		/* Item record. */
+    )
+{
+    if ((item->parent == NULL) || (ITEM_SORTSPEC(item->parent) == NULL))
+	return;
+    if (item->flags & ITEM_FLAG_SORT_PENDING)
+	return;
+    item->flags |= ITEM_FLAG_SORT_PENDING;
+    TreeItemList_Append(&tree->sortPendingList, item);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Item_SortForget --
+ *
+ *	Called when an item is deleted so it is not left on the list of
+ *	items waiting to be placed in sorted order.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The item is removed from TreeCtrl.sortPendingList.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+Item_SortForget(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item		/* Item record. */
+    )
+{
+    TreeItemList *pending = &tree->sortPendingList;
+    int i, j;
+
+    if (!(item->flags & ITEM_FLAG_SORT_PENDING))
+	return;
+    item->flags &= ~ITEM_FLAGS_SORT;
+    for (i = j = 0; i < TreeItemList_Count(pending); i++) {
+	if (TreeItemList_Nth(pending, i) != item)
+	    pending->pointers[j++] = pending->pointers[i];
+    }
+    pending->count = j;
+    pending->pointers[j] = NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Item_SortChildrenAdded --
+ *
+ *	Called after new children are linked into a parent with
+ *	TreeItem_AddToParent().
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	If the parent has an [item sortspec] the new children are queued
+ *	to be placed in sorted order.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+Item_SortChildrenAdded(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem parent,		/* Item the children were added to. */
+    TreeItem head,		/* First new child. */
+    int count,			/* Number of new children. */
+    unsigned int epoch		/* TreeCtrl.visEpoch before the children
+				 * were added. */
+    )
+{
+    ItemSortSpec *spec = ITEM_SORTSPEC(parent);
+
+    if (spec == NULL)
+	return;
+
+    /* The new children are not in spec->children, which is still
+     * correct if it was before they were added. */
+    if (spec->epoch == epoch)
+	spec->epoch = tree->visEpoch;
+
+    while (count-- > 0) {
+	Item_SortKeyChanged(tree, head);
+	head->flags |= ITEM_FLAG_SORT_NEW;
+	head = head->nextSibling;
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Item_FixHeaderColumns --
+ *
+ *	Tell the header-columns of a header-item where their Column
+ *	records are after the records were moved in memory.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+Item_FixHeaderColumns(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item,		/* Item token. */
+    int first,			/* Index of the first moved column. */
+    int count			/* Number of moved columns. */
+    )
+{
+    int i;
+
+    if (ITEM_HEADER(item) == NULL)
+	return;
+    for (i = first; i < first + count; i++) {
+	if (item->columns[i].headerColumn != NULL)
+	    TreeHeaderColumn_SetItemColumn(item->columns[i].headerColumn,
+		    &item->columns[i]);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Column_Init --
+ *
+ *	Initialize a new Column record.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	If the item is a header, a header-column is allocated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+Column_Init(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item,		/* Item containing the column. */
+    TreeItemColumn column	/* Uninitialized column record. */
+    )
+{
     memset(column, '\0', sizeof(TreeItemColumn_));
     column->span = 1;
 
-    if (item->header != NULL) {
+    if (ITEM_HEADER(item) != NULL) {
 	column->headerColumn = TreeHeaderColumn_CreateWithItemColumn(
-	    item->header, column);
+	    ITEM_HEADER(item), column);
 #if TREECTRL_DEBUG
 	if (column->headerColumn == NULL)
 	    panic("TreeHeaderColumn_CreateWithItemColumn failed");
 #endif
 	column->cstate = STATE_HEADER_NORMAL;
     }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Item_ResizeColumns --
+ *
+ *	Reallocate the array of Column records of an Item.  New records
+ *	at the end of the array are initialized.  Records past the new
+ *	size must already have been freed.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Memory is allocated and freed.  Column tokens for the item
+ *	become invalid.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+Item_ResizeColumns(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item,		/* Item token. */
+    int count			/* New number of columns. */
+    )
+{
+    TreeItemColumn columns = NULL;
+    int i, oldCount = item->columnCount;
 
-    return column;
+    if (count == oldCount)
+	return;
+    if (count > 0) {
+#ifdef ALLOC_HAX
+	columns = (TreeItemColumn) TreeAlloc_CAlloc(tree->allocData,
+		ItemColumnUid, sizeof(TreeItemColumn_), count,
+		ITEM_COLUMN_ROUND);
+#else
+	columns = (TreeItemColumn) ckalloc(sizeof(TreeItemColumn_) * count);
+#endif
+	if (oldCount > 0)
+	    memcpy(columns, item->columns,
+		    sizeof(TreeItemColumn_) * MIN(count, oldCount));
+    }
+    if (oldCount > 0) {
+#ifdef ALLOC_HAX
+	TreeAlloc_CFree(tree->allocData, ItemColumnUid,
+		(char *) item->columns, sizeof(TreeItemColumn_), oldCount,
+		ITEM_COLUMN_ROUND);
+#else
+	WCFREE(item->columns, TreeItemColumn_, oldCount);
+#endif
+    }
+    item->columns = columns;
+    item->columnCount = count;
+    Item_FixHeaderColumns(tree, item, 0, MIN(count, oldCount));
+    for (i = oldCount; i < count; i++)
+	Column_Init(tree, item, &columns[i]);
 }
 
 /*
@@ -281,7 +612,7 @@ TreeItemColumn_GetStyle(
  *
  * TreeItemColumn_Index --
  *
- *	Return the 0-based index of a Column in an Item's linked list of
+ *	Return the 0-based index of a Column in an Item's array of
  *	Columns.
  *
  * Results:
@@ -300,15 +631,9 @@ TreeItemColumn_Index(
     TreeItemColumn column	/* Column token. */
     )
 {
-    TreeItemColumn walk;
-    int i = 0;
+    int i = (int) (column - item->columns);
 
-    walk = item->columns;
-    while ((walk != NULL) && (walk != column)) {
-	i++;
-	walk = walk->next;
-    }
-    if (walk == NULL)
+    if (i < 0 || i >= item->columnCount)
 	panic("TreeItemColumn_Index: couldn't find the column\n");
     return i;
 }
@@ -378,7 +703,7 @@ TreeItemColumn_SetStyle(
  *	Return the Column to the right of this one.
  *
  * Results:
- *	The next Column in the linked list, or NULL.
+ *	The next Column in the item, or NULL.
  *
  * Side effects:
  *	None.
@@ -389,10 +714,11 @@ TreeItemColumn_SetStyle(
 TreeItemColumn
 TreeItemColumn_GetNext(
     TreeCtrl *tree,		/* Widget info. */
+    TreeItem item,		/* Item token. */
     TreeItemColumn column	/* Column token. */
     )
 {
-    return column->next;
+    return ITEM_COLUMN_NEXT(item, column);
 }
 
 /*
@@ -400,10 +726,11 @@ TreeItemColumn_GetNext(
  *
  * Column_FreeResources --
  *
- *	Free the style and memory associated with the given Column.
+ *	Free the style and header-column associated with the given Column.
+ *	The Column record itself is part of the item's array.
  *
  * Results:
- *	The next Column in the linked list, or NULL.
+ *	None.
  *
  * Side effects:
  *	Memory is freed.
@@ -411,24 +738,16 @@ TreeItemColumn_GetNext(
  *----------------------------------------------------------------------
  */
 
-static TreeItemColumn
+static void
 Column_FreeResources(
     TreeCtrl *tree,		/* Widget info. */
     TreeItemColumn self		/* Column to free. */
     )
 {
-    TreeItemColumn next = self->next;
-
     if (self->style != NULL)
 	TreeStyle_FreeResources(tree, self->style);
     if (self->headerColumn != NULL)
 	TreeHeaderColumn_FreeResources(tree, self->headerColumn);
-#ifdef ALLOC_HAX
-    TreeAlloc_Free(tree->allocData, ItemColumnUid, (char *) self, sizeof(TreeItemColumn_));
-#else
-    WFREE(self, TreeItemColumn_);
-#endif
-    return next;
 }
 
 /*
@@ -554,46 +873,201 @@ Tree_UpdateItemIndex(
 /*
  *----------------------------------------------------------------------
  *
- * Item_Alloc --
+ * Item_CountVisible --
  *
- *	Allocate an initialize a new Item record.
+ *	Count the number of items in a subtree that currently have an
+ *	Item.indexVis value, how many of those are -wrap=true, and the
+ *	maximum Item.depth of any item in the subtree.
  *
  * Results:
- *	Pointer to the allocated Item record.
+ *	The counts are added to the given pointers. maxDepth is only
+ *	ever increased.
  *
  * Side effects:
- *	Memory is allocated.
+ *	None.
  *
  *----------------------------------------------------------------------
  */
 
-static TreeItem
-Item_Alloc(
-    TreeCtrl *tree,		/* Widget info. */
-    int isHeader
+static void
+Item_CountVisible(
+    TreeItem item,		/* Top of the subtree. */
+    int *visCount,		/* Incremented for each item with an
+				 * Item.indexVis value. */
+    int *wrapCount,		/* Incremented for each of those with
+				 * -wrap=true. */
+    int *maxDepth		/* Maximum depth in the subtree. */
     )
 {
-#ifdef ALLOC_HAX
-    TreeItem item = (TreeItem) TreeAlloc_Alloc(tree->allocData, ItemUid, sizeof(TreeItem_));
-#else
-    TreeItem item = (TreeItem) ckalloc(sizeof(TreeItem_));
-#endif
-    memset(item, '\0', sizeof(TreeItem_));
-    if (Tk_InitOptions(tree->interp, (char *) item,
-		tree->itemOptionTable, tree->tkwin) != TCL_OK)
-	panic("Tk_InitOptions() failed in Item_Alloc()");
-    if (isHeader) {
-	if (tree->gotFocus)
-	    item->state |= STATE_HEADER_FOCUS;
-#if MAC_OSX_TK
-	if (!tree->isActive)
-	    item->state |= STATE_HEADER_BG;
-#endif
-    } else {
-	item->state =
-	    STATE_ITEM_OPEN |
-	    STATE_ITEM_ENABLED;
-	if (tree->gotFocus)
+    TreeItem child;
+
+    if (item->indexVis != -1) {
+	(*visCount)++;
+	if (IS_WRAP(item))
+	    (*wrapCount)++;
+    }
+    if (item->depth > *maxDepth)
+	*maxDepth = item->depth;
+    for (child = item->firstChild; child != NULL; child = child->nextSibling)
+	Item_CountVisible(child, visCount, wrapCount, maxDepth);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Item_IsIndexTail --
+ *
+ *	Determine whether the given item and its descendants are the
+ *	last items in the flattened tree. When that is true, a change
+ *	to the item does not affect the Item.index or Item.indexVis of
+ *	any other item, so the indexes can be kept up-to-date without
+ *	the full walk done by Tree_UpdateItemIndex().
+ *
+ * Results:
+ *	TRUE if the item indexes are currently valid, the item is a
+ *	descendant of the root item, and neither the item nor any of
+ *	its ancestors has a following sibling.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+Item_IsIndexTail(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item		/* Item token. */
+    )
+{
+    TreeItem ancestor;
+
+    if (tree->updateIndex || IS_ROOT(item) || (ITEM_HEADER(item) != NULL) ||
+	    (item->nextSibling != NULL))
+	return FALSE;
+
+    for (ancestor = item->parent;
+	    ancestor != NULL;
+	    ancestor = ancestor->parent) {
+	if (ancestor == tree->root)
+	    return TRUE;
+	if (ancestor->nextSibling != NULL)
+	    return FALSE;
+    }
+    return FALSE;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Item_UpdateIndexTail --
+ *
+ *	Set the Item.depth, Item.index and Item.indexVis fields of the
+ *	given Item and all its descendants. The caller must have checked
+ *	Item_IsIndexTail() first. This costs time proportional to the
+ *	size of the subtree instead of the total number of items.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	TreeCtrl.itemVisCount, TreeCtrl.itemWrapCount and TreeCtrl.depth
+ *	are updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+Item_UpdateIndexTail(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item,		/* Item to renumber. */
+    int index			/* New Item.index of the item. */
+    )
+{
+    int visCount = 0, wrapCount = 0, maxDepth = -1, indexVis;
+
+    /* Forget the old visible rows, they are all at the end. */
+    Item_CountVisible(item, &visCount, &wrapCount, &maxDepth);
+    tree->itemVisCount -= visCount;
+    tree->itemWrapCount -= wrapCount;
+
+    indexVis = tree->itemVisCount;
+    Item_UpdateIndex(tree, item, &index, &indexVis);
+    tree->itemVisCount = indexVis;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Item_SetState --
+ *
+ *	Set the STATE_xxx flags of an item. This must be used instead of
+ *	setting TreeItem.state once the item is in the table of items.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The per-state bitmaps of the table of items are updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+Item_SetState(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item,		/* Item record. */
+    int state			/* New STATE_xxx flags. */
+    )
+{
+    if ((state != item->state) && (ITEM_HEADER(item) == NULL))
+	Tree_ItemStateChanged(tree, item, item->state, state);
+    item->state = state;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Item_Alloc --
+ *
+ *	Allocate an initialize a new Item record.
+ *
+ * Results:
+ *	Pointer to the allocated Item record.
+ *
+ * Side effects:
+ *	Memory is allocated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static TreeItem
+Item_Alloc(
+    TreeCtrl *tree,		/* Widget info. */
+    int isHeader
+    )
+{
+#ifdef ALLOC_HAX
+    TreeItem item = (TreeItem) TreeAlloc_Alloc(tree->allocData, ItemUid, sizeof(TreeItem_));
+#else
+    TreeItem item = (TreeItem) ckalloc(sizeof(TreeItem_));
+#endif
+    memset(item, '\0', sizeof(TreeItem_));
+    if (Tk_InitOptions(tree->interp, (char *) item,
+		tree->itemOptionTable, tree->tkwin) != TCL_OK)
+	panic("Tk_InitOptions() failed in Item_Alloc()");
+    if (isHeader) {
+	if (tree->gotFocus)
+	    item->state |= STATE_HEADER_FOCUS;
+#if MAC_OSX_TK
+	if (!tree->isActive)
+	    item->state |= STATE_HEADER_BG;
+#endif
+    } else {
+	item->state =
+	    STATE_ITEM_OPEN |
+	    STATE_ITEM_ENABLED;
+	if (tree->gotFocus)
 	    item->state |= STATE_ITEM_FOCUS;
     }
     item->indexVis = -1;
@@ -601,8 +1075,11 @@ Item_Alloc(
     item->flags |= ITEM_FLAG_SPANS_SIMPLE;
     if (isHeader)
 	Tree_AddHeader(tree, item);
-    else
+    else {
 	Tree_AddItem(tree, item);
+	/* New items get text from -itemstyle and master elements. */
+	TreeItem_FindTextChanged(tree, item);
+    }
     return item;
 }
 
@@ -631,7 +1108,7 @@ Item_AllocRoot(
 
     item = Item_Alloc(tree, FALSE);
     item->depth = -1;
-    item->state |= STATE_ITEM_ACTIVE;
+    Item_SetState(tree, item, item->state | STATE_ITEM_ACTIVE);
     return item;
 }
 
@@ -756,7 +1233,7 @@ TreeItemColumn_ChangeState(
 	sMask = TreeStyle_ChangeState(tree, column->style,
 		item->state | column->cstate, state);
 	if (sMask) {
-	    if ((sMask & CS_LAYOUT) /*&& (item->header == NULL)*/)
+	    if ((sMask & CS_LAYOUT) /*&& (ITEM_HEADER(item) == NULL)*/)
 		TreeColumns_InvalidateWidthOfItems(tree, treeColumn);
 	    iMask |= sMask;
 	}
@@ -765,14 +1242,14 @@ TreeItemColumn_ChangeState(
 	    TreeItem_InvalidateHeight(tree, item);
 	    TreeItemColumn_InvalidateSize(tree, column);
 	    Tree_FreeItemDInfo(tree, item, NULL);
-	    if (item->header == NULL)
+	    if (ITEM_HEADER(item) == NULL)
 		Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
 	} else if (iMask & CS_DISPLAY) {
 	    Tree_InvalidateItemDInfo(tree, treeColumn, item, NULL);
 	}
     }
 
-    if ((iMask & CS_LAYOUT) /*&& (item->header != NULL)*/)
+    if ((iMask & CS_LAYOUT) /*&& (ITEM_HEADER(item) != NULL)*/)
 	TreeColumns_InvalidateWidth(tree);
 
     column->cstate = cstate;
@@ -810,7 +1287,7 @@ TreeItem_ChangeState(
     TreeColumn treeColumn;
     int columnIndex = 0, state, cstate;
     int sMask, iMask = 0;
-    int tailOK = item->header != NULL;
+    int tailOK = ITEM_HEADER(item) != NULL;
 
     state = item->state;
     state &= ~stateOff;
@@ -839,7 +1316,7 @@ TreeItem_ChangeState(
 	    }
 	}
 	columnIndex++;
-	column = column->next;
+	column = ITEM_COLUMN_NEXT(item, column);
 	treeColumn = Tree_ColumnToTheRight(treeColumn, FALSE, tailOK);
     }
 
@@ -923,13 +1400,13 @@ TreeItem_ChangeState(
     if (iMask & CS_LAYOUT) {
 	TreeItem_InvalidateHeight(tree, item);
 	Tree_FreeItemDInfo(tree, item, NULL);
-	if (item->header == NULL)
+	if (ITEM_HEADER(item) == NULL)
 	    Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
 	else
 	    TreeColumns_InvalidateWidth(tree);
     }
 
-    item->state = state;
+    Item_SetState(tree, item, state);
 
     return iMask;
 }
@@ -963,10 +1440,10 @@ TreeItem_UndefineState(
 
     while (column != NULL) {
 	column->cstate &= ~state;
-	column = column->next;
+	column = ITEM_COLUMN_NEXT(item, column);
     }
 
-    item->state &= ~state;
+    Item_SetState(tree, item, item->state & ~state);
 }
 
 /*
@@ -998,7 +1475,7 @@ TreeItem_HasButton(
 	return 0;
     if (item->parent == tree->root && !tree->showRootChildButtons)
 	return 0;
-    if (item->flags & ITEM_FLAG_BUTTON)
+    if (item->flags & (ITEM_FLAG_BUTTON | ITEM_FLAG_POPULATE))
 	return 1;
     if (item->flags & ITEM_FLAG_BUTTON_AUTO) {
 	TreeItem child = item->firstChild;
@@ -1275,7 +1752,7 @@ TreeItem_CanAddToSelection(
     TreeItem item		/* Item token. */
     )
 {
-    if (item->header != NULL)
+    if (ITEM_HEADER(item) != NULL)
 	return FALSE;
 
     if (TreeItem_GetSelected(tree, item))
@@ -1422,7 +1899,12 @@ TreeItem_SetDInfo(
     TreeItemDInfo dInfo		/* Display-info token. */
     )
 {
-    item->dInfo = dInfo;
+    if (dInfo != NULL) {
+	Item_GetExtra(tree, item)->dInfo = dInfo;
+    } else if (item->extra != NULL) {
+	item->extra->dInfo = NULL;
+	Item_FreeExtraIfUnused(tree, item);
+    }
 }
 
 /*
@@ -1448,7 +1930,7 @@ TreeItem_GetDInfo(
     TreeItem item		/* Item token. */
     )
 {
-    return item->dInfo;
+    return ITEM_DINFO(item);
 }
 
 /*
@@ -1828,8 +2310,9 @@ Qualifiers_Scan(
 		if (tree->itemTagExpr) {
 		    if (q->exprOK)
 			TagExpr_Free(&q->expr);
+		    q->exprOK = FALSE;
 		    if (TagExpr_Init(tree, objv[j + 1], &q->expr) != TCL_OK)
-			return TCL_ERROR;
+			goto errorExit;
 		    q->exprOK = TRUE;
 		} else {
 		    q->tag = Tk_GetUid(Tcl_GetString(objv[j + 1]));
@@ -1852,6 +2335,7 @@ Qualifiers_Scan(
 errorExit:
     if (q->exprOK)
 	TagExpr_Free(&q->expr);
+    q->exprOK = FALSE;
     return TCL_ERROR;
 }
 
@@ -1925,96 +2409,110 @@ Qualifiers_Free(
 	TagExpr_Free(&q->expr);
 }
 
+/*
+ * The [item find] and tag indexes map a key to a list of item ids. The
+ * lists are only appended to, so they may hold the ids of deleted items
+ * or of items that no longer have the key, and the callers check every
+ * item they get from them.
+ */
+
+typedef struct IdPosting {
+    int count;			/* Number of ids. */
+    int alloc;			/* Room in ids[]. */
+    int ids[1];			/* Ids of items with the key.
+				 * Actual size is alloc. */
+} IdPosting;
+
 /*
  *----------------------------------------------------------------------
  *
- * NotManyMsg --
+ * IdPosting_Add --
  *
- *	Set the interpreter result with an error message.
+ *	Add an item id to the list for a key.
  *
  * Results:
- *	None.
+ *	1 if the id was added, 0 if it was already last in the list.
  *
  * Side effects:
- *	Changes the interpreter result.
+ *	Memory is allocated.
  *
  *----------------------------------------------------------------------
  */
 
-static void
-NotManyMsg(
-    TreeCtrl *tree,
-    int doHeaders
+static int
+IdPosting_Add(
+    Tcl_HashTable *tablePtr,	/* TCL_ONE_WORD_KEYS table. */
+    char *key,			/* Key. */
+    int id			/* Item id. */
     )
 {
-    FormatResult(tree->interp, "can't specify > 1 %s for this command",
-	doHeaders ? "header" : "item");
+    Tcl_HashEntry *hPtr;
+    IdPosting *posting;
+    int isNew;
+
+    hPtr = Tcl_CreateHashEntry(tablePtr, key, &isNew);
+    if (isNew) {
+	posting = (IdPosting *) ckalloc(sizeof(IdPosting));
+	posting->count = 0;
+	posting->alloc = 1;
+	Tcl_SetHashValue(hPtr, (ClientData) posting);
+    } else {
+	posting = (IdPosting *) Tcl_GetHashValue(hPtr);
+	if (posting->ids[posting->count - 1] == id)
+	    return 0;
+    }
+    if (posting->count == posting->alloc) {
+	posting->alloc *= 2;
+	posting = (IdPosting *) ckrealloc((char *) posting,
+		sizeof(IdPosting) + sizeof(int) * (posting->alloc - 1));
+	Tcl_SetHashValue(hPtr, (ClientData) posting);
+    }
+    posting->ids[posting->count++] = id;
+    return 1;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * TreeItemList_FromObj --
+ * IdPostings_Clear --
  *
- *	Parse a Tcl_Obj item description to get a list of items.
+ *	Remove every list from a table.
  *
- *   -- returning a single item --
- *   "active MODIFIERS"
- *   "anchor MODIFIERS"
- *   "nearest x y MODIFIERS"
- *   "root MODIFIERS"
- *   "first QUALIFIERS MODIFIERS"
- *   "last QUALIFIERS MODIFIERS"
- *   "end QUALIFIERS MODIFIERS"
- *   "rnc row col MODIFIERS"
- *   "ID MODIFIERS"
- *   -- returning multiple items --
- *   all QUALIFIERS
- *   QUALIFIERS (like "all QUALIFIERS")
- *   list listOfItemDescs
- *   range QUALIFIERS
- *   tag tagExpr QUALIFIERS
- *   "TAG-EXPR QUALFIERS"
+ * Results:
+ *	None.
  *
- *   MODIFIERS:
- *   -- returning a single item --
- *   above
- *   below
- *   left
- *   right
- *   top
- *   bottom
- *   leftmost
- *   rightmost
- *   next QUALIFIERS
- *   prev QUALIFIERS
- *   parent
- *   firstchild QUALIFIERS
- *   lastchild QUALIFIERS
- *   child N|end?-offset? QUALIFIERS
- *   nextsibling QUALIFIERS
- *   prevsibling QUALIFIERS
- *   sibling N|end?-offset? QUALIFIERS
- *   -- returning multiple items --
- *   ancestors QUALIFIERS
- *   children QUALIFIERS
- *   descendants QUALIFIERS
+ * Side effects:
+ *	Memory is deallocated.
  *
- *   QUALIFIERS:
- *   depth integer
- *   state stateList
- *   tag tagExpr
- *   visible
- *   !visible
+ *----------------------------------------------------------------------
+ */
+
+static void
+IdPostings_Clear(
+    Tcl_HashTable *tablePtr	/* TCL_ONE_WORD_KEYS table. */
+    )
+{
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+
+    hPtr = Tcl_FirstHashEntry(tablePtr, &search);
+    while (hPtr != NULL) {
+	ckfree((char *) Tcl_GetHashValue(hPtr));
+	hPtr = Tcl_NextHashEntry(&search);
+    }
+    Tcl_DeleteHashTable(tablePtr);
+    Tcl_InitHashTable(tablePtr, TCL_ONE_WORD_KEYS);
+}
+
+/*
+ *----------------------------------------------------------------------
  *
- *   Examples:
- *   $T item id "first visible firstchild"
- *   $T item id "first visible firstchild visible"
- *   $T item id "nearest x y nextsibling visible"
- *   $T item id "last visible state enabled"
+ * IdPostings_Bytes --
+ *
+ *	Count the memory used by a table of lists, for [debug alloc].
  *
  * Results:
- *	TCL_OK or TCL_ERROR.
+ *	Number of bytes. The number of keys is stored in *countPtr.
  *
  * Side effects:
  *	None.
@@ -2022,620 +2520,384 @@ NotManyMsg(
  *----------------------------------------------------------------------
  */
 
-int
-TreeItemList_FromObj(
-    TreeCtrl *tree,		/* Widget info. */
-    Tcl_Obj *objPtr,		/* Object to parse to a list of items. */
-    TreeItemList *items,	/* Uninitialized item list. Caller must free
-				 * it with TreeItemList_Free unless the
-				 * result of this function is TCL_ERROR. */
-    int flags			/* IFO_xxx flags */
+static long
+IdPostings_Bytes(
+    Tcl_HashTable *tablePtr,	/* TCL_ONE_WORD_KEYS table. */
+    int *countPtr		/* Out: number of keys. */
     )
 {
-    Tcl_Interp *interp = tree->interp;
-    int i, objc, index, listIndex, id;
     Tcl_HashEntry *hPtr;
     Tcl_HashSearch search;
-    Tcl_Obj **objv, *elemPtr;
-    TreeItem item = NULL;
-    Qualifiers q;
-    int qualArgsTotal;
+    IdPosting *posting;
+    long bytes = 0;
 
-    static CONST char *indexName[] = {
-	"active", "all", "anchor", "end", "first", "last", "list",
-	"nearest", "range", "rnc", "root", (char *) NULL
-    };
-    enum indexEnum {
-	INDEX_ACTIVE, INDEX_ALL, INDEX_ANCHOR, INDEX_END, INDEX_FIRST,
-	INDEX_LAST, INDEX_LIST, INDEX_NEAREST, INDEX_RANGE, INDEX_RNC,
-	INDEX_ROOT
-    };
-    /* Number of arguments used by indexName[]. */
-    static int indexArgs[] = {
-	1, 1, 1, 1, 1, 1, 2, 3, 3, 3, 1
-    };
-    /* Boolean: can indexName[] be followed by 1 or more qualifiers. */
-    static int indexQual[] = {
-	0, 1, 0, 1, 1, 1, 0, 0, 1, 0, 0, 1
-    };
+    *countPtr = 0;
+    hPtr = Tcl_FirstHashEntry(tablePtr, &search);
+    while (hPtr != NULL) {
+	posting = (IdPosting *) Tcl_GetHashValue(hPtr);
+	(*countPtr)++;
+	bytes += sizeof(Tcl_HashEntry) + sizeof(IdPosting) +
+		(long) (posting->alloc - 1) * sizeof(int);
+	hPtr = Tcl_NextHashEntry(&search);
+    }
+    return bytes;
+}
 
-    static CONST char *modifiers[] = {
-	"above", "ancestors", "below", "bottom", "child", "children",
-	"descendants", "firstchild", "lastchild", "left", "leftmost", "next",
-	"nextsibling", "parent", "prev", "prevsibling", "right", "rightmost",
-	"sibling", "top", (char *) NULL
-    };
-    enum modEnum {
-	TMOD_ABOVE, TMOD_ANCESTORS, TMOD_BELOW, TMOD_BOTTOM, TMOD_CHILD,
-	TMOD_CHILDREN, TMOD_DESCENDANTS, TMOD_FIRSTCHILD, TMOD_LASTCHILD,
-	TMOD_LEFT, TMOD_LEFTMOST, TMOD_NEXT, TMOD_NEXTSIBLING, TMOD_PARENT,
-	TMOD_PREV, TMOD_PREVSIBLING, TMOD_RIGHT, TMOD_RIGHTMOST, TMOD_SIBLING,
-	TMOD_TOP
-    };
-    /* Number of arguments used by modifiers[]. */
-    static int modArgs[] = {
-	1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 1, 1
-    };
-    /* Boolean: can modifiers[] be followed by 1 or more qualifiers. */
-    static int modQual[] = {
-	0, 1, 0, 0, 1, 1, 1, 1, 1, 0, 0, 1, 1, 0, 1, 1, 0, 0, 1, 0, 0
-    };
+/* BEGIN tag index */
 
-    TreeItemList_Init(tree, items, 0);
-    Qualifiers_Init(tree, &q);
+/*
+ * When the -tagindex option is true, item descriptions with a tag or tag
+ * expression use an index that maps each tag to the ids of the items
+ * that have it, instead of testing the tags of every item.
+ *
+ * An item is added to the list of each of its tags whenever its tags
+ * are set or added to. Removing a tag leaves the item in the list. The
+ * whole index is rebuilt when it has grown to twice its size after the
+ * last rebuild.
+ */
 
-    if (Tcl_ListObjGetElements(NULL, objPtr, &objc, &objv) != TCL_OK)
-	goto baditem;
-    if (objc == 0)
-	goto baditem;
+#define TAG_REBUILD_MIN 100000	/* Don't rebuild a small index because it
+				 * has doubled. */
 
-    listIndex = 0;
-    elemPtr = objv[listIndex];
-    if (Tcl_GetIndexFromObj(NULL, elemPtr, indexName, NULL, 0, &index)
-	    == TCL_OK) {
+struct TreeTagIndex_ {
+    Tcl_HashTable tagHash;	/* Tk_Uid -> IdPosting. */
+    int valid;			/* FALSE if the index must be rebuilt. */
+    long entries;		/* Number of ids in all the lists. */
+    long builtEntries;		/* Value of entries after the last
+				 * rebuild. */
+};
 
-	if (objc - listIndex < indexArgs[index]) {
-	    Tcl_AppendResult(interp, "missing arguments to \"",
-		    Tcl_GetString(elemPtr), "\" keyword", NULL);
-	    goto errorExit;
-	}
+/*
+ *----------------------------------------------------------------------
+ *
+ * Item_TagsChanged --
+ *
+ *	Called after tags are set or added to an item.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	If there is a tag index the item is added to the list of each of
+ *	its tags.
+ *
+ *----------------------------------------------------------------------
+ */
 
-	qualArgsTotal = 0;
-	if (indexQual[index]) {
-	    if (Qualifiers_Scan(&q, objc, objv, listIndex + indexArgs[index],
-		    &qualArgsTotal) != TCL_OK) {
-		goto errorExit;
-	    }
-	}
+static void
+Item_TagsChanged(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item		/* Item record. */
+    )
+{
+    TreeTagIndex index = tree->tagIndex;
+    int i;
 
-	switch ((enum indexEnum) index) {
-	    case INDEX_ACTIVE: {
-		item = tree->activeItem;
-		break;
-	    }
-	    case INDEX_ALL: {
-		if (qualArgsTotal) {
-		    hPtr = Tcl_FirstHashEntry(&tree->itemHash, &search);
-		    while (hPtr != NULL) {
-			item = (TreeItem) Tcl_GetHashValue(hPtr);
-			if (Qualifies(&q, item)) {
-			    TreeItemList_Append(items, (TreeItem) item);
-			}
-			hPtr = Tcl_NextHashEntry(&search);
-		    }
-		    item = NULL;
-		} else if (flags & IFO_LIST_ALL) {
-		    hPtr = Tcl_FirstHashEntry(&tree->itemHash, &search);
-		    while (hPtr != NULL) {
-			item = (TreeItem) Tcl_GetHashValue(hPtr);
-			TreeItemList_Append(items, item);
-			hPtr = Tcl_NextHashEntry(&search);
-		    }
-		    item = NULL;
-		} else {
-		    item = ITEM_ALL;
-		}
-		break;
-	    }
-	    case INDEX_ANCHOR: {
-		item = tree->anchorItem;
-		break;
-	    }
-	    case INDEX_FIRST: {
-		item = tree->root;
-		while (!Qualifies(&q, item))
-		    item = TreeItem_Next(tree, item);
-		break;
-	    }
-	    case INDEX_END:
-	    case INDEX_LAST: {
-		item = tree->root;
-		while (item->lastChild) {
-		    item = item->lastChild;
-		}
-		while (!Qualifies(&q, item))
-		    item = TreeItem_Prev(tree, item);
-		break;
-	    }
-	    case INDEX_LIST: {
-		int listObjc;
-		Tcl_Obj **listObjv;
-		int count;
+    if ((index == NULL) || !index->valid || (item->tagInfo == NULL) ||
+	    (ITEM_HEADER(item) != NULL))
+	return;
+    for (i = 0; i < item->tagInfo->numTags; i++) {
+	index->entries += IdPosting_Add(&index->tagHash,
+		(char *) item->tagInfo->tagPtr[i], item->id);
+    }
+}
 
-		if (Tcl_ListObjGetElements(interp, objv[listIndex + 1],
-			&listObjc, &listObjv) != TCL_OK) {
-		    goto errorExit;
-		}
-		for (i = 0; i < listObjc; i++) {
-		    TreeItemList item2s;
-		    if (TreeItemList_FromObj(tree, listObjv[i], &item2s, flags)
-			    != TCL_OK)
-			goto errorExit;
-		    TreeItemList_Concat(items, &item2s);
-		    TreeItemList_Free(&item2s);
-		}
-		/* If any of the item descriptions in the list is "all", then
-		 * clear the list of items and use "all". */
-		count = TreeItemList_Count(items);
-		for (i = 0; i < count; i++) {
-		    TreeItem item2 = TreeItemList_Nth(items, i);
-		    if (IS_ALL(item2))
-			break;
-		}
-		if (i < count) {
-		    TreeItemList_Free(items);
-		    item = ITEM_ALL;
-		} else
-		    item = NULL;
-		break;
-	    }
-	    case INDEX_NEAREST: {
-		int x, y;
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeItem_TagIndexConfigure --
+ *
+ *	Create or free the tag index after the -tagindex option changes.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Memory is allocated or deallocated. A new index is built the
+ *	next time it is used.
+ *
+ *----------------------------------------------------------------------
+ */
 
-		if (Tk_GetPixelsFromObj(interp, tree->tkwin,
-			objv[listIndex + 1], &x) != TCL_OK) {
-		    goto errorExit;
-		}
-		if (Tk_GetPixelsFromObj(interp, tree->tkwin,
-			objv[listIndex + 2], &y) != TCL_OK) {
-		    goto errorExit;
-		}
-		item = Tree_ItemUnderPoint(tree, &x, &y, NULL, TRUE);
-		break;
-	    }
-	    case INDEX_RANGE: {
-		TreeItem itemFirst, itemLast;
+void
+TreeItem_TagIndexConfigure(
+    TreeCtrl *tree		/* Widget info. */
+    )
+{
+    TreeTagIndex index = tree->tagIndex;
 
-		if (TreeItem_FromObj(tree, objv[listIndex + 1], &itemFirst,
-			IFO_NOT_NULL) != TCL_OK)
-		    goto errorExit;
-		if (TreeItem_FromObj(tree, objv[listIndex + 2], &itemLast,
-			IFO_NOT_NULL) != TCL_OK)
-		    goto errorExit;
-		if (TreeItem_FirstAndLast(tree, &itemFirst, &itemLast) == 0)
-		    goto errorExit;
-		while (1) {
-		    if (Qualifies(&q, itemFirst)) {
-			TreeItemList_Append(items, itemFirst);
-		    }
-		    if (itemFirst == itemLast)
-			break;
-		    itemFirst = TreeItem_Next(tree, itemFirst);
-		}
-		item = NULL;
-		break;
-	    }
-	    case INDEX_RNC: {
-		int row, col;
+    if (tree->tagIndexOn && (index == NULL)) {
+	index = (TreeTagIndex) ckalloc(sizeof(struct TreeTagIndex_));
+	Tcl_InitHashTable(&index->tagHash, TCL_ONE_WORD_KEYS);
+	index->valid = FALSE;
+	index->entries = index->builtEntries = 0;
+	tree->tagIndex = index;
+    } else if (!tree->tagIndexOn && (index != NULL)) {
+	IdPostings_Clear(&index->tagHash);
+	Tcl_DeleteHashTable(&index->tagHash);
+	ckfree((char *) index);
+	tree->tagIndex = NULL;
+    }
+}
 
-		if (Tcl_GetIntFromObj(interp, objv[listIndex + 1], &row) != TCL_OK)
-		    goto errorExit;
-		if (Tcl_GetIntFromObj(interp, objv[listIndex + 2], &col) != TCL_OK)
-		    goto errorExit;
-		item = Tree_RNCToItem(tree, row, col);
-		break;
-	    }
-	    case INDEX_ROOT: {
-		item = tree->root;
-		break;
-	    }
-	}
+/*
+ *----------------------------------------------------------------------
+ *
+ * TagIndex_Update --
+ *
+ *	Build the tag index if needed before it is used.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The index may be rebuilt.
+ *
+ *----------------------------------------------------------------------
+ */
 
-	listIndex += indexArgs[index] + qualArgsTotal;
+static void
+TagIndex_Update(
+    TreeCtrl *tree		/* Widget info. */
+    )
+{
+    TreeTagIndex index = tree->tagIndex;
+    TreeItem item;
+    int search;
 
-    /* No indexName[] was found. */
-    } else {
-	int gotId = FALSE;
-	TagExpr expr;
+    if (index->valid && ((index->entries <= TAG_REBUILD_MIN) ||
+	    (index->entries <= index->builtEntries * 2)))
+	return;
 
-	/* Try an itemPrefix + item ID. */
-	if (tree->itemPrefixLen) {
-	    char *end, *t = Tcl_GetString(elemPtr);
-	    if (strncmp(t, tree->itemPrefix, tree->itemPrefixLen) == 0) {
-		t += tree->itemPrefixLen;
-		id = strtoul(t, &end, 10);
-		if ((end != t) && (*end == '\0'))
-		    gotId = TRUE;
-	    }
+    IdPostings_Clear(&index->tagHash);
+    index->entries = 0;
+    index->valid = TRUE;
+    item = Tree_FirstItem(tree, &search);
+    while (item != NULL) {
+	Item_TagsChanged(tree, item);
+	item = Tree_NextItem(tree, &search);
+    }
+    index->builtEntries = index->entries;
+}
 
-	/* Try an item ID. */
-	} else if (Tcl_GetIntFromObj(NULL, elemPtr, &id) == TCL_OK) {
-	    gotId = TRUE;
-	}
-	if (gotId) {
-	    hPtr = Tcl_FindHashEntry(&tree->itemHash, (char *) INT2PTR(id));
-	    if (hPtr != NULL) {
-		item = (TreeItem) Tcl_GetHashValue(hPtr);
-	    } else {
-		item = NULL;
-	    }
-	    listIndex++;
-	    goto gotFirstPart;
-	}
+static int
+IdCompare(
+    const void *a,
+    const void *b
+    )
+{
+    return *(int *) a - *(int *) b;
+}
 
-	/* Try a list of qualifiers. This has the same effect as
-	 * "all QUALIFIERS". */
-	if (Qualifiers_Scan(&q, objc, objv, listIndex, &qualArgsTotal)
-		!= TCL_OK) {
-	    goto errorExit;
-	}
-	if (qualArgsTotal) {
-	    hPtr = Tcl_FirstHashEntry(&tree->itemHash, &search);
-	    while (hPtr != NULL) {
-		item = (TreeItem) Tcl_GetHashValue(hPtr);
-		if (Qualifies(&q, item)) {
-		    TreeItemList_Append(items, item);
-		}
-		hPtr = Tcl_NextHashEntry(&search);
-	    }
-	    item = NULL;
-	    listIndex += qualArgsTotal;
-	    goto gotFirstPart;
-	}
+/*
+ *----------------------------------------------------------------------
+ *
+ * Item_ListTagged --
+ *
+ *	Use the tag index to find the items that match a tag or tag
+ *	expression and some qualifiers. Only the items in the lists of
+ *	the tags that a matching item must have are tested.
+ *
+ * Results:
+ *	If there is no tag index, or the tags don't limit which items
+ *	can match (as in "!tag"), FALSE is returned and the caller must
+ *	test every item. Otherwise the matching items are appended to the
+ *	list in order of increasing id and TRUE is returned.
+ *
+ * Side effects:
+ *	The index may be rebuilt.
+ *
+ *----------------------------------------------------------------------
+ */
 
-	/* Try a tag or tag expression followed by qualifiers. */
-	if (objc > 1) {
-	    if (Qualifiers_Scan(&q, objc, objv, listIndex + 1,
-		    &qualArgsTotal) != TCL_OK) {
-		goto errorExit;
-	    }
-	}
-	if (tree->itemTagExpr) {
-	    if (TagExpr_Init(tree, elemPtr, &expr) != TCL_OK)
-		goto errorExit;
-	    hPtr = Tcl_FirstHashEntry(&tree->itemHash, &search);
-	    while (hPtr != NULL) {
-		item = (TreeItem) Tcl_GetHashValue(hPtr);
-		if (TagExpr_Eval(&expr, item->tagInfo) && Qualifies(&q, item)) {
-		    TreeItemList_Append(items, item);
-		}
-		hPtr = Tcl_NextHashEntry(&search);
-	    }
-	    TagExpr_Free(&expr);
-	} else {
-	    Tk_Uid tag = Tk_GetUid(Tcl_GetString(elemPtr));
-	    hPtr = Tcl_FirstHashEntry(&tree->itemHash, &search);
-	    while (hPtr != NULL) {
-		item = (TreeItem) Tcl_GetHashValue(hPtr);
-		if (TreeItem_HasTag(item, tag) && Qualifies(&q, item)) {
-		    TreeItemList_Append(items, item);
-		}
-		hPtr = Tcl_NextHashEntry(&search);
-	    }
-	}
-	item = NULL;
-	listIndex += 1 + qualArgsTotal;
-    }
+static int
+Item_ListTagged(
+    TreeCtrl *tree,		/* Widget info. */
+    TagExpr *expr,		/* Tag expression to match, or NULL. */
+    Tk_Uid tag,			/* Tag to match, or NULL. */
+    Qualifiers *q,		/* Qualifiers to match. */
+    TreeItemList *items		/* Matching items are appended here. */
+    )
+{
+    TreeTagIndex index = tree->tagIndex;
+    Tk_Uid uids[TAG_EXPR_COVER_MAX];
+    int masks[1 << TAG_EXPR_COVER_MAX];
+    IdPosting *postings[TAG_EXPR_COVER_MAX], *posting;
+    Tcl_HashEntry *hPtr;
+    TreeItem item;
+    int i, j, best, chosen = 0, numUids, numMasks, *ids, count = 0;
 
-gotFirstPart:
-    /* If 1 item, use it and clear the list. */
-    if (TreeItemList_Count(items) == 1) {
-	item = TreeItemList_Nth(items, 0);
-	items->count = 0;
+    if (index == NULL)
+	return FALSE;
+
+    /* Find the combinations of tags a matching item can have. */
+    if (tag == NULL && expr == NULL) {
+	if (q->exprOK)
+	    expr = &q->expr;
+	else
+	    tag = q->tag;
+    }
+    if (expr != NULL) {
+	if (!TagExpr_Cover(expr, uids, &numUids, masks, &numMasks))
+	    return FALSE;
+    } else if (tag != NULL) {
+	uids[0] = tag;
+	masks[0] = 1;
+	numUids = numMasks = 1;
+    } else {
+	return FALSE;
     }
 
-    /* If "all" but only root exists, use it. */
-    if (IS_ALL(item) && (tree->itemCount == 1) && !(flags & IFO_NOT_ROOT)) {
-	item = tree->root;
+    TagIndex_Update(tree);
+    for (i = 0; i < numUids; i++) {
+	hPtr = Tcl_FindHashEntry(&index->tagHash, (char *) uids[i]);
+	postings[i] = hPtr ? (IdPosting *) Tcl_GetHashValue(hPtr) : NULL;
     }
 
-    /* If > 1 item, no modifiers may follow. */
-    if ((TreeItemList_Count(items) > 1) || IS_ALL(item)) {
-	if (listIndex < objc) {
-	    Tcl_AppendResult(interp, "unexpected arguments after \"",
-		(char *) NULL);
-	    for (i = 0; i < listIndex; i++) {
-		Tcl_AppendResult(interp, Tcl_GetString(objv[i]), (char *) NULL);
-		if (i != listIndex - 1)
-		    Tcl_AppendResult(interp, " ", (char *) NULL);
+    /* An item having a combination of tags is in the list of each tag
+     * in it, so only the shortest list is needed. No item has a tag
+     * without a list. */
+    for (i = 0; i < numMasks; i++) {
+	best = -1;
+	for (j = 0; j < numUids; j++) {
+	    if (!(masks[i] & (1 << j)))
+		continue;
+	    if (postings[j] == NULL) {
+		best = -1;
+		break;
 	    }
-	    Tcl_AppendResult(interp, "\"", (char *) NULL);
-	    goto errorExit;
+	    if ((best == -1) || (postings[j]->count < postings[best]->count))
+		best = j;
+	}
+	if ((best != -1) && !(chosen & (1 << best))) {
+	    chosen |= 1 << best;
+	    count += postings[best]->count;
 	}
     }
+    if (count == 0)
+	return TRUE;
 
-    /* This means a valid specification was given, but there is no such item */
-    if ((TreeItemList_Count(items) == 0) && (item == NULL)) {
-	if (flags & IFO_NOT_NULL)
-	    goto noitem;
-	/* Empty list returned */
-	goto goodExit;
+    ids = (int *) ckalloc(sizeof(int) * count);
+    count = 0;
+    for (j = 0; j < numUids; j++) {
+	if (!(chosen & (1 << j)))
+	    continue;
+	posting = postings[j];
+	memcpy(ids + count, posting->ids, sizeof(int) * posting->count);
+	count += posting->count;
+    }
+    qsort(ids, count, sizeof(int), IdCompare);
+    for (i = 0; i < count; i++) {
+	if ((i > 0) && (ids[i] == ids[i - 1]))
+	    continue;
+	item = Tree_FindItem(tree, ids[i]);
+	if (item == NULL)
+	    continue;
+	if ((expr != NULL) && !TagExpr_Eval(expr, item->tagInfo))
+	    continue;
+	if ((tag != NULL) && !TreeItem_HasTag(item, tag))
+	    continue;
+	if (Qualifies(q, item))
+	    TreeItemList_Append(items, item);
     }
+    ckfree((char *) ids);
+    return TRUE;
+}
 
-    /* Process any modifiers following the item we matched above. */
-    for (; listIndex < objc; /* nothing */) {
+/* END tag index */
 
-	elemPtr = objv[listIndex];
-	if (Tcl_GetIndexFromObj(interp, elemPtr, modifiers, "modifier", 0,
-		    &index) != TCL_OK) {
-	    goto errorExit;
-	}
-	if (objc - listIndex < modArgs[index]) {
-	    Tcl_AppendResult(interp, "missing arguments to \"",
-		    Tcl_GetString(elemPtr), "\" modifier", NULL);
-	    goto errorExit;
-	}
+/*
+ *----------------------------------------------------------------------
+ *
+ * Item_ListQualified --
+ *
+ *	Find every item that matches some qualifiers, for the "all" and
+ *	qualifier-only forms of an item description. The tag index and
+ *	the per-state bitmaps of the table of items are used to skip
+ *	items that can't match.
+ *
+ * Results:
+ *	Matching items are appended to the list in order of increasing
+ *	id.
+ *
+ * Side effects:
+ *	The tag index may be rebuilt.
+ *
+ *----------------------------------------------------------------------
+ */
 
-	qualArgsTotal = 0;
-	if (modQual[index]) {
-	    Qualifiers_Free(&q);
-	    Qualifiers_Init(tree, &q);
-	    if (Qualifiers_Scan(&q, objc, objv, listIndex + modArgs[index],
-		    &qualArgsTotal) != TCL_OK) {
-		goto errorExit;
-	    }
-	}
+static void
+Item_ListQualified(
+    TreeCtrl *tree,		/* Widget info. */
+    Qualifiers *q,		/* Qualifiers to match. */
+    TreeItemList *items		/* Matching items are appended here. */
+    )
+{
+    TreeItem item;
+    int search = 0;
 
-	switch ((enum modEnum) index) {
-	    case TMOD_ABOVE: {
-		item = Tree_ItemAbove(tree, item);
-		break;
-	    }
-	    case TMOD_ANCESTORS: {
-		item = item->parent;
-		while (item != NULL) {
-		    if (Qualifies(&q, item)) {
-			TreeItemList_Append(items, item);
-		    }
-		    item = item->parent;
-		}
-		item = NULL;
-		break;
-	    }
-	    case TMOD_BELOW: {
-		item = Tree_ItemBelow(tree, item);
-		break;
-	    }
-	    case TMOD_BOTTOM: {
-		item = Tree_ItemBottom(tree, item);
-		break;
-	    }
-	    case TMOD_CHILD: {
-		int n, endRelative;
+    if (Item_ListTagged(tree, NULL, NULL, q, items))
+	return;
+    item = Tree_NextItemInState(tree, &search, q->states);
+    while (item != NULL) {
+	if (Qualifies(q, item))
+	    TreeItemList_Append(items, item);
+	item = Tree_NextItemInState(tree, &search, q->states);
+    }
+}
 
-		if (Tree_GetIntForIndex(tree, objv[listIndex + 1], &n,
-			&endRelative) != TCL_OK) {
-		    goto errorExit;
-		}
-		if (endRelative) {
-		    item = item->lastChild;
-		    while (item != NULL) {
-			if (Qualifies(&q, item))
-			    if (n-- <= 0)
-				break;
-			item = item->prevSibling;
-		    }
-		} else {
-		    item = item->firstChild;
-		    while (item != NULL) {
-			if (Qualifies(&q, item))
-			    if (n-- <= 0)
-				break;
-			item = item->nextSibling;
-		    }
-		}
-		break;
-	    }
-	    case TMOD_CHILDREN: {
-		item = item->firstChild;
-		while (item != NULL) {
-		    if (Qualifies(&q, item)) {
-			TreeItemList_Append(items, item);
-		    }
-		    item = item->nextSibling;
-		}
-		item = NULL;
-		break;
-	    }
-	    case TMOD_DESCENDANTS: {
-		TreeItem last = item;
+/*
+ *----------------------------------------------------------------------
+ *
+ * NotManyMsg --
+ *
+ *	Set the interpreter result with an error message.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Changes the interpreter result.
+ *
+ *----------------------------------------------------------------------
+ */
 
-		while (last->lastChild != NULL)
-		    last = last->lastChild;
-		item = item->firstChild;
-		while (item != NULL) {
-		    if (Qualifies(&q, item)) {
-			TreeItemList_Append(items, item);
-		    }
-		    if (item == last)
-			break;
-		    item = TreeItem_Next(tree, item);
-		}
-		item = NULL;
-		break;
-	    }
-	    case TMOD_FIRSTCHILD: {
-		item = item->firstChild;
-		while (!Qualifies(&q, item))
-		    item = item->nextSibling;
-		break;
-	    }
-	    case TMOD_LASTCHILD: {
-		item = item->lastChild;
-		while (!Qualifies(&q, item))
-		    item = item->prevSibling;
-		break;
-	    }
-	    case TMOD_LEFT: {
-		item = Tree_ItemLeft(tree, item);
-		break;
-	    }
-	    case TMOD_LEFTMOST: {
-		item = Tree_ItemLeftMost(tree, item);
-		break;
-	    }
-	    case TMOD_NEXT: {
-		item = TreeItem_Next(tree, item);
-		while (!Qualifies(&q, item))
-		    item = TreeItem_Next(tree, item);
-		break;
-	    }
-	    case TMOD_NEXTSIBLING: {
-		item = item->nextSibling;
-		while (!Qualifies(&q, item))
-		    item = item->nextSibling;
-		break;
-	    }
-	    case TMOD_PARENT: {
-		item = item->parent;
-		break;
-	    }
-	    case TMOD_PREV: {
-		item = TreeItem_Prev(tree, item);
-		while (!Qualifies(&q, item))
-		    item = TreeItem_Prev(tree, item);
-		break;
-	    }
-	    case TMOD_PREVSIBLING: {
-		item = item->prevSibling;
-		while (!Qualifies(&q, item))
-		    item = item->prevSibling;
-		break;
-	    }
-	    case TMOD_RIGHT: {
-		item = Tree_ItemRight(tree, item);
-		break;
-	    }
-	    case TMOD_RIGHTMOST: {
-		item = Tree_ItemRightMost(tree, item);
-		break;
-	    }
-	    case TMOD_SIBLING: {
-		int n, endRelative;
-
-		if (Tree_GetIntForIndex(tree, objv[listIndex + 1], &n,
-			&endRelative) != TCL_OK) {
-		    goto errorExit;
-		}
-		item = item->parent;
-		if (item == NULL)
-		    break;
-		if (endRelative) {
-		    item = item->lastChild;
-		    while (item != NULL) {
-			if (Qualifies(&q, item))
-			    if (n-- <= 0)
-				break;
-			item = item->prevSibling;
-		    }
-		} else {
-		    item = item->firstChild;
-		    while (item != NULL) {
-			if (Qualifies(&q, item))
-			    if (n-- <= 0)
-				break;
-			item = item->nextSibling;
-		    }
-		}
-		break;
-	    }
-	    case TMOD_TOP: {
-		item = Tree_ItemTop(tree, item);
-		break;
-	    }
-	}
-	if ((TreeItemList_Count(items) > 1) || IS_ALL(item)) {
-	    int end = listIndex + modArgs[index] + qualArgsTotal;
-	    if (end < objc) {
-		Tcl_AppendResult(interp, "unexpected arguments after \"",
-		    (char *) NULL);
-		for (i = 0; i < end; i++) {
-		    Tcl_AppendResult(interp, Tcl_GetString(objv[i]), (char *) NULL);
-		    if (i != end - 1)
-			Tcl_AppendResult(interp, " ", (char *) NULL);
-		}
-		Tcl_AppendResult(interp, "\"", (char *) NULL);
-		goto errorExit;
-	    }
-	}
-	if ((TreeItemList_Count(items) == 0) && (item == NULL)) {
-	    if (flags & IFO_NOT_NULL)
-		goto noitem;
-	    /* Empty list returned. */
-	    goto goodExit;
-	}
-	listIndex += modArgs[index] + qualArgsTotal;
-    }
-    if ((flags & IFO_NOT_MANY) && (IS_ALL(item) ||
-	    (TreeItemList_Count(items) > 1))) {
-	NotManyMsg(tree, FALSE);
-	goto errorExit;
-    }
-    if (TreeItemList_Count(items)) {
-	if (flags & (IFO_NOT_ROOT | IFO_NOT_ORPHAN)) {
-	    int i;
-	    for (i = 0; i < TreeItemList_Count(items); i++) {
-		item = TreeItemList_Nth(items, i);
-		if (IS_ROOT(item) && (flags & IFO_NOT_ROOT))
-		    goto notRoot;
-		if ((item->parent == NULL) && (flags & IFO_NOT_ORPHAN))
-		    goto notOrphan;
-	    }
-	}
-    } else if (IS_ALL(item)) {
-	TreeItemList_Append(items, ITEM_ALL);
-    } else {
-	if (IS_ROOT(item) && (flags & IFO_NOT_ROOT)) {
-notRoot:
-	    FormatResult(interp, "can't specify \"root\" for this command");
-	    goto errorExit;
-	}
-	if ((item->parent == NULL) && (flags & IFO_NOT_ORPHAN)) {
-notOrphan:
-	    FormatResult(interp, "item \"%s\" has no parent",
-		    Tcl_GetString(objPtr));
-	    goto errorExit;
-	}
-	TreeItemList_Append(items, item);
-    }
-goodExit:
-    Qualifiers_Free(&q);
-    return TCL_OK;
-
-baditem:
-    Tcl_AppendResult(interp, "bad item description \"", Tcl_GetString(objPtr),
-	    "\"", NULL);
-    goto errorExit;
+static void
+NotManyMsg(
+    TreeCtrl *tree,
+    int doHeaders
+    )
+{
+    FormatResult(tree->interp, "can't specify > 1 %s for this command",
+	doHeaders ? "header" : "item");
+}
 
-noitem:
-    Tcl_AppendResult(interp, "item \"", Tcl_GetString(objPtr),
-	    "\" doesn't exist", NULL);
+/*
+ * A Tcl_Obj returned by TreeItem_ToObj(), or parsed as a lone item id,
+ * remembers the widget and the item id so it needn't be parsed again when
+ * it is passed back to the widget. The id is looked up in the table of
+ * items every time, so a reference to a deleted item still fails. The
+ * string rep is always valid.
+ */
 
-errorExit:
-    Qualifiers_Free(&q);
-    TreeItemList_Free(items);
-    return TCL_ERROR;
-}
+static Tcl_ObjType itemIdObjType = {
+    "treeitem",			/* name */
+    NULL,			/* freeIntRepProc */
+    NULL,			/* dupIntRepProc */
+    NULL,			/* updateStringProc */
+    NULL			/* setFromAnyProc */
+};
 
 /*
  *----------------------------------------------------------------------
  *
- * TreeItem_FromObj --
+ * ItemIdObj_Length --
  *
- *	Parse a Tcl_Obj item description to get a single item.
+ *	Return the length of the string rep TreeItem_ToObj() would give
+ *	an item with the given id.
  *
  * Results:
- *	TCL_OK or TCL_ERROR.
+ *	Number of characters.
  *
  * Side effects:
  *	None.
@@ -2643,94 +2905,72 @@ errorExit:
  *----------------------------------------------------------------------
  */
 
-int
-TreeItem_FromObj(
+static int
+ItemIdObj_Length(
     TreeCtrl *tree,		/* Widget info. */
-    Tcl_Obj *objPtr,		/* Object to parse to an item. */
-    TreeItem *itemPtr,		/* Returned item. */
-    int flags			/* IFO_xxx flags */
+    int id			/* Item id. */
     )
 {
-    TreeItemList items;
+    int length = tree->itemPrefixLen + 1;
 
-    if (TreeItemList_FromObj(tree, objPtr, &items, flags | IFO_NOT_MANY) != TCL_OK)
-	return TCL_ERROR;
-    /* May be NULL. */
-    (*itemPtr) = TreeItemList_Nth(&items, 0);
-    TreeItemList_Free(&items);
-    return TCL_OK;
+    if (id < 0) {
+	length++;
+	id = -id;
+    }
+    while (id >= 10) {
+	length++;
+	id /= 10;
+    }
+    return length;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * TreeItemForEach_Start --
+ * ItemIdObj_Set --
  *
- *	Begin iterating over items. A command might accept two item
- *	descriptions for a range of items, or a single item description
- *	which may itself refer to multiple items. Either item
- *	description could be ITEM_ALL.
+ *	Give a Tcl_Obj the "treeitem" internal rep, if its string rep is
+ *	exactly what TreeItem_ToObj() would produce for the id.
  *
  * Results:
- *	Returns the first item to iterate over. If an error occurs
- *	then ItemForEach.error is set to 1.
+ *	None.
  *
  * Side effects:
- *	None.
+ *	The old internal rep is freed.
  *
  *----------------------------------------------------------------------
  */
 
-TreeItem
-TreeItemForEach_Start(
-    TreeItemList *items,	/* List of items. */
-    TreeItemList *item2s,	/* List of items or NULL. */
-    ItemForEach *iter		/* Returned info, pass to
-				   TreeItemForEach_Next. */
+static void
+ItemIdObj_Set(
+    TreeCtrl *tree,		/* Widget info. */
+    Tcl_Obj *objPtr,		/* Object to convert. */
+    int id			/* Item id. */
     )
 {
-    TreeCtrl *tree = items->tree;
-    TreeItem item, item2 = NULL;
-
-    item = TreeItemList_Nth(items, 0);
-    if (item2s)
-	item2 = TreeItemList_Nth(item2s, 0);
-
-    iter->tree = tree;
-    iter->all = FALSE;
-    iter->error = 0;
-    iter->items = NULL;
-
-    if (IS_ALL(item) || IS_ALL(item2)) {
-	Tcl_HashEntry *hPtr = Tcl_FirstHashEntry(&tree->itemHash, &iter->search);
-	iter->all = TRUE;
-	return iter->item = (TreeItem) Tcl_GetHashValue(hPtr);
-    }
-
-    if (item2 != NULL) {
-	if (TreeItem_FirstAndLast(tree, &item, &item2) == 0) {
-	    iter->error = 1;
-	    return NULL;
-	}
-	iter->last = item2;
-	return iter->item = item;
-    }
+    int length;
 
-    iter->items = items;
-    iter->index = 0;
-    return iter->item = item;
+    (void) Tcl_GetStringFromObj(objPtr, &length);
+    if (length != ItemIdObj_Length(tree, id))
+	return;
+    if ((objPtr->typePtr != NULL) &&
+	    (objPtr->typePtr->freeIntRepProc != NULL))
+	(*objPtr->typePtr->freeIntRepProc)(objPtr);
+    objPtr->internalRep.twoPtrValue.ptr1 = (VOID *) tree;
+    objPtr->internalRep.twoPtrValue.ptr2 = INT2PTR(id);
+    objPtr->typePtr = &itemIdObjType;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * TreeItemForEach_Next --
+ * ItemIdObj_Get --
  *
- *	Returns the next item to iterate over. Keep calling this until
- *	the result is NULL.
+ *	Get the item id from a Tcl_Obj with the "treeitem" internal rep.
  *
  * Results:
- *	Returns the next item to iterate over or NULL.
+ *	TRUE if the object has the "treeitem" internal rep for this
+ *	widget and the current -itemprefix, FALSE otherwise.
  *
  * Side effects:
  *	None.
@@ -2738,204 +2978,168 @@ TreeItemForEach_Start(
  *----------------------------------------------------------------------
  */
 
-TreeItem
-TreeItemForEach_Next(
-    ItemForEach *iter		/* Initialized by TreeItemForEach_Start. */
+static int
+ItemIdObj_Get(
+    TreeCtrl *tree,		/* Widget info. */
+    Tcl_Obj *objPtr,		/* Object to examine. */
+    int *idPtr			/* Returned item id. */
     )
 {
-    TreeCtrl *tree = iter->tree;
-
-    if (iter->all) {
-	Tcl_HashEntry *hPtr = Tcl_NextHashEntry(&iter->search);
-	if (hPtr == NULL)
-	    return iter->item = NULL;
-	return iter->item = (TreeItem) Tcl_GetHashValue(hPtr);
-    }
+    int id;
 
-    if (iter->items != NULL) {
-	if (iter->index >= TreeItemList_Count(iter->items))
-	    return iter->item = NULL;
-	return iter->item = TreeItemList_Nth(iter->items, ++iter->index);
-    }
+    if ((objPtr->typePtr != &itemIdObjType) ||
+	    (objPtr->internalRep.twoPtrValue.ptr1 != (VOID *) tree))
+	return FALSE;
+    id = PTR2INT(objPtr->internalRep.twoPtrValue.ptr2);
 
-    if (iter->item == iter->last)
-	return iter->item = NULL;
-    return iter->item = TreeItem_Next(tree, iter->item);
+    /* -itemprefix may have changed since the string rep was made. */
+    if ((objPtr->length != ItemIdObj_Length(tree, id)) ||
+	    strncmp(objPtr->bytes, tree->itemPrefix, tree->itemPrefixLen))
+	return FALSE;
+    (*idPtr) = id;
+    return TRUE;
 }
 
+/*
+ * An item description of more than one word is compiled the first time it
+ * is used: the Tcl_Obj keeps the words of the description, and each set
+ * of qualifiers and the leading tag expression are parsed once and kept
+ * with it. The compiled description belongs to one widget and is parsed
+ * again after states are defined or undefined or the widget is
+ * configured. The string rep is always valid.
+ */
+
+typedef struct ItemDesc {
+    int refCount;		/* One for the Tcl_Obj holding this, and one
+				 * for each TreeItemList_FromObj() using
+				 * it. */
+    int epoch;			/* TreeCtrl.itemDescEpoch when compiled. */
+    Tcl_Obj *listObj;		/* The words of the description. */
+    int objc;			/* Number of words. */
+    Qualifiers **quals;		/* The qualifiers starting at each word, or
+				 * NULL if not parsed yet. */
+    int *qualArgs;		/* Number of words used by quals[]. */
+    TagExpr *expr;		/* The tag expression in the first word, or
+				 * NULL if not parsed yet. */
+} ItemDesc;
+
+static void ItemDescObj_FreeIntRep(Tcl_Obj *objPtr);
+static void ItemDescObj_DupIntRep(Tcl_Obj *srcPtr, Tcl_Obj *dupPtr);
+
+static Tcl_ObjType itemDescObjType = {
+    "treeitemdesc",		/* name */
+    ItemDescObj_FreeIntRep,	/* freeIntRepProc */
+    ItemDescObj_DupIntRep,	/* dupIntRepProc */
+    NULL,			/* updateStringProc */
+    NULL			/* setFromAnyProc */
+};
+
+/* Epochs come from one counter so a description compiled for a deleted
+ * widget never matches a new widget at the same address. */
+static int itemDescEpoch = 0;
+TCL_DECLARE_MUTEX(itemDescMutex)
+
 /*
  *----------------------------------------------------------------------
  *
- * Item_ToggleOpen --
+ * TreeItem_InvalidateDescriptions --
  *
- *	Inverts the STATE_ITEM_OPEN flag of an Item.
+ *	Make every compiled item description for a widget be parsed
+ *	again the next time it is used.
  *
  * Results:
- *	Items may be displayed/undisplayed.
+ *	None.
  *
  * Side effects:
- *	Display changes.
+ *	None.
  *
  *----------------------------------------------------------------------
  */
 
-static void
-Item_ToggleOpen(
-    TreeCtrl *tree,		/* Widget info. */
-    TreeItem item,		/* Item record. */
-    int stateOff,		/* STATE_ITEM_OPEN or 0 */
-    int stateOn			/* STATE_ITEM_OPEN or 0 */
+void
+TreeItem_InvalidateDescriptions(
+    TreeCtrl *tree		/* Widget info. */
     )
 {
-    TreeItem_ChangeState(tree, item, stateOff, stateOn);
-
-    if (IS_ROOT(item) && !tree->showRoot)
-	return;
-
-#if 0
-    /* Don't affect display if we weren't visible */
-    if (!TreeItem_ReallyVisible(tree, item))
-	return;
-
-    /* Invalidate display info for this item, so it is redrawn later. */
-    Tree_InvalidateItemDInfo(tree, item, NULL);
-#endif
-
-    if (item->numChildren > 0) {
-	/* indexVis needs updating for all items after this one, if we
-	 * have any visible children */
-	tree->updateIndex = 1;
-	Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
-
-	/* Hiding/showing children may change the width of any column */
-	TreeColumns_InvalidateWidthOfItems(tree, NULL);
-	TreeColumns_InvalidateSpans(tree);
-    }
-
-    /* If this item was previously onscreen, this call is repetitive. */
-    Tree_EventuallyRedraw(tree);
+    Tcl_MutexLock(&itemDescMutex);
+    tree->itemDescEpoch = ++itemDescEpoch;
+    Tcl_MutexUnlock(&itemDescMutex);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * TreeItem_OpenClose --
+ * ItemDesc_Release --
  *
- *	Inverts the STATE_ITEM_OPEN flag of an Item.
+ *	Drop a reference to a compiled item description.
  *
  * Results:
- *	Items may be displayed/undisplayed.
+ *	None.
  *
  * Side effects:
- *	Display changes. <Expand> and <Collapse> events may be
- *	generated.
+ *	Memory is deallocated when the last reference is dropped.
  *
  *----------------------------------------------------------------------
  */
 
-void
-TreeItem_OpenClose(
-    TreeCtrl *tree,		/* Widget info. */
-    TreeItem item,		/* Item token. */
-    int mode			/* -1: toggle
-				 * 0: close
-				 * 1: open */
+static void
+ItemDesc_Release(
+    ItemDesc *desc		/* Compiled description. */
     )
 {
-    int stateOff = 0, stateOn = 0;
-
-    /* When processing a list of items, any <Expand> or <Collapse> event
-     * may result in items being deleted. */
-    if (IS_DELETED(item)) return;
-
-    if (mode == -1) {
-	if (item->state & STATE_ITEM_OPEN)
-	    stateOff = STATE_ITEM_OPEN;
-	else
-	    stateOn = STATE_ITEM_OPEN;
-    } else if (!mode && (item->state & STATE_ITEM_OPEN))
-	stateOff = STATE_ITEM_OPEN;
-    else if (mode && !(item->state & STATE_ITEM_OPEN))
-	stateOn = STATE_ITEM_OPEN;
+    int i;
 
-    if (stateOff != stateOn) {
-	TreeNotify_OpenClose(tree, item, stateOn, TRUE);
-	if (IS_DELETED(item)) return;
-	Item_ToggleOpen(tree, item, stateOff, stateOn);
-	TreeNotify_OpenClose(tree, item, stateOn, FALSE);
+    if (--desc->refCount > 0)
+	return;
+    for (i = 0; i < desc->objc; i++) {
+	if (desc->quals[i] != NULL) {
+	    Qualifiers_Free(desc->quals[i]);
+	    ckfree((char *) desc->quals[i]);
+	}
     }
+    if (desc->expr != NULL) {
+	TagExpr_Free(desc->expr);
+	ckfree((char *) desc->expr);
+    }
+    Tcl_DecrRefCount(desc->listObj);
+    ckfree((char *) desc);
 }
 
-/*
- *----------------------------------------------------------------------
- *
- * TreeItem_Delete --
- *
- *	Recursively frees resources associated with an Item and its
- *	descendants.
- *
- * Results:
- *	Items are removed from their parent and freed.
- *
- * Side effects:
- *	Memory is freed. If the active item or selection-anchor item
- *	is deleted, the root becomes the active/anchor item.
- *	Display changes may occur.
- *
- *----------------------------------------------------------------------
- */
-
-void
-TreeItem_Delete(
-    TreeCtrl *tree,		/* Widget info. */
-    TreeItem item		/* Item token. */
+static void
+ItemDescObj_FreeIntRep(
+    Tcl_Obj *objPtr		/* Object with the "treeitemdesc" rep. */
     )
 {
-    while (item->numChildren > 0)
-	TreeItem_Delete(tree, item->firstChild);
+    ItemDesc_Release((ItemDesc *) objPtr->internalRep.twoPtrValue.ptr2);
+    objPtr->typePtr = NULL;
+}
 
-    /* Remove from tree->headerItems. */
-    if (item->header != NULL) {
-	if (item != tree->headerItems) {
-	    item->prevSibling->nextSibling = item->nextSibling;
-	    if (item->nextSibling != NULL)
-		item->nextSibling->prevSibling = item->prevSibling;
-	} else {
-	    tree->headerItems = item->nextSibling;
-	    if (item->nextSibling != NULL)
-		item->nextSibling->prevSibling = NULL;
-	}
-	item->prevSibling = item->nextSibling = NULL;
-    }
+static void
+ItemDescObj_DupIntRep(
+    Tcl_Obj *srcPtr,		/* Object with the "treeitemdesc" rep. */
+    Tcl_Obj *dupPtr		/* Object to share it with. */
+    )
+{
+    ItemDesc *desc = (ItemDesc *) srcPtr->internalRep.twoPtrValue.ptr2;
 
-    TreeItem_RemoveFromParent(tree, item);
-    TreeDisplay_ItemDeleted(tree, item);
-    TreeGradient_ItemDeleted(tree, item);
-    TreeTheme_ItemDeleted(tree, item);
-    if (item->header != NULL)
-	Tree_RemoveHeader(tree, item);
-    else
-	Tree_RemoveItem(tree, item);
-    TreeItem_FreeResources(tree, item);
-    if (tree->activeItem == item) {
-	tree->activeItem = tree->root;
-	TreeItem_ChangeState(tree, tree->activeItem, 0, STATE_ITEM_ACTIVE);
-    }
-    if (tree->anchorItem == item)
-	tree->anchorItem = tree->root;
-    if (tree->debug.enable && tree->debug.data)
-	Tree_Debug(tree);
+    desc->refCount++;
+    dupPtr->internalRep.twoPtrValue.ptr1 =
+	srcPtr->internalRep.twoPtrValue.ptr1;
+    dupPtr->internalRep.twoPtrValue.ptr2 = (VOID *) desc;
+    dupPtr->typePtr = &itemDescObjType;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * TreeItem_Deleted --
+ * ItemDescObj_Get --
  *
- *	Return 1 if the given item is deleted.
+ *	Get the compiled item description from a Tcl_Obj with the
+ *	"treeitemdesc" internal rep.
  *
  * Results:
- *	None.
+ *	The description with a reference added for the caller, or NULL
+ *	if the object has no current description for this widget.
  *
  * Side effects:
  *	None.
@@ -2943,803 +3147,838 @@ TreeItem_Delete(
  *----------------------------------------------------------------------
  */
 
-int
-TreeItem_Deleted(
+static ItemDesc *
+ItemDescObj_Get(
     TreeCtrl *tree,		/* Widget info. */
-    TreeItem item		/* Item token. */
+    Tcl_Obj *objPtr		/* Object to examine. */
     )
 {
-    return IS_DELETED(item);
+    ItemDesc *desc;
+
+    if ((objPtr->typePtr != &itemDescObjType) ||
+	    (objPtr->internalRep.twoPtrValue.ptr1 != (VOID *) tree))
+	return NULL;
+    desc = (ItemDesc *) objPtr->internalRep.twoPtrValue.ptr2;
+    if (desc->epoch != tree->itemDescEpoch)
+	return NULL;
+    desc->refCount++;
+    return desc;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * TreeItem_FirstAndLast --
+ * ItemDescObj_Set --
  *
- *	Determine the order of two items and swap them if needed.
+ *	Give a Tcl_Obj the "treeitemdesc" internal rep for a description
+ *	with the given words.
  *
  * Results:
- *	If the items do not share a common ancestor, 0 is returned and
- *	an error message is left in the interpreter result.
- *	Otherwise the return value is the number of items in the
- *	range between first and last.
+ *	The new description with a reference added for the caller.
+ *	*objvPtr is pointed at the words kept by the description, since
+ *	the old internal rep of the object (which may have held them) is
+ *	freed.
  *
  * Side effects:
- *	None.
+ *	Memory is allocated.
  *
  *----------------------------------------------------------------------
  */
 
-int
-TreeItem_FirstAndLast(
+static ItemDesc *
+ItemDescObj_Set(
     TreeCtrl *tree,		/* Widget info. */
-    TreeItem *first,		/* Item token. */
-    TreeItem *last		/* Item token. */
+    Tcl_Obj *objPtr,		/* Object to convert. */
+    int objc,			/* Number of words. */
+    Tcl_Obj ***objvPtr		/* In: the words. Out: the same words. */
     )
 {
-    int indexFirst, indexLast, index;
+    ItemDesc *desc;
 
-    if (TreeItem_RootAncestor(tree, *first) !=
-	    TreeItem_RootAncestor(tree, *last)) {
-	FormatResult(tree->interp,
-		"item %s%d and item %s%d don't share a common ancestor",
-		tree->itemPrefix, TreeItem_GetID(tree, *first),
-		tree->itemPrefix, TreeItem_GetID(tree, *last));
-	return 0;
-    }
-    TreeItem_ToIndex(tree, *first, &indexFirst, NULL);
-    TreeItem_ToIndex(tree, *last, &indexLast, NULL);
-    if (indexFirst > indexLast) {
-	TreeItem item = *first;
-	*first = *last;
-	*last = item;
+    desc = (ItemDesc *) ckalloc(sizeof(ItemDesc) +
+	    objc * (sizeof(Qualifiers *) + sizeof(int)));
+    desc->refCount = 2;
+    desc->epoch = tree->itemDescEpoch;
+    desc->listObj = Tcl_NewListObj(objc, *objvPtr);
+    Tcl_IncrRefCount(desc->listObj);
+    desc->objc = objc;
+    desc->quals = (Qualifiers **) (desc + 1);
+    desc->qualArgs = (int *) (desc->quals + objc);
+    memset((char *) desc->quals, '\0', objc * sizeof(Qualifiers *));
+    desc->expr = NULL;
 
-	index = indexFirst;
-	indexFirst = indexLast;
-	indexLast = index;
-    }
-    return indexLast - indexFirst + 1;
+    (void) Tcl_GetString(objPtr);
+    if ((objPtr->typePtr != NULL) &&
+	    (objPtr->typePtr->freeIntRepProc != NULL))
+	(*objPtr->typePtr->freeIntRepProc)(objPtr);
+    objPtr->internalRep.twoPtrValue.ptr1 = (VOID *) tree;
+    objPtr->internalRep.twoPtrValue.ptr2 = (VOID *) desc;
+    objPtr->typePtr = &itemDescObjType;
+
+    (void) Tcl_ListObjGetElements(NULL, desc->listObj, &objc, objvPtr);
+    return desc;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * TreeItem_ListDescendants --
+ * ItemDesc_ScanQualifiers --
  *
- *	Appends descendants of an item to a list of items.
+ *	Call Qualifiers_Scan(), or use the result of an earlier call for
+ *	the same words of a compiled description.
  *
  * Results:
- *	List of items may grow.
+ *	TCL_OK or TCL_ERROR. *qPtr is set to the qualifiers to use:
+ *	either the given ones or ones kept by the description.
  *
  * Side effects:
- *	None.
+ *	Memory may be allocated.
  *
  *----------------------------------------------------------------------
  */
 
-void
-TreeItem_ListDescendants(
+static int
+ItemDesc_ScanQualifiers(
     TreeCtrl *tree,		/* Widget info. */
-    TreeItem item,		/* Item token. */
-    TreeItemList *items		/* List of items to append descendants to. */
+    ItemDesc *desc,		/* Compiled description, or NULL. */
+    Qualifiers *q,		/* Initialized qualifiers to scan into
+				 * when there is no description. */
+    int objc,			/* Number of arguments. */
+    Tcl_Obj **objv,		/* Argument values. */
+    int startIndex,		/* First objv[] index to look at. */
+    int *argsUsed,		/* Out: number of objv[] used. */
+    Qualifiers **qPtr		/* Out: qualifiers to use. */
     )
 {
-    TreeItem last;
+    Qualifiers *dq;
 
-    if (item->firstChild == NULL)
-	return;
-    last = item;
-    while (last->lastChild != NULL)
-	last = last->lastChild;
-    item = item->firstChild;
-    while (1) {
-	TreeItemList_Append(items, item);
-	if (item == last)
-	    break;
-	item = TreeItem_Next(tree, item);
+    if ((desc == NULL) || (startIndex >= desc->objc)) {
+	(*qPtr) = q;
+	return Qualifiers_Scan(q, objc, objv, startIndex, argsUsed);
+    }
+    if (desc->quals[startIndex] == NULL) {
+	dq = (Qualifiers *) ckalloc(sizeof(Qualifiers));
+	Qualifiers_Init(tree, dq);
+	if (Qualifiers_Scan(dq, objc, objv, startIndex,
+		&desc->qualArgs[startIndex]) != TCL_OK) {
+	    ckfree((char *) dq);
+	    return TCL_ERROR;
+	}
+	desc->quals[startIndex] = dq;
     }
+    (*argsUsed) = desc->qualArgs[startIndex];
+    (*qPtr) = desc->quals[startIndex];
+    return TCL_OK;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * TreeItem_UpdateDepth --
- *
- *	Recursively updates Item.depth of an Item and its
- *	descendants.
+ * TreeItemList_FromObj --
  *
- * Results:
- *	None.
+ *	Parse a Tcl_Obj item description to get a list of items.
  *
- * Side effects:
- *	None.
+ *   -- returning a single item --
+ *   "active MODIFIERS"
+ *   "anchor MODIFIERS"
+ *   "nearest x y MODIFIERS"
+ *   "root MODIFIERS"
+ *   "first QUALIFIERS MODIFIERS"
+ *   "last QUALIFIERS MODIFIERS"
+ *   "end QUALIFIERS MODIFIERS"
+ *   "rnc row col MODIFIERS"
+ *   "ID MODIFIERS"
+ *   -- returning multiple items --
+ *   all QUALIFIERS
+ *   QUALIFIERS (like "all QUALIFIERS")
+ *   list listOfItemDescs
+ *   range QUALIFIERS
+ *   tag tagExpr QUALIFIERS
+ *   "TAG-EXPR QUALFIERS"
  *
- *----------------------------------------------------------------------
- */
-
-void
-TreeItem_UpdateDepth(
-    TreeCtrl *tree,		/* Widget info. */
-    TreeItem item		/* Item token. */
-    )
-{
-    TreeItem child;
-
-    if (IS_ROOT(item))
-	return;
-    if (item->parent != NULL)
-	item->depth = item->parent->depth + 1;
-    else
-	item->depth = 0;
-    child = item->firstChild;
-    while (child != NULL) {
-	TreeItem_UpdateDepth(tree, child);
-	child = child->nextSibling;
-    }
-}
-
-/*
- *----------------------------------------------------------------------
+ *   MODIFIERS:
+ *   -- returning a single item --
+ *   above
+ *   below
+ *   left
+ *   right
+ *   top
+ *   bottom
+ *   leftmost
+ *   rightmost
+ *   next QUALIFIERS
+ *   prev QUALIFIERS
+ *   parent
+ *   firstchild QUALIFIERS
+ *   lastchild QUALIFIERS
+ *   child N|end?-offset? QUALIFIERS
+ *   nextsibling QUALIFIERS
+ *   prevsibling QUALIFIERS
+ *   sibling N|end?-offset? QUALIFIERS
+ *   -- returning multiple items --
+ *   ancestors QUALIFIERS
+ *   children QUALIFIERS
+ *   descendants QUALIFIERS
  *
- * TreeItem_AddToParent --
+ *   QUALIFIERS:
+ *   depth integer
+ *   state stateList
+ *   tag tagExpr
+ *   visible
+ *   !visible
  *
- *	Called *after* an Item is added as a child to another Item.
+ *   Examples:
+ *   $T item id "first visible firstchild"
+ *   $T item id "first visible firstchild visible"
+ *   $T item id "nearest x y nextsibling visible"
+ *   $T item id "last visible state enabled"
  *
  * Results:
- *	None.
+ *	TCL_OK or TCL_ERROR.
  *
  * Side effects:
- *	Display changes.
+ *	None.
  *
  *----------------------------------------------------------------------
  */
 
-void
-TreeItem_AddToParent(
+int
+TreeItemList_FromObj(
     TreeCtrl *tree,		/* Widget info. */
-    TreeItem item		/* Item token. */
+    Tcl_Obj *objPtr,		/* Object to parse to a list of items. */
+    TreeItemList *items,	/* Uninitialized item list. Caller must free
+				 * it with TreeItemList_Free unless the
+				 * result of this function is TCL_ERROR. */
+    int flags			/* IFO_xxx flags */
     )
 {
-    TreeItem last, parent = item->parent;
-
-    /* If this is the new last child, redraw the lines of the previous
-     * sibling and all of its descendants so the line from the previous
-     * sibling reaches this item */
-    if ((item->prevSibling != NULL) &&
-	    (item->nextSibling == NULL) &&
-	    tree->showLines && (tree->columnTree != NULL)) {
-	last = item->prevSibling;
-	while (last->lastChild != NULL)
-	    last = last->lastChild;
-	Tree_InvalidateItemDInfo(tree, tree->columnTree,
-		item->prevSibling, last);
-    }
-
-    /* Redraw the parent if the parent has "-button auto". */
-    if (IS_VISIBLE(item) && (parent->flags & ITEM_FLAG_BUTTON_AUTO) &&
-	    tree->showButtons && (tree->columnTree != NULL)) {
-	Tree_InvalidateItemDInfo(tree, tree->columnTree, parent,
-		NULL);
-    }
-
-    tree->updateIndex = 1;
-    Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
-
-    /* Tree_UpdateItemIndex() also recalcs depth, but in one of my demos
-     * I retrieve item depth during list creation. Since Tree_UpdateItemIndex()
-     * is slow I will keep depth up-to-date here. */
-    TreeItem_UpdateDepth(tree, item);
-
-    TreeColumns_InvalidateWidthOfItems(tree, NULL);
-    TreeColumns_InvalidateSpans(tree);
-
-    if (tree->debug.enable && tree->debug.data)
-	Tree_Debug(tree);
-}
+    Tcl_Interp *interp = tree->interp;
+    int i, objc, index, listIndex, id;
+    int search;
+    Tcl_Obj **objv, *elemPtr;
+    TreeItem item = NULL;
+    Qualifiers q, *qp = &q;
+    ItemDesc *desc = NULL;
+    int qualArgsTotal;
 
-/*
- *----------------------------------------------------------------------
- *
- * RemoveFromParentAux --
- *
- *	Recursively update Item.depth, Item.index and Item.indexVis.
- *
- * Results:
- *	None.
- *
- * Side effects:
- *	Display changes.
- *
- *----------------------------------------------------------------------
- */
+    static CONST char *indexName[] = {
+	"active", "all", "anchor", "end", "first", "last", "list",
+	"nearest", "range", "rnc", "root", (char *) NULL
+    };
+    enum indexEnum {
+	INDEX_ACTIVE, INDEX_ALL, INDEX_ANCHOR, INDEX_END, INDEX_FIRST,
+	INDEX_LAST, INDEX_LIST, INDEX_NEAREST, INDEX_RANGE, INDEX_RNC,
+	INDEX_ROOT
+    };
+    /* Number of arguments used by indexName[]. */
+    static int indexArgs[] = {
+	1, 1, 1, 1, 1, 1, 2, 3, 3, 3, 1
+    };
+    /* Boolean: can indexName[] be followed by 1 or more qualifiers. */
+    static int indexQual[] = {
+	0, 1, 0, 1, 1, 1, 0, 0, 1, 0, 0, 1
+    };
 
-static void
-RemoveFromParentAux(
-    TreeCtrl *tree,		/* Widget info. */
-    TreeItem item,		/* Item being removed. */
-    int *index			/* New value of Item.index. Is incremented. */
-    )
-{
-    TreeItem child;
+    static CONST char *modifiers[] = {
+	"above", "ancestors", "below", "bottom", "child", "children",
+	"descendants", "firstchild", "lastchild", "left", "leftmost", "next",
+	"nextsibling", "parent", "prev", "prevsibling", "right", "rightmost",
+	"sibling", "top", (char *) NULL
+    };
+    enum modEnum {
+	TMOD_ABOVE, TMOD_ANCESTORS, TMOD_BELOW, TMOD_BOTTOM, TMOD_CHILD,
+	TMOD_CHILDREN, TMOD_DESCENDANTS, TMOD_FIRSTCHILD, TMOD_LASTCHILD,
+	TMOD_LEFT, TMOD_LEFTMOST, TMOD_NEXT, TMOD_NEXTSIBLING, TMOD_PARENT,
+	TMOD_PREV, TMOD_PREVSIBLING, TMOD_RIGHT, TMOD_RIGHTMOST, TMOD_SIBLING,
+	TMOD_TOP
+    };
+    /* Number of arguments used by modifiers[]. */
+    static int modArgs[] = {
+	1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 1, 1
+    };
+    /* Boolean: can modifiers[] be followed by 1 or more qualifiers. */
+    static int modQual[] = {
+	0, 1, 0, 0, 1, 1, 1, 1, 1, 0, 0, 1, 1, 0, 1, 1, 0, 0, 1, 0, 0
+    };
 
-    /* Invalidate display info. Don't free it because we may just be
-     * moving the item to a new parent. FIXME: if it is being moved,
-     * it might not actually need to be redrawn (just copied) */
-    if (item->dInfo != NULL)
-	Tree_InvalidateItemDInfo(tree, NULL, item, NULL);
+    TreeItemList_Init(tree, items, 0);
+    Qualifiers_Init(tree, &q);
 
-    if (item->parent != NULL)
-	item->depth = item->parent->depth + 1;
-    else
-	item->depth = 0;
-    item->index = (*index)++;
-    item->indexVis = -1;
-    child = item->firstChild;
-    while (child != NULL) {
-	RemoveFromParentAux(tree, child, index);
-	child = child->nextSibling;
+    /* An item id we returned before. Check this before the object is
+     * converted to a list. */
+    if (ItemIdObj_Get(tree, objPtr, &id)) {
+	item = Tree_FindItem(tree, id);
+	objc = listIndex = 0;
+	objv = NULL;
+	goto gotFirstPart;
     }
-}
-
-/*
- *----------------------------------------------------------------------
- *
- * TreeItem_RemoveFromParent --
- *
- *	Remove an Item from its parent (if any).
- *
- * Results:
- *	None.
- *
- * Side effects:
- *	Display changes.
- *
- *----------------------------------------------------------------------
- */
-
-void
-TreeItem_RemoveFromParent(
-    TreeCtrl *tree,		/* Widget info. */
-    TreeItem item		/* Item token. */
-    )
-{
-    TreeItem parent = item->parent;
-    TreeItem last;
-    int index = 0;
-
-    if (parent == NULL)
-	return;
 
-    /* If this is the last child, redraw the lines of the previous
-     * sibling and all of its descendants because the line from
-     * the previous sibling to us is now gone */
-    if ((item->prevSibling != NULL) &&
-	    (item->nextSibling == NULL) &&
-	    tree->showLines && (tree->columnTree != NULL)) {
-	last = item->prevSibling;
-	while (last->lastChild != NULL)
-	    last = last->lastChild;
-	Tree_InvalidateItemDInfo(tree, tree->columnTree,
-		item->prevSibling, last);
+    desc = ItemDescObj_Get(tree, objPtr);
+    if (desc != NULL) {
+	(void) Tcl_ListObjGetElements(NULL, desc->listObj, &objc, &objv);
+    } else {
+	if (Tcl_ListObjGetElements(NULL, objPtr, &objc, &objv) != TCL_OK)
+	    goto baditem;
+	if (objc == 0)
+	    goto baditem;
+	if (objc > 1)
+	    desc = ItemDescObj_Set(tree, objPtr, objc, &objv);
     }
 
-    /* Redraw the parent if the parent has "-button auto". */
-    if (IS_VISIBLE(item) && (parent->flags & ITEM_FLAG_BUTTON_AUTO) &&
-	    tree->showButtons && (tree->columnTree != NULL)) {
-	Tree_InvalidateItemDInfo(tree, tree->columnTree, parent,
-		NULL);
-    }
+    listIndex = 0;
+    elemPtr = objv[listIndex];
+    if (Tcl_GetIndexFromObj(NULL, elemPtr, indexName, NULL, 0, &index)
+	    == TCL_OK) {
 
-    /*
-     * Set a flag indicating that item indexes are out-of-date. This doesn't
-     * cover the current item being removed.
-     */
-    tree->updateIndex = 1;
-    Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
+	if (objc - listIndex < indexArgs[index]) {
+	    Tcl_AppendResult(interp, "missing arguments to \"",
+		    Tcl_GetString(elemPtr), "\" keyword", NULL);
+	    goto errorExit;
+	}
 
-    if (item->prevSibling)
-	item->prevSibling->nextSibling = item->nextSibling;
-    if (item->nextSibling)
-	item->nextSibling->prevSibling = item->prevSibling;
-    if (parent->firstChild == item) {
-	parent->firstChild = item->nextSibling;
-	if (!parent->firstChild)
-	    parent->lastChild = NULL;
-    }
-    if (parent->lastChild == item)
-	parent->lastChild = item->prevSibling;
-    item->prevSibling = item->nextSibling = NULL;
-    item->parent = NULL;
-    parent->numChildren--;
+	qualArgsTotal = 0;
+	if (indexQual[index]) {
+	    if (ItemDesc_ScanQualifiers(tree, desc, &q, objc, objv,
+		    listIndex + indexArgs[index], &qualArgsTotal, &qp)
+		    != TCL_OK) {
+		goto errorExit;
+	    }
+	}
 
-    /*
-     * Update Item.depth, Item.index and Item.indexVis for the item and its
-     * descendants. An up-to-date Item.index is needed for some operations that
-     * use a range of items, such as [item delete].
-     */
-    RemoveFromParentAux(tree, item, &index);
-}
+	switch ((enum indexEnum) index) {
+	    case INDEX_ACTIVE: {
+		item = tree->activeItem;
+		break;
+	    }
+	    case INDEX_ALL: {
+		if (qualArgsTotal) {
+		    Item_ListQualified(tree, qp, items);
+		    item = NULL;
+		} else if (flags & IFO_LIST_ALL) {
+		    item = Tree_FirstItem(tree, &search);
+		    while (item != NULL) {
+			TreeItemList_Append(items, item);
+			item = Tree_NextItem(tree, &search);
+		    }
+		    item = NULL;
+		} else {
+		    item = ITEM_ALL;
+		}
+		break;
+	    }
+	    case INDEX_ANCHOR: {
+		item = tree->anchorItem;
+		break;
+	    }
+	    case INDEX_FIRST: {
+		item = tree->root;
+		while (!Qualifies(qp, item))
+		    item = TreeItem_Next(tree, item);
+		break;
+	    }
+	    case INDEX_END:
+	    case INDEX_LAST: {
+		item = tree->root;
+		while (item->lastChild) {
+		    item = item->lastChild;
+		}
+		while (!Qualifies(qp, item))
+		    item = TreeItem_Prev(tree, item);
+		break;
+	    }
+	    case INDEX_LIST: {
+		int listObjc;
+		Tcl_Obj **listObjv;
+		int count;
 
-/*
- *----------------------------------------------------------------------
- *
- * TreeItem_RemoveColumns --
- *
- *	Free a range of Columns in an Item.
- *
- * Results:
- *	None.
- *
- * Side effects:
- *	Memory is deallocated.
- *
- *----------------------------------------------------------------------
- */
+		if (Tcl_ListObjGetElements(interp, objv[listIndex + 1],
+			&listObjc, &listObjv) != TCL_OK) {
+		    goto errorExit;
+		}
+		for (i = 0; i < listObjc; i++) {
+		    TreeItemList item2s;
+		    if (TreeItemList_FromObj(tree, listObjv[i], &item2s, flags)
+			    != TCL_OK)
+			goto errorExit;
+		    TreeItemList_Concat(items, &item2s);
+		    TreeItemList_Free(&item2s);
+		}
+		/* If any of the item descriptions in the list is "all", then
+		 * clear the list of items and use "all". */
+		count = TreeItemList_Count(items);
+		for (i = 0; i < count; i++) {
+		    TreeItem item2 = TreeItemList_Nth(items, i);
+		    if (IS_ALL(item2))
+			break;
+		}
+		if (i < count) {
+		    TreeItemList_Free(items);
+		    item = ITEM_ALL;
+		} else
+		    item = NULL;
+		break;
+	    }
+	    case INDEX_NEAREST: {
+		int x, y;
 
-void
-TreeItem_RemoveColumns(
-    TreeCtrl *tree,		/* Widget info. */
-    TreeItem item,		/* Item token. */
-    int first,			/* 0-based column index at start of
-				 * the range. Must be <= last */
-    int last			/* 0-based column index at end of
-				 * the range. Must be >= first */
-    )
-{
-    TreeItemColumn column = item->columns;
-    TreeItemColumn prev = NULL, next = NULL;
-    int i = 0;
+		if (Tk_GetPixelsFromObj(interp, tree->tkwin,
+			objv[listIndex + 1], &x) != TCL_OK) {
+		    goto errorExit;
+		}
+		if (Tk_GetPixelsFromObj(interp, tree->tkwin,
+			objv[listIndex + 2], &y) != TCL_OK) {
+		    goto errorExit;
+		}
+		item = Tree_ItemUnderPoint(tree, &x, &y, NULL, TRUE);
+		break;
+	    }
+	    case INDEX_RANGE: {
+		TreeItem itemFirst, itemLast;
 
-    while (column != NULL) {
-	next = column->next;
-	if (i == first - 1)
-	    prev = column;
-	else if (i >= first)
-	    Column_FreeResources(tree, column);
-	if (i == last)
-	    break;
-	++i;
-	column = next;
-    }
-    if (prev != NULL)
-	prev->next = next;
-    else if (first == 0)
-	item->columns = next;
-}
+		if (TreeItem_FromObj(tree, objv[listIndex + 1], &itemFirst,
+			IFO_NOT_NULL) != TCL_OK)
+		    goto errorExit;
+		if (TreeItem_FromObj(tree, objv[listIndex + 2], &itemLast,
+			IFO_NOT_NULL) != TCL_OK)
+		    goto errorExit;
+		if (TreeItem_FirstAndLast(tree, &itemFirst, &itemLast) == 0)
+		    goto errorExit;
+		while (1) {
+		    if (Qualifies(qp, itemFirst)) {
+			TreeItemList_Append(items, itemFirst);
+		    }
+		    if (itemFirst == itemLast)
+			break;
+		    itemFirst = TreeItem_Next(tree, itemFirst);
+		}
+		item = NULL;
+		break;
+	    }
+	    case INDEX_RNC: {
+		int row, col;
 
-/*
- *----------------------------------------------------------------------
- *
- * TreeItem_RemoveAllColumns --
- *
- *	Free all the Columns in an Item.
- *
- * Results:
- *	None.
- *
- * Side effects:
- *	Memory is deallocated.
- *
- *----------------------------------------------------------------------
- */
+		if (Tcl_GetIntFromObj(interp, objv[listIndex + 1], &row) != TCL_OK)
+		    goto errorExit;
+		if (Tcl_GetIntFromObj(interp, objv[listIndex + 2], &col) != TCL_OK)
+		    goto errorExit;
+		item = Tree_RNCToItem(tree, row, col);
+		break;
+	    }
+	    case INDEX_ROOT: {
+		item = tree->root;
+		break;
+	    }
+	}
 
-void
-TreeItem_RemoveAllColumns(
-    TreeCtrl *tree,		/* Widget info. */
-    TreeItem item		/* Item token. */
-    )
-{
-    TreeItemColumn column = item->columns;
+	listIndex += indexArgs[index] + qualArgsTotal;
 
-    while (column != NULL) {
-	TreeItemColumn next = column->next;
-	/* Don't delete the tail item-column in header items. */
-	if (item->header != NULL && next == NULL) {
-	    item->columns = column;
-	    return;
+    /* No indexName[] was found. */
+    } else {
+	int gotId = FALSE;
+	TagExpr expr;
+
+	/* Try an itemPrefix + item ID. */
+	if (tree->itemPrefixLen) {
+	    char *end, *t = Tcl_GetString(elemPtr);
+	    if (strncmp(t, tree->itemPrefix, tree->itemPrefixLen) == 0) {
+		t += tree->itemPrefixLen;
+		id = strtoul(t, &end, 10);
+		if ((end != t) && (*end == '\0'))
+		    gotId = TRUE;
+	    }
+
+	/* Try an item ID. */
+	} else if (Tcl_GetIntFromObj(NULL, elemPtr, &id) == TCL_OK) {
+	    gotId = TRUE;
+	}
+	if (gotId) {
+	    item = Tree_FindItem(tree, id);
+	    listIndex++;
+	    if (objc == 1)
+		ItemIdObj_Set(tree, objPtr, id);
+	    goto gotFirstPart;
 	}
-	Column_FreeResources(tree, column);
-	column = next;
-    }
-    item->columns = NULL;
-}
 
-/*
- *----------------------------------------------------------------------
- *
- * Item_CreateColumn --
- *
- *	Allocate a Column record for an Item if it doesn't already
- *	exist.
- *
- * Results:
- *	Pointer to new or existing Column record.
- *
- * Side effects:
- *	Any column records preceding the desired one are allocated
- *	if they weren't already. Memory is allocated.
- *
- *----------------------------------------------------------------------
- */
+	/* Try a list of qualifiers. This has the same effect as
+	 * "all QUALIFIERS". */
+	if (ItemDesc_ScanQualifiers(tree, desc, &q, objc, objv, listIndex,
+		&qualArgsTotal, &qp) != TCL_OK) {
+	    goto errorExit;
+	}
+	if (qualArgsTotal) {
+	    Item_ListQualified(tree, qp, items);
+	    item = NULL;
+	    listIndex += qualArgsTotal;
+	    goto gotFirstPart;
+	}
 
-static TreeItemColumn
-Item_CreateColumn(
-    TreeCtrl *tree,		/* Widget info. */
-    TreeItem item,		/* Item to contain the column. */
-    int columnIndex,		/* 0-based index of new column. */
-    int *isNew			/* May be NULL. Set to TRUE if the
-				 * column record was created. */
-    )
-{
-    TreeItemColumn column;
-    int i;
+	/* Try a tag or tag expression followed by qualifiers. */
+	if (objc > 1) {
+	    if (ItemDesc_ScanQualifiers(tree, desc, &q, objc, objv,
+		    listIndex + 1, &qualArgsTotal, &qp) != TCL_OK) {
+		goto errorExit;
+	    }
+	}
+	if (tree->itemTagExpr) {
+	    TagExpr *exprPtr = &expr;
 
-#ifdef TREECTRL_DEBUG
-    if (columnIndex < 0 || columnIndex >= tree->columnCount + (item->header ? 1 : 0)) {
-	panic("Item_CreateColumn with index %d, must be from 0-%d", columnIndex, tree->columnCount + (item->header ? 1 : 0) - 1);
+	    if (desc != NULL && desc->expr != NULL) {
+		exprPtr = desc->expr;
+	    } else {
+		if (desc != NULL)
+		    exprPtr = (TagExpr *) ckalloc(sizeof(TagExpr));
+		if (TagExpr_Init(tree, elemPtr, exprPtr) != TCL_OK) {
+		    if (exprPtr != &expr)
+			ckfree((char *) exprPtr);
+		    goto errorExit;
+		}
+		if (desc != NULL)
+		    desc->expr = exprPtr;
+	    }
+	    if (!Item_ListTagged(tree, exprPtr, NULL, qp, items)) {
+		search = 0;
+		item = Tree_NextItemInState(tree, &search, qp->states);
+		while (item != NULL) {
+		    if (TagExpr_Eval(exprPtr, item->tagInfo) &&
+			    Qualifies(qp, item)) {
+			TreeItemList_Append(items, item);
+		    }
+		    item = Tree_NextItemInState(tree, &search, qp->states);
+		}
+	    }
+	    if (exprPtr == &expr)
+		TagExpr_Free(&expr);
+	} else {
+	    Tk_Uid tag = Tk_GetUid(Tcl_GetString(elemPtr));
+	    if (!Item_ListTagged(tree, NULL, tag, qp, items)) {
+		search = 0;
+		item = Tree_NextItemInState(tree, &search, qp->states);
+		while (item != NULL) {
+		    if (TreeItem_HasTag(item, tag) && Qualifies(qp, item)) {
+			TreeItemList_Append(items, item);
+		    }
+		    item = Tree_NextItemInState(tree, &search, qp->states);
+		}
+	    }
+	}
+	item = NULL;
+	listIndex += 1 + qualArgsTotal;
     }
-#endif
 
-    if (isNew != NULL) (*isNew) = FALSE;
-    column = item->columns;
-    if (column == NULL) {
-	column = Column_Alloc(tree, item);
-	item->columns = column;
-	if (isNew != NULL) (*isNew) = TRUE;
+gotFirstPart:
+    /* If 1 item, use it and clear the list. */
+    if (TreeItemList_Count(items) == 1) {
+	item = TreeItemList_Nth(items, 0);
+	items->count = 0;
+    }
+
+    /* If "all" but only root exists, use it. */
+    if (IS_ALL(item) && (tree->itemCount == 1) && !(flags & IFO_NOT_ROOT)) {
+	item = tree->root;
     }
-    for (i = 0; i < columnIndex; i++) {
-	if (column->next == NULL) {
-	    column->next = Column_Alloc(tree, item);
-	    if (isNew != NULL) (*isNew) = TRUE;
+
+    /* If > 1 item, no modifiers may follow. */
+    if ((TreeItemList_Count(items) > 1) || IS_ALL(item)) {
+	if (listIndex < objc) {
+	    Tcl_AppendResult(interp, "unexpected arguments after \"",
+		(char *) NULL);
+	    for (i = 0; i < listIndex; i++) {
+		Tcl_AppendResult(interp, Tcl_GetString(objv[i]), (char *) NULL);
+		if (i != listIndex - 1)
+		    Tcl_AppendResult(interp, " ", (char *) NULL);
+	    }
+	    Tcl_AppendResult(interp, "\"", (char *) NULL);
+	    goto errorExit;
 	}
-	column = column->next;
     }
 
-/* If creating a new -lock=none column then Column_Move does nothing */
-if (item->header != NULL && columnIndex == TreeColumn_Index(tree->columnTail) + 1) {
-    TreeItem_MoveColumn(tree, item, columnIndex, columnIndex - 1);
-}
+    /* This means a valid specification was given, but there is no such item */
+    if ((TreeItemList_Count(items) == 0) && (item == NULL)) {
+	if (flags & IFO_NOT_NULL)
+	    goto noitem;
+	/* Empty list returned */
+	goto goodExit;
+    }
 
-    return column;
-}
+    /* Process any modifiers following the item we matched above. */
+    for (; listIndex < objc; /* nothing */) {
 
-/*
- *----------------------------------------------------------------------
- *
- * TreeItem_MoveColumn --
- *
- *	Rearranges an Item's list of Column records by moving one
- *	in front of another.
- *
- * Results:
- *	If the Column to be moved does not exist and the Column to place it
- *	in front of does not exist, then nothing happens. If the Column is
- *	to be moved past all currently allocated Columns, then new
- *	Column records are allocated.
- *
- * Side effects:
- *	Memory may be allocated.
- *
- *----------------------------------------------------------------------
- */
-
-void
-TreeItem_MoveColumn(
-    TreeCtrl *tree,		/* Widget info. */
-    TreeItem item,		/* Item token. */
-    int columnIndex,		/* 0-based index of the column to move. */
-    int beforeIndex		/* 0-based index of the second column to move
-				 * the first column to the left of. */
-    )
-{
-    TreeItemColumn before = NULL, move = NULL;
-    TreeItemColumn prevM = NULL, prevB = NULL;
-    TreeItemColumn last = NULL, prev, walk;
-    int index = 0;
-
-    prev = NULL;
-    walk = item->columns;
-    while (walk != NULL) {
-	if (index == columnIndex) {
-	    prevM = prev;
-	    move = walk;
+	elemPtr = objv[listIndex];
+	if (Tcl_GetIndexFromObj(interp, elemPtr, modifiers, "modifier", 0,
+		    &index) != TCL_OK) {
+	    goto errorExit;
 	}
-	if (index == beforeIndex) {
-	    prevB = prev;
-	    before = walk;
+	if (objc - listIndex < modArgs[index]) {
+	    Tcl_AppendResult(interp, "missing arguments to \"",
+		    Tcl_GetString(elemPtr), "\" modifier", NULL);
+	    goto errorExit;
 	}
-	prev = walk;
-	if (walk->next == NULL)
-	    last = walk;
-	index++;
-	walk = walk->next;
-    }
 
-    if (move == NULL && before == NULL)
-	return;
-    if (move == NULL)
-	move = Column_Alloc(tree, item);
-    else {
-	if (before == NULL) {
-	    prevB = Item_CreateColumn(tree, item, beforeIndex - 1, NULL);
-	    last = prevB;
+	qualArgsTotal = 0;
+	if (modQual[index]) {
+	    Qualifiers_Free(&q);
+	    Qualifiers_Init(tree, &q);
+	    if (ItemDesc_ScanQualifiers(tree, desc, &q, objc, objv,
+		    listIndex + modArgs[index], &qualArgsTotal, &qp)
+		    != TCL_OK) {
+		goto errorExit;
+	    }
 	}
-	if (prevM == NULL)
-	    item->columns = move->next;
-	else
-	    prevM->next = move->next;
-    }
-    if (before == NULL) {
-	last->next = move;
-	move->next = NULL;
-    } else {
-	if (prevB == NULL)
-	    item->columns = move;
-	else
-	    prevB->next = move;
-	move->next = before;
-    }
-}
-
-/*
- *----------------------------------------------------------------------
- *
- * TreeItem_FreeResources --
- *
- *	Free memory etc assocated with an Item.
- *
- * Results:
- *	None.
- *
- * Side effects:
- *	Memory is deallocated. Display changes.
- *
- *----------------------------------------------------------------------
- */
-
-void
-TreeItem_FreeResources(
-    TreeCtrl *tree,		/* Widget info. */
-    TreeItem item		/* Item token. */
-    )
-{
-    TreeItemColumn column;
-
-    column = item->columns;
-    while (column != NULL)
-	column = Column_FreeResources(tree, column);
-    if (item->dInfo != NULL)
-	Tree_FreeItemDInfo(tree, item, NULL);
-    if (item->rInfo != NULL)
-	Tree_FreeItemRInfo(tree, item);
-    if (item->spans != NULL)
-	ckfree((char *) item->spans);
-    if (item->header != NULL)
-	TreeHeader_FreeResources(item->header);
-    Tk_FreeConfigOptions((char *) item, tree->itemOptionTable, tree->tkwin);
-
-    /* Add the item record to the "preserved" list. It will be freed later. */
-    TreeItemList_Append(&tree->preserveItemList, item);
-}
-
-/*
- *----------------------------------------------------------------------
- *
- * TreeItem_Release --
- *
- *	Finally free an item record when it is no longer needed.
- *
- * Results:
- *	None.
- *
- * Side effects:
- *	Memory is deallocated.
- *
- *----------------------------------------------------------------------
- */
-
-void
-TreeItem_Release(
-    TreeCtrl *tree,		/* Widget info. */
-    TreeItem item		/* Item token. */
-    )
-{
-#ifdef ALLOC_HAX
-    TreeAlloc_Free(tree->allocData, ItemUid, (char *) item, sizeof(TreeItem_));
-#else
-    WFREE(item, TreeItem_);
-#endif
-}
-
-/*
- *----------------------------------------------------------------------
- *
- * Item_HeightOfStyles --
- *
- *	Return the height used by styles in an Item.
- *
- * Results:
- *	Maximum height in pixels of the style in each visible Column.
- *
- * Side effects:
- *	None.
- *
- *----------------------------------------------------------------------
- */
-
-static int
-Item_HeightOfStyles(
-    TreeCtrl *tree,		/* Widget info. */
-    TreeItem item		/* Item record. */
-    )
-{
-    TreeItemColumn column = item->columns;
-    int *spans = TreeItem_GetSpans(tree, item);
-    int tailOK = item->header != NULL;
-    TreeColumn treeColumn = Tree_FirstColumn(tree, -1, tailOK);
-    StyleDrawArgs drawArgs;
-    int height = 0, hasHeaderElem = FALSE;
 
-    drawArgs.tree = tree;
+	switch ((enum modEnum) index) {
+	    case TMOD_ABOVE: {
+		item = Tree_ItemAbove(tree, item);
+		break;
+	    }
+	    case TMOD_ANCESTORS: {
+		item = item->parent;
+		while (item != NULL) {
+		    if (Qualifies(qp, item)) {
+			TreeItemList_Append(items, item);
+		    }
+		    item = item->parent;
+		}
+		item = NULL;
+		break;
+	    }
+	    case TMOD_BELOW: {
+		item = Tree_ItemBelow(tree, item);
+		break;
+	    }
+	    case TMOD_BOTTOM: {
+		item = Tree_ItemBottom(tree, item);
+		break;
+	    }
+	    case TMOD_CHILD: {
+		int n, endRelative;
 
-    if (spans == NULL) {
-	while (column != NULL) {
-	    if (TreeColumn_Visible(treeColumn) && (column->style != NULL)) {
-		drawArgs.state = item->state | column->cstate;
-		drawArgs.style = column->style;
-		drawArgs.indent = TreeItem_Indent(tree, treeColumn, item);
-		if (treeColumn == tree->columnTail) {
-		    drawArgs.width = -1; /* as much width as the style needs */
+		if (Tree_GetIntForIndex(tree, objv[listIndex + 1], &n,
+			&endRelative) != TCL_OK) {
+		    goto errorExit;
+		}
+		if (endRelative) {
+		    item = item->lastChild;
+		    while (item != NULL) {
+			if (Qualifies(qp, item))
+			    if (n-- <= 0)
+				break;
+			item = item->prevSibling;
+		    }
 		} else {
-		    drawArgs.width = TreeColumn_UseWidth(treeColumn);
-		    if (item->header != NULL)
-			drawArgs.width += drawArgs.indent;
+		    item = item->firstChild;
+		    while (item != NULL) {
+			if (Qualifies(qp, item))
+			    if (n-- <= 0)
+				break;
+			item = item->nextSibling;
+		    }
 		}
-		height = MAX(height, TreeStyle_UseHeight(&drawArgs));
-		if (!hasHeaderElem && (item->header != NULL) &&
-			TreeStyle_HasHeaderElement(tree, column->style))
-		    hasHeaderElem = TRUE;
+		break;
 	    }
-	    treeColumn = Tree_ColumnToTheRight(treeColumn, FALSE, tailOK);
-	    column = column->next;
-	}
-    } else {
-	while (column != NULL) {
-	    if (TreeColumn_Visible(treeColumn)) {
-		int columnIndex = TreeColumn_Index(treeColumn);
-		int columnIndex2 = columnIndex;
-		TreeColumn treeColumn2 = treeColumn;
-		drawArgs.width = 0;
-#if defined(TREECTRL_DEBUG)
-		if (TreeColumn_Index(treeColumn) != columnIndex) BreakIntoDebugger();
-		if (TreeItemColumn_Index(tree, item, column) != columnIndex) BreakIntoDebugger();
-		if (spans[columnIndex] != columnIndex) BreakIntoDebugger();
-#endif
-		while (spans[columnIndex2] == columnIndex) {
-		    if (!TreeColumn_Visible(treeColumn2)) {
-			/* nothing */
-		    } else if (treeColumn2 == tree->columnTail) {
-			drawArgs.width = -1; /* as much width as the style needs */
-		    } else {
-			drawArgs.width += TreeColumn_UseWidth(treeColumn2);
+	    case TMOD_CHILDREN: {
+		item = item->firstChild;
+		while (item != NULL) {
+		    if (Qualifies(qp, item)) {
+			TreeItemList_Append(items, item);
 		    }
-		    treeColumn2 = Tree_ColumnToTheRight(treeColumn2, FALSE, tailOK);
-		    if (treeColumn2 == NULL)
-			break;
-		    columnIndex2++;
-		}
-		if (column->style != NULL) {
-		    drawArgs.indent = TreeItem_Indent(tree, treeColumn, item);
-		    if (item->header != NULL)
-			drawArgs.width += drawArgs.indent;
-		    drawArgs.state = item->state | column->cstate;
-		    drawArgs.style = column->style;
-		    height = MAX(height, TreeStyle_UseHeight(&drawArgs));
-		    if (!hasHeaderElem && (item->header != NULL) &&
-			    TreeStyle_HasHeaderElement(tree, column->style))
-			hasHeaderElem = TRUE;
-		}
-		treeColumn = treeColumn2;
-		if (treeColumn == NULL)
-		    break;
-		while ((column != NULL) && (columnIndex < columnIndex2)) {
-		    column = column->next;
-		    columnIndex++;
+		    item = item->nextSibling;
 		}
-		continue;
+		item = NULL;
+		break;
 	    }
-	    treeColumn = Tree_ColumnToTheRight(treeColumn, FALSE, tailOK);
-	    column = column->next;
-	}
-    }
-
-    /* List headers are a fixed height on Aqua. */
-    /* FIXME: all that work above just to ignore the result here! */
-    if (hasHeaderElem && tree->useTheme) {
-	if (tree->themeHeaderHeight > 0)
-	    return tree->themeHeaderHeight;
-    }
-
-    return height;
-}
+	    case TMOD_DESCENDANTS: {
+		TreeItem last = item;
 
-/*
- *----------------------------------------------------------------------
- *
- * TreeItem_Height --
- *
- *	Return the height of an Item.
- *
- * Results:
- *	If the Item -height option is > 0, the result is the maximum
- *	of the button height (if a button is displayed) and the -height
- *	option.
- *	If the TreeCtrl -itemheight option is > 0, the result is the maximum
- *	of the button height (if a button is displayed) and the -itemheight
- *	option.
- *	Otherwise the result is the maximum of the button height (if a button
- *	is displayed) AND the TreeCtrl -minitemheight AND the height of
- *	the style in each visible Column.
- *
- * Side effects:
- *	None.
- *
- *----------------------------------------------------------------------
- */
-
-int
-TreeItem_Height(
-    TreeCtrl *tree,		/* Widget info. */
-    TreeItem item		/* Item token. */
-    )
-{
-    int buttonHeight = 0;
-    int useHeight;
-
-    if (!TreeItem_ReallyVisible(tree, item))
-	return 0;
+		while (last->lastChild != NULL)
+		    last = last->lastChild;
+		item = item->firstChild;
+		while (item != NULL) {
+		    if (Qualifies(qp, item)) {
+			TreeItemList_Append(items, item);
+		    }
+		    if (item == last)
+			break;
+		    item = TreeItem_Next(tree, item);
+		}
+		item = NULL;
+		break;
+	    }
+	    case TMOD_FIRSTCHILD: {
+		item = item->firstChild;
+		while (!Qualifies(qp, item))
+		    item = item->nextSibling;
+		break;
+	    }
+	    case TMOD_LASTCHILD: {
+		item = item->lastChild;
+		while (!Qualifies(qp, item))
+		    item = item->prevSibling;
+		break;
+	    }
+	    case TMOD_LEFT: {
+		item = Tree_ItemLeft(tree, item);
+		break;
+	    }
+	    case TMOD_LEFTMOST: {
+		item = Tree_ItemLeftMost(tree, item);
+		break;
+	    }
+	    case TMOD_NEXT: {
+		item = TreeItem_Next(tree, item);
+		while (!Qualifies(qp, item))
+		    item = TreeItem_Next(tree, item);
+		break;
+	    }
+	    case TMOD_NEXTSIBLING: {
+		item = item->nextSibling;
+		while (!Qualifies(qp, item))
+		    item = item->nextSibling;
+		break;
+	    }
+	    case TMOD_PARENT: {
+		item = item->parent;
+		break;
+	    }
+	    case TMOD_PREV: {
+		item = TreeItem_Prev(tree, item);
+		while (!Qualifies(qp, item))
+		    item = TreeItem_Prev(tree, item);
+		break;
+	    }
+	    case TMOD_PREVSIBLING: {
+		item = item->prevSibling;
+		while (!Qualifies(qp, item))
+		    item = item->prevSibling;
+		break;
+	    }
+	    case TMOD_RIGHT: {
+		item = Tree_ItemRight(tree, item);
+		break;
+	    }
+	    case TMOD_RIGHTMOST: {
+		item = Tree_ItemRightMost(tree, item);
+		break;
+	    }
+	    case TMOD_SIBLING: {
+		int n, endRelative;
 
-    if (item->header != NULL) {
-	if (item->fixedHeight > 0)
-	    return item->fixedHeight;
-	return Item_HeightOfStyles(tree, item);
+		if (Tree_GetIntForIndex(tree, objv[listIndex + 1], &n,
+			&endRelative) != TCL_OK) {
+		    goto errorExit;
+		}
+		item = item->parent;
+		if (item == NULL)
+		    break;
+		if (endRelative) {
+		    item = item->lastChild;
+		    while (item != NULL) {
+			if (Qualifies(qp, item))
+			    if (n-- <= 0)
+				break;
+			item = item->prevSibling;
+		    }
+		} else {
+		    item = item->firstChild;
+		    while (item != NULL) {
+			if (Qualifies(qp, item))
+			    if (n-- <= 0)
+				break;
+			item = item->nextSibling;
+		    }
+		}
+		break;
+	    }
+	    case TMOD_TOP: {
+		item = Tree_ItemTop(tree, item);
+		break;
+	    }
+	}
+	if ((TreeItemList_Count(items) > 1) || IS_ALL(item)) {
+	    int end = listIndex + modArgs[index] + qualArgsTotal;
+	    if (end < objc) {
+		Tcl_AppendResult(interp, "unexpected arguments after \"",
+		    (char *) NULL);
+		for (i = 0; i < end; i++) {
+		    Tcl_AppendResult(interp, Tcl_GetString(objv[i]), (char *) NULL);
+		    if (i != end - 1)
+			Tcl_AppendResult(interp, " ", (char *) NULL);
+		}
+		Tcl_AppendResult(interp, "\"", (char *) NULL);
+		goto errorExit;
+	    }
+	}
+	if ((TreeItemList_Count(items) == 0) && (item == NULL)) {
+	    if (flags & IFO_NOT_NULL)
+		goto noitem;
+	    /* Empty list returned. */
+	    goto goodExit;
+	}
+	listIndex += modArgs[index] + qualArgsTotal;
     }
-
-    /* Get requested height of the style in each column */
-    useHeight = Item_HeightOfStyles(tree, item);
-
-    /* Can't have less height than our button */
-    if (TreeItem_HasButton(tree, item)) {
-	buttonHeight = Tree_ButtonHeight(tree, item->state);
+    if ((flags & IFO_NOT_MANY) && (IS_ALL(item) ||
+	    (TreeItemList_Count(items) > 1))) {
+	NotManyMsg(tree, FALSE);
+	goto errorExit;
     }
+    if (TreeItemList_Count(items)) {
+	if (flags & (IFO_NOT_ROOT | IFO_NOT_ORPHAN)) {
+	    int i;
+	    for (i = 0; i < TreeItemList_Count(items); i++) {
+		item = TreeItemList_Nth(items, i);
+		if (IS_ROOT(item) && (flags & IFO_NOT_ROOT))
+		    goto notRoot;
+		if ((item->parent == NULL) && (flags & IFO_NOT_ORPHAN))
+		    goto notOrphan;
+	    }
+	}
+    } else if (IS_ALL(item)) {
+	TreeItemList_Append(items, ITEM_ALL);
+    } else {
+	if (IS_ROOT(item) && (flags & IFO_NOT_ROOT)) {
+notRoot:
+	    FormatResult(interp, "can't specify \"root\" for this command");
+	    goto errorExit;
+	}
+	if ((item->parent == NULL) && (flags & IFO_NOT_ORPHAN)) {
+notOrphan:
+	    FormatResult(interp, "item \"%s\" has no parent",
+		    Tcl_GetString(objPtr));
+	    goto errorExit;
+	}
+	TreeItemList_Append(items, item);
+    }
+goodExit:
+    Qualifiers_Free(&q);
+    if (desc != NULL)
+	ItemDesc_Release(desc);
+    return TCL_OK;
 
-    /* User specified a fixed height for this item */
-    if (item->fixedHeight > 0)
-	return MAX(item->fixedHeight, buttonHeight);
-
-    /* Fixed height of all items */
-    if (tree->itemHeight > 0)
-	return MAX(tree->itemHeight, buttonHeight);
+baditem:
+    Tcl_AppendResult(interp, "bad item description \"", Tcl_GetString(objPtr),
+	    "\"", NULL);
+    goto errorExit;
 
-    /* Minimum height of all items */
-    if (tree->minItemHeight > 0)
-	useHeight = MAX(useHeight, tree->minItemHeight);
+noitem:
+    Tcl_AppendResult(interp, "item \"", Tcl_GetString(objPtr),
+	    "\" doesn't exist", NULL);
 
-    /* No fixed height specified */
-    return MAX(useHeight, buttonHeight);
+errorExit:
+    Qualifiers_Free(&q);
+    if (desc != NULL)
+	ItemDesc_Release(desc);
+    TreeItemList_Free(items);
+    return TCL_ERROR;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * TreeItem_InvalidateHeight --
+ * TreeItem_FromObj --
  *
- *	Marks Item.neededHeight out-of-date.
- *	NOTE: Item.neededHeight is unused.
+ *	Parse a Tcl_Obj item description to get a single item.
  *
  * Results:
- *	None.
+ *	TCL_OK or TCL_ERROR.
  *
  * Side effects:
  *	None.
@@ -3747,23 +3986,37 @@ TreeItem_Height(
  *----------------------------------------------------------------------
  */
 
-void
-TreeItem_InvalidateHeight(
+int
+TreeItem_FromObj(
     TreeCtrl *tree,		/* Widget info. */
-    TreeItem item		/* Item token. */
+    Tcl_Obj *objPtr,		/* Object to parse to an item. */
+    TreeItem *itemPtr,		/* Returned item. */
+    int flags			/* IFO_xxx flags */
     )
 {
+    TreeItemList items;
+
+    if (TreeItemList_FromObj(tree, objPtr, &items, flags | IFO_NOT_MANY) != TCL_OK)
+	return TCL_ERROR;
+    /* May be NULL. */
+    (*itemPtr) = TreeItemList_Nth(&items, 0);
+    TreeItemList_Free(&items);
+    return TCL_OK;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * TreeItem_FindColumn --
+ * TreeItemForEach_Start --
  *
- *	Return an item-column token given a zero-based index.
+ *	Begin iterating over items. A command might accept two item
+ *	descriptions for a range of items, or a single item description
+ *	which may itself refer to multiple items. Either item
+ *	description could be ITEM_ALL.
  *
  * Results:
- *	The item-column token or NULL.
+ *	Returns the first item to iterate over. If an error occurs
+ *	then ItemForEach.error is set to 1.
  *
  * Side effects:
  *	None.
@@ -3771,35 +4024,55 @@ TreeItem_InvalidateHeight(
  *----------------------------------------------------------------------
  */
 
-TreeItemColumn
-TreeItem_FindColumn(
-    TreeCtrl *tree,		/* Widget info. */
-    TreeItem item,		/* Item token. */
-    int columnIndex		/* 0-based index of column to find. */
-    )
-{
-    TreeItemColumn column;
-    int i = 0;
-
-    column = item->columns;
-    if (!column)
-	return NULL;
-    while (column != NULL && i < columnIndex) {
-	column = column->next;
-	i++;
+TreeItem
+TreeItemForEach_Start(
+    TreeItemList *items,	/* List of items. */
+    TreeItemList *item2s,	/* List of items or NULL. */
+    ItemForEach *iter		/* Returned info, pass to
+				   TreeItemForEach_Next. */
+    )
+{
+    TreeCtrl *tree = items->tree;
+    TreeItem item, item2 = NULL;
+
+    item = TreeItemList_Nth(items, 0);
+    if (item2s)
+	item2 = TreeItemList_Nth(item2s, 0);
+
+    iter->tree = tree;
+    iter->all = FALSE;
+    iter->error = 0;
+    iter->items = NULL;
+
+    if (IS_ALL(item) || IS_ALL(item2)) {
+	iter->all = TRUE;
+	return iter->item = Tree_FirstItem(tree, &iter->search);
+    }
+
+    if (item2 != NULL) {
+	if (TreeItem_FirstAndLast(tree, &item, &item2) == 0) {
+	    iter->error = 1;
+	    return NULL;
+	}
+	iter->last = item2;
+	return iter->item = item;
     }
-    return column;
+
+    iter->items = items;
+    iter->index = 0;
+    return iter->item = item;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * TreeItem_ColumnFromObj --
+ * TreeItemForEach_Next --
  *
- *	Return an item-column token given a Tcl_Obj column description.
+ *	Returns the next item to iterate over. Keep calling this until
+ *	the result is NULL.
  *
  * Results:
- *	TCL_OK or TCL_ERROR.
+ *	Returns the next item to iterate over or NULL.
  *
  * Side effects:
  *	None.
@@ -3807,184 +4080,140 @@ TreeItem_FindColumn(
  *----------------------------------------------------------------------
  */
 
-int
-TreeItem_ColumnFromObj(
-    TreeCtrl *tree,		/* Widget info. */
-    TreeItem item,		/* Item token. */
-    Tcl_Obj *obj,		/* Column description. */
-    TreeItemColumn *columnPtr,	/* Returned column, or NULL. */
-    TreeColumn *treeColumnPtr,	/* May be NULL. Returned tree column,
-				 * or NULL. */
-    int *indexPtr,		/* May be NULL. Returned 0-based index of
-				 * the column. */
-    int flags			/* CFO_XXX flags. */
+TreeItem
+TreeItemForEach_Next(
+    ItemForEach *iter		/* Initialized by TreeItemForEach_Start. */
     )
 {
-    TreeColumn treeColumn;
-    int columnIndex;
+    TreeCtrl *tree = iter->tree;
 
-    if (TreeColumn_FromObj(tree, obj, &treeColumn, flags) != TCL_OK)
-	return TCL_ERROR;
-    columnIndex = TreeColumn_Index(treeColumn);
-    (*columnPtr) = TreeItem_FindColumn(tree, item, columnIndex);
-    if (treeColumnPtr != NULL)
-	(*treeColumnPtr) = treeColumn;
-    if (indexPtr != NULL)
-	(*indexPtr) = columnIndex;
-    return TCL_OK;
+    if (iter->all)
+	return iter->item = Tree_NextItem(tree, &iter->search);
+
+    if (iter->items != NULL) {
+	if (iter->index >= TreeItemList_Count(iter->items))
+	    return iter->item = NULL;
+	return iter->item = TreeItemList_Nth(iter->items, ++iter->index);
+    }
+
+    if (iter->item == iter->last)
+	return iter->item = NULL;
+    return iter->item = TreeItem_Next(tree, iter->item);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * TreeItem_Indent --
+ * Item_ToggleOpen --
  *
- *	Return the amount of indentation for the given item. This is
- *	the width of the buttons/lines.
+ *	Inverts the STATE_ITEM_OPEN flag of an Item.
  *
  * Results:
- *	Pixel value >= 0.
+ *	Items may be displayed/undisplayed.
  *
  * Side effects:
- *	None.
+ *	Display changes.
  *
  *----------------------------------------------------------------------
  */
 
-int
-TreeItem_Indent(
+static void
+Item_ToggleOpen(
     TreeCtrl *tree,		/* Widget info. */
-    TreeColumn treeColumn,	/* Which column. */
-    TreeItem item		/* Item token. */
+    TreeItem item,		/* Item record. */
+    int stateOff,		/* STATE_ITEM_OPEN or 0 */
+    int stateOn			/* STATE_ITEM_OPEN or 0 */
     )
 {
-    int depth;
+    TreeItem_ChangeState(tree, item, stateOff, stateOn);
+    Tree_VisibilityChanged(tree);
+#ifdef SELECTION_VISIBLE
+    if (stateOff)
+	Tree_SubtreeHidden(tree, item);
+#endif
 
-    if (item->header != NULL) {
-	if ((TreeColumn_Lock(treeColumn) == COLUMN_LOCK_NONE) &&
-		(TreeColumn_VisIndex(treeColumn) == 0)) {
-	    return tree->canvasPadX[PAD_TOP_LEFT];
-	}
-	return 0;
-    }
+    if (IS_ROOT(item) && !tree->showRoot)
+	return;
 
-    if (treeColumn != tree->columnTree)
-	return 0;
+#if 0
+    /* Don't affect display if we weren't visible */
+    if (!TreeItem_ReallyVisible(tree, item))
+	return;
 
-    if (IS_ROOT(item))
-	return (tree->showRoot && tree->showButtons && tree->showRootButton)
-	    ? tree->useIndent : 0;
+    /* Invalidate display info for this item, so it is redrawn later. */
+    Tree_InvalidateItemDInfo(tree, item, NULL);
+#endif
 
-    Tree_UpdateItemIndex(tree);
+    if (item->numChildren > 0) {
+	/* indexVis needs updating for all items after this one, if we
+	 * have any visible children */
+	if (Item_IsIndexTail(tree, item))
+	    Item_UpdateIndexTail(tree, item, item->index);
+	else
+	    tree->updateIndex = 1;
+	Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
 
-    depth = item->depth;
-    if (tree->showRoot)
-    {
-	depth += 1;
-	if (tree->showButtons && tree->showRootButton)
-	    depth += 1;
+	/* Hiding/showing children may change the width of any column */
+	TreeColumns_InvalidateWidthOfItems(tree, NULL);
+	TreeColumns_InvalidateSpans(tree);
     }
-    else if (tree->showButtons && tree->showRootChildButtons)
-	depth += 1;
-    else if (tree->showLines && tree->showRootLines)
-	depth += 1;
 
-    return tree->useIndent * depth;
+    /* If this item was previously onscreen, this call is repetitive. */
+    Tree_EventuallyRedraw(tree);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * ItemDrawBackground --
+ * Item_Populate --
  *
- *	Draws part of the background area of an Item. The area is
- *	erased to the -itembackground color of the tree column or the
- *	TreeCtrl -background color. If the TreeCtrl -backgroundimage
- *	option is specified then that image is tiled over the given area.
+ *	Generate a <Populate> event for an item whose -populate option
+ *	is TRUE and clear that option.
  *
  * Results:
  *	None.
  *
  * Side effects:
- *	Stuff is drawn in a drawable.
+ *	Whatever binding scripts do.  Items inserted while the event is
+ *	being handled are numbered and laid out once afterwards instead
+ *	of once per item.
  *
  *----------------------------------------------------------------------
  */
 
 static void
-ItemDrawBackground(
+Item_Populate(
     TreeCtrl *tree,		/* Widget info. */
-    TreeColumn treeColumn,	/* Tree-column token. */
-    TreeItem item,		/* Item record. */
-    TreeItemColumn column,	/* First column. */
-    TreeDrawable td,		/* Where to draw. */
-    int x, int y,		/* Area of the item to draw. */
-    int width, int height,	/* ^ */
-    int index			/* Used to select a color from the
-				 * tree-column's -itembackground option. */
+    TreeItem item		/* Item token. */
     )
 {
-    TreeColor *tc;
-    TreeClip clip, *clipPtr = &clip;
-    TreeRectangle tr;
-
-#if USE_ITEM_PIXMAP == 0
-    clip.type = TREE_CLIP_AREA;
-    switch (TreeColumn_Lock(treeColumn)) {
-	case COLUMN_LOCK_LEFT:
-	    clip.area = TREE_AREA_LEFT;
-	    break;
-	case COLUMN_LOCK_NONE:
-	    clip.area = TREE_AREA_CONTENT;
-	    break;
-	case COLUMN_LOCK_RIGHT:
-	    clip.area = TREE_AREA_RIGHT;
-	    break;
-    }
-#else
-    clipPtr = NULL;
-#endif
+    item->flags &= ~ITEM_FLAG_POPULATE;
+    if (tree->columnTree != NULL)
+	Tree_InvalidateItemDInfo(tree, tree->columnTree, item, NULL);
 
-    TreeRect_SetXYWH(tr, x, y, width, height);
-
-    /*
-     * If the -backgroundimage is being drawn and is opaque,
-     * there is no need to erase first (unless it doesn't tile!).
-     */
-    if (!Tree_IsBgImageOpaque(tree)) {
-	tc = TreeColumn_BackgroundColor(treeColumn, index);
-	if (tc != NULL) {
-	    TreeRectangle trBrush;
-	    TreeColor_GetBrushBounds(tree, tc, tr,
-		    tree->drawableXOrigin, tree->drawableYOrigin,
-		    treeColumn, item, &trBrush);
-	    if (!TreeColor_IsOpaque(tree, tc)
-		    || (trBrush.width <= 0) || (trBrush.height <= 0)) {
-		GC gc = Tk_3DBorderGC(tree->tkwin, tree->border, TK_3D_FLAT_GC);
-		Tree_FillRectangle(tree, td, clipPtr, gc, tr);
-	    }
-	    TreeColor_FillRect(tree, td, clipPtr, tc, trBrush, tr);
-	} else {
-	    GC gc = Tk_3DBorderGC(tree->tkwin, tree->border, TK_3D_FLAT_GC);
-	    Tree_FillRectangle(tree, td, clipPtr, gc, tr);
-	}
-    }
-    if (tree->backgroundImage != NULL) {
-	Tree_DrawBgImage(tree, td, tr, tree->drawableXOrigin,
-		tree->drawableYOrigin);
+    Tcl_Preserve((ClientData) tree);
+    tree->populating++;
+    TreeNotify_Populate(tree, item);
+    tree->populating--;
+    if (!tree->deleted) {
+	TreeColumns_InvalidateWidthOfItems(tree, NULL);
+	TreeColumns_InvalidateSpans(tree);
+	Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
     }
+    Tcl_Release((ClientData) tree);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * TreeItem_SpansInvalidate --
+ * Item_OpenCloseState --
  *
- *	Invalidates the Item.spans field of one or all items.
+ *	Figure out how TreeItem_OpenClose() changes the STATE_ITEM_OPEN
+ *	flag of an Item.
  *
  * Results:
- *	The item(s) are removed from the TreeCtrl.itemSpansHash to
- *	indicate that the list of spans must be recalculated.
+ *	The flag to turn off and the flag to turn on; both are zero if
+ *	nothing changes.
  *
  * Side effects:
  *	None.
@@ -3992,383 +4221,368 @@ ItemDrawBackground(
  *----------------------------------------------------------------------
  */
 
-void
-TreeItem_SpansInvalidate(
-    TreeCtrl *tree,		/* Widget info. */
-    TreeItem item		/* Item token. NULL for all items. */
+static void
+Item_OpenCloseState(
+    TreeItem item,		/* Item record. */
+    int mode,			/* -1: toggle
+				 * 0: close
+				 * 1: open */
+    int *stateOff,		/* Out: STATE_ITEM_OPEN or 0 */
+    int *stateOn		/* Out: STATE_ITEM_OPEN or 0 */
     )
 {
-    Tcl_HashEntry *hPtr;
-    Tcl_HashSearch search;
-    int count = 0;
-
-    if (item == NULL) {
-	hPtr = Tcl_FirstHashEntry(&tree->itemSpansHash, &search);
-	while (hPtr != NULL) {
-	    item = (TreeItem) Tcl_GetHashKey(&tree->itemSpansHash, hPtr);
-	    item->flags &= ~ITEM_FLAG_SPANS_VALID;
-	    count++;
-	    hPtr = Tcl_NextHashEntry(&search);
-	}
-	if (count) {
-	    Tcl_DeleteHashTable(&tree->itemSpansHash);
-	    Tcl_InitHashTable(&tree->itemSpansHash, TCL_ONE_WORD_KEYS);
-	}
-    } else if (item->flags & ITEM_FLAG_SPANS_VALID) {
-	hPtr = Tcl_FindHashEntry(&tree->itemSpansHash, (char *) item);
-	Tcl_DeleteHashEntry(hPtr);
-	item->flags &= ~ITEM_FLAG_SPANS_VALID;
-	count++;
-    }
-
-    if (count && tree->debug.enable && tree->debug.span)
-	dbwin("TreeItem_SpansInvalidate forgot %d items\n", count);
-
-    TreeColumns_InvalidateSpans(tree); /* FIXME: only if item visible? */
+    *stateOff = *stateOn = 0;
+    if (mode == -1) {
+	if (item->state & STATE_ITEM_OPEN)
+	    *stateOff = STATE_ITEM_OPEN;
+	else
+	    *stateOn = STATE_ITEM_OPEN;
+    } else if (!mode && (item->state & STATE_ITEM_OPEN))
+	*stateOff = STATE_ITEM_OPEN;
+    else if (mode && !(item->state & STATE_ITEM_OPEN))
+	*stateOn = STATE_ITEM_OPEN;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * TreeItem_SpansRedo --
+ * TreeItem_OpenClose --
  *
- *	Updates the Item.spans field of an item.
+ *	Inverts the STATE_ITEM_OPEN flag of an Item.
  *
  * Results:
- *	Item.spans is resized if needed to (at least) the current number
- *	of tree columns. For tree column N, the index of the item
- *	column displayed there is written to spans[N].
- *
- *	The return value is 1 if every span is 1, otherwise 0.
+ *	Items may be displayed/undisplayed.
  *
  * Side effects:
- *	Memory may be allocated.
+ *	Display changes. <Expand> and <Collapse> events may be
+ *	generated.
  *
  *----------------------------------------------------------------------
  */
 
-int
-TreeItem_SpansRedo(
+void
+TreeItem_OpenClose(
     TreeCtrl *tree,		/* Widget info. */
-    TreeItem item		/* Item token. */
+    TreeItem item,		/* Item token. */
+    int mode			/* -1: toggle
+				 * 0: close
+				 * 1: open */
     )
 {
-    TreeColumn treeColumn = tree->columns;
-    TreeItemColumn itemColumn = item->columns;
-    int columnCount = tree->columnCount + (item->header ? 1 : 0);
-    int columnIndex = 0, spanner = 0, span = 1, simple = TRUE;
-    int lock = TreeColumn_Lock(treeColumn);
+    int stateOff, stateOn;
 
-    if (tree->debug.enable && tree->debug.span)
-	dbwin("TreeItem_SpansRedo %s %d\n", item->header ? "header" : "item",
-	    item->id);
+    /* When processing a list of items, any <Expand> or <Collapse> event
+     * may result in items being deleted. */
+    if (IS_DELETED(item)) return;
 
-    if (item->spans == NULL) {
-	item->spans = (int *) ckalloc(sizeof(int) * columnCount);
-	item->spanAlloc = columnCount;
-    } else if (item->spanAlloc < columnCount) {
-	item->spans = (int *) ckrealloc((char *) item->spans,
-		sizeof(int) * columnCount);
-	item->spanAlloc = columnCount;
-    }
+    Item_OpenCloseState(item, mode, &stateOff, &stateOn);
 
-    while (treeColumn != NULL) {
-	/* End current span if column lock changes. */
-	if (TreeColumn_Lock(treeColumn) != lock) {
-	    lock = TreeColumn_Lock(treeColumn);
-	    span = 1;
-	}
-	if (--span == 0) {
-	    if (TreeColumn_Visible(treeColumn))
-		span = itemColumn ? itemColumn->span : 1;
-	    else
-		span = 1;
-	    spanner = columnIndex;
-	}
-	if ((itemColumn != NULL) && (itemColumn->span > 1))
-	    simple = FALSE;
-	item->spans[columnIndex] = spanner;
-	columnIndex++;
-	treeColumn = TreeColumn_Next(treeColumn);
-	if (itemColumn != NULL)
-	    itemColumn = itemColumn->next;
+    /* The first time an item with -populate is opened, give scripts the
+     * chance to create its children. */
+    if (stateOn && (item->flags & ITEM_FLAG_POPULATE)) {
+	Item_Populate(tree, item);
+	if (IS_DELETED(item)) return;
     }
 
-    /* Add a span of 1 for the tail column if this is a header. */
-    if (item->header != NULL) {
-	item->spans[columnCount - 1] = columnCount - 1; /* tail column */
+    if (stateOff != stateOn) {
+	TreeNotify_OpenClose(tree, item, stateOn, TRUE);
+	if (IS_DELETED(item)) return;
+	Item_ToggleOpen(tree, item, stateOff, stateOn);
+	TreeNotify_OpenClose(tree, item, stateOn, FALSE);
     }
-
-    return simple;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * TreeItem_SpansRedoIfNeeded --
+ * TreeItem_OpenCloseList --
  *
- *	Updates the Item.spans field of an item if needed.
+ *	Call TreeItem_OpenClose() for each item in a list. When no
+ *	script is bound to the <Expand>, <Collapse> or <Populate> events
+ *	the STATE_ITEM_OPEN flag of every item is changed first and the
+ *	layout is invalidated once afterwards.
  *
  * Results:
- *	If all spans are known to be 1, nothing is done. If the list of
- *	spans is marked valid, nothing is done. Otherwise the list of
- *	spans is recalculated; if any span is > 1 the item is added
- *	to TreeCtrl.itemSpansHash.
+ *	Items may be displayed/undisplayed.
  *
  * Side effects:
- *	Memory may be allocated.
+ *	Display changes. <Expand> and <Collapse> events may be
+ *	generated.
  *
  *----------------------------------------------------------------------
  */
 
 void
-TreeItem_SpansRedoIfNeeded(
-    TreeCtrl *tree,
-    TreeItem item
+TreeItem_OpenCloseList(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItemList *items,	/* Items to open or close. */
+    int mode			/* -1: toggle
+				 * 0: close
+				 * 1: open */
     )
 {
-    /* All the spans are 1. */
-    if (item->flags & ITEM_FLAG_SPANS_SIMPLE)
+    TreeItem item;
+    int i, count = TreeItemList_Count(items);
+    int stateOff, stateOn, changed = FALSE;
+
+    /* Scripts bound to the events may do anything, so each item is
+     * handled completely before the next. */
+    if (count < 2 || TreeNotify_OpenCloseBound(tree)) {
+	for (i = 0; i < count; i++)
+	    TreeItem_OpenClose(tree, TreeItemList_Nth(items, i), mode);
 	return;
+    }
 
-    /* Some spans > 1, but we calculated them already. */
-    if (item->flags & ITEM_FLAG_SPANS_VALID)
+    for (i = 0; i < count; i++) {
+	item = TreeItemList_Nth(items, i);
+	Item_OpenCloseState(item, mode, &stateOff, &stateOn);
+	if (stateOff == stateOn)
+	    continue;
+	if (stateOn && (item->flags & ITEM_FLAG_POPULATE))
+	    Item_Populate(tree, item);
+	TreeItem_ChangeState(tree, item, stateOff, stateOn);
+#ifdef SELECTION_VISIBLE
+	if (stateOff)
+	    Tree_SubtreeHidden(tree, item);
+#endif
+	changed = TRUE;
+    }
+    if (!changed)
 	return;
 
-    if (TreeItem_SpansRedo(tree, item)) {
-	/* Reverted to all spans=1. */
-	item->flags |= ITEM_FLAG_SPANS_SIMPLE;
-    } else {
-	int isNew;
-	Tcl_HashEntry *hPtr;
-
-	hPtr = Tcl_CreateHashEntry(&tree->itemSpansHash, (char *) item, &isNew);
-	Tcl_SetHashValue(hPtr, (ClientData) item);
-	item->flags |= ITEM_FLAG_SPANS_VALID;
-    }
+    /* Everything that Item_ToggleOpen() does for each item is done once
+     * here. */
+    Tree_VisibilityChanged(tree);
+    tree->updateIndex = 1;
+    Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
+    TreeColumns_InvalidateWidthOfItems(tree, NULL);
+    TreeColumns_InvalidateSpans(tree);
 }
 
+/*
+ * The number of item-columns whose styles are freed by each call to
+ * Item_FreeDeadProc.
+ */
+#define DEAD_COLUMNS_PER_IDLE 5000
+
 /*
  *----------------------------------------------------------------------
  *
- * TreeItem_GetSpans --
+ * Item_FreeDead --
  *
- *	Returns the spans[] array for an item.
+ *	Free the styles and options of items on tree->deadItemList,
+ *	most-recently deleted first.
  *
  * Results:
- *	If all spans are known to be 1, the result is NULL. Otherwise the
- *	list of spans is returned.
+ *	None.
  *
  * Side effects:
- *	Memory may be allocated.
+ *	Memory is freed. Item records are released when no longer in
+ *	use.
  *
  *----------------------------------------------------------------------
  */
 
-int *
-TreeItem_GetSpans(
+static void
+Item_FreeDead(
     TreeCtrl *tree,		/* Widget info. */
-    TreeItem item		/* Item token. */
+    int budget			/* Stop after freeing about this many
+				 * item-columns, or -1 to free all. */
     )
 {
-    TreeItem_SpansRedoIfNeeded(tree, item);
-    if (item->flags & ITEM_FLAG_SPANS_SIMPLE)
-	return NULL;
-    return item->spans;
+    TreeItemList *items = &tree->deadItemList;
+    TreeItem item;
+
+    Tree_PreserveItems(tree);
+    while (TreeItemList_Count(items) > 0) {
+	if (budget != -1 && budget <= 0)
+	    break;
+	item = TreeItemList_Nth(items, TreeItemList_Count(items) - 1);
+	items->pointers[--items->count] = NULL;
+	if (budget != -1)
+	    budget -= item->columnCount + 1;
+	TreeItem_FreeResources(tree, item);
+    }
+    if (TreeItemList_Count(items) == 0)
+	TreeItemList_Free(items);
+    Tree_ReleaseItems(tree);
 }
 
 /*
- * The following structure holds information about which item column
- * is displayed at a given tree column.
+ *----------------------------------------------------------------------
+ *
+ * Item_FreeDeadProc --
+ *
+ *	Tcl_DoWhenIdle callback that frees some of the deleted items
+ *	and reschedules itself until none are left.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Memory is freed.
+ *
+ *----------------------------------------------------------------------
  */
-typedef struct SpanInfo {
-    TreeColumn treeColumn;	/* Always non-null. */
-    TreeItemColumn itemColumn;	/* May be null. */
-    int span;			/* Number of tree-columns spanned. */
-    int width;			/* Width of the span. */
-    int visIndex;		/* 0-based index into list of
-				 * spans.  Used by header items. */
-    int isDragColumn;		/* TRUE if this span is for a column header
-				 * that is being dragged. */
-} SpanInfo;
 
-typedef struct ColumnColumn {
-    TreeColumn treeColumn;
-    TreeItemColumn itemColumn;
-    int isDragColumn;
-} ColumnColumn;
-
-typedef struct SpanInfoStack SpanInfoStack;
-struct SpanInfoStack
+static void
+Item_FreeDeadProc(
+    ClientData clientData	/* Widget info. */
+    )
 {
-    int spanCount;
-    SpanInfo *spans;
-    int columnCount;
-    ColumnColumn *columns;
-    int inUse;
-    SpanInfoStack *next;
-};
+    TreeCtrl *tree = clientData;
+
+    Item_FreeDead(tree, DEAD_COLUMNS_PER_IDLE);
+    if (TreeItemList_Count(&tree->deadItemList) > 0)
+	Tcl_DoWhenIdle(Item_FreeDeadProc, (ClientData) tree);
+}
 
 /*
  *----------------------------------------------------------------------
  *
- * Item_GetSpans --
+ * TreeItem_FreeDeadItems --
  *
- *	Fills an array of SpanInfo records, one per visible span.
+ *	Free the styles of every deleted item right away. This must be
+ *	called before master styles or elements are changed or deleted,
+ *	since the styles of deleted items still refer to them.
  *
  * Results:
- *	The return value is the number of SpanInfo records written.
+ *	None.
  *
  * Side effects:
+ *	Memory is freed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TreeItem_FreeDeadItems(
+    TreeCtrl *tree		/* Widget info. */
+    )
+{
+    if (TreeItemList_Count(&tree->deadItemList) == 0)
+	return;
+    Tcl_CancelIdleCall(Item_FreeDeadProc, (ClientData) tree);
+    Item_FreeDead(tree, -1);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Item_Bury --
+ *
+ *	Free the display info of a deleted item now and queue the item
+ *	so its styles are freed when idle. Items whose styles hold
+ *	windows or -textvariable traces are freed right away, so the
+ *	windows are destroyed and the traces removed before the caller
+ *	continues.
+ *
+ * Results:
  *	None.
  *
+ * Side effects:
+ *	Memory is freed. An idle callback may be scheduled.
+ *
  *----------------------------------------------------------------------
  */
 
-static int
-Item_GetSpans(
+static void
+Item_Bury(
     TreeCtrl *tree,		/* Widget info. */
-    TreeItem item,		/* Item token. */
-    TreeColumn firstColumn,	/* Which columns. */
-    TreeColumn lastColumn,	/* Which columns. */
-    int columnCount,
-    SpanInfo spans[],		/* Returned span records. */
-#define WALKSPAN_IGNORE_DND 0	     /* Ignore header drag-and-drop positions. */
-#define WALKSPAN_ONLY_DRAGGED 0x01   /* Calculate the bounds of dragged headers
-				      * only considering -imageoffset. */
-#define WALKSPAN_DRAG_ORDER 0x02     /* Calculate the bounds of all headers in
-				      * their current drag positions. */
-#define WALKSPAN_IGNORE_DRAGGED 0x04 /* Don't call the callback routine for
-                                      * dragged headers. */
-    int dragPosition
+    TreeItem item		/* Item token. */
     )
 {
-    /* Note: getting head of the stack, that's ok since this routine isn't
-     * in danger of being called recursively. */
-    SpanInfoStack *siStack = tree->itemSpanPriv;
-    ColumnColumn *columns = siStack->columns;
-    TreeColumn treeColumn = firstColumn;
-    int columnIndex = TreeColumn_Index(firstColumn);
-    TreeItemColumn column = TreeItem_FindColumn(tree, item, columnIndex);
-    int spanCount = 0, span = 1;
-    SpanInfo *spanPtr = NULL;
-    int i, isDragColumn;
-
-    if ((item->header == NULL) && (dragPosition & WALKSPAN_ONLY_DRAGGED))
-	return 0;
+    int i;
 
-    if ((columns == NULL) || (siStack->columnCount < tree->columnCount + 1)) {
-	columns = (ColumnColumn *) ckrealloc((char *) columns,
-	    sizeof(ColumnColumn) * (tree->columnCount + 1));
-	siStack->columnCount = tree->columnCount + 1;
-	siStack->columns = columns;
+    if (ITEM_DINFO(item) != NULL)
+	Tree_FreeItemDInfo(tree, item, NULL);
+    if (item->rInfo != NULL)
+	Tree_FreeItemRInfo(tree, item);
+    for (i = 0; i < item->columnCount; i++) {
+	if ((item->columns[i].style != NULL) &&
+		TreeStyle_NeedsPromptFree(tree, item->columns[i].style))
+	    break;
     }
-
-#ifdef TREECTRL_DEBUG
-    for (i = 0; i < tree->columnCount + 1; i++) {
-	columns[i].treeColumn = NULL;
-	columns[i].itemColumn = NULL;
+    if (i < item->columnCount || item->columnCount == 0) {
+	TreeItem_FreeResources(tree, item);
+	return;
     }
-#endif
+    if (TreeItemList_Count(&tree->deadItemList) == 0)
+	Tcl_DoWhenIdle(Item_FreeDeadProc, (ClientData) tree);
+    TreeItemList_Append(&tree->deadItemList, item);
+}
 
-    columnCount = 0;
-    while (treeColumn != NULL) {
-	if (TreeColumn_Lock(treeColumn) != TreeColumn_Lock(firstColumn))
-	    break;
-	columnIndex = columnCount;
-	isDragColumn = 0;
-	if ((item->header != NULL) && (dragPosition != WALKSPAN_IGNORE_DND)) {
-	    if (dragPosition & WALKSPAN_DRAG_ORDER) {
-		isDragColumn = TreeHeader_IsDraggedColumn(item->header,
-		    treeColumn);
-		columnIndex = TreeHeader_ColumnDragOrder(item->header,
-		    treeColumn, columnIndex);
-	    }
-	    if (dragPosition & WALKSPAN_ONLY_DRAGGED)
-		isDragColumn = 1;
-	}
-#ifdef TREECTRL_DEBUG
-	if (columnIndex < 0 || columnIndex >= siStack->columnCount) panic("Item_GetSpans columnIndex %d columnCount %d", columnIndex, siStack->columnCount);
-#endif
-	columns[columnIndex].treeColumn = treeColumn;
-	columns[columnIndex].itemColumn = column;
-	columns[columnIndex].isDragColumn = isDragColumn;
-	columnCount++;
-	if (treeColumn == lastColumn) /* FIXME: lastColumn is usually NULL */
-	    break;
-	treeColumn = Tree_ColumnToTheRight(treeColumn, TRUE,
-	    item->header != NULL);
-	if (column != NULL)
-	    column = column->next;
-	if (treeColumn == tree->columnTail) {
-	    while (column != NULL && column->next != NULL)
-		column = column->next;
-	}
-    }
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeItem_Delete --
+ *
+ *	Recursively frees resources associated with an Item and its
+ *	descendants.
+ *
+ * Results:
+ *	Items are removed from their parent and freed.
+ *
+ * Side effects:
+ *	Memory is freed. If the active item or selection-anchor item
+ *	is deleted, the root becomes the active/anchor item.
+ *	Display changes may occur.
+ *
+ *----------------------------------------------------------------------
+ */
 
-    isDragColumn = columns[0].isDragColumn;
-    for (i = 0; i < columnCount; i++) {
-	treeColumn = columns[i].treeColumn;
-	column = columns[i].itemColumn;
-	if (isDragColumn != columns[i].isDragColumn)
-	    span = 1;
-	isDragColumn = columns[i].isDragColumn;
-	if (treeColumn == tree->columnTail) {
-	    span = 1; /* End the current span if it hits the tail. */
-	}
-	if (--span == 0) {
-	    /* Always create a span for the tail column in headers */
-	    if ((treeColumn == tree->columnTail) || TreeColumn_Visible(treeColumn)) {
-		span = column ? column->span : 1;
-		if (spanPtr == NULL)
-		    spanPtr = spans;
-		else
-		    spanPtr++;
-		spanPtr->treeColumn = treeColumn;
-		spanPtr->itemColumn = column;
-		spanPtr->span = 0;
-		spanPtr->width = 0;
-		if (!(dragPosition & WALKSPAN_ONLY_DRAGGED) &&
-			(item->header != NULL) &&
-			(spanCount == 0) &&
-			(TreeColumn_Lock(treeColumn) == COLUMN_LOCK_NONE)) {
-		    spanPtr->width += tree->canvasPadX[PAD_TOP_LEFT];
-		}
-		spanPtr->visIndex = spanCount;
-		spanPtr->isDragColumn = isDragColumn;
-		spanCount++;
-	    } else {
-		span = 1;
-		continue;
-	    }
-	}
-	spanPtr->span++;
-	if (treeColumn == tree->columnTail) {
-	    spanPtr->width = 100; /* TreeItem_WalkSpans will calculate the correct value */
+void
+TreeItem_Delete(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item		/* Item token. */
+    )
+{
+    while (item->numChildren > 0)
+	TreeItem_Delete(tree, item->firstChild);
+
+    /* Remove from tree->headerItems. */
+    if (ITEM_HEADER(item) != NULL) {
+	if (item != tree->headerItems) {
+	    item->prevSibling->nextSibling = item->nextSibling;
+	    if (item->nextSibling != NULL)
+		item->nextSibling->prevSibling = item->prevSibling;
 	} else {
-	    spanPtr->width += TreeColumn_UseWidth(treeColumn);
+	    tree->headerItems = item->nextSibling;
+	    if (item->nextSibling != NULL)
+		item->nextSibling->prevSibling = NULL;
 	}
+	item->prevSibling = item->nextSibling = NULL;
     }
 
-    return spanCount;
+    Item_SortForget(tree, item);
+    TreeItem_RemoveFromParent(tree, item);
+    TreeDisplay_ItemDeleted(tree, item);
+    TreeGradient_ItemDeleted(tree, item);
+    TreeTheme_ItemDeleted(tree, item);
+    if (ITEM_HEADER(item) != NULL)
+	Tree_RemoveHeader(tree, item);
+    else
+	Tree_RemoveItem(tree, item);
+    if (ITEM_HEADER(item) != NULL)
+	TreeItem_FreeResources(tree, item);
+    else
+	Item_Bury(tree, item);
+    if (tree->activeItem == item) {
+	tree->activeItem = tree->root;
+	TreeItem_ChangeState(tree, tree->activeItem, 0, STATE_ITEM_ACTIVE);
+    }
+    if (tree->anchorItem == item)
+	tree->anchorItem = tree->root;
+    if (tree->debug.enable && tree->debug.data)
+	Tree_Debug(tree);
 }
 
-typedef int (*TreeItemWalkSpansProc)(
-    TreeCtrl *tree,
-    TreeItem item,
-    SpanInfo *spanPtr,
-    StyleDrawArgs *drawArgs,
-    ClientData clientData
-    );
-
 /*
  *----------------------------------------------------------------------
  *
- * TreeItem_WalkSpans --
+ * TreeItem_Deleted --
  *
- *	Iterates over the spans of an item and calls a callback routine
- *	for each span of non-zero width. This is used for drawing,
- *	hit-testing and other purposes.
+ *	Return 1 if the given item is deleted.
  *
  * Results:
  *	None.
@@ -4379,936 +4593,660 @@ typedef int (*TreeItemWalkSpansProc)(
  *----------------------------------------------------------------------
  */
 
-static void
-TreeItem_WalkSpans(
+int
+TreeItem_Deleted(
     TreeCtrl *tree,		/* Widget info. */
-    TreeItem item,		/* Item token. */
-    int lock,			/* Which columns. */
-    int x, int y,		/* Drawable coordinates of the item. */
-    int width, int height,	/* Total size of the item. */
-    int dragPosition,
-    TreeItemWalkSpansProc proc,	/* Callback routine. */
-    ClientData clientData	/* Data passed to callback routine. */
+    TreeItem item		/* Item token. */
     )
 {
-    SpanInfoStack *siStack = tree->itemSpanPriv;
-    int columnWidth, totalWidth;
-    TreeItemColumn itemColumn;
-    StyleDrawArgs drawArgs;
-    TreeColumn treeColumn = tree->columnLockNone, treeColumnLast = NULL;
-    int spanCount, spanIndex, columnCount = tree->columnCountVis;
-    SpanInfo *spans;
-    int area = TREE_AREA_CONTENT;
+    return IS_DELETED(item);
+}
 
-    switch (lock) {
-	case COLUMN_LOCK_LEFT:
-	    treeColumn = tree->columnLockLeft;
-	    columnCount = tree->columnCountVisLeft;
-	    area = TREE_AREA_LEFT;
-	    break;
-	case COLUMN_LOCK_NONE:
-	    break;
-	case COLUMN_LOCK_RIGHT:
-	    treeColumn = tree->columnLockRight;
-	    columnCount = tree->columnCountVisRight;
-	    area = TREE_AREA_RIGHT;
-	    break;
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeItem_FirstAndLast --
+ *
+ *	Determine the order of two items and swap them if needed.
+ *
+ * Results:
+ *	If the items do not share a common ancestor, 0 is returned and
+ *	an error message is left in the interpreter result.
+ *	Otherwise the return value is the number of items in the
+ *	range between first and last.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TreeItem_FirstAndLast(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem *first,		/* Item token. */
+    TreeItem *last		/* Item token. */
+    )
+{
+    int indexFirst, indexLast, index;
+
+    if (TreeItem_RootAncestor(tree, *first) !=
+	    TreeItem_RootAncestor(tree, *last)) {
+	FormatResult(tree->interp,
+		"item %s%d and item %s%d don't share a common ancestor",
+		tree->itemPrefix, TreeItem_GetID(tree, *first),
+		tree->itemPrefix, TreeItem_GetID(tree, *last));
+	return 0;
     }
+    TreeItem_ToIndex(tree, *first, &indexFirst, NULL);
+    TreeItem_ToIndex(tree, *last, &indexLast, NULL);
+    if (indexFirst > indexLast) {
+	TreeItem item = *first;
+	*first = *last;
+	*last = item;
 
-    if (item->header != NULL) {
-	switch (lock) {
-	    case COLUMN_LOCK_LEFT:
-		area = TREE_AREA_HEADER_LEFT;
-		break;
-	    case COLUMN_LOCK_NONE:
-		area = TREE_AREA_HEADER_NONE;
-		if (treeColumn == NULL)
-		    treeColumn = tree->columnTail;
-		columnCount += 1; /* +1 for columnTail */
-		break;
-	    case COLUMN_LOCK_RIGHT:
-		area = TREE_AREA_HEADER_RIGHT;
-		break;
-	}
-	if (dragPosition & WALKSPAN_ONLY_DRAGGED) {
-	    columnCount = TreeHeader_GetDraggedColumns(item->header, lock,
-		&treeColumn, &treeColumnLast);
-	    if (columnCount == 0)
-		return;
-	}
+	index = indexFirst;
+	indexFirst = indexLast;
+	indexLast = index;
     }
+    return indexLast - indexFirst + 1;
+}
 
-    if (columnCount <= 0)
-	return;
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeItem_ListDescendants --
+ *
+ *	Appends descendants of an item to a list of items.
+ *
+ * Results:
+ *	List of items may grow.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-    if (!Tree_AreaBbox(tree, area, &drawArgs.bounds)) {
-	TreeRect_SetXYWH(drawArgs.bounds, 0, 0, 0, 0);
+void
+TreeItem_ListDescendants(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item,		/* Item token. */
+    TreeItemList *items		/* List of items to append descendants to. */
+    )
+{
+    TreeItem last;
+
+    if (item->firstChild == NULL)
+	return;
+    last = item;
+    while (last->lastChild != NULL)
+	last = last->lastChild;
+    item = item->firstChild;
+    while (1) {
+	TreeItemList_Append(items, item);
+	if (item == last)
+	    break;
+	item = TreeItem_Next(tree, item);
     }
-
-    /* Originally, the array of SpanInfo records used by this function was
-     * allocated using STATIC_ALLOC.  Not wanting to allocate memory every
-     * time this function is called (which is often) I decided to keep a
-     * pointer to the array.  One problem is that TreeItem_UpdateWindowPositions
-     * may result in recursive calls to this function via code in <Configure>
-     * event scripts. So I have to keep a stack on the heap. That's also why
-     * the array can't be shared by different treectrl widgets. */
-    if (siStack == NULL) {
-	siStack = (SpanInfoStack *) ckalloc(sizeof(SpanInfoStack));
-	memset(siStack, '\0', sizeof(SpanInfoStack));
-	tree->itemSpanPriv = siStack;
-    }
-    while (siStack->inUse) {
-	if (siStack->next == NULL) {
-	    siStack->next = (SpanInfoStack *) ckalloc(sizeof(SpanInfoStack));
-	    memset(siStack->next, '\0', sizeof(SpanInfoStack));
-	    siStack = siStack->next;
-	    break;
-	}
-	siStack = siStack->next;
-    }
-    if (siStack->spanCount < columnCount) {
-	siStack->spans = (SpanInfo *) ckrealloc((char *) siStack->spans,
-	    sizeof(SpanInfo) * columnCount);
-	siStack->spanCount = columnCount;
-    }
-    spans = siStack->spans;
-
-    spanCount = Item_GetSpans(tree, item, treeColumn, treeColumnLast,
-	columnCount, spans, dragPosition);
-    if (spanCount <= 0)
-	return;
-
-#ifdef TREECTRL_DEBUG
-    if (siStack->inUse) panic("TreeItem_WalkSpans stack is in use");
-#endif
-    siStack->inUse = 1;
-
-    drawArgs.tree = tree;
-    drawArgs.item = item; /* needed for gradients */
-    drawArgs.td.drawable = None;
-
-    totalWidth = 0;
-    if (dragPosition & WALKSPAN_ONLY_DRAGGED) {
-#ifdef TREECTRL_DEBUG
-	if (item->header == NULL) panic("TreeItem_WalkSpans header == NULL");
-#endif
-	treeColumn = spans[0].treeColumn; /* tree->columnDrag.column */
-	totalWidth = TreeColumn_Offset(treeColumn);
-    }
-    for (spanIndex = 0; spanIndex < spanCount; spanIndex++) {
-	treeColumn = spans[spanIndex].treeColumn;
-	itemColumn = spans[spanIndex].itemColumn;
-
-	/* This is where the actual width of the tail column is determined. */
-	if (treeColumn == tree->columnTail) {
-	    spans[spanIndex].width = MAX(0, MAX(Tree_ContentWidth(tree),
-		Tree_FakeCanvasWidth(tree)) - totalWidth) + tree->tailExtend;
-	}
-	if (item->header != NULL) {
-	    columnWidth = spans[spanIndex].width;
-
-	/* If this is the single visible column, use the provided width which
-	 * may be different than the column's width. */
-	} else if ((tree->columnCountVis == 1) && (treeColumn == tree->columnVis)) {
-	    columnWidth = width;
-
-	/* More than one column is visible, or this is not the visible
-	 * column. */
-	} else {
-	    columnWidth = spans[spanIndex].width;
-	}
-	if (columnWidth <= 0)
-	    continue;
-
-	if ((dragPosition & WALKSPAN_IGNORE_DRAGGED) &&
-		spans[spanIndex].isDragColumn)
-	    goto next;
-
-	if (itemColumn != NULL) {
-	    drawArgs.state = item->state | itemColumn->cstate;
-	    drawArgs.style = itemColumn->style; /* may be NULL */
-	} else {
-	    drawArgs.state = item->state;
-	    drawArgs.style = NULL;
-	}
-	if ((dragPosition & WALKSPAN_DRAG_ORDER) && (item->header != NULL)) {
-	    if ((spanIndex == 0) && (TreeColumn_Lock(treeColumn) == COLUMN_LOCK_NONE))
-		drawArgs.indent = tree->canvasPadX[PAD_TOP_LEFT];
-	    else
-		drawArgs.indent = 0;
-	} else
-	    drawArgs.indent = TreeItem_Indent(tree, treeColumn, item);
-	drawArgs.x = x + totalWidth;
-	if (dragPosition & WALKSPAN_ONLY_DRAGGED) {
-#ifdef TREECTRL_DEBUG
-	    if (item->header == NULL) panic("TreeItem_WalkSpans header == NULL");
-#endif
-	    drawArgs.x += tree->columnDrag.offset;
-	    drawArgs.indent = 0;
-	}
-	drawArgs.y = y;
-	drawArgs.width = columnWidth;
-	drawArgs.height = height;
-	drawArgs.spanIndex = spanIndex;
-	if (item->header != NULL)
-	    drawArgs.justify = TreeHeaderColumn_Justify(item->header,
-		itemColumn->headerColumn);
-	else
-	    drawArgs.justify = TreeColumn_ItemJustify(treeColumn);
-	drawArgs.column = treeColumn; /* needed for gradients */
-
-	if ((*proc)(tree, item, &spans[spanIndex], &drawArgs, clientData))
-	    break;
-next:
-	totalWidth += columnWidth;
-    }
-
-    siStack->inUse = 0;
-}
+}
 
 /*
  *----------------------------------------------------------------------
  *
- * SpanWalkProc_Draw --
+ * TreeItem_UpdateDepth --
  *
- *	Callback routine to TreeItem_WalkSpans for TreeItem_Draw.
+ *	Recursively updates Item.depth of an Item and its
+ *	descendants.
  *
  * Results:
  *	None.
  *
  * Side effects:
- *	Stuff is drawn in a drawable.
+ *	None.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-SpanWalkProc_Draw(
-    TreeCtrl *tree,
-    TreeItem item,
-    SpanInfo *spanPtr,
-    StyleDrawArgs *drawArgs,
-    ClientData clientData
+void
+TreeItem_UpdateDepth(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item		/* Item token. */
     )
 {
-    TreeColumn treeColumn = spanPtr->treeColumn;
-    TreeItemColumn itemColumn = spanPtr->itemColumn;
-#if COLUMNGRID == 1
-    TreeColor *leftColor, *rightColor;
-    int leftWidth, rightWidth;
-#endif
-    int i, x;
-    struct {
-	TreeDrawable td;
-	int minX;
-	int maxX;
-	int index;
-	int dragPosition;
-    } *data = clientData;
-
-    /* Draw nothing if the entire span is out-of-bounds. */
-    if ((drawArgs->x >= data->maxX) ||
-	    (drawArgs->x + drawArgs->width <= data->minX))
-	return 0;
-
-    drawArgs->td = data->td;
-
-    if (item->header != NULL) {
-	TreeHeaderColumn_Draw(item->header,
-	    itemColumn ? itemColumn->headerColumn : NULL,
-	    spanPtr->visIndex, drawArgs, data->dragPosition);
-
-	return drawArgs->x + drawArgs->width >= data->maxX;
-    }
-
-    /* Draw background colors. */
-    if (spanPtr->span == 1) {
-	/* Important point: use drawArgs->width since an item's width may
-	 * be totally different than tree->columnVis' width. */
-	ItemDrawBackground(tree, treeColumn, item, itemColumn,
-		drawArgs->td, drawArgs->x, drawArgs->y,
-		drawArgs->width, drawArgs->height, data->index);
-    } else {
-	x = drawArgs->x;
-	for (i = 0; i < spanPtr->span; i++) {
-	    int columnWidth = TreeColumn_UseWidth(treeColumn);
-	    if ((columnWidth > 0) && (x < data->maxX) &&
-		    (x + columnWidth > data->minX)) {
-		ItemDrawBackground(tree, treeColumn, item, itemColumn,
-			drawArgs->td, x, drawArgs->y,
-			columnWidth, drawArgs->height, data->index);
-	    }
-	    x += columnWidth;
-	    treeColumn = TreeColumn_Next(treeColumn);
-	}
-    }
-
-    if (drawArgs->style != NULL) {
-	StyleDrawArgs drawArgsCopy = *drawArgs;
-	TreeStyle_Draw(&drawArgsCopy);
-    }
-
-#if COLUMNGRID == 1
-    if (TreeColumn_GridColors(spanPtr->treeColumn, &leftColor, &rightColor,
-	    &leftWidth, &rightWidth) != 0) {
-	TreeRectangle tr, trBrush;
-
-	if (leftColor != NULL && leftWidth > 0) {
-	    TreeRect_SetXYWH(tr, drawArgs->x, drawArgs->y, leftWidth,
-		    drawArgs->height);
-	    TreeColor_GetBrushBounds(tree, leftColor, tr,
-		    tree->drawableXOrigin, tree->drawableYOrigin,
-		    spanPtr->treeColumn, item, &trBrush);
-	    TreeColor_FillRect(tree, data->td, NULL, leftColor, trBrush, tr);
-	}
-	if (rightColor != NULL && rightWidth > 0) {
-	    TreeRect_SetXYWH(tr, drawArgs->x + drawArgs->width - rightWidth,
-		    drawArgs->y, rightWidth, drawArgs->height);
-	    TreeColor_GetBrushBounds(tree, rightColor, tr,
-		    tree->drawableXOrigin, tree->drawableYOrigin,
-		    spanPtr->treeColumn, item, &trBrush);
-	    TreeColor_FillRect(tree, data->td, NULL, rightColor, trBrush, tr);
-	}
-    }
-#endif
+    TreeItem child;
 
-    if (spanPtr->treeColumn == tree->columnTree) {
-	if (tree->showLines)
-	    TreeItem_DrawLines(tree, item, drawArgs->x, drawArgs->y,
-		    drawArgs->width, drawArgs->height, data->td,
-		    drawArgs->style);
-	if (tree->showButtons)
-	    TreeItem_DrawButton(tree, item, drawArgs->x, drawArgs->y,
-		    drawArgs->width, drawArgs->height, data->td,
-		    drawArgs->style);
+    if (IS_ROOT(item))
+	return;
+    if (item->parent != NULL)
+	item->depth = item->parent->depth + 1;
+    else
+	item->depth = 0;
+    child = item->firstChild;
+    while (child != NULL) {
+	TreeItem_UpdateDepth(tree, child);
+	child = child->nextSibling;
     }
-
-    /* Stop walking if we went past the right edge of the dirty area. */
-    return drawArgs->x + drawArgs->width >= data->maxX;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * TreeItem_Draw --
+ * TreeItem_AddToParent --
  *
- *	Draws part of an Item.
+ *	Called *after* an Item is added as a child to another Item.
  *
  * Results:
  *	None.
  *
  * Side effects:
- *	Stuff is drawn in a drawable.
+ *	Display changes.
  *
  *----------------------------------------------------------------------
  */
 
 void
-TreeItem_Draw(
+TreeItem_AddToParent(
     TreeCtrl *tree,		/* Widget info. */
-    TreeItem item,		/* Item token. */
-    int lock,			/* Which columns. */
-    int x, int y,		/* Drawable coordinates of the item. */
-    int width, int height,	/* Total size of the item. */
-    TreeDrawable td,		/* Where to draw. */
-    int minX, int maxX,		/* Left/right edge that needs to be drawn. */
-    int index			/* Used to select a color from a
-				 * tree-column's -itembackground option. */
+    TreeItem item		/* Item token. */
     )
 {
-    struct {
-	TreeDrawable td;
-	int minX;
-	int maxX;
-	int index;
-	int dragPosition;
-    } clientData;
+    TreeItem last, parent = item->parent;
 
-    clientData.td = td;
-    clientData.minX = minX;
-    clientData.maxX = maxX;
-    clientData.index = index;
-    clientData.dragPosition = FALSE;
+    /* If this is the new last child, redraw the lines of the previous
+     * sibling and all of its descendants so the line from the previous
+     * sibling reaches this item */
+    if ((item->prevSibling != NULL) &&
+	    (item->nextSibling == NULL) &&
+	    tree->showLines && (tree->columnTree != NULL)) {
+	last = item->prevSibling;
+	while (last->lastChild != NULL)
+	    last = last->lastChild;
+	Tree_InvalidateItemDInfo(tree, tree->columnTree,
+		item->prevSibling, last);
+    }
 
-    TreeItem_WalkSpans(tree, item, lock,
-	    x, y, width, height,
-	    WALKSPAN_DRAG_ORDER,
-	    SpanWalkProc_Draw, (ClientData) &clientData);
+    /* Redraw the parent if the parent has "-button auto". */
+    if (IS_VISIBLE(item) && (parent->flags & ITEM_FLAG_BUTTON_AUTO) &&
+	    tree->showButtons && (tree->columnTree != NULL)) {
+	Tree_InvalidateItemDInfo(tree, tree->columnTree, parent,
+		NULL);
+    }
 
-    if (item->header != NULL) {
-	clientData.dragPosition = TRUE;
-	TreeItem_WalkSpans(tree, item, lock,
-		x, y, width, height,
-		WALKSPAN_ONLY_DRAGGED,
-		SpanWalkProc_Draw, (ClientData) &clientData);
+    /* When appending to the end of the list (the usual case when items are
+     * streamed in) only the new items need numbering. Items created by a
+     * <Populate> binding are numbered all at once when it returns. */
+    if (tree->populating) {
+	tree->updateIndex = 1;
+    } else if (Item_IsIndexTail(tree, item)) {
+	last = item->prevSibling;
+	if (last != NULL) {
+	    while (last->lastChild != NULL)
+		last = last->lastChild;
+	} else {
+	    last = parent;
+	}
+	Item_UpdateIndexTail(tree, item, last->index + 1);
+    } else {
+	tree->updateIndex = 1;
+    }
+    Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
+    Tree_VisibilityChanged(tree);
+
+    /* Tree_UpdateItemIndex() also recalcs depth, but in one of my demos
+     * I retrieve item depth during list creation. Since Tree_UpdateItemIndex()
+     * is slow I will keep depth up-to-date here. */
+    TreeItem_UpdateDepth(tree, item);
+
+    /* Item_Populate() does this when the <Populate> binding returns. */
+    if (!tree->populating) {
+	TreeColumns_InvalidateWidthOfItems(tree, NULL);
+	TreeColumns_InvalidateSpans(tree);
     }
+
+    if (tree->debug.enable && tree->debug.data)
+	Tree_Debug(tree);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * TreeItem_DrawLines --
+ * RemoveFromParentAux --
  *
- *	Draws horizontal and vertical lines indicating parent-child
- *	relationship in an item.
+ *	Recursively update Item.depth, Item.index and Item.indexVis.
  *
  * Results:
  *	None.
  *
  * Side effects:
- *	Stuff is drawn in a drawable.
+ *	Display changes.
  *
  *----------------------------------------------------------------------
  */
 
-void
-TreeItem_DrawLines(
+static void
+RemoveFromParentAux(
     TreeCtrl *tree,		/* Widget info. */
-    TreeItem item,		/* Item token. */
-    int x, int y,		/* Drawable coordinates of columnTree. */
-    int width, int height,	/* Total size of columnTree. */
-    TreeDrawable td,		/* Where to draw. */
-    TreeStyle style		/* Instance style or NULL. Used to get
-				 * optional vertical offset of the button. */
+    TreeItem item,		/* Item being removed. */
+    int *index			/* New value of Item.index. Is incremented. */
     )
 {
-    TreeItem parent, walk;
-    int buttonY = -1;
-    int indent, left, lineLeft, lineTop;
-    int hasPrev, hasNext;
-    int i, vert = 0;
-
-    indent = TreeItem_Indent(tree, tree->columnTree, item);
-
-    if (style != NULL)
-	buttonY = TreeStyle_GetButtonY(tree, style);
-
-    /* Left edge of button/line area */
-    left = x /* + tree->columnTreeLeft */ + indent - tree->useIndent;
+    TreeItem child;
 
-    /* Left edge of vertical line */
-    lineLeft = left + (tree->useIndent - tree->lineThickness) / 2;
+    /* Invalidate display info. Don't free it because we may just be
+     * moving the item to a new parent. FIXME: if it is being moved,
+     * it might not actually need to be redrawn (just copied) */
+    if (ITEM_DINFO(item) != NULL)
+	Tree_InvalidateItemDInfo(tree, NULL, item, NULL);
 
-    /* Top edge of horizontal line */
-    if (buttonY < 0)
-	lineTop = y + (height - tree->lineThickness) / 2;
+    if (item->parent != NULL)
+	item->depth = item->parent->depth + 1;
     else
-	lineTop = y + buttonY + (tree->buttonHeightMax - tree->lineThickness) / 2;
-
-    /* NOTE: The next three checks do not call TreeItem_ReallyVisible()
-     * since 'item' is ReallyVisible */
-
-    /* Check for ReallyVisible previous sibling */
-    walk = item->prevSibling;
-    while ((walk != NULL) && !IS_VISIBLE(walk))
-	walk = walk->prevSibling;
-    hasPrev = (walk != NULL);
-
-    /* Check for ReallyVisible parent */
-    if ((item->parent != NULL) && (!IS_ROOT(item->parent) || tree->showRoot))
-	hasPrev = TRUE;
-
-    /* Check for ReallyVisible next sibling */
-    walk = item->nextSibling;
-    while ((walk != NULL) && !IS_VISIBLE(walk))
-	walk = walk->nextSibling;
-    hasNext = (walk != NULL);
-
-    /* Option: Don't connect children of root item */
-    if ((item->parent != NULL) && IS_ROOT(item->parent) && !tree->showRootLines)
-	hasPrev = hasNext = FALSE;
-
-    /* Vertical line to parent and/or previous/next sibling */
-    if (hasPrev || hasNext) {
-	int top = y, bottom = y + height;
-
-	if (!hasPrev)
-	    top = lineTop;
-	if (!hasNext)
-	    bottom = lineTop + tree->lineThickness;
-
-	if (tree->lineStyle == LINE_STYLE_DOT) {
-	    for (i = 0; i < tree->lineThickness; i++) {
-		Tree_VDotLine(tree, td.drawable,
-			lineLeft + i,
-			top,
-			bottom);
-	    }
-	} else {
-	    XFillRectangle(tree->display, td.drawable, tree->lineGC[0],
-		    lineLeft,
-		    top,
-		    tree->lineThickness,
-		    bottom - top);
-	}
-
-	/* Don't overlap horizontal line */
-	vert = tree->lineThickness;
-    }
-
-    /* Horizontal line to self */
-    if (hasPrev || hasNext) {
-	if (tree->lineStyle == LINE_STYLE_DOT) {
-	    for (i = 0; i < tree->lineThickness; i++) {
-		Tree_HDotLine(tree, td.drawable,
-			lineLeft + vert,
-			lineTop + i,
-			x /* + tree->columnTreeLeft */ + indent);
-	    }
-	} else {
-	    XFillRectangle(tree->display, td.drawable, tree->lineGC[0],
-		    lineLeft + vert,
-		    lineTop,
-		    left + tree->useIndent - (lineLeft + vert),
-		    tree->lineThickness);
-	}
-    }
-
-    /* Vertical lines from ancestors to their next siblings */
-    for (parent = item->parent;
-	 parent != NULL;
-	 parent = parent->parent) {
-	lineLeft -= tree->useIndent;
-
-	/* Option: Don't connect children of root item */
-	if ((parent->parent != NULL) && IS_ROOT(parent->parent) && !tree->showRootLines)
-	    continue;
-
-	/* Check for ReallyVisible next sibling */
-	item = parent->nextSibling;
-	while ((item != NULL) && !IS_VISIBLE(item))
-	    item = item->nextSibling;
-
-	if (item != NULL) {
-	    if (tree->lineStyle == LINE_STYLE_DOT) {
-		for (i = 0; i < tree->lineThickness; i++) {
-		    Tree_VDotLine(tree, td.drawable,
-			    lineLeft + i,
-			    y,
-			    y + height);
-		}
-	    } else {
-		XFillRectangle(tree->display, td.drawable, tree->lineGC[0],
-			lineLeft,
-			y,
-			tree->lineThickness,
-			height);
-	    }
-	}
+	item->depth = 0;
+    item->index = (*index)++;
+    item->indexVis = -1;
+    child = item->firstChild;
+    while (child != NULL) {
+	RemoveFromParentAux(tree, child, index);
+	child = child->nextSibling;
     }
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * TreeItem_DrawButton --
+ * TreeItem_RemoveFromParent --
  *
- *	Draws the button (if any) in an item.
+ *	Remove an Item from its parent (if any).
  *
  * Results:
  *	None.
  *
  * Side effects:
- *	Stuff is drawn in a drawable.
+ *	Display changes.
  *
  *----------------------------------------------------------------------
  */
 
 void
-TreeItem_DrawButton(
+TreeItem_RemoveFromParent(
     TreeCtrl *tree,		/* Widget info. */
-    TreeItem item,		/* Item token. */
-    int x, int y,		/* Drawable coordinates of columnTree. */
-    int width, int height,	/* Total size of columnTree. */
-    TreeDrawable td,		/* Where to draw. */
-    TreeStyle style		/* Instance style or NULL. Used to get
-				 * optional vertical offset of the button. */
+    TreeItem item		/* Item token. */
     )
 {
-    int indent, left, lineLeft, lineTop;
-    int buttonLeft, buttonTop, buttonY = -1, w1;
-    Tk_Image image;
-    Pixmap bitmap;
+    TreeItem parent = item->parent;
+    TreeItem last;
+    int index = 0;
 
-    if (!TreeItem_HasButton(tree, item))
+    if (parent == NULL)
 	return;
 
-    indent = TreeItem_Indent(tree, tree->columnTree, item);
+#ifdef SELECTION_VISIBLE
+    /* The item may be going somewhere it isn't ReallyVisible(). */
+    Tree_SubtreeHidden(tree, item);
+#endif
 
-    if (style != NULL)
-	buttonY = TreeStyle_GetButtonY(tree, style);
+    /* If this is the last child, redraw the lines of the previous
+     * sibling and all of its descendants because the line from
+     * the previous sibling to us is now gone */
+    if ((item->prevSibling != NULL) &&
+	    (item->nextSibling == NULL) &&
+	    tree->showLines && (tree->columnTree != NULL)) {
+	last = item->prevSibling;
+	while (last->lastChild != NULL)
+	    last = last->lastChild;
+	Tree_InvalidateItemDInfo(tree, tree->columnTree,
+		item->prevSibling, last);
+    }
 
-    /* Left edge of button/line area */
-    left = x /* + tree->columnTreeLeft */ + indent - tree->useIndent;
+    /* Redraw the parent if the parent has "-button auto". */
+    if (IS_VISIBLE(item) && (parent->flags & ITEM_FLAG_BUTTON_AUTO) &&
+	    tree->showButtons && (tree->columnTree != NULL)) {
+	Tree_InvalidateItemDInfo(tree, tree->columnTree, parent,
+		NULL);
+    }
 
-    image = PerStateImage_ForState(tree, &tree->buttonImage, item->state, NULL);
-    if (image != NULL) {
-	int imgW, imgH;
-	Tk_SizeOfImage(image, &imgW, &imgH);
-	if (buttonY < 0)
-	    buttonY = (height - imgH) / 2;
-	Tree_RedrawImage(image, 0, 0, imgW, imgH, td,
-	    left + (tree->useIndent - imgW) / 2,
-	    y + buttonY);
-	return;
-    }
-
-    bitmap = PerStateBitmap_ForState(tree, &tree->buttonBitmap, item->state, NULL);
-    if (bitmap != None) {
-	int bmpW, bmpH;
-	int bx, by;
-	Tk_SizeOfBitmap(tree->display, bitmap, &bmpW, &bmpH);
-	if (buttonY < 0)
-	    buttonY = (height - bmpH) / 2;
-	bx = left + (tree->useIndent - bmpW) / 2;
-	by = y + buttonY;
-	Tree_DrawBitmap(tree, bitmap, td.drawable, NULL, NULL,
-		0, 0, (unsigned int) bmpW, (unsigned int) bmpH,
-		bx, by);
-	return;
-    }
-
-    if (tree->useTheme) {
-	int bw, bh;
-	int buttonState = item->state;
-
-	/* FIXME: These may overwrite [state define] states */
-	buttonState &= ~ITEM_FLAGS_BUTTONSTATE;
-	if (item->flags & ITEM_FLAG_BUTTONSTATE_ACTIVE)
-	    buttonState |= BUTTON_STATE_ACTIVE;
-	if (item->flags & ITEM_FLAG_BUTTONSTATE_PRESSED)
-	    buttonState |= BUTTON_STATE_PRESSED;
-
-	if (TreeTheme_GetButtonSize(tree, td.drawable,
-		(buttonState & STATE_ITEM_OPEN) != 0, &bw, &bh) == TCL_OK) {
-	    if (buttonY < 0)
-		buttonY = (height - bh) / 2;
-	    if (TreeTheme_DrawButton(tree, td, item, buttonState,
-		    left + (tree->useIndent - bw) / 2, y + buttonY,
-		    bw, bh) == TCL_OK) {
-		return;
-	    }
+    /*
+     * If the item is at the end of the list, no other item is renumbered
+     * when it goes away. Otherwise set a flag indicating that item indexes
+     * are out-of-date. This doesn't cover the current item being removed.
+     */
+    if (Item_IsIndexTail(tree, item)) {
+	int visCount = 0, wrapCount = 0, maxDepth = -1;
+
+	Item_CountVisible(item, &visCount, &wrapCount, &maxDepth);
+	/* TreeCtrl.depth doesn't change if something else is at least
+	 * as deep, such as a sibling of a leaf item. */
+	if ((maxDepth < tree->depth) ||
+		((maxDepth == item->depth) && (parent->numChildren > 1))) {
+	    tree->itemVisCount -= visCount;
+	    tree->itemWrapCount -= wrapCount;
+	} else {
+	    tree->updateIndex = 1;
 	}
+    } else {
+	tree->updateIndex = 1;
     }
+    Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
+    Tree_VisibilityChanged(tree);
 
-    w1 = tree->buttonThickness / 2;
-
-    /* Left edge of vertical line */
-    /* Make sure this matches TreeItem_DrawLines() */
-    lineLeft = left + (tree->useIndent - tree->buttonThickness) / 2;
-
-    /* Top edge of horizontal line */
-    /* Make sure this matches TreeItem_DrawLines() */
-    if (buttonY < 0)
-	lineTop = y + (height - tree->lineThickness) / 2;
-    else
-	lineTop = y + buttonY + (tree->buttonHeightMax - tree->lineThickness) / 2;
-
-    buttonLeft = left + (tree->useIndent - tree->buttonSize) / 2;
-    if (buttonY < 0)
-	buttonTop = y + (height - tree->buttonSize) / 2;
-    else
-	buttonTop = y + buttonY + (tree->buttonHeightMax - tree->buttonSize) / 2;
-
-    /* Erase button background */
-    XFillRectangle(tree->display, td.drawable,
-	    Tk_3DBorderGC(tree->tkwin, tree->border, TK_3D_FLAT_GC),
-	    buttonLeft + tree->buttonThickness,
-	    buttonTop + tree->buttonThickness,
-	    tree->buttonSize - tree->buttonThickness,
-	    tree->buttonSize - tree->buttonThickness);
-
-    /* Draw button outline */
-    XDrawRectangle(tree->display, td.drawable, tree->buttonGC,
-	    buttonLeft + w1,
-	    buttonTop + w1,
-	    tree->buttonSize - tree->buttonThickness,
-	    tree->buttonSize - tree->buttonThickness);
-
-    /* Horizontal '-' */
-    XFillRectangle(tree->display, td.drawable, tree->buttonGC,
-	    buttonLeft + tree->buttonThickness * 2,
-	    lineTop,
-	    tree->buttonSize - tree->buttonThickness * 4,
-	    tree->buttonThickness);
-
-    if (!(item->state & STATE_ITEM_OPEN)) {
-	/* Finish '+' */
-	XFillRectangle(tree->display, td.drawable, tree->buttonGC,
-		lineLeft,
-		buttonTop + tree->buttonThickness * 2,
-		tree->buttonThickness,
-		tree->buttonSize - tree->buttonThickness * 4);
+    if (item->prevSibling)
+	item->prevSibling->nextSibling = item->nextSibling;
+    if (item->nextSibling)
+	item->nextSibling->prevSibling = item->prevSibling;
+    if (parent->firstChild == item) {
+	parent->firstChild = item->nextSibling;
+	if (!parent->firstChild)
+	    parent->lastChild = NULL;
     }
+    if (parent->lastChild == item)
+	parent->lastChild = item->prevSibling;
+    item->prevSibling = item->nextSibling = NULL;
+    item->parent = NULL;
+    parent->numChildren--;
+
+    /*
+     * Update Item.depth, Item.index and Item.indexVis for the item and its
+     * descendants. An up-to-date Item.index is needed for some operations that
+     * use a range of items, such as [item delete]. Items being deleted are
+     * never looked at again.
+     */
+    if (!IS_DELETED(item))
+	RemoveFromParentAux(tree, item, &index);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * SpanWalkProc_UpdateWindowPositions --
+ * TreeItem_RemoveColumns --
  *
- *	Callback routine to TreeItem_WalkSpans for
- *	TreeItem_UpdateWindowPositions.
+ *	Free a range of Columns in an Item.
  *
  * Results:
  *	None.
  *
  * Side effects:
- *	Windows in window elements may be resized/repositioned.
+ *	Memory is deallocated.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-SpanWalkProc_UpdateWindowPositions(
-    TreeCtrl *tree,
-    TreeItem item,
-    SpanInfo *spanPtr,
-    StyleDrawArgs *drawArgs,
-    ClientData clientData
+void
+TreeItem_RemoveColumns(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item,		/* Item token. */
+    int first,			/* 0-based column index at start of
+				 * the range. Must be <= last */
+    int last			/* 0-based column index at end of
+				 * the range. Must be >= first */
     )
 {
-    StyleDrawArgs drawArgsCopy;
-    int requests;
-
-    if ((drawArgs->x >= TreeRect_Right(drawArgs->bounds)) ||
-	    (drawArgs->x + drawArgs->width <= TreeRect_Left(drawArgs->bounds)) ||
-	    (drawArgs->style == NULL))
-	return 0;
-
-    TreeDisplay_GetReadyForTrouble(tree, &requests);
-
-    drawArgsCopy = *drawArgs;
-    TreeStyle_UpdateWindowPositions(&drawArgsCopy);
-
-    if (TreeDisplay_WasThereTrouble(tree, requests))
-	return 1;
+    int i, count = item->columnCount;
 
-    /* Stop walking if we went past the right edge of the display area. */
-    return drawArgs->x + drawArgs->width >= TreeRect_Right(drawArgs->bounds);
+    if (first >= count)
+	return;
+    if (last >= count)
+	last = count - 1;
+    for (i = first; i <= last; i++)
+	Column_FreeResources(tree, &item->columns[i]);
+    if (last + 1 < count) {
+	memmove(&item->columns[first], &item->columns[last + 1],
+		sizeof(TreeItemColumn_) * (count - last - 1));
+    }
+    Item_ResizeColumns(tree, item, count - (last - first + 1));
+    TreeItem_FindTextChanged(tree, item);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * TreeItem_UpdateWindowPositions --
+ * TreeItem_RemoveAllColumns --
  *
- *	Updates the geometry of any on-screen window elements. Called
- *	by the display code when an item was possibly scrolled.
+ *	Free all the Columns in an Item.
  *
  * Results:
  *	None.
  *
  * Side effects:
- *	Windows in window elements may be resized/repositioned.
+ *	Memory is deallocated.
  *
  *----------------------------------------------------------------------
  */
 
 void
-TreeItem_UpdateWindowPositions(
+TreeItem_RemoveAllColumns(
     TreeCtrl *tree,		/* Widget info. */
-    TreeItem item,		/* Item token. */
-    int lock,			/* Columns we care about. */
-    int x, int y,		/* Window coordinates of the item. */
-    int width, int height	/* Total size of the item. */
+    TreeItem item		/* Item token. */
     )
 {
-    TreeItem_WalkSpans(tree, item, lock,
-	    x, y, width, height,
-	    WALKSPAN_DRAG_ORDER | WALKSPAN_IGNORE_DRAGGED,
-	    SpanWalkProc_UpdateWindowPositions, (ClientData) NULL);
+    int count = item->columnCount;
 
-    if (item->header != NULL) {
-	TreeItem_WalkSpans(tree, item, lock,
-		x, y, width, height,
-		WALKSPAN_ONLY_DRAGGED,
-		SpanWalkProc_UpdateWindowPositions, (ClientData) NULL);
+    if (count == 0)
+	return;
+
+    /* Don't delete the tail item-column in header items. */
+    if (ITEM_HEADER(item) != NULL) {
+	TreeItem_RemoveColumns(tree, item, 0, count - 2);
+	return;
     }
+    TreeItem_RemoveColumns(tree, item, 0, count - 1);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * SpanWalkProc_GetOnScreenColumns --
+ * Item_CreateColumn --
  *
- *	Callback routine to TreeItem_WalkSpans for
- *	TreeItem_GetOnScreenColumns.
+ *	Allocate a Column record for an Item if it doesn't already
+ *	exist.
  *
  * Results:
- *	None.
+ *	Pointer to new or existing Column record.
  *
  * Side effects:
- *	None.
+ *	Any column records preceding the desired one are allocated
+ *	if they weren't already. Memory is allocated and existing
+ *	Column tokens for the item may become invalid.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-SpanWalkProc_GetOnScreenColumns(
-    TreeCtrl *tree,
-    TreeItem item,
-    SpanInfo *spanPtr,
-    StyleDrawArgs *drawArgs,
-    ClientData clientData
+static TreeItemColumn
+Item_CreateColumn(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item,		/* Item to contain the column. */
+    int columnIndex,		/* 0-based index of new column. */
+    int *isNew			/* May be NULL. Set to TRUE if the
+				 * column record was created. */
     )
 {
-    TreeColumnList *columns = clientData;
+    int count;
 
-    if ((drawArgs->x >= TreeRect_Right(drawArgs->bounds)) ||
-	    (drawArgs->x + drawArgs->width <= TreeRect_Left(drawArgs->bounds)))
-	return 0;
+#ifdef TREECTRL_DEBUG
+    if (columnIndex < 0 || columnIndex >= tree->columnCount + (ITEM_HEADER(item) ? 1 : 0)) {
+	panic("Item_CreateColumn with index %d, must be from 0-%d", columnIndex, tree->columnCount + (ITEM_HEADER(item) ? 1 : 0) - 1);
+    }
+#endif
 
-    TreeColumnList_Append(columns, drawArgs->column);
+    if (isNew != NULL) (*isNew) = FALSE;
+    if (columnIndex >= item->columnCount) {
+	/* Size the array for every column in one go so filling in an item
+	 * column-by-column doesn't reallocate it each time. Header-items
+	 * are sized exactly since each header-column is a real column. */
+	count = columnIndex + 1;
+	if (ITEM_HEADER(item) == NULL)
+	    count = MAX(count, tree->columnCount);
+	Item_ResizeColumns(tree, item, count);
+	if (isNew != NULL) (*isNew) = TRUE;
+    }
 
-    /* Stop walking if we went past the right edge of the display area. */
-    return drawArgs->x + drawArgs->width >= TreeRect_Right(drawArgs->bounds);
+/* If creating a new -lock=none column then Column_Move does nothing */
+if (ITEM_HEADER(item) != NULL && columnIndex == TreeColumn_Index(tree->columnTail) + 1) {
+    TreeItem_MoveColumn(tree, item, columnIndex, columnIndex - 1);
+    return &item->columns[columnIndex - 1];
+}
+
+    return &item->columns[columnIndex];
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * TreeItem_GetOnScreenColumns --
+ * TreeItem_MoveColumn --
  *
- *	Get a list of onscreen columns for an item.
+ *	Rearranges an Item's array of Column records by moving one
+ *	in front of another.
  *
  * Results:
- *	None.
+ *	If the Column to be moved does not exist and the Column to place it
+ *	in front of does not exist, then nothing happens. If the Column is
+ *	to be moved past all currently allocated Columns, then new
+ *	Column records are allocated.
  *
  * Side effects:
- *	None.
+ *	Memory may be allocated.
  *
  *----------------------------------------------------------------------
  */
 
 void
-TreeItem_GetOnScreenColumns(
+TreeItem_MoveColumn(
     TreeCtrl *tree,		/* Widget info. */
     TreeItem item,		/* Item token. */
-    int lock,			/* Which columns. */
-    int x, int y,		/* Drawable coordinates of the item. */
-    int width, int height,	/* Total size of the item. */
-    TreeColumnList *columns	/* Out: list of onscreen columns. */
+    int columnIndex,		/* 0-based index of the column to move. */
+    int beforeIndex		/* 0-based index of the second column to move
+				 * the first column to the left of. */
     )
 {
-    TreeItem_WalkSpans(tree, item, lock,
-	x, y, width, height,
-	WALKSPAN_DRAG_ORDER | WALKSPAN_IGNORE_DRAGGED,
-	SpanWalkProc_GetOnScreenColumns, (ClientData) columns);
+    TreeItemColumn_ move;
+    TreeItemColumn columns;
+    int count = item->columnCount, first, num;
 
-    if (item->header != NULL) {
-	TreeItem_WalkSpans(tree, item, lock,
-	    x, y, width, height,
-	    WALKSPAN_ONLY_DRAGGED,
-	    SpanWalkProc_GetOnScreenColumns, (ClientData) columns);
-    }
-}
+    if (columnIndex >= count && beforeIndex >= count)
+	return;
+    if (columnIndex == beforeIndex)
+	return;
+
+    if (columnIndex >= count) {
+	/* Insert a new Column in front of the other. */
+	Item_ResizeColumns(tree, item, count + 1);
+	columnIndex = count;
+    } else if (beforeIndex > count) {
+	Item_ResizeColumns(tree, item, beforeIndex);
+    }
+
+    columns = item->columns;
+    move = columns[columnIndex];
+    if (columnIndex < beforeIndex) {
+	first = columnIndex;
+	num = beforeIndex - columnIndex;
+	memmove(&columns[columnIndex], &columns[columnIndex + 1],
+		sizeof(TreeItemColumn_) * (num - 1));
+	columns[beforeIndex - 1] = move;
+    } else {
+	first = beforeIndex;
+	num = columnIndex - beforeIndex + 1;
+	memmove(&columns[beforeIndex + 1], &columns[beforeIndex],
+		sizeof(TreeItemColumn_) * (num - 1));
+	columns[beforeIndex] = move;
+    }
+    Item_FixHeaderColumns(tree, item, first, num);
+}
 
 /*
  *----------------------------------------------------------------------
  *
- * TreeItem_OnScreen --
+ * TreeItem_FreeResources --
  *
- *	Called by the display code when the item becomes visible
- *	(i.e., actually displayed) or hidden.
+ *	Free memory etc assocated with an Item.
  *
  * Results:
  *	None.
  *
  * Side effects:
- *	Windows in window elements may be mapped/unmapped.
+ *	Memory is deallocated. Display changes.
  *
  *----------------------------------------------------------------------
  */
 
 void
-TreeItem_OnScreen(
+TreeItem_FreeResources(
     TreeCtrl *tree,		/* Widget info. */
-    TreeItem item,		/* Item token. */
-    int onScreen		/* TRUE if item is displayed. */
+    TreeItem item		/* Item token. */
     )
 {
-#if 0
-    TreeItemColumn column = item->columns;
+    TreeItem_RemoveColumns(tree, item, 0, item->columnCount - 1);
+    if (ITEM_DINFO(item) != NULL)
+	Tree_FreeItemDInfo(tree, item, NULL);
+    if (item->rInfo != NULL)
+	Tree_FreeItemRInfo(tree, item);
+    if (item->extra != NULL && item->extra->spans != NULL) {
+	ckfree((char *) item->extra->spans);
+	item->extra->spans = NULL;
+    }
+    if (ITEM_HEADER(item) != NULL)
+	TreeHeader_FreeResources(ITEM_HEADER(item));
+    if (ITEM_SORTSPEC(item) != NULL) {
+	ItemSortSpec *spec = ITEM_SORTSPEC(item);
 
-    while (column != NULL) {
-	if (column->style != NULL) {
-	    TreeStyle_OnScreen(tree, column->style, onScreen);
-	}
-	column = column->next;
+	Tcl_DecrRefCount(spec->specObj);
+	if (spec->children != NULL)
+	    ckfree((char *) spec->children);
+	ckfree((char *) spec);
+	item->extra->sortSpec = NULL;
     }
-#endif
+    Tk_FreeConfigOptions((char *) item, tree->itemOptionTable, tree->tkwin);
+
+    /* Add the item record to the "preserved" list. It will be freed later. */
+    TreeItemList_Append(&tree->preserveItemList, item);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * TreeItem_ReallyVisible --
+ * TreeItem_Release --
  *
- *	Return whether the given Item could be displayed.
+ *	Finally free an item record when it is no longer needed.
  *
  * Results:
- *	TRUE if the item's -visible is TRUE, all of its ancestors'
- *	-visible options are TRUE, and all of its ancestors are open.
+ *	None.
  *
  * Side effects:
- *	None.
+ *	Memory is deallocated.
  *
  *----------------------------------------------------------------------
  */
 
-int
-TreeItem_ReallyVisible(
+void
+TreeItem_Release(
     TreeCtrl *tree,		/* Widget info. */
     TreeItem item		/* Item token. */
     )
 {
-    TreeItem parent = item->parent;
-
-    if (item->header != NULL) {
-	if (!tree->showHeader || !IS_VISIBLE(item))
-	    return 0;
-
-	/* For compatibility, if there are no visible columns then don't
-	 * display the lone tail column. */
-	(void) TreeColumns_UpdateCounts(tree);
-	if (tree->columnCountVis +
-		tree->columnCountVisLeft +
-		tree->columnCountVisRight == 0)
-	    return 0;
-
-	return 1;
-    }
-
-    if (!tree->updateIndex)
-	return item->indexVis != -1;
-
-    if (!IS_VISIBLE(item))
-	return 0;
-    if (parent == NULL)
-	return IS_ROOT(item) ? tree->showRoot : 0;
-    if (IS_ROOT(parent)) {
-	if (!IS_VISIBLE(parent))
-	    return 0;
-	if (!tree->showRoot)
-	    return 1;
-	if (!(parent->state & STATE_ITEM_OPEN))
-	    return 0;
+    if (item->extra != NULL) {
+#ifdef ALLOC_HAX
+	TreeAlloc_Free(tree->allocData, ItemExtraUid, (char *) item->extra,
+		sizeof(ItemExtra));
+#else
+	WFREE(item->extra, ItemExtra);
+#endif
     }
-    if (!IS_VISIBLE(parent) || !(parent->state & STATE_ITEM_OPEN))
-	return 0;
-    return TreeItem_ReallyVisible(tree, parent);
+#ifdef ALLOC_HAX
+    TreeAlloc_Free(tree->allocData, ItemUid, (char *) item, sizeof(TreeItem_));
+#else
+    WFREE(item, TreeItem_);
+#endif
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * TreeItem_RootAncestor --
+ * Item_HeightOfStyles --
  *
- *	Return the toplevel ancestor of an Item.
+ *	Return the height used by styles in an Item.
  *
  * Results:
- *	Returns the root, or an orphan ancestor, or the given Item.
+ *	Maximum height in pixels of the style in each visible Column.
  *
  * Side effects:
  *	None.
@@ -5316,26 +5254,119 @@ TreeItem_ReallyVisible(
  *----------------------------------------------------------------------
  */
 
-TreeItem
-TreeItem_RootAncestor(
+static int
+Item_HeightOfStyles(
     TreeCtrl *tree,		/* Widget info. */
-    TreeItem item		/* Item token. */
+    TreeItem item		/* Item record. */
     )
 {
-    while (item->parent != NULL)
-	item = item->parent;
-    return item;
+    TreeItemColumn column = item->columns;
+    int *spans = TreeItem_GetSpans(tree, item);
+    int tailOK = ITEM_HEADER(item) != NULL;
+    TreeColumn treeColumn = Tree_FirstColumn(tree, -1, tailOK);
+    StyleDrawArgs drawArgs;
+    int height = 0, hasHeaderElem = FALSE;
+
+    drawArgs.tree = tree;
+
+    if (spans == NULL) {
+	while (column != NULL) {
+	    if (TreeColumn_Visible(treeColumn) && (column->style != NULL)) {
+		drawArgs.state = item->state | column->cstate;
+		drawArgs.style = column->style;
+		drawArgs.indent = TreeItem_Indent(tree, treeColumn, item);
+		if (treeColumn == tree->columnTail) {
+		    drawArgs.width = -1; /* as much width as the style needs */
+		} else {
+		    drawArgs.width = TreeColumn_UseWidth(treeColumn);
+		    if (ITEM_HEADER(item) != NULL)
+			drawArgs.width += drawArgs.indent;
+		}
+		height = MAX(height, TreeStyle_UseHeight(&drawArgs));
+		if (!hasHeaderElem && (ITEM_HEADER(item) != NULL) &&
+			TreeStyle_HasHeaderElement(tree, column->style))
+		    hasHeaderElem = TRUE;
+	    }
+	    treeColumn = Tree_ColumnToTheRight(treeColumn, FALSE, tailOK);
+	    column = ITEM_COLUMN_NEXT(item, column);
+	}
+    } else {
+	while (column != NULL) {
+	    if (TreeColumn_Visible(treeColumn)) {
+		int columnIndex = TreeColumn_Index(treeColumn);
+		int columnIndex2 = columnIndex;
+		TreeColumn treeColumn2 = treeColumn;
+		drawArgs.width = 0;
+#if defined(TREECTRL_DEBUG)
+		if (TreeColumn_Index(treeColumn) != columnIndex) BreakIntoDebugger();
+		if (TreeItemColumn_Index(tree, item, column) != columnIndex) BreakIntoDebugger();
+		if (spans[columnIndex] != columnIndex) BreakIntoDebugger();
+#endif
+		while (spans[columnIndex2] == columnIndex) {
+		    if (!TreeColumn_Visible(treeColumn2)) {
+			/* nothing */
+		    } else if (treeColumn2 == tree->columnTail) {
+			drawArgs.width = -1; /* as much width as the style needs */
+		    } else {
+			drawArgs.width += TreeColumn_UseWidth(treeColumn2);
+		    }
+		    treeColumn2 = Tree_ColumnToTheRight(treeColumn2, FALSE, tailOK);
+		    if (treeColumn2 == NULL)
+			break;
+		    columnIndex2++;
+		}
+		if (column->style != NULL) {
+		    drawArgs.indent = TreeItem_Indent(tree, treeColumn, item);
+		    if (ITEM_HEADER(item) != NULL)
+			drawArgs.width += drawArgs.indent;
+		    drawArgs.state = item->state | column->cstate;
+		    drawArgs.style = column->style;
+		    height = MAX(height, TreeStyle_UseHeight(&drawArgs));
+		    if (!hasHeaderElem && (ITEM_HEADER(item) != NULL) &&
+			    TreeStyle_HasHeaderElement(tree, column->style))
+			hasHeaderElem = TRUE;
+		}
+		treeColumn = treeColumn2;
+		if (treeColumn == NULL)
+		    break;
+		while ((column != NULL) && (columnIndex < columnIndex2)) {
+		    column = ITEM_COLUMN_NEXT(item, column);
+		    columnIndex++;
+		}
+		continue;
+	    }
+	    treeColumn = Tree_ColumnToTheRight(treeColumn, FALSE, tailOK);
+	    column = ITEM_COLUMN_NEXT(item, column);
+	}
+    }
+
+    /* List headers are a fixed height on Aqua. */
+    /* FIXME: all that work above just to ignore the result here! */
+    if (hasHeaderElem && tree->useTheme) {
+	if (tree->themeHeaderHeight > 0)
+	    return tree->themeHeaderHeight;
+    }
+
+    return height;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * TreeItem_IsAncestor --
+ * TreeItem_Height --
  *
- *	Determine if one Item is the ancestor of another.
+ *	Return the height of an Item.
  *
  * Results:
- *	TRUE if item1 is an ancestor of item2.
+ *	If the Item -height option is > 0, the result is the maximum
+ *	of the button height (if a button is displayed) and the -height
+ *	option.
+ *	If the TreeCtrl -itemheight option is > 0, the result is the maximum
+ *	of the button height (if a button is displayed) and the -itemheight
+ *	option.
+ *	Otherwise the result is the maximum of the button height (if a button
+ *	is displayed) AND the TreeCtrl -minitemheight AND the height of
+ *	the style in each visible Column.
  *
  * Side effects:
  *	None.
@@ -5344,205 +5375,153 @@ TreeItem_RootAncestor(
  */
 
 int
-TreeItem_IsAncestor(
+TreeItem_Height(
     TreeCtrl *tree,		/* Widget info. */
-    TreeItem item1,		/* Possible ancestor. */
-    TreeItem item2		/* Item to check ancestry of. */
+    TreeItem item		/* Item token. */
     )
 {
-    if (item1 == item2)
+    int buttonHeight = 0;
+    int useHeight;
+
+    if (!TreeItem_ReallyVisible(tree, item))
 	return 0;
-    while (item2 && item2 != item1)
-	item2 = item2->parent;
-    return item2 != NULL;
+
+    if (ITEM_HEADER(item) != NULL) {
+	if (item->fixedHeight > 0)
+	    return item->fixedHeight;
+	return Item_HeightOfStyles(tree, item);
+    }
+
+    /* Can't have less height than our button */
+    if (TreeItem_HasButton(tree, item)) {
+	buttonHeight = Tree_ButtonHeight(tree, item->state);
+    }
+
+    /* User specified a fixed height for this item */
+    if (item->fixedHeight > 0)
+	return MAX(item->fixedHeight, buttonHeight);
+
+    /* Fixed height of all items */
+    if (tree->itemHeight > 0)
+	return MAX(tree->itemHeight, buttonHeight);
+
+    /* Get requested height of the style in each column */
+    useHeight = Item_HeightOfStyles(tree, item);
+
+    /* Minimum height of all items */
+    if (tree->minItemHeight > 0)
+	useHeight = MAX(useHeight, tree->minItemHeight);
+
+    /* No fixed height specified */
+    return MAX(useHeight, buttonHeight);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * TreeItem_ToObj --
+ * TreeItem_InvalidateHeight --
  *
- *	Convert an Item to a Tcl_Obj.
+ *	Marks Item.neededHeight out-of-date.
+ *	NOTE: Item.neededHeight is unused.
  *
  * Results:
- *	A new Tcl_Obj representing the Item.
+ *	None.
  *
  * Side effects:
- *	Memory is allocated.
+ *	None.
  *
  *----------------------------------------------------------------------
  */
 
-Tcl_Obj *
-TreeItem_ToObj(
+void
+TreeItem_InvalidateHeight(
     TreeCtrl *tree,		/* Widget info. */
     TreeItem item		/* Item token. */
     )
 {
-    if (tree->itemPrefixLen) {
-	char buf[100 + TCL_INTEGER_SPACE];
-	(void) sprintf(buf, "%s%d", tree->itemPrefix, item->id);
-	return Tcl_NewStringObj(buf, -1);
-    }
-    return Tcl_NewIntObj(item->id);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * Item_Configure --
+ * TreeItem_FindColumn --
  *
- *	This procedure is called to process an objc/objv list, plus
- *	the Tk option database, in order to configure (or reconfigure)
- *	an Item.
+ *	Return an item-column token given a zero-based index.
  *
  * Results:
- *	The return value is a standard Tcl result.  If TCL_ERROR is
- *	returned, then the interp's result contains an error message.
+ *	The item-column token or NULL.
  *
  * Side effects:
- *	Configuration information gets set for item;  old resources get
- *	freed, if there were any.
+ *	None.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-Item_Configure(
+TreeItemColumn
+TreeItem_FindColumn(
     TreeCtrl *tree,		/* Widget info. */
-    TreeItem item,		/* Item to configure. */
-    int objc,			/* Number of arguments */
-    Tcl_Obj *CONST objv[]	/* Array of arguments */
+    TreeItem item,		/* Item token. */
+    int columnIndex		/* 0-based index of column to find. */
     )
 {
-    Tk_SavedOptions savedOptions;
-    int error;
-    Tcl_Obj *errorResult = NULL;
-    int mask;
-    int lastVisible = IS_VISIBLE(item);
-    int lastWrap = IS_WRAP(item);
-
-    for (error = 0; error <= 1; error++) {
-	if (error == 0) {
-	    if (Tree_SetOptions(tree, STATE_DOMAIN_ITEM, item, tree->itemOptionTable,
-			objc, objv, &savedOptions, &mask) != TCL_OK) {
-		mask = 0;
-		continue;
-	    }
-
-	    /* xxx */
-
-	    Tk_FreeSavedOptions(&savedOptions);
-	    break;
-	} else {
-	    errorResult = Tcl_GetObjResult(tree->interp);
-	    Tcl_IncrRefCount(errorResult);
-	    Tk_RestoreSavedOptions(&savedOptions);
-
-	    /* xxx */
-
-	    Tcl_SetObjResult(tree->interp, errorResult);
-	    Tcl_DecrRefCount(errorResult);
-	    return TCL_ERROR;
-	}
-    }
-
-    if (mask & ITEM_CONF_SIZE) {
-	Tree_FreeItemDInfo(tree, item, NULL);
-	Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
-    }
-
-    if (mask & ITEM_CONF_BUTTON) {
-	if (tree->columnTree != NULL)
-	    Tree_InvalidateItemDInfo(tree, tree->columnTree, item, NULL);
-    }
-
-    if ((mask & ITEM_CONF_VISIBLE) && (IS_VISIBLE(item) != lastVisible)) {
-
-	/* Changing the visibility of an item can change the width of
-	 * any column. This is due to column expansion (a style may
-	 * be the widest in a column) or when any span > 1. */
-	TreeColumns_InvalidateWidthOfItems(tree, NULL);
-	TreeColumns_InvalidateSpans(tree);
-
-	/* If this is the last child, redraw the lines of the previous
-	 * sibling and all of its descendants because the line from
-	 * the previous sibling to us is appearing/disappearing. */
-	if ((item->prevSibling != NULL) &&
-		(item->nextSibling == NULL) &&
-		tree->showLines && (tree->columnTree != NULL)) {
-	    TreeItem last = item->prevSibling;
-	    while (last->lastChild != NULL)
-		last = last->lastChild;
-	    Tree_InvalidateItemDInfo(tree, tree->columnTree,
-		    item->prevSibling,
-		    last);
-	}
-
-	/* Redraw the parent if the parent has "-button auto". */
-	if ((item->parent != NULL) &&
-		(item->parent->flags & ITEM_FLAG_BUTTON_AUTO) &&
-		tree->showButtons && (tree->columnTree != NULL)) {
-	    Tree_InvalidateItemDInfo(tree, tree->columnTree, item->parent,
-		    NULL);
-	}
-
-	tree->updateIndex = 1;
-	Tree_DInfoChanged(tree, DINFO_REDO_RANGES | DINFO_REDO_SELECTION);
-    }
-
-    if ((mask & ITEM_CONF_WRAP) && (IS_WRAP(item) != lastWrap)) {
-	tree->updateIndex = 1;
-	TreeColumns_InvalidateWidthOfItems(tree, NULL);
-	Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
-    }
-
-    return TCL_OK;
+    if (columnIndex < 0 || columnIndex >= item->columnCount)
+	return NULL;
+    return &item->columns[columnIndex];
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * NoStyleMsg --
+ * TreeItem_ColumnFromObj --
  *
- *	Utility to set the interpreter result with a message indicating
- *	a Column has no assigned style.
+ *	Return an item-column token given a Tcl_Obj column description.
  *
  * Results:
- *	None.
+ *	TCL_OK or TCL_ERROR.
  *
  * Side effects:
- *	Interpreter result is changed.
+ *	None.
  *
  *----------------------------------------------------------------------
  */
 
-static void
-NoStyleMsg(
+int
+TreeItem_ColumnFromObj(
     TreeCtrl *tree,		/* Widget info. */
-    TreeItem item,		/* Item record. */
-    int columnIndex		/* 0-based index of the column that
-				 * has no style. */
+    TreeItem item,		/* Item token. */
+    Tcl_Obj *obj,		/* Column description. */
+    TreeItemColumn *columnPtr,	/* Returned column, or NULL. */
+    TreeColumn *treeColumnPtr,	/* May be NULL. Returned tree column,
+				 * or NULL. */
+    int *indexPtr,		/* May be NULL. Returned 0-based index of
+				 * the column. */
+    int flags			/* CFO_XXX flags. */
     )
 {
-    FormatResult(tree->interp,
-	    "%s %s%d column %s%d has no style",
-	    item->header ? "header" : "item",
-	    item->header ? "" : tree->itemPrefix, item->id,
-	    tree->columnPrefix,
-	    TreeColumn_GetID(Tree_FindColumn(tree, columnIndex)));
+    TreeColumn treeColumn;
+    int columnIndex;
+
+    if (TreeColumn_FromObj(tree, obj, &treeColumn, flags) != TCL_OK)
+	return TCL_ERROR;
+    columnIndex = TreeColumn_Index(treeColumn);
+    (*columnPtr) = TreeItem_FindColumn(tree, item, columnIndex);
+    if (treeColumnPtr != NULL)
+	(*treeColumnPtr) = treeColumn;
+    if (indexPtr != NULL)
+	(*indexPtr) = columnIndex;
+    return TCL_OK;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * StateDomainErrMsg --
+ * TreeItem_Indent --
  *
- *	Utility to set the interpreter result with a message indicating
- *	a style's state-domain isn't compatible.
+ *	Return the amount of indentation for the given item. This is
+ *	the width of the buttons/lines.
  *
  * Results:
- *	Interpreter result is changed.
+ *	Pixel value >= 0.
  *
  * Side effects:
  *	None.
@@ -5550,421 +5529,3629 @@ NoStyleMsg(
  *----------------------------------------------------------------------
  */
 
-static void
-StateDomainErrMsg(
+int
+TreeItem_Indent(
     TreeCtrl *tree,		/* Widget info. */
-    TreeItem item,		/* Item record. */
-    TreeStyle style		/* Style token. */
+    TreeColumn treeColumn,	/* Which column. */
+    TreeItem item		/* Item token. */
     )
 {
-    FormatResult(tree->interp,
-	    "state domain conflict between %s \"%s%d\" and style \"%s\"",
-	    item->header ? "header" : "item",
-	    item->header ? "" : tree->itemPrefix, item->id,
-	    TreeStyle_GetName(tree, style));
+    int depth;
+
+    if (ITEM_HEADER(item) != NULL) {
+	if ((TreeColumn_Lock(treeColumn) == COLUMN_LOCK_NONE) &&
+		(TreeColumn_VisIndex(treeColumn) == 0)) {
+	    return tree->canvasPadX[PAD_TOP_LEFT];
+	}
+	return 0;
+    }
+
+    if (treeColumn != tree->columnTree)
+	return 0;
+
+    if (IS_ROOT(item))
+	return (tree->showRoot && tree->showButtons && tree->showRootButton)
+	    ? tree->useIndent : 0;
+
+    Tree_UpdateItemIndex(tree);
+
+    depth = item->depth;
+    if (tree->showRoot)
+    {
+	depth += 1;
+	if (tree->showButtons && tree->showRootButton)
+	    depth += 1;
+    }
+    else if (tree->showButtons && tree->showRootChildButtons)
+	depth += 1;
+    else if (tree->showLines && tree->showRootLines)
+	depth += 1;
+
+    return tree->useIndent * depth;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * TreeItemCmd_Bbox --
+ * ItemDrawBackground --
  *
- *	This procedure is invoked to process the [item bbox] widget
- *	command.  See the user documentation for details on what
- *	it does.
+ *	Draws part of the background area of an Item. The area is
+ *	erased to the -itembackground color of the tree column or the
+ *	TreeCtrl -background color. If the TreeCtrl -backgroundimage
+ *	option is specified then that image is tiled over the given area.
  *
  * Results:
- *	A standard Tcl result.
+ *	None.
  *
  * Side effects:
- *	See the user documentation.
+ *	Stuff is drawn in a drawable.
  *
  *----------------------------------------------------------------------
  */
 
-int
-TreeItemCmd_Bbox(
+static void
+ItemDrawBackground(
     TreeCtrl *tree,		/* Widget info. */
-    int objc,			/* Number of arguments. */
-    Tcl_Obj *CONST objv[],	/* Argument values. */
-    int doHeaders		/* TRUE to operate on headers, FALSE
-				 * to operate on items. */
+    TreeColumn treeColumn,	/* Tree-column token. */
+    TreeItem item,		/* Item record. */
+    TreeItemColumn column,	/* First column. */
+    TreeDrawable td,		/* Where to draw. */
+    int x, int y,		/* Area of the item to draw. */
+    int width, int height,	/* ^ */
+    int index			/* Used to select a color from the
+				 * tree-column's -itembackground option. */
     )
 {
-    Tcl_Interp *interp = tree->interp;
-    TreeItem item;
-    int count;
-    TreeColumn treeColumn;
-    TreeRectangle rect;
-
-    if (objc < 4 || objc > 6) {
-	Tcl_WrongNumArgs(interp, 3, objv,
-	    doHeaders ?
-		"header ?column? ?element?" :
-		"item ?column? ?element?");
-	return TCL_ERROR;
-    }
+    TreeColor *tc;
+    TreeClip clip, *clipPtr = &clip;
+    TreeRectangle tr;
 
-    if (doHeaders) {
-	TreeHeader header;
-	if (TreeHeader_FromObj(tree, objv[3], &header) != TCL_OK)
-	    return TCL_ERROR;
-	item = TreeHeader_GetItem(header);
-    } else {
-	if (TreeItem_FromObj(tree, objv[3], &item, IFO_NOT_NULL) != TCL_OK)
-	    return TCL_ERROR;
+#if USE_ITEM_PIXMAP == 0
+    clip.type = TREE_CLIP_AREA;
+    switch (TreeColumn_Lock(treeColumn)) {
+	case COLUMN_LOCK_LEFT:
+	    clip.area = TREE_AREA_LEFT;
+	    break;
+	case COLUMN_LOCK_NONE:
+	    clip.area = TREE_AREA_CONTENT;
+	    break;
+	case COLUMN_LOCK_RIGHT:
+	    clip.area = TREE_AREA_RIGHT;
+	    break;
     }
+#else
+    clipPtr = NULL;
+#endif
 
-    (void) Tree_GetOriginX(tree);
-    (void) Tree_GetOriginY(tree);
+    TreeRect_SetXYWH(tr, x, y, width, height);
 
-    if (objc == 4) {
-	/* If an item is visible but has zero height a valid bbox
-	 * is returned. */
-	if (Tree_ItemBbox(tree, item, COLUMN_LOCK_NONE, &rect) < 0)
-	    return TCL_OK;
+    /*
+     * If the -backgroundimage is being drawn and is opaque,
+     * there is no need to erase first (unless it doesn't tile!).
+     */
+    if (!Tree_IsBgImageOpaque(tree)) {
+	tc = TreeColumn_BackgroundColor(treeColumn, index);
+	if (tc != NULL) {
+	    TreeRectangle trBrush;
+	    TreeColor_GetBrushBounds(tree, tc, tr,
+		    tree->drawableXOrigin, tree->drawableYOrigin,
+		    treeColumn, item, &trBrush);
+	    if (!TreeColor_IsOpaque(tree, tc)
+		    || (trBrush.width <= 0) || (trBrush.height <= 0)) {
+		GC gc = Tk_3DBorderGC(tree->tkwin, tree->border, TK_3D_FLAT_GC);
+		Tree_FillRectangle(tree, td, clipPtr, gc, tr);
+	    }
+	    TreeColor_FillRect(tree, td, clipPtr, tc, trBrush, tr);
+	} else {
+	    GC gc = Tk_3DBorderGC(tree->tkwin, tree->border, TK_3D_FLAT_GC);
+	    Tree_FillRectangle(tree, td, clipPtr, gc, tr);
+	}
+    }
+    if (tree->backgroundImage != NULL) {
+	Tree_DrawBgImage(tree, td, tr, tree->drawableXOrigin,
+		tree->drawableYOrigin);
+    }
+}
 
-	if (doHeaders)
-	    rect.width -= tree->tailExtend;
-    } else {
-	if (TreeColumn_FromObj(tree, objv[4], &treeColumn,
-		CFO_NOT_NULL | CFO_NOT_TAIL) != TCL_OK)
-	    return TCL_ERROR;
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeItem_SpansInvalidate --
+ *
+ *	Invalidates the Item.spans field of one or all items.
+ *
+ * Results:
+ *	The item(s) are removed from the TreeCtrl.itemSpansHash to
+ *	indicate that the list of spans must be recalculated.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-	/* Bounds of a column. */
-	if (objc == 5) {
-	    objc = 0;
-	    objv = NULL;
+void
+TreeItem_SpansInvalidate(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item		/* Item token. NULL for all items. */
+    )
+{
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+    int count = 0;
 
-	/* Single element in a column. */
-	} else {
-	    TreeItemColumn column;
-	    TreeElement elem;
+    if (item == NULL) {
+	hPtr = Tcl_FirstHashEntry(&tree->itemSpansHash, &search);
+	while (hPtr != NULL) {
+	    item = (TreeItem) Tcl_GetHashKey(&tree->itemSpansHash, hPtr);
+	    item->flags &= ~ITEM_FLAG_SPANS_VALID;
+	    count++;
+	    hPtr = Tcl_NextHashEntry(&search);
+	}
+	if (count) {
+	    Tcl_DeleteHashTable(&tree->itemSpansHash);
+	    Tcl_InitHashTable(&tree->itemSpansHash, TCL_ONE_WORD_KEYS);
+	}
+    } else if (item->flags & ITEM_FLAG_SPANS_VALID) {
+	hPtr = Tcl_FindHashEntry(&tree->itemSpansHash, (char *) item);
+	Tcl_DeleteHashEntry(hPtr);
+	item->flags &= ~ITEM_FLAG_SPANS_VALID;
+	count++;
+    }
 
-	    objc -= 5;
-	    objv += 5;
+    if (count && tree->debug.enable && tree->debug.span)
+	dbwin("TreeItem_SpansInvalidate forgot %d items\n", count);
 
-	    /* Validate the style + element here.  If a span has zero size
-	     * it won't be done. */
-	    column = TreeItem_FindColumn(tree, item, TreeColumn_Index(treeColumn));
-	    if (column == NULL || column->style == NULL || TreeStyle_IsHeaderStyle(tree, column->style)) {
-		NoStyleMsg(tree, item, TreeColumn_Index(treeColumn));
-		return TCL_ERROR;
-	    }
-	    if (TreeElement_FromObj(tree, objv[0], &elem) != TCL_OK)
-		return TCL_ERROR;
-	    if (TreeStyle_FindElement(tree, column->style, elem, NULL) != TCL_OK)
-		return TCL_ERROR;
-	}
+    TreeColumns_InvalidateSpans(tree); /* FIXME: only if item visible? */
+}
 
-	count = TreeItem_GetRects(tree, item, treeColumn, objc, objv, &rect);
-	if (count == 0)
-	    return TCL_OK;
-	if (count == -1)
-	    return TCL_ERROR;
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeItem_SpansRedo --
+ *
+ *	Updates the Item.spans field of an item.
+ *
+ * Results:
+ *	Item.spans is resized if needed to (at least) the current number
+ *	of tree columns. For tree column N, the index of the item
+ *	column displayed there is written to spans[N].
+ *
+ *	The return value is 1 if every span is 1, otherwise 0.
+ *
+ * Side effects:
+ *	Memory may be allocated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TreeItem_SpansRedo(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item		/* Item token. */
+    )
+{
+    TreeColumn treeColumn = tree->columns;
+    TreeItemColumn itemColumn = item->columns;
+    int columnCount = tree->columnCount + (ITEM_HEADER(item) ? 1 : 0);
+    int columnIndex = 0, spanner = 0, span = 1, simple = TRUE;
+    int lock = TreeColumn_Lock(treeColumn);
+    ItemExtra *extra;
+
+    if (tree->debug.enable && tree->debug.span)
+	dbwin("TreeItem_SpansRedo %s %d\n", ITEM_HEADER(item) ? "header" : "item",
+	    item->id);
+
+    extra = Item_GetExtra(tree, item);
+    if (extra->spans == NULL) {
+	extra->spans = (int *) ckalloc(sizeof(int) * columnCount);
+	extra->spanAlloc = columnCount;
+    } else if (extra->spanAlloc < columnCount) {
+	extra->spans = (int *) ckrealloc((char *) extra->spans,
+		sizeof(int) * columnCount);
+	extra->spanAlloc = columnCount;
     }
 
-    /* Canvas -> window coordinates */
-    FormatResult(interp, "%d %d %d %d",
-	    TreeRect_Left(rect) - tree->xOrigin,
-	    TreeRect_Top(rect) - tree->yOrigin,
-	    TreeRect_Left(rect) - tree->xOrigin + TreeRect_Width(rect),
-	    TreeRect_Top(rect) - tree->yOrigin + TreeRect_Height(rect));
+    while (treeColumn != NULL) {
+	/* End current span if column lock changes. */
+	if (TreeColumn_Lock(treeColumn) != lock) {
+	    lock = TreeColumn_Lock(treeColumn);
+	    span = 1;
+	}
+	if (--span == 0) {
+	    if (TreeColumn_Visible(treeColumn))
+		span = itemColumn ? itemColumn->span : 1;
+	    else
+		span = 1;
+	    spanner = columnIndex;
+	}
+	if ((itemColumn != NULL) && (itemColumn->span > 1))
+	    simple = FALSE;
+	extra->spans[columnIndex] = spanner;
+	columnIndex++;
+	treeColumn = TreeColumn_Next(treeColumn);
+	if (itemColumn != NULL)
+	    itemColumn = ITEM_COLUMN_NEXT(item, itemColumn);
+    }
 
-    return TCL_OK;
+    /* Add a span of 1 for the tail column if this is a header. */
+    if (ITEM_HEADER(item) != NULL) {
+	extra->spans[columnCount - 1] = columnCount - 1; /* tail column */
+    }
+
+    return simple;
 }
 
-static int
-ItemBboxCmd(
-    ClientData clientData,	/* Widget info. */
-    Tcl_Interp *interp,		/* Current interpreter. */
-    int objc,			/* Number of arguments. */
-    Tcl_Obj *CONST objv[]	/* Argument values. */
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeItem_SpansRedoIfNeeded --
+ *
+ *	Updates the Item.spans field of an item if needed.
+ *
+ * Results:
+ *	If all spans are known to be 1, nothing is done. If the list of
+ *	spans is marked valid, nothing is done. Otherwise the list of
+ *	spans is recalculated; if any span is > 1 the item is added
+ *	to TreeCtrl.itemSpansHash.
+ *
+ * Side effects:
+ *	Memory may be allocated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TreeItem_SpansRedoIfNeeded(
+    TreeCtrl *tree,
+    TreeItem item
     )
 {
-    TreeCtrl *tree = clientData;
+    /* All the spans are 1. */
+    if (item->flags & ITEM_FLAG_SPANS_SIMPLE)
+	return;
 
-    return TreeItemCmd_Bbox(tree, objc, objv, FALSE);
+    /* Some spans > 1, but we calculated them already. */
+    if (item->flags & ITEM_FLAG_SPANS_VALID)
+	return;
+
+    if (TreeItem_SpansRedo(tree, item)) {
+	/* Reverted to all spans=1. */
+	item->flags |= ITEM_FLAG_SPANS_SIMPLE;
+    } else {
+	int isNew;
+	Tcl_HashEntry *hPtr;
+
+	hPtr = Tcl_CreateHashEntry(&tree->itemSpansHash, (char *) item, &isNew);
+	Tcl_SetHashValue(hPtr, (ClientData) item);
+	item->flags |= ITEM_FLAG_SPANS_VALID;
+    }
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * ItemCreateCmd --
+ * TreeItem_GetSpans --
  *
- *	This procedure is invoked to process the [item create] widget
- *	command.  See the user documentation for details on what
- *	it does.
+ *	Returns the spans[] array for an item.
  *
  * Results:
- *	A standard Tcl result.
+ *	If all spans are known to be 1, the result is NULL. Otherwise the
+ *	list of spans is returned.
  *
  * Side effects:
- *	See the user documentation.
+ *	Memory may be allocated.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-ItemCreateCmd(
-    ClientData clientData,	/* Widget info. */
-    Tcl_Interp *interp,		/* Current interpreter. */
-    int objc,			/* Number of arguments. */
-    Tcl_Obj *CONST objv[]	/* Argument values. */
+int *
+TreeItem_GetSpans(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item		/* Item token. */
     )
 {
-    TreeCtrl *tree = clientData;
-    static CONST char *optionNames[] = { "-button", "-count", "-enabled",
-	"-height", "-nextsibling", "-open", "-parent", "-prevsibling",
-	"-returnid", "-tags", "-visible", "-wrap",
-	(char *) NULL };
-    enum { OPT_BUTTON, OPT_COUNT, OPT_ENABLED, OPT_HEIGHT, OPT_NEXTSIBLING,
-	OPT_OPEN, OPT_PARENT, OPT_PREVSIBLING, OPT_RETURNID, OPT_TAGS,
-	OPT_VISIBLE, OPT_WRAP };
-    int index, i, count = 1, button = 0, returnId = 1, open = 1, visible = 1;
-    int enabled = 1, wrap = 0, height = 0;
-    TreeItem item, parent = NULL, prevSibling = NULL, nextSibling = NULL;
-    TreeItem head = NULL, tail = NULL;
-    Tcl_Obj *listObj = NULL, *tagsObj = NULL;
-    TagInfo *tagInfo = NULL;
-    TreeColumn treeColumn;
+    TreeItem_SpansRedoIfNeeded(tree, item);
+    if (item->flags & ITEM_FLAG_SPANS_SIMPLE)
+	return NULL;
+    return item->extra->spans;
+}
+
+/*
+ * The following structure holds information about which item column
+ * is displayed at a given tree column.
+ */
+typedef struct SpanInfo {
+    TreeColumn treeColumn;	/* Always non-null. */
+    TreeItemColumn itemColumn;	/* May be null. */
+    int span;			/* Number of tree-columns spanned. */
+    int width;			/* Width of the span. */
+    int visIndex;		/* 0-based index into list of
+				 * spans.  Used by header items. */
+    int isDragColumn;		/* TRUE if this span is for a column header
+				 * that is being dragged. */
+} SpanInfo;
+
+typedef struct ColumnColumn {
+    TreeColumn treeColumn;
+    TreeItemColumn itemColumn;
+    int isDragColumn;
+} ColumnColumn;
+
+typedef struct SpanInfoStack SpanInfoStack;
+struct SpanInfoStack
+{
+    int spanCount;
+    SpanInfo *spans;
+    int columnCount;
+    ColumnColumn *columns;
+    int inUse;
+    SpanInfoStack *next;
+};
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Item_GetSpans --
+ *
+ *	Fills an array of SpanInfo records, one per visible span.
+ *
+ * Results:
+ *	The return value is the number of SpanInfo records written.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+Item_GetSpans(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item,		/* Item token. */
+    TreeColumn firstColumn,	/* Which columns. */
+    TreeColumn lastColumn,	/* Which columns. */
+    int columnCount,
+    SpanInfo spans[],		/* Returned span records. */
+#define WALKSPAN_IGNORE_DND 0	     /* Ignore header drag-and-drop positions. */
+#define WALKSPAN_ONLY_DRAGGED 0x01   /* Calculate the bounds of dragged headers
+				      * only considering -imageoffset. */
+#define WALKSPAN_DRAG_ORDER 0x02     /* Calculate the bounds of all headers in
+				      * their current drag positions. */
+#define WALKSPAN_IGNORE_DRAGGED 0x04 /* Don't call the callback routine for
+                                      * dragged headers. */
+    int dragPosition
+    )
+{
+    /* Note: getting head of the stack, that's ok since this routine isn't
+     * in danger of being called recursively. */
+    SpanInfoStack *siStack = tree->itemSpanPriv;
+    ColumnColumn *columns = siStack->columns;
+    TreeColumn treeColumn = firstColumn;
+    int columnIndex = TreeColumn_Index(firstColumn);
+    TreeItemColumn column = TreeItem_FindColumn(tree, item, columnIndex);
+    int spanCount = 0, span = 1;
+    SpanInfo *spanPtr = NULL;
+    int i, isDragColumn;
+
+    if ((ITEM_HEADER(item) == NULL) && (dragPosition & WALKSPAN_ONLY_DRAGGED))
+	return 0;
+
+    if ((columns == NULL) || (siStack->columnCount < tree->columnCount + 1)) {
+	columns = (ColumnColumn *) ckrealloc((char *) columns,
+	    sizeof(ColumnColumn) * (tree->columnCount + 1));
+	siStack->columnCount = tree->columnCount + 1;
+	siStack->columns = columns;
+    }
+
+#ifdef TREECTRL_DEBUG
+    for (i = 0; i < tree->columnCount + 1; i++) {
+	columns[i].treeColumn = NULL;
+	columns[i].itemColumn = NULL;
+    }
+#endif
+
+    columnCount = 0;
+    while (treeColumn != NULL) {
+	if (TreeColumn_Lock(treeColumn) != TreeColumn_Lock(firstColumn))
+	    break;
+	columnIndex = columnCount;
+	isDragColumn = 0;
+	if ((ITEM_HEADER(item) != NULL) && (dragPosition != WALKSPAN_IGNORE_DND)) {
+	    if (dragPosition & WALKSPAN_DRAG_ORDER) {
+		isDragColumn = TreeHeader_IsDraggedColumn(ITEM_HEADER(item),
+		    treeColumn);
+		columnIndex = TreeHeader_ColumnDragOrder(ITEM_HEADER(item),
+		    treeColumn, columnIndex);
+	    }
+	    if (dragPosition & WALKSPAN_ONLY_DRAGGED)
+		isDragColumn = 1;
+	}
+#ifdef TREECTRL_DEBUG
+	if (columnIndex < 0 || columnIndex >= siStack->columnCount) panic("Item_GetSpans columnIndex %d columnCount %d", columnIndex, siStack->columnCount);
+#endif
+	columns[columnIndex].treeColumn = treeColumn;
+	columns[columnIndex].itemColumn = column;
+	columns[columnIndex].isDragColumn = isDragColumn;
+	columnCount++;
+	if (treeColumn == lastColumn) /* FIXME: lastColumn is usually NULL */
+	    break;
+	treeColumn = Tree_ColumnToTheRight(treeColumn, TRUE,
+	    ITEM_HEADER(item) != NULL);
+	if (column != NULL)
+	    column = ITEM_COLUMN_NEXT(item, column);
+	if (treeColumn == tree->columnTail) {
+	    while (column != NULL && ITEM_COLUMN_NEXT(item, column) != NULL)
+		column = ITEM_COLUMN_NEXT(item, column);
+	}
+    }
+
+    isDragColumn = columns[0].isDragColumn;
+    for (i = 0; i < columnCount; i++) {
+	treeColumn = columns[i].treeColumn;
+	column = columns[i].itemColumn;
+	if (isDragColumn != columns[i].isDragColumn)
+	    span = 1;
+	isDragColumn = columns[i].isDragColumn;
+	if (treeColumn == tree->columnTail) {
+	    span = 1; /* End the current span if it hits the tail. */
+	}
+	if (--span == 0) {
+	    /* Always create a span for the tail column in headers */
+	    if ((treeColumn == tree->columnTail) || TreeColumn_Visible(treeColumn)) {
+		span = column ? column->span : 1;
+		if (spanPtr == NULL)
+		    spanPtr = spans;
+		else
+		    spanPtr++;
+		spanPtr->treeColumn = treeColumn;
+		spanPtr->itemColumn = column;
+		spanPtr->span = 0;
+		spanPtr->width = 0;
+		if (!(dragPosition & WALKSPAN_ONLY_DRAGGED) &&
+			(ITEM_HEADER(item) != NULL) &&
+			(spanCount == 0) &&
+			(TreeColumn_Lock(treeColumn) == COLUMN_LOCK_NONE)) {
+		    spanPtr->width += tree->canvasPadX[PAD_TOP_LEFT];
+		}
+		spanPtr->visIndex = spanCount;
+		spanPtr->isDragColumn = isDragColumn;
+		spanCount++;
+	    } else {
+		span = 1;
+		continue;
+	    }
+	}
+	spanPtr->span++;
+	if (treeColumn == tree->columnTail) {
+	    spanPtr->width = 100; /* TreeItem_WalkSpans will calculate the correct value */
+	} else {
+	    spanPtr->width += TreeColumn_UseWidth(treeColumn);
+	}
+    }
+
+    return spanCount;
+}
+
+typedef int (*TreeItemWalkSpansProc)(
+    TreeCtrl *tree,
+    TreeItem item,
+    SpanInfo *spanPtr,
+    StyleDrawArgs *drawArgs,
+    ClientData clientData
+    );
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeItem_WalkSpans --
+ *
+ *	Iterates over the spans of an item and calls a callback routine
+ *	for each span of non-zero width. This is used for drawing,
+ *	hit-testing and other purposes.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+TreeItem_WalkSpans(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item,		/* Item token. */
+    int lock,			/* Which columns. */
+    int x, int y,		/* Drawable coordinates of the item. */
+    int width, int height,	/* Total size of the item. */
+    int dragPosition,
+    TreeItemWalkSpansProc proc,	/* Callback routine. */
+    ClientData clientData	/* Data passed to callback routine. */
+    )
+{
+    SpanInfoStack *siStack = tree->itemSpanPriv;
+    int columnWidth, totalWidth;
+    TreeItemColumn itemColumn;
+    StyleDrawArgs drawArgs;
+    TreeColumn treeColumn = tree->columnLockNone, treeColumnLast = NULL;
+    int spanCount, spanIndex, columnCount = tree->columnCountVis;
+    SpanInfo *spans;
+    int area = TREE_AREA_CONTENT;
+
+    switch (lock) {
+	case COLUMN_LOCK_LEFT:
+	    treeColumn = tree->columnLockLeft;
+	    columnCount = tree->columnCountVisLeft;
+	    area = TREE_AREA_LEFT;
+	    break;
+	case COLUMN_LOCK_NONE:
+	    break;
+	case COLUMN_LOCK_RIGHT:
+	    treeColumn = tree->columnLockRight;
+	    columnCount = tree->columnCountVisRight;
+	    area = TREE_AREA_RIGHT;
+	    break;
+    }
+
+    if (ITEM_HEADER(item) != NULL) {
+	switch (lock) {
+	    case COLUMN_LOCK_LEFT:
+		area = TREE_AREA_HEADER_LEFT;
+		break;
+	    case COLUMN_LOCK_NONE:
+		area = TREE_AREA_HEADER_NONE;
+		if (treeColumn == NULL)
+		    treeColumn = tree->columnTail;
+		columnCount += 1; /* +1 for columnTail */
+		break;
+	    case COLUMN_LOCK_RIGHT:
+		area = TREE_AREA_HEADER_RIGHT;
+		break;
+	}
+	if (dragPosition & WALKSPAN_ONLY_DRAGGED) {
+	    columnCount = TreeHeader_GetDraggedColumns(ITEM_HEADER(item), lock,
+		&treeColumn, &treeColumnLast);
+	    if (columnCount == 0)
+		return;
+	}
+    }
+
+    if (columnCount <= 0)
+	return;
+
+    if (!Tree_AreaBbox(tree, area, &drawArgs.bounds)) {
+	TreeRect_SetXYWH(drawArgs.bounds, 0, 0, 0, 0);
+    }
+
+    /* Originally, the array of SpanInfo records used by this function was
+     * allocated using STATIC_ALLOC.  Not wanting to allocate memory every
+     * time this function is called (which is often) I decided to keep a
+     * pointer to the array.  One problem is that TreeItem_UpdateWindowPositions
+     * may result in recursive calls to this function via code in <Configure>
+     * event scripts. So I have to keep a stack on the heap. That's also why
+     * the array can't be shared by different treectrl widgets. */
+    if (siStack == NULL) {
+	siStack = (SpanInfoStack *) ckalloc(sizeof(SpanInfoStack));
+	memset(siStack, '\0', sizeof(SpanInfoStack));
+	tree->itemSpanPriv = siStack;
+    }
+    while (siStack->inUse) {
+	if (siStack->next == NULL) {
+	    siStack->next = (SpanInfoStack *) ckalloc(sizeof(SpanInfoStack));
+	    memset(siStack->next, '\0', sizeof(SpanInfoStack));
+	    siStack = siStack->next;
+	    break;
+	}
+	siStack = siStack->next;
+    }
+    if (siStack->spanCount < columnCount) {
+	siStack->spans = (SpanInfo *) ckrealloc((char *) siStack->spans,
+	    sizeof(SpanInfo) * columnCount);
+	siStack->spanCount = columnCount;
+    }
+    spans = siStack->spans;
+
+    spanCount = Item_GetSpans(tree, item, treeColumn, treeColumnLast,
+	columnCount, spans, dragPosition);
+    if (spanCount <= 0)
+	return;
+
+#ifdef TREECTRL_DEBUG
+    if (siStack->inUse) panic("TreeItem_WalkSpans stack is in use");
+#endif
+    siStack->inUse = 1;
+
+    drawArgs.tree = tree;
+    drawArgs.item = item; /* needed for gradients */
+    drawArgs.td.drawable = None;
+
+    totalWidth = 0;
+    if (dragPosition & WALKSPAN_ONLY_DRAGGED) {
+#ifdef TREECTRL_DEBUG
+	if (ITEM_HEADER(item) == NULL) panic("TreeItem_WalkSpans header == NULL");
+#endif
+	treeColumn = spans[0].treeColumn; /* tree->columnDrag.column */
+	totalWidth = TreeColumn_Offset(treeColumn);
+    }
+    for (spanIndex = 0; spanIndex < spanCount; spanIndex++) {
+	treeColumn = spans[spanIndex].treeColumn;
+	itemColumn = spans[spanIndex].itemColumn;
+
+	/* This is where the actual width of the tail column is determined. */
+	if (treeColumn == tree->columnTail) {
+	    spans[spanIndex].width = MAX(0, MAX(Tree_ContentWidth(tree),
+		Tree_FakeCanvasWidth(tree)) - totalWidth) + tree->tailExtend;
+	}
+	if (ITEM_HEADER(item) != NULL) {
+	    columnWidth = spans[spanIndex].width;
+
+	/* If this is the single visible column, use the provided width which
+	 * may be different than the column's width. */
+	} else if ((tree->columnCountVis == 1) && (treeColumn == tree->columnVis)) {
+	    columnWidth = width;
+
+	/* More than one column is visible, or this is not the visible
+	 * column. */
+	} else {
+	    columnWidth = spans[spanIndex].width;
+	}
+	if (columnWidth <= 0)
+	    continue;
+
+	if ((dragPosition & WALKSPAN_IGNORE_DRAGGED) &&
+		spans[spanIndex].isDragColumn)
+	    goto next;
+
+	if (itemColumn != NULL) {
+	    drawArgs.state = item->state | itemColumn->cstate;
+	    drawArgs.style = itemColumn->style; /* may be NULL */
+	} else {
+	    drawArgs.state = item->state;
+	    drawArgs.style = NULL;
+	}
+	if ((dragPosition & WALKSPAN_DRAG_ORDER) && (ITEM_HEADER(item) != NULL)) {
+	    if ((spanIndex == 0) && (TreeColumn_Lock(treeColumn) == COLUMN_LOCK_NONE))
+		drawArgs.indent = tree->canvasPadX[PAD_TOP_LEFT];
+	    else
+		drawArgs.indent = 0;
+	} else
+	    drawArgs.indent = TreeItem_Indent(tree, treeColumn, item);
+	drawArgs.x = x + totalWidth;
+	if (dragPosition & WALKSPAN_ONLY_DRAGGED) {
+#ifdef TREECTRL_DEBUG
+	    if (ITEM_HEADER(item) == NULL) panic("TreeItem_WalkSpans header == NULL");
+#endif
+	    drawArgs.x += tree->columnDrag.offset;
+	    drawArgs.indent = 0;
+	}
+	drawArgs.y = y;
+	drawArgs.width = columnWidth;
+	drawArgs.height = height;
+	drawArgs.spanIndex = spanIndex;
+	if (ITEM_HEADER(item) != NULL)
+	    drawArgs.justify = TreeHeaderColumn_Justify(ITEM_HEADER(item),
+		itemColumn->headerColumn);
+	else
+	    drawArgs.justify = TreeColumn_ItemJustify(treeColumn);
+	drawArgs.column = treeColumn; /* needed for gradients */
+
+	if ((*proc)(tree, item, &spans[spanIndex], &drawArgs, clientData))
+	    break;
+next:
+	totalWidth += columnWidth;
+    }
+
+    siStack->inUse = 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SpanWalkProc_Draw --
+ *
+ *	Callback routine to TreeItem_WalkSpans for TreeItem_Draw.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Stuff is drawn in a drawable.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+SpanWalkProc_Draw(
+    TreeCtrl *tree,
+    TreeItem item,
+    SpanInfo *spanPtr,
+    StyleDrawArgs *drawArgs,
+    ClientData clientData
+    )
+{
+    TreeColumn treeColumn = spanPtr->treeColumn;
+    TreeItemColumn itemColumn = spanPtr->itemColumn;
+#if COLUMNGRID == 1
+    TreeColor *leftColor, *rightColor;
+    int leftWidth, rightWidth;
+#endif
+    int i, x;
+    struct {
+	TreeDrawable td;
+	int minX;
+	int maxX;
+	int index;
+	int dragPosition;
+    } *data = clientData;
+
+    /* Draw nothing if the entire span is out-of-bounds. */
+    if ((drawArgs->x >= data->maxX) ||
+	    (drawArgs->x + drawArgs->width <= data->minX))
+	return 0;
+
+    drawArgs->td = data->td;
+
+    if (ITEM_HEADER(item) != NULL) {
+	TreeHeaderColumn_Draw(ITEM_HEADER(item),
+	    itemColumn ? itemColumn->headerColumn : NULL,
+	    spanPtr->visIndex, drawArgs, data->dragPosition);
+
+	return drawArgs->x + drawArgs->width >= data->maxX;
+    }
+
+    /* Draw background colors. */
+    if (spanPtr->span == 1) {
+	/* Important point: use drawArgs->width since an item's width may
+	 * be totally different than tree->columnVis' width. */
+	ItemDrawBackground(tree, treeColumn, item, itemColumn,
+		drawArgs->td, drawArgs->x, drawArgs->y,
+		drawArgs->width, drawArgs->height, data->index);
+    } else {
+	x = drawArgs->x;
+	for (i = 0; i < spanPtr->span; i++) {
+	    int columnWidth = TreeColumn_UseWidth(treeColumn);
+	    if ((columnWidth > 0) && (x < data->maxX) &&
+		    (x + columnWidth > data->minX)) {
+		ItemDrawBackground(tree, treeColumn, item, itemColumn,
+			drawArgs->td, x, drawArgs->y,
+			columnWidth, drawArgs->height, data->index);
+	    }
+	    x += columnWidth;
+	    treeColumn = TreeColumn_Next(treeColumn);
+	}
+    }
+
+    if (drawArgs->style != NULL) {
+	StyleDrawArgs drawArgsCopy = *drawArgs;
+	TreeStyle_Draw(&drawArgsCopy);
+    }
+
+#if COLUMNGRID == 1
+    if (TreeColumn_GridColors(spanPtr->treeColumn, &leftColor, &rightColor,
+	    &leftWidth, &rightWidth) != 0) {
+	TreeRectangle tr, trBrush;
+
+	if (leftColor != NULL && leftWidth > 0) {
+	    TreeRect_SetXYWH(tr, drawArgs->x, drawArgs->y, leftWidth,
+		    drawArgs->height);
+	    TreeColor_GetBrushBounds(tree, leftColor, tr,
+		    tree->drawableXOrigin, tree->drawableYOrigin,
+		    spanPtr->treeColumn, item, &trBrush);
+	    TreeColor_FillRect(tree, data->td, NULL, leftColor, trBrush, tr);
+	}
+	if (rightColor != NULL && rightWidth > 0) {
+	    TreeRect_SetXYWH(tr, drawArgs->x + drawArgs->width - rightWidth,
+		    drawArgs->y, rightWidth, drawArgs->height);
+	    TreeColor_GetBrushBounds(tree, rightColor, tr,
+		    tree->drawableXOrigin, tree->drawableYOrigin,
+		    spanPtr->treeColumn, item, &trBrush);
+	    TreeColor_FillRect(tree, data->td, NULL, rightColor, trBrush, tr);
+	}
+    }
+#endif
+
+    if (spanPtr->treeColumn == tree->columnTree) {
+	if (tree->showLines)
+	    TreeItem_DrawLines(tree, item, drawArgs->x, drawArgs->y,
+		    drawArgs->width, drawArgs->height, data->td,
+		    drawArgs->style);
+	if (tree->showButtons)
+	    TreeItem_DrawButton(tree, item, drawArgs->x, drawArgs->y,
+		    drawArgs->width, drawArgs->height, data->td,
+		    drawArgs->style);
+    }
+
+    /* Stop walking if we went past the right edge of the dirty area. */
+    return drawArgs->x + drawArgs->width >= data->maxX;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeItem_Draw --
+ *
+ *	Draws part of an Item.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Stuff is drawn in a drawable.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TreeItem_Draw(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item,		/* Item token. */
+    int lock,			/* Which columns. */
+    int x, int y,		/* Drawable coordinates of the item. */
+    int width, int height,	/* Total size of the item. */
+    TreeDrawable td,		/* Where to draw. */
+    int minX, int maxX,		/* Left/right edge that needs to be drawn. */
+    int index			/* Used to select a color from a
+				 * tree-column's -itembackground option. */
+    )
+{
+    struct {
+	TreeDrawable td;
+	int minX;
+	int maxX;
+	int index;
+	int dragPosition;
+    } clientData;
+
+    clientData.td = td;
+    clientData.minX = minX;
+    clientData.maxX = maxX;
+    clientData.index = index;
+    clientData.dragPosition = FALSE;
+
+    TreeItem_WalkSpans(tree, item, lock,
+	    x, y, width, height,
+	    WALKSPAN_DRAG_ORDER,
+	    SpanWalkProc_Draw, (ClientData) &clientData);
+
+    if (ITEM_HEADER(item) != NULL) {
+	clientData.dragPosition = TRUE;
+	TreeItem_WalkSpans(tree, item, lock,
+		x, y, width, height,
+		WALKSPAN_ONLY_DRAGGED,
+		SpanWalkProc_Draw, (ClientData) &clientData);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeItem_DrawLines --
+ *
+ *	Draws horizontal and vertical lines indicating parent-child
+ *	relationship in an item.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Stuff is drawn in a drawable.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TreeItem_DrawLines(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item,		/* Item token. */
+    int x, int y,		/* Drawable coordinates of columnTree. */
+    int width, int height,	/* Total size of columnTree. */
+    TreeDrawable td,		/* Where to draw. */
+    TreeStyle style		/* Instance style or NULL. Used to get
+				 * optional vertical offset of the button. */
+    )
+{
+    TreeItem parent, walk;
+    int buttonY = -1;
+    int indent, left, lineLeft, lineTop;
+    int hasPrev, hasNext;
+    int i, vert = 0;
+
+    indent = TreeItem_Indent(tree, tree->columnTree, item);
+
+    if (style != NULL)
+	buttonY = TreeStyle_GetButtonY(tree, style);
+
+    /* Left edge of button/line area */
+    left = x /* + tree->columnTreeLeft */ + indent - tree->useIndent;
+
+    /* Left edge of vertical line */
+    lineLeft = left + (tree->useIndent - tree->lineThickness) / 2;
+
+    /* Top edge of horizontal line */
+    if (buttonY < 0)
+	lineTop = y + (height - tree->lineThickness) / 2;
+    else
+	lineTop = y + buttonY + (tree->buttonHeightMax - tree->lineThickness) / 2;
+
+    /* NOTE: The next three checks do not call TreeItem_ReallyVisible()
+     * since 'item' is ReallyVisible */
+
+    /* Check for ReallyVisible previous sibling */
+    walk = item->prevSibling;
+    while ((walk != NULL) && !IS_VISIBLE(walk))
+	walk = walk->prevSibling;
+    hasPrev = (walk != NULL);
+
+    /* Check for ReallyVisible parent */
+    if ((item->parent != NULL) && (!IS_ROOT(item->parent) || tree->showRoot))
+	hasPrev = TRUE;
+
+    /* Check for ReallyVisible next sibling */
+    walk = item->nextSibling;
+    while ((walk != NULL) && !IS_VISIBLE(walk))
+	walk = walk->nextSibling;
+    hasNext = (walk != NULL);
+
+    /* Option: Don't connect children of root item */
+    if ((item->parent != NULL) && IS_ROOT(item->parent) && !tree->showRootLines)
+	hasPrev = hasNext = FALSE;
+
+    /* Vertical line to parent and/or previous/next sibling */
+    if (hasPrev || hasNext) {
+	int top = y, bottom = y + height;
+
+	if (!hasPrev)
+	    top = lineTop;
+	if (!hasNext)
+	    bottom = lineTop + tree->lineThickness;
+
+	if (tree->lineStyle == LINE_STYLE_DOT) {
+	    for (i = 0; i < tree->lineThickness; i++) {
+		Tree_VDotLine(tree, td.drawable,
+			lineLeft + i,
+			top,
+			bottom);
+	    }
+	} else {
+	    XFillRectangle(tree->display, td.drawable, tree->lineGC[0],
+		    lineLeft,
+		    top,
+		    tree->lineThickness,
+		    bottom - top);
+	}
+
+	/* Don't overlap horizontal line */
+	vert = tree->lineThickness;
+    }
+
+    /* Horizontal line to self */
+    if (hasPrev || hasNext) {
+	if (tree->lineStyle == LINE_STYLE_DOT) {
+	    for (i = 0; i < tree->lineThickness; i++) {
+		Tree_HDotLine(tree, td.drawable,
+			lineLeft + vert,
+			lineTop + i,
+			x /* + tree->columnTreeLeft */ + indent);
+	    }
+	} else {
+	    XFillRectangle(tree->display, td.drawable, tree->lineGC[0],
+		    lineLeft + vert,
+		    lineTop,
+		    left + tree->useIndent - (lineLeft + vert),
+		    tree->lineThickness);
+	}
+    }
+
+    /* Vertical lines from ancestors to their next siblings */
+    for (parent = item->parent;
+	 parent != NULL;
+	 parent = parent->parent) {
+	lineLeft -= tree->useIndent;
+
+	/* Option: Don't connect children of root item */
+	if ((parent->parent != NULL) && IS_ROOT(parent->parent) && !tree->showRootLines)
+	    continue;
+
+	/* Check for ReallyVisible next sibling */
+	item = parent->nextSibling;
+	while ((item != NULL) && !IS_VISIBLE(item))
+	    item = item->nextSibling;
+
+	if (item != NULL) {
+	    if (tree->lineStyle == LINE_STYLE_DOT) {
+		for (i = 0; i < tree->lineThickness; i++) {
+		    Tree_VDotLine(tree, td.drawable,
+			    lineLeft + i,
+			    y,
+			    y + height);
+		}
+	    } else {
+		XFillRectangle(tree->display, td.drawable, tree->lineGC[0],
+			lineLeft,
+			y,
+			tree->lineThickness,
+			height);
+	    }
+	}
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeItem_DrawButton --
+ *
+ *	Draws the button (if any) in an item.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Stuff is drawn in a drawable.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TreeItem_DrawButton(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item,		/* Item token. */
+    int x, int y,		/* Drawable coordinates of columnTree. */
+    int width, int height,	/* Total size of columnTree. */
+    TreeDrawable td,		/* Where to draw. */
+    TreeStyle style		/* Instance style or NULL. Used to get
+				 * optional vertical offset of the button. */
+    )
+{
+    int indent, left, lineLeft, lineTop;
+    int buttonLeft, buttonTop, buttonY = -1, w1;
+    Tk_Image image;
+    Pixmap bitmap;
+
+    if (!TreeItem_HasButton(tree, item))
+	return;
+
+    indent = TreeItem_Indent(tree, tree->columnTree, item);
+
+    if (style != NULL)
+	buttonY = TreeStyle_GetButtonY(tree, style);
+
+    /* Left edge of button/line area */
+    left = x /* + tree->columnTreeLeft */ + indent - tree->useIndent;
+
+    image = PerStateImage_ForState(tree, &tree->buttonImage, item->state, NULL);
+    if (image != NULL) {
+	int imgW, imgH;
+	Tk_SizeOfImage(image, &imgW, &imgH);
+	if (buttonY < 0)
+	    buttonY = (height - imgH) / 2;
+	Tree_RedrawImage(image, 0, 0, imgW, imgH, td,
+	    left + (tree->useIndent - imgW) / 2,
+	    y + buttonY);
+	return;
+    }
+
+    bitmap = PerStateBitmap_ForState(tree, &tree->buttonBitmap, item->state, NULL);
+    if (bitmap != None) {
+	int bmpW, bmpH;
+	int bx, by;
+	Tk_SizeOfBitmap(tree->display, bitmap, &bmpW, &bmpH);
+	if (buttonY < 0)
+	    buttonY = (height - bmpH) / 2;
+	bx = left + (tree->useIndent - bmpW) / 2;
+	by = y + buttonY;
+	Tree_DrawBitmap(tree, bitmap, td.drawable, NULL, NULL,
+		0, 0, (unsigned int) bmpW, (unsigned int) bmpH,
+		bx, by);
+	return;
+    }
+
+    if (tree->useTheme) {
+	int bw, bh;
+	int buttonState = item->state;
+
+	/* FIXME: These may overwrite [state define] states */
+	buttonState &= ~ITEM_FLAGS_BUTTONSTATE;
+	if (item->flags & ITEM_FLAG_BUTTONSTATE_ACTIVE)
+	    buttonState |= BUTTON_STATE_ACTIVE;
+	if (item->flags & ITEM_FLAG_BUTTONSTATE_PRESSED)
+	    buttonState |= BUTTON_STATE_PRESSED;
+
+	if (TreeTheme_GetButtonSize(tree, td.drawable,
+		(buttonState & STATE_ITEM_OPEN) != 0, &bw, &bh) == TCL_OK) {
+	    if (buttonY < 0)
+		buttonY = (height - bh) / 2;
+	    if (TreeTheme_DrawButton(tree, td, item, buttonState,
+		    left + (tree->useIndent - bw) / 2, y + buttonY,
+		    bw, bh) == TCL_OK) {
+		return;
+	    }
+	}
+    }
+
+    w1 = tree->buttonThickness / 2;
+
+    /* Left edge of vertical line */
+    /* Make sure this matches TreeItem_DrawLines() */
+    lineLeft = left + (tree->useIndent - tree->buttonThickness) / 2;
+
+    /* Top edge of horizontal line */
+    /* Make sure this matches TreeItem_DrawLines() */
+    if (buttonY < 0)
+	lineTop = y + (height - tree->lineThickness) / 2;
+    else
+	lineTop = y + buttonY + (tree->buttonHeightMax - tree->lineThickness) / 2;
+
+    buttonLeft = left + (tree->useIndent - tree->buttonSize) / 2;
+    if (buttonY < 0)
+	buttonTop = y + (height - tree->buttonSize) / 2;
+    else
+	buttonTop = y + buttonY + (tree->buttonHeightMax - tree->buttonSize) / 2;
+
+    /* Erase button background */
+    XFillRectangle(tree->display, td.drawable,
+	    Tk_3DBorderGC(tree->tkwin, tree->border, TK_3D_FLAT_GC),
+	    buttonLeft + tree->buttonThickness,
+	    buttonTop + tree->buttonThickness,
+	    tree->buttonSize - tree->buttonThickness,
+	    tree->buttonSize - tree->buttonThickness);
+
+    /* Draw button outline */
+    XDrawRectangle(tree->display, td.drawable, tree->buttonGC,
+	    buttonLeft + w1,
+	    buttonTop + w1,
+	    tree->buttonSize - tree->buttonThickness,
+	    tree->buttonSize - tree->buttonThickness);
+
+    /* Horizontal '-' */
+    XFillRectangle(tree->display, td.drawable, tree->buttonGC,
+	    buttonLeft + tree->buttonThickness * 2,
+	    lineTop,
+	    tree->buttonSize - tree->buttonThickness * 4,
+	    tree->buttonThickness);
+
+    if (!(item->state & STATE_ITEM_OPEN)) {
+	/* Finish '+' */
+	XFillRectangle(tree->display, td.drawable, tree->buttonGC,
+		lineLeft,
+		buttonTop + tree->buttonThickness * 2,
+		tree->buttonThickness,
+		tree->buttonSize - tree->buttonThickness * 4);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SpanWalkProc_UpdateWindowPositions --
+ *
+ *	Callback routine to TreeItem_WalkSpans for
+ *	TreeItem_UpdateWindowPositions.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Windows in window elements may be resized/repositioned.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+SpanWalkProc_UpdateWindowPositions(
+    TreeCtrl *tree,
+    TreeItem item,
+    SpanInfo *spanPtr,
+    StyleDrawArgs *drawArgs,
+    ClientData clientData
+    )
+{
+    StyleDrawArgs drawArgsCopy;
+    int requests;
+
+    if ((drawArgs->x >= TreeRect_Right(drawArgs->bounds)) ||
+	    (drawArgs->x + drawArgs->width <= TreeRect_Left(drawArgs->bounds)) ||
+	    (drawArgs->style == NULL))
+	return 0;
+
+    TreeDisplay_GetReadyForTrouble(tree, &requests);
+
+    drawArgsCopy = *drawArgs;
+    TreeStyle_UpdateWindowPositions(&drawArgsCopy);
+
+    if (TreeDisplay_WasThereTrouble(tree, requests))
+	return 1;
+
+    /* Stop walking if we went past the right edge of the display area. */
+    return drawArgs->x + drawArgs->width >= TreeRect_Right(drawArgs->bounds);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeItem_UpdateWindowPositions --
+ *
+ *	Updates the geometry of any on-screen window elements. Called
+ *	by the display code when an item was possibly scrolled.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Windows in window elements may be resized/repositioned.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TreeItem_UpdateWindowPositions(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item,		/* Item token. */
+    int lock,			/* Columns we care about. */
+    int x, int y,		/* Window coordinates of the item. */
+    int width, int height	/* Total size of the item. */
+    )
+{
+    TreeItem_WalkSpans(tree, item, lock,
+	    x, y, width, height,
+	    WALKSPAN_DRAG_ORDER | WALKSPAN_IGNORE_DRAGGED,
+	    SpanWalkProc_UpdateWindowPositions, (ClientData) NULL);
+
+    if (ITEM_HEADER(item) != NULL) {
+	TreeItem_WalkSpans(tree, item, lock,
+		x, y, width, height,
+		WALKSPAN_ONLY_DRAGGED,
+		SpanWalkProc_UpdateWindowPositions, (ClientData) NULL);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SpanWalkProc_GetOnScreenColumns --
+ *
+ *	Callback routine to TreeItem_WalkSpans for
+ *	TreeItem_GetOnScreenColumns.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+SpanWalkProc_GetOnScreenColumns(
+    TreeCtrl *tree,
+    TreeItem item,
+    SpanInfo *spanPtr,
+    StyleDrawArgs *drawArgs,
+    ClientData clientData
+    )
+{
+    TreeColumnList *columns = clientData;
+
+    if ((drawArgs->x >= TreeRect_Right(drawArgs->bounds)) ||
+	    (drawArgs->x + drawArgs->width <= TreeRect_Left(drawArgs->bounds)))
+	return 0;
+
+    TreeColumnList_Append(columns, drawArgs->column);
+
+    /* Stop walking if we went past the right edge of the display area. */
+    return drawArgs->x + drawArgs->width >= TreeRect_Right(drawArgs->bounds);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeItem_GetOnScreenColumns --
+ *
+ *	Get a list of onscreen columns for an item.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TreeItem_GetOnScreenColumns(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item,		/* Item token. */
+    int lock,			/* Which columns. */
+    int x, int y,		/* Drawable coordinates of the item. */
+    int width, int height,	/* Total size of the item. */
+    TreeColumnList *columns	/* Out: list of onscreen columns. */
+    )
+{
+    TreeItem_WalkSpans(tree, item, lock,
+	x, y, width, height,
+	WALKSPAN_DRAG_ORDER | WALKSPAN_IGNORE_DRAGGED,
+	SpanWalkProc_GetOnScreenColumns, (ClientData) columns);
+
+    if (ITEM_HEADER(item) != NULL) {
+	TreeItem_WalkSpans(tree, item, lock,
+	    x, y, width, height,
+	    WALKSPAN_ONLY_DRAGGED,
+	    SpanWalkProc_GetOnScreenColumns, (ClientData) columns);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeItem_OnScreen --
+ *
+ *	Called by the display code when the item becomes visible
+ *	(i.e., actually displayed) or hidden.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Windows in window elements may be mapped/unmapped.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TreeItem_OnScreen(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item,		/* Item token. */
+    int onScreen		/* TRUE if item is displayed. */
+    )
+{
+#if 0
+    TreeItemColumn column = item->columns;
+
+    while (column != NULL) {
+	if (column->style != NULL) {
+	    TreeStyle_OnScreen(tree, column->style, onScreen);
+	}
+	column = ITEM_COLUMN_NEXT(item, column);
+    }
+#endif
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeItem_NeedsData --
+ *
+ *	Return whether the -itemdatacommand should be called for an
+ *	item before it is displayed.
+ *
+ * Results:
+ *	TRUE if there is an -itemdatacommand and it hasn't been called
+ *	for the item since the item was created or its data was
+ *	discarded.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TreeItem_NeedsData(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item		/* Item token. */
+    )
+{
+    if (tree->itemDataCmd == NULL || ITEM_HEADER(item) != NULL)
+	return FALSE;
+    return (item->flags & ITEM_FLAG_DATA) == 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ItemData_Forget --
+ *
+ *	Discard the styles assigned to an item by the -itemdatacommand.
+ *	The next time the item is displayed the command will be called
+ *	for it again.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Memory is freed.  If the height of the item depends on its
+ *	styles the display is marked for re-layout.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ItemData_Forget(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item		/* Item token. */
+    )
+{
+    TreeItemColumn column;
+
+    item->flags &= ~ITEM_FLAG_DATA;
+    for (column = item->columns; column != NULL; column = ITEM_COLUMN_NEXT(item, column)) {
+	if (column->style == NULL)
+	    continue;
+	TreeItemColumn_ForgetStyle(tree, column);
+	TreeItemColumn_InvalidateSize(tree, column);
+    }
+
+    /* The column widths are left alone: the item will be given its
+     * data back before it is displayed again. */
+    TreeItem_InvalidateHeight(tree, item);
+    if (item->fixedHeight <= 0 && tree->itemHeight <= 0)
+	Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ItemData_Trim --
+ *
+ *	Discard the data of the least-recently loaded items until no more
+ *	than -itemdatacachesize items have data.  Items that are
+ *	currently displayed are never discarded; they are moved to the
+ *	end of the queue instead.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Memory may be freed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ItemData_Trim(
+    TreeCtrl *tree		/* Widget info. */
+    )
+{
+    int limit = tree->itemDataCacheSize;
+    int tries = tree->itemData.count;
+    int id;
+    TreeItem item;
+
+    if (limit <= 0)
+	return;
+
+    while (tree->itemData.count > limit && tries-- > 0) {
+	id = tree->itemData.ids[tree->itemData.first];
+	tree->itemData.first = (tree->itemData.first + 1) % tree->itemData.alloc;
+	tree->itemData.count--;
+
+	item = Tree_FindItem(tree, id);
+	if (item == NULL || !(item->flags & ITEM_FLAG_DATA))
+	    continue;
+	if (ITEM_DINFO(item) != NULL) {
+	    /* Onscreen, keep it. */
+	    tree->itemData.ids[(tree->itemData.first + tree->itemData.count)
+		    % tree->itemData.alloc] = id;
+	    tree->itemData.count++;
+	    continue;
+	}
+	ItemData_Forget(tree, item);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeItem_RequestData --
+ *
+ *	Called by the display code with the list of items about to be
+ *	displayed for which TreeItem_NeedsData() returned TRUE.  The
+ *	-itemdatacommand is evaluated with the widget path and the list
+ *	of item ids appended; the script is expected to assign styles
+ *	and element options to those items.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	A Tcl command is invoked, and an additional command may be
+ *	invoked to process errors in the command.  The data of items
+ *	no longer displayed may be discarded.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TreeItem_RequestData(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItemList *items		/* Items that need data. */
+    )
+{
+    Tcl_Interp *interp = tree->interp;
+    int i, count = TreeItemList_Count(items);
+    TreeItem item;
+    Tcl_DString dString;
+    Tcl_Obj *idObj;
+    char *itemDataCmd;
+    int result, track;
+
+    if (count == 0 || tree->itemDataCmd == NULL)
+	return;
+
+    /* Grow the ring, unwrapping it so the oldest id is at ids[0].
+     * Items are only queued for discarding when the cache is bounded. */
+    track = tree->itemDataCacheSize > 0;
+    if (track && tree->itemData.count + count > tree->itemData.alloc) {
+	int alloc = MAX(tree->itemData.alloc * 2,
+		tree->itemData.count + count);
+	int *ids = (int *) ckalloc(sizeof(int) * alloc);
+	for (i = 0; i < tree->itemData.count; i++) {
+	    ids[i] = tree->itemData.ids[(tree->itemData.first + i)
+		    % tree->itemData.alloc];
+	}
+	if (tree->itemData.ids != NULL)
+	    ckfree((char *) tree->itemData.ids);
+	tree->itemData.ids = ids;
+	tree->itemData.alloc = alloc;
+	tree->itemData.first = 0;
+    }
+
+    Tcl_DStringInit(&dString);
+    Tcl_DStringAppend(&dString, tree->itemDataCmd, -1);
+    Tcl_DStringAppendElement(&dString, Tk_PathName(tree->tkwin));
+    Tcl_DStringStartSublist(&dString);
+    for (i = 0; i < count; i++) {
+	item = TreeItemList_Nth(items, i);
+	item->flags |= ITEM_FLAG_DATA;
+	if (track) {
+	    tree->itemData.ids[(tree->itemData.first + tree->itemData.count)
+		    % tree->itemData.alloc] = item->id;
+	    tree->itemData.count++;
+	}
+	idObj = TreeItem_ToObj(tree, item);
+	Tcl_IncrRefCount(idObj);
+	Tcl_DStringAppendElement(&dString, Tcl_GetString(idObj));
+	Tcl_DecrRefCount(idObj);
+    }
+    Tcl_DStringEndSublist(&dString);
+
+    ItemData_Trim(tree);
+
+    Tcl_Preserve((ClientData) interp);
+    Tcl_Preserve((ClientData) tree);
+
+    itemDataCmd = tree->itemDataCmd;
+    Tcl_Preserve((ClientData) itemDataCmd);
+    result = Tcl_EvalEx(interp, Tcl_DStringValue(&dString),
+	    Tcl_DStringLength(&dString), TCL_EVAL_GLOBAL);
+    if (result != TCL_OK)
+	Tcl_BackgroundError(interp);
+    Tcl_ResetResult(interp);
+    Tcl_Release((ClientData) itemDataCmd);
+
+    Tcl_Release((ClientData) tree);
+    Tcl_Release((ClientData) interp);
+
+    Tcl_DStringFree(&dString);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeItem_DataCacheSizeChanged --
+ *
+ *	Called when the -itemdatacachesize option changes.  Items are
+ *	only queued while the cache is bounded, so when it becomes
+ *	bounded the items that already have data are queued, lowest id
+ *	first since the order they were given data in is not known.
+ *	The data of items over the new limit is discarded right away.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Memory may be allocated or freed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TreeItem_DataCacheSizeChanged(
+    TreeCtrl *tree,		/* Widget info. */
+    int oldSize			/* Previous -itemdatacachesize. */
+    )
+{
+    TreeItem item;
+    int search, count = 0;
+
+    if (tree->itemDataCacheSize <= 0) {
+	TreeItem_FreeDataCache(tree);
+	return;
+    }
+
+    if (oldSize <= 0) {
+	TreeItem_FreeDataCache(tree);
+	for (item = Tree_FirstItem(tree, &search);
+		item != NULL;
+		item = Tree_NextItem(tree, &search)) {
+	    if (item->flags & ITEM_FLAG_DATA)
+		count++;
+	}
+	if (count == 0)
+	    return;
+	tree->itemData.ids = (int *) ckalloc(sizeof(int) * count);
+	tree->itemData.alloc = count;
+	for (item = Tree_FirstItem(tree, &search);
+		item != NULL;
+		item = Tree_NextItem(tree, &search)) {
+	    if (item->flags & ITEM_FLAG_DATA)
+		tree->itemData.ids[tree->itemData.count++] = item->id;
+	}
+    }
+
+    ItemData_Trim(tree);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeItem_FreeDataCache --
+ *
+ *	Free the queue of items that have data.  Called when the widget
+ *	is destroyed.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Memory is freed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TreeItem_FreeDataCache(
+    TreeCtrl *tree		/* Widget info. */
+    )
+{
+    if (tree->itemData.ids != NULL)
+	ckfree((char *) tree->itemData.ids);
+    tree->itemData.ids = NULL;
+    tree->itemData.alloc = tree->itemData.first = tree->itemData.count = 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeItem_ReallyVisible --
+ *
+ *	Return whether the given Item could be displayed.
+ *
+ * Results:
+ *	TRUE if the item's -visible is TRUE, all of its ancestors'
+ *	-visible options are TRUE, and all of its ancestors are open.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TreeItem_ReallyVisible(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item		/* Item token. */
+    )
+{
+    TreeItem parent = item->parent;
+    int visible;
+
+    if (ITEM_HEADER(item) != NULL) {
+	if (!tree->showHeader || !IS_VISIBLE(item))
+	    return 0;
+
+	/* For compatibility, if there are no visible columns then don't
+	 * display the lone tail column. */
+	(void) TreeColumns_UpdateCounts(tree);
+	if (tree->columnCountVis +
+		tree->columnCountVisLeft +
+		tree->columnCountVisRight == 0)
+	    return 0;
+
+	return 1;
+    }
+
+    if (!tree->updateIndex)
+	return item->indexVis != -1;
+
+    /* The answer is remembered until something changes that could affect
+     * the visibility of any item, so walking up a deep tree is done once
+     * per ancestor instead of once per call. */
+    if (item->visEpoch == tree->visEpoch)
+	return (item->flags & ITEM_FLAG_REALLY_VISIBLE) != 0;
+
+    if (!IS_VISIBLE(item))
+	visible = 0;
+    else if (parent == NULL)
+	visible = IS_ROOT(item) ? tree->showRoot : 0;
+    else if (IS_ROOT(parent) && IS_VISIBLE(parent) && !tree->showRoot)
+	visible = 1;
+    else if (!IS_VISIBLE(parent) || !(parent->state & STATE_ITEM_OPEN))
+	visible = 0;
+    else
+	visible = TreeItem_ReallyVisible(tree, parent);
+
+    item->visEpoch = tree->visEpoch;
+    if (visible)
+	item->flags |= ITEM_FLAG_REALLY_VISIBLE;
+    else
+	item->flags &= ~ITEM_FLAG_REALLY_VISIBLE;
+    return visible;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeItem_RootAncestor --
+ *
+ *	Return the toplevel ancestor of an Item.
+ *
+ * Results:
+ *	Returns the root, or an orphan ancestor, or the given Item.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+TreeItem
+TreeItem_RootAncestor(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item		/* Item token. */
+    )
+{
+    while (item->parent != NULL)
+	item = item->parent;
+    return item;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeItem_IsAncestor --
+ *
+ *	Determine if one Item is the ancestor of another.
+ *
+ * Results:
+ *	TRUE if item1 is an ancestor of item2.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TreeItem_IsAncestor(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item1,		/* Possible ancestor. */
+    TreeItem item2		/* Item to check ancestry of. */
+    )
+{
+    if (item1 == item2)
+	return 0;
+    while (item2 && item2 != item1)
+	item2 = item2->parent;
+    return item2 != NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeItem_ToObj --
+ *
+ *	Convert an Item to a Tcl_Obj.
+ *
+ * Results:
+ *	A new Tcl_Obj representing the Item.
+ *
+ * Side effects:
+ *	Memory is allocated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+Tcl_Obj *
+TreeItem_ToObj(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item		/* Item token. */
+    )
+{
+    char buf[100 + TCL_INTEGER_SPACE];
+    Tcl_Obj *objPtr;
+
+    if (tree->itemPrefixLen)
+	(void) sprintf(buf, "%s%d", tree->itemPrefix, item->id);
+    else
+	(void) sprintf(buf, "%d", item->id);
+    objPtr = Tcl_NewStringObj(buf, -1);
+    if (ITEM_HEADER(item) == NULL)
+	ItemIdObj_Set(tree, objPtr, item->id);
+    return objPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Item_Configure --
+ *
+ *	This procedure is called to process an objc/objv list, plus
+ *	the Tk option database, in order to configure (or reconfigure)
+ *	an Item.
+ *
+ * Results:
+ *	The return value is a standard Tcl result.  If TCL_ERROR is
+ *	returned, then the interp's result contains an error message.
+ *
+ * Side effects:
+ *	Configuration information gets set for item;  old resources get
+ *	freed, if there were any.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+Item_Configure(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item,		/* Item to configure. */
+    int objc,			/* Number of arguments */
+    Tcl_Obj *CONST objv[]	/* Array of arguments */
+    )
+{
+    Tk_SavedOptions savedOptions;
+    int error;
+    Tcl_Obj *errorResult = NULL;
+    int mask;
+    int lastVisible = IS_VISIBLE(item);
+    int lastWrap = IS_WRAP(item);
+    TagInfo *lastTags = item->tagInfo;
+
+    for (error = 0; error <= 1; error++) {
+	if (error == 0) {
+	    if (Tree_SetOptions(tree, STATE_DOMAIN_ITEM, item, tree->itemOptionTable,
+			objc, objv, &savedOptions, &mask) != TCL_OK) {
+		mask = 0;
+		continue;
+	    }
+
+	    /* xxx */
+
+	    Tk_FreeSavedOptions(&savedOptions);
+	    break;
+	} else {
+	    errorResult = Tcl_GetObjResult(tree->interp);
+	    Tcl_IncrRefCount(errorResult);
+	    Tk_RestoreSavedOptions(&savedOptions);
+
+	    /* xxx */
+
+	    Tcl_SetObjResult(tree->interp, errorResult);
+	    Tcl_DecrRefCount(errorResult);
+	    return TCL_ERROR;
+	}
+    }
+
+    if (mask & ITEM_CONF_SIZE) {
+	Tree_FreeItemDInfo(tree, item, NULL);
+	Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
+    }
+
+    if (mask & ITEM_CONF_BUTTON) {
+	if (tree->columnTree != NULL)
+	    Tree_InvalidateItemDInfo(tree, tree->columnTree, item, NULL);
+    }
+
+    if ((mask & ITEM_CONF_VISIBLE) && (IS_VISIBLE(item) != lastVisible)) {
+	Tree_VisibilityChanged(tree);
+#ifdef SELECTION_VISIBLE
+	if (lastVisible)
+	    Tree_SubtreeHidden(tree, item);
+#endif
+
+	/* Changing the visibility of an item can change the width of
+	 * any column. This is due to column expansion (a style may
+	 * be the widest in a column) or when any span > 1. */
+	TreeColumns_InvalidateWidthOfItems(tree, NULL);
+	TreeColumns_InvalidateSpans(tree);
+
+	/* If this is the last child, redraw the lines of the previous
+	 * sibling and all of its descendants because the line from
+	 * the previous sibling to us is appearing/disappearing. */
+	if ((item->prevSibling != NULL) &&
+		(item->nextSibling == NULL) &&
+		tree->showLines && (tree->columnTree != NULL)) {
+	    TreeItem last = item->prevSibling;
+	    while (last->lastChild != NULL)
+		last = last->lastChild;
+	    Tree_InvalidateItemDInfo(tree, tree->columnTree,
+		    item->prevSibling,
+		    last);
+	}
+
+	/* Redraw the parent if the parent has "-button auto". */
+	if ((item->parent != NULL) &&
+		(item->parent->flags & ITEM_FLAG_BUTTON_AUTO) &&
+		tree->showButtons && (tree->columnTree != NULL)) {
+	    Tree_InvalidateItemDInfo(tree, tree->columnTree, item->parent,
+		    NULL);
+	}
+
+	if (Item_IsIndexTail(tree, item))
+	    Item_UpdateIndexTail(tree, item, item->index);
+	else
+	    tree->updateIndex = 1;
+	Tree_DInfoChanged(tree, DINFO_REDO_RANGES | DINFO_REDO_SELECTION);
+    }
+
+    if ((mask & ITEM_CONF_WRAP) && (IS_WRAP(item) != lastWrap)) {
+	/* -wrap doesn't change any Item.index or Item.indexVis, only the
+	 * count of visible wrapping items. */
+	if (!tree->updateIndex && (item->indexVis != -1))
+	    tree->itemWrapCount += IS_WRAP(item) ? 1 : -1;
+	TreeColumns_InvalidateWidthOfItems(tree, NULL);
+	Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
+    }
+
+    if (item->tagInfo != lastTags)
+	Item_TagsChanged(tree, item);
+
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * NoStyleMsg --
+ *
+ *	Utility to set the interpreter result with a message indicating
+ *	a Column has no assigned style.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Interpreter result is changed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+NoStyleMsg(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item,		/* Item record. */
+    int columnIndex		/* 0-based index of the column that
+				 * has no style. */
+    )
+{
+    FormatResult(tree->interp,
+	    "%s %s%d column %s%d has no style",
+	    ITEM_HEADER(item) ? "header" : "item",
+	    ITEM_HEADER(item) ? "" : tree->itemPrefix, item->id,
+	    tree->columnPrefix,
+	    TreeColumn_GetID(Tree_FindColumn(tree, columnIndex)));
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StateDomainErrMsg --
+ *
+ *	Utility to set the interpreter result with a message indicating
+ *	a style's state-domain isn't compatible.
+ *
+ * Results:
+ *	Interpreter result is changed.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+StateDomainErrMsg(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item,		/* Item record. */
+    TreeStyle style		/* Style token. */
+    )
+{
+    FormatResult(tree->interp,
+	    "state domain conflict between %s \"%s%d\" and style \"%s\"",
+	    ITEM_HEADER(item) ? "header" : "item",
+	    ITEM_HEADER(item) ? "" : tree->itemPrefix, item->id,
+	    TreeStyle_GetName(tree, style));
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeItemCmd_Bbox --
+ *
+ *	This procedure is invoked to process the [item bbox] widget
+ *	command.  See the user documentation for details on what
+ *	it does.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	See the user documentation.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TreeItemCmd_Bbox(
+    TreeCtrl *tree,		/* Widget info. */
+    int objc,			/* Number of arguments. */
+    Tcl_Obj *CONST objv[],	/* Argument values. */
+    int doHeaders		/* TRUE to operate on headers, FALSE
+				 * to operate on items. */
+    )
+{
+    Tcl_Interp *interp = tree->interp;
+    TreeItem item;
+    int count;
+    TreeColumn treeColumn;
+    TreeRectangle rect;
+
+    if (objc < 4 || objc > 6) {
+	Tcl_WrongNumArgs(interp, 3, objv,
+	    doHeaders ?
+		"header ?column? ?element?" :
+		"item ?column? ?element?");
+	return TCL_ERROR;
+    }
+
+    if (doHeaders) {
+	TreeHeader header;
+	if (TreeHeader_FromObj(tree, objv[3], &header) != TCL_OK)
+	    return TCL_ERROR;
+	item = TreeHeader_GetItem(header);
+    } else {
+	if (TreeItem_FromObj(tree, objv[3], &item, IFO_NOT_NULL) != TCL_OK)
+	    return TCL_ERROR;
+    }
+
+    (void) Tree_GetOriginX(tree);
+    (void) Tree_GetOriginY(tree);
+
+    if (objc == 4) {
+	/* If an item is visible but has zero height a valid bbox
+	 * is returned. */
+	if (Tree_ItemBbox(tree, item, COLUMN_LOCK_NONE, &rect) < 0)
+	    return TCL_OK;
+
+	if (doHeaders)
+	    rect.width -= tree->tailExtend;
+    } else {
+	if (TreeColumn_FromObj(tree, objv[4], &treeColumn,
+		CFO_NOT_NULL | CFO_NOT_TAIL) != TCL_OK)
+	    return TCL_ERROR;
+
+	/* Bounds of a column. */
+	if (objc == 5) {
+	    objc = 0;
+	    objv = NULL;
+
+	/* Single element in a column. */
+	} else {
+	    TreeItemColumn column;
+	    TreeElement elem;
+
+	    objc -= 5;
+	    objv += 5;
+
+	    /* Validate the style + element here.  If a span has zero size
+	     * it won't be done. */
+	    column = TreeItem_FindColumn(tree, item, TreeColumn_Index(treeColumn));
+	    if (column == NULL || column->style == NULL || TreeStyle_IsHeaderStyle(tree, column->style)) {
+		NoStyleMsg(tree, item, TreeColumn_Index(treeColumn));
+		return TCL_ERROR;
+	    }
+	    if (TreeElement_FromObj(tree, objv[0], &elem) != TCL_OK)
+		return TCL_ERROR;
+	    if (TreeStyle_FindElement(tree, column->style, elem, NULL) != TCL_OK)
+		return TCL_ERROR;
+	}
+
+	count = TreeItem_GetRects(tree, item, treeColumn, objc, objv, &rect);
+	if (count == 0)
+	    return TCL_OK;
+	if (count == -1)
+	    return TCL_ERROR;
+    }
+
+    /* Canvas -> window coordinates */
+    FormatResult(interp, "%d %d %d %d",
+	    TreeRect_Left(rect) - tree->xOrigin,
+	    TreeRect_Top(rect) - tree->yOrigin,
+	    TreeRect_Left(rect) - tree->xOrigin + TreeRect_Width(rect),
+	    TreeRect_Top(rect) - tree->yOrigin + TreeRect_Height(rect));
+
+    return TCL_OK;
+}
+
+static int
+ItemBboxCmd(
+    ClientData clientData,	/* Widget info. */
+    Tcl_Interp *interp,		/* Current interpreter. */
+    int objc,			/* Number of arguments. */
+    Tcl_Obj *CONST objv[]	/* Argument values. */
+    )
+{
+    TreeCtrl *tree = clientData;
+
+    return TreeItemCmd_Bbox(tree, objc, objv, FALSE);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ItemCreateCmd --
+ *
+ *	This procedure is invoked to process the [item create] widget
+ *	command.  See the user documentation for details on what
+ *	it does.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	See the user documentation.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ItemCreateCmd(
+    ClientData clientData,	/* Widget info. */
+    Tcl_Interp *interp,		/* Current interpreter. */
+    int objc,			/* Number of arguments. */
+    Tcl_Obj *CONST objv[]	/* Argument values. */
+    )
+{
+    TreeCtrl *tree = clientData;
+    static CONST char *optionNames[] = { "-button", "-count", "-enabled",
+	"-height", "-nextsibling", "-open", "-parent", "-populate",
+	"-prevsibling", "-returnid", "-tags", "-visible", "-wrap",
+	(char *) NULL };
+    enum { OPT_BUTTON, OPT_COUNT, OPT_ENABLED, OPT_HEIGHT, OPT_NEXTSIBLING,
+	OPT_OPEN, OPT_PARENT, OPT_POPULATE, OPT_PREVSIBLING, OPT_RETURNID,
+	OPT_TAGS, OPT_VISIBLE, OPT_WRAP };
+    int index, i, count = 1, button = 0, returnId = 1, open = 1, visible = 1;
+    int enabled = 1, wrap = 0, height = 0, populate = 0, state;
+    TreeItem item, parent = NULL, prevSibling = NULL, nextSibling = NULL;
+    TreeItem head = NULL, tail = NULL;
+    Tcl_Obj *listObj = NULL, *tagsObj = NULL;
+    TagInfo *tagInfo = NULL;
+    TreeColumn treeColumn;
+
+    for (i = 3; i < objc; i += 2) {
+	if (Tcl_GetIndexFromObj(interp, objv[i], optionNames, "option", 0,
+		&index) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	if (i + 1 == objc) {
+	    FormatResult(interp, "missing value for \"%s\" option",
+		    optionNames[index]);
+	    return TCL_ERROR;
+	}
+	switch (index) {
+	    case OPT_BUTTON: {
+		int length;
+		char *s = Tcl_GetStringFromObj(objv[i + 1], &length);
+		if (s[0] == 'a' && strncmp(s, "auto", length) == 0) {
+		    button = ITEM_FLAG_BUTTON_AUTO;
+		} else {
+		    if (Tcl_GetBooleanFromObj(interp, objv[i + 1], &button) != TCL_OK) {
+			FormatResult(interp, "expected boolean or auto but got \"%s\"", s);
+			return TCL_ERROR;
+		    }
+		    if (button) {
+			button = ITEM_FLAG_BUTTON;
+		    }
+		}
+		break;
+	    }
+	    case OPT_COUNT:
+		if (Tcl_GetIntFromObj(interp, objv[i + 1], &count) != TCL_OK)
+		    return TCL_ERROR;
+		if (count <= 0) {
+		    FormatResult(interp, "bad count \"%d\": must be > 0",
+			    count);
+		    return TCL_ERROR;
+		}
+		break;
+	    case OPT_ENABLED:
+		if (Tcl_GetBooleanFromObj(interp, objv[i + 1], &enabled)
+			!= TCL_OK) {
+		    return TCL_ERROR;
+		}
+		break;
+	    case OPT_HEIGHT:
+		if (Tk_GetPixelsFromObj(interp, tree->tkwin, objv[i + 1],
+			&height) != TCL_OK)
+		    return TCL_ERROR;
+		if (height < 0) {
+		    FormatResult(interp, "bad screen distance \"%s\": must be > 0",
+			    Tcl_GetString(objv[i + 1]));
+		    return TCL_ERROR;
+		}
+		break;
+	    case OPT_NEXTSIBLING:
+		if (TreeItem_FromObj(tree, objv[i + 1], &nextSibling,
+			IFO_NOT_NULL | IFO_NOT_ROOT | IFO_NOT_ORPHAN) != TCL_OK) {
+		    return TCL_ERROR;
+		}
+		parent = prevSibling = NULL;
+		break;
+	    case OPT_OPEN:
+		if (Tcl_GetBooleanFromObj(interp, objv[i + 1], &open)
+			!= TCL_OK) {
+		    return TCL_ERROR;
+		}
+		break;
+	    case OPT_PARENT:
+		if (TreeItem_FromObj(tree, objv[i + 1], &parent, IFO_NOT_NULL) != TCL_OK) {
+		    return TCL_ERROR;
+		}
+		prevSibling = nextSibling = NULL;
+		break;
+	    case OPT_POPULATE:
+		if (Tcl_GetBooleanFromObj(interp, objv[i + 1], &populate)
+			!= TCL_OK) {
+		    return TCL_ERROR;
+		}
+		break;
+	    case OPT_PREVSIBLING:
+		if (TreeItem_FromObj(tree, objv[i + 1], &prevSibling,
+			IFO_NOT_NULL | IFO_NOT_ROOT | IFO_NOT_ORPHAN) != TCL_OK) {
+		    return TCL_ERROR;
+		}
+		parent = nextSibling = NULL;
+		break;
+	    case OPT_RETURNID:
+		if (Tcl_GetBooleanFromObj(interp, objv[i + 1], &returnId)
+			!= TCL_OK) {
+		    return TCL_ERROR;
+		}
+		break;
+	    case OPT_TAGS:
+		tagsObj = objv[i + 1];
+		break;
+	    case OPT_VISIBLE:
+		if (Tcl_GetBooleanFromObj(interp, objv[i + 1], &visible)
+			!= TCL_OK) {
+		    return TCL_ERROR;
+		}
+		break;
+	    case OPT_WRAP:
+		if (Tcl_GetBooleanFromObj(interp, objv[i + 1], &wrap)
+			!= TCL_OK) {
+		    return TCL_ERROR;
+		}
+		break;
+	}
+    }
+
+    /* Do it here so I don't have to free it above if an error occurs. */
+    if (tagsObj != NULL) {
+	if (TagInfo_FromObj(tree, tagsObj, &tagInfo) != TCL_OK)
+	    return TCL_ERROR;
+    }
+
+    if (returnId)
+	listObj = Tcl_NewListObj(0, NULL);
+
+    /* Don't allow non-deleted items to become children of a
+    * deleted item. */
+    if ((parent && IS_DELETED(parent)) ||
+	(prevSibling && IS_DELETED(prevSibling->parent)) ||
+	(nextSibling && IS_DELETED(nextSibling->parent)))
+	parent = prevSibling = nextSibling = NULL;
+
+    for (i = 0; i < count; i++) {
+	item = Item_Alloc(tree, FALSE);
+	item->flags &= ~(ITEM_FLAG_BUTTON | ITEM_FLAG_BUTTON_AUTO);
+	item->flags |= button;
+	state = item->state & ~(STATE_ITEM_ENABLED | STATE_ITEM_OPEN);
+	if (enabled) state |= STATE_ITEM_ENABLED;
+	if (open) state |= STATE_ITEM_OPEN;
+	Item_SetState(tree, item, state);
+	if (visible) item->flags |= ITEM_FLAG_VISIBLE;
+	else item->flags &= ~ITEM_FLAG_VISIBLE;
+	if (wrap) item->flags |= ITEM_FLAG_WRAP;
+	else item->flags &= ~ITEM_FLAG_WRAP;
+	if (populate) item->flags |= ITEM_FLAG_POPULATE;
+	item->fixedHeight = height;
+
+	/* Apply each column's -itemstyle option. */
+	for (treeColumn = tree->columns; treeColumn != NULL;
+		treeColumn = TreeColumn_Next(treeColumn)) {
+	    TreeStyle style = TreeColumn_ItemStyle(treeColumn);
+	    if (style != NULL) {
+		TreeItemColumn column = Item_CreateColumn(tree, item,
+			TreeColumn_Index(treeColumn), NULL);
+		column->style = TreeStyle_NewInstance(tree, style);
+	    }
+	}
+#ifdef DEPRECATED
+	/* Apply default styles */
+	if (tree->defaultStyle.numStyles) {
+	    int i, n = MIN(tree->columnCount, tree->defaultStyle.numStyles);
+
+	    for (i = 0; i < n; i++) {
+		TreeItemColumn column = Item_CreateColumn(tree, item, i, NULL);
+		if (column->style != NULL)
+		    continue;
+		if (tree->defaultStyle.styles[i] != NULL) {
+		    column->style = TreeStyle_NewInstance(tree,
+			    tree->defaultStyle.styles[i]);
+		}
+	    }
+	}
+#endif /* DEPRECATED */
+
+	if (tagInfo != NULL) {
+	    if (count == 1) {
+		item->tagInfo = tagInfo;
+		tagInfo = NULL;
+	    } else {
+		item->tagInfo = TagInfo_Copy(tree, tagInfo);
+	    }
+	    Item_TagsChanged(tree, item);
+	}
+
+	/* Link the new items together as siblings */
+	if (parent || prevSibling || nextSibling) {
+	    if (head == NULL)
+		head = item;
+	    if (tail != NULL) {
+		tail->nextSibling = item;
+		item->prevSibling = tail;
+	    }
+	    tail = item;
+	}
+
+	if (returnId)
+	    Tcl_ListObjAppendElement(interp, listObj, TreeItem_ToObj(tree,
+		    item));
+    }
+
+    if (parent != NULL) {
+	head->prevSibling = parent->lastChild;
+	if (parent->lastChild != NULL)
+	    parent->lastChild->nextSibling = head;
+	else
+	    parent->firstChild = head;
+	parent->lastChild = tail;
+    } else if (prevSibling != NULL) {
+	parent = prevSibling->parent;
+	if (prevSibling->nextSibling != NULL)
+	    prevSibling->nextSibling->prevSibling = tail;
+	else
+	    parent->lastChild = tail;
+	head->prevSibling = prevSibling;
+	tail->nextSibling = prevSibling->nextSibling;
+	prevSibling->nextSibling = head;
+    } else if (nextSibling != NULL) {
+	parent = nextSibling->parent;
+	if (nextSibling->prevSibling != NULL)
+	    nextSibling->prevSibling->nextSibling = head;
+	else
+	    parent->firstChild = head;
+	head->prevSibling = nextSibling->prevSibling;
+	tail->nextSibling = nextSibling;
+	nextSibling->prevSibling = tail;
+    }
+
+    if (parent != NULL) {
+	unsigned int epoch = tree->visEpoch;
+
+	for (item = head; item != NULL; item = item->nextSibling) {
+	    item->parent = parent;
+	    item->depth = parent->depth + 1;
+	}
+	parent->numChildren += count;
+	TreeItem_AddToParent(tree, head);
+	Item_SortChildrenAdded(tree, parent, head, count, epoch);
+    }
+
+    TagInfo_Free(tree, tagInfo);
+
+    if (returnId)
+	Tcl_SetObjResult(interp, listObj);
+
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Item_Import --
+ *
+ *	Create items from a list of item descriptions, as accepted by
+ *	the [item import] widget command.  Each description is a list of
+ *	key/value pairs; the "children" key holds a nested list of item
+ *	descriptions.
+ *
+ * Results:
+ *	A standard Tcl result.  The new items are linked together but
+ *	not inserted into the tree.  When an error occurs the items
+ *	created so far are still linked (and must be deleted by the
+ *	caller).
+ *
+ * Side effects:
+ *	Memory is allocated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+Item_Import(
+    TreeCtrl *tree,		/* Widget info. */
+    Tcl_Obj *listObj,		/* List of item descriptions. */
+    TreeItem parent,		/* New item the items are appended to as
+				 * children, or NULL to chain them as
+				 * siblings from *headPtr to *tailPtr. */
+    int depth,			/* Depth of the new items. */
+    TreeItem *headPtr,		/* In/out: first new sibling. */
+    TreeItem *tailPtr,		/* In/out: last new sibling. */
+    Tcl_Obj *resultObj		/* List to append new item ids to. */
+    )
+{
+    Tcl_Interp *interp = tree->interp;
+    static CONST char *keyNames[] = { "button", "children", "open",
+	"styles", "tags", "texts", (char *) NULL };
+    enum { KEY_BUTTON, KEY_CHILDREN, KEY_OPEN, KEY_STYLES, KEY_TAGS,
+	KEY_TEXTS };
+    int objc, keyc, valc, i, j, k, index, length, button, open;
+    Tcl_Obj **objv, **keyv, **valv, *childrenObj, *textsObj;
+    TreeItem item;
+    TreeColumn treeColumn;
+    TreeItemColumn column;
+    TreeStyle style;
+    TreeElement elem;
+    TagInfo *tagInfo;
+
+    if (Tcl_ListObjGetElements(interp, listObj, &objc, &objv) != TCL_OK)
+	return TCL_ERROR;
+
+    for (i = 0; i < objc; i++) {
+	if (Tcl_ListObjGetElements(interp, objv[i], &keyc, &keyv) != TCL_OK)
+	    return TCL_ERROR;
+	if (keyc & 1) {
+	    FormatResult(interp, "missing value for \"%s\"",
+		    Tcl_GetString(keyv[keyc - 1]));
+	    return TCL_ERROR;
+	}
+
+	item = Item_Alloc(tree, FALSE);
+	item->depth = depth;
+	if (parent != NULL) {
+	    item->parent = parent;
+	    item->prevSibling = parent->lastChild;
+	    if (parent->lastChild != NULL)
+		parent->lastChild->nextSibling = item;
+	    else
+		parent->firstChild = item;
+	    parent->lastChild = item;
+	    parent->numChildren++;
+	} else {
+	    if (*headPtr == NULL)
+		*headPtr = item;
+	    else {
+		(*tailPtr)->nextSibling = item;
+		item->prevSibling = *tailPtr;
+	    }
+	    *tailPtr = item;
+	}
+	Tcl_ListObjAppendElement(NULL, resultObj, TreeItem_ToObj(tree, item));
+
+	/* Apply each column's -itemstyle option. */
+	for (treeColumn = tree->columns; treeColumn != NULL;
+		treeColumn = TreeColumn_Next(treeColumn)) {
+	    style = TreeColumn_ItemStyle(treeColumn);
+	    if (style != NULL) {
+		column = Item_CreateColumn(tree, item,
+			TreeColumn_Index(treeColumn), NULL);
+		column->style = TreeStyle_NewInstance(tree, style);
+	    }
+	}
+
+	childrenObj = textsObj = NULL;
+	for (j = 0; j < keyc; j += 2) {
+	    if (Tcl_GetIndexFromObj(interp, keyv[j], keyNames, "key", 0,
+		    &index) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    switch (index) {
+		case KEY_BUTTON: {
+		    char *str = Tcl_GetStringFromObj(keyv[j + 1], &length);
+		    if (str[0] == 'a' && strncmp(str, "auto", length) == 0) {
+			button = ITEM_FLAG_BUTTON_AUTO;
+		    } else {
+			if (Tcl_GetBooleanFromObj(interp, keyv[j + 1],
+				&button) != TCL_OK) {
+			    FormatResult(interp, "expected boolean or auto but got \"%s\"", str);
+			    return TCL_ERROR;
+			}
+			if (button) {
+			    button = ITEM_FLAG_BUTTON;
+			}
+		    }
+		    item->flags &= ~(ITEM_FLAG_BUTTON | ITEM_FLAG_BUTTON_AUTO);
+		    item->flags |= button;
+		    break;
+		}
+		case KEY_CHILDREN:
+		    childrenObj = keyv[j + 1];
+		    break;
+		case KEY_OPEN:
+		    if (Tcl_GetBooleanFromObj(interp, keyv[j + 1], &open)
+			    != TCL_OK) {
+			return TCL_ERROR;
+		    }
+		    Item_SetState(tree, item, open ?
+			    (item->state | STATE_ITEM_OPEN) :
+			    (item->state & ~STATE_ITEM_OPEN));
+		    break;
+		case KEY_STYLES:
+		    if (Tcl_ListObjGetElements(interp, keyv[j + 1], &valc,
+			    &valv) != TCL_OK) {
+			return TCL_ERROR;
+		    }
+		    if (valc > tree->columnCount) {
+			FormatResult(interp,
+				"too many styles: there are only %d columns",
+				tree->columnCount);
+			return TCL_ERROR;
+		    }
+		    for (k = 0; k < valc; k++) {
+			(void) Tcl_GetStringFromObj(valv[k], &length);
+			if (length == 0)
+			    continue;
+			if (TreeStyle_FromObj(tree, valv[k], &style) != TCL_OK)
+			    return TCL_ERROR;
+			if (TreeStyle_GetStateDomain(tree, style) !=
+				STATE_DOMAIN_ITEM) {
+			    StateDomainErrMsg(tree, item, style);
+			    return TCL_ERROR;
+			}
+			column = Item_CreateColumn(tree, item, k, NULL);
+			TreeItemColumn_ForgetStyle(tree, column);
+			column->style = TreeStyle_NewInstance(tree, style);
+		    }
+		    break;
+		case KEY_TAGS:
+		    if (TagInfo_FromObj(tree, keyv[j + 1], &tagInfo) != TCL_OK)
+			return TCL_ERROR;
+		    TagInfo_Free(tree, item->tagInfo);
+		    item->tagInfo = tagInfo;
+		    Item_TagsChanged(tree, item);
+		    break;
+		case KEY_TEXTS:
+		    /* Done after all the styles are assigned. */
+		    textsObj = keyv[j + 1];
+		    break;
+	    }
+	}
+
+	if (textsObj != NULL) {
+	    if (Tcl_ListObjGetElements(interp, textsObj, &valc, &valv)
+		    != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    if (valc > tree->columnCount) {
+		FormatResult(interp,
+			"too many texts: there are only %d columns",
+			tree->columnCount);
+		return TCL_ERROR;
+	    }
+	    for (k = 0; k < valc; k++) {
+		(void) Tcl_GetStringFromObj(valv[k], &length);
+		if (length == 0)
+		    continue;
+		column = TreeItem_FindColumn(tree, item, k);
+		if ((column == NULL) || (column->style == NULL)) {
+		    NoStyleMsg(tree, item, k);
+		    return TCL_ERROR;
+		}
+		if (TreeStyle_SetText(tree, item, column, column->style,
+			valv[k], &elem) != TCL_OK) {
+		    return TCL_ERROR;
+		}
+	    }
+	}
+
+	if (childrenObj != NULL) {
+	    if (Item_Import(tree, childrenObj, item, depth + 1, NULL, NULL,
+		    resultObj) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	}
+    }
+
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ItemImportCmd --
+ *
+ *	This procedure is invoked to process the [item import] widget
+ *	command.  See the user documentation for details on what
+ *	it does.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	See the user documentation.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ItemImportCmd(
+    ClientData clientData,	/* Widget info. */
+    Tcl_Interp *interp,		/* Current interpreter. */
+    int objc,			/* Number of arguments. */
+    Tcl_Obj *CONST objv[]	/* Argument values. */
+    )
+{
+    TreeCtrl *tree = clientData;
+    TreeItem parent, item, next, last, head = NULL, tail = NULL;
+    Tcl_Obj *listObj;
+    int count = 0;
+
+    if (objc != 5) {
+	Tcl_WrongNumArgs(interp, 3, objv, "parent data");
+	return TCL_ERROR;
+    }
+    if (TreeItem_FromObj(tree, objv[3], &parent, IFO_NOT_NULL) != TCL_OK)
+	return TCL_ERROR;
+    if (IS_DELETED(parent)) {
+	FormatResult(interp, "item %s%d is being deleted",
+		tree->itemPrefix, parent->id);
+	return TCL_ERROR;
+    }
+
+    /* Build the whole subtree off to the side, then insert it with a
+     * single TreeItem_AddToParent() so the list is laid out once. */
+    listObj = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(listObj);
+    if (Item_Import(tree, objv[4], NULL, parent->depth + 1, &head, &tail,
+	    listObj) != TCL_OK) {
+	for (item = head; item != NULL; item = next) {
+	    next = item->nextSibling;
+	    item->prevSibling = item->nextSibling = NULL;
+	    TreeItem_Delete(tree, item);
+	}
+	Tcl_DecrRefCount(listObj);
+	return TCL_ERROR;
+    }
+
+    if (head != NULL) {
+	unsigned int epoch = tree->visEpoch;
+
+	/* TreeItem_AddToParent() only redraws the lines of the previous
+	 * last child when it is given the new last child, so do that here
+	 * when more than one sibling is appended. */
+	if ((parent->lastChild != NULL) && (head != tail) &&
+		tree->showLines && (tree->columnTree != NULL)) {
+	    last = parent->lastChild;
+	    while (last->lastChild != NULL)
+		last = last->lastChild;
+	    Tree_InvalidateItemDInfo(tree, tree->columnTree,
+		    parent->lastChild, last);
+	}
+
+	head->prevSibling = parent->lastChild;
+	if (parent->lastChild != NULL)
+	    parent->lastChild->nextSibling = head;
+	else
+	    parent->firstChild = head;
+	parent->lastChild = tail;
+	for (item = head; item != NULL; item = item->nextSibling) {
+	    item->parent = parent;
+	    count++;
+	}
+	parent->numChildren += count;
+	TreeItem_AddToParent(tree, head);
+	Item_SortChildrenAdded(tree, parent, head, count, epoch);
+    }
+
+    Tcl_SetObjResult(interp, listObj);
+    Tcl_DecrRefCount(listObj);
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ItemMoveCmd --
+ *
+ *	This procedure is invoked to process the [item move] widget
+ *	command.  See the user documentation for details on what
+ *	it does.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	See the user documentation.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ItemMoveCmd(
+    ClientData clientData,	/* Widget info. */
+    Tcl_Interp *interp,		/* Current interpreter. */
+    int objc,			/* Number of arguments. */
+    Tcl_Obj *CONST objv[]	/* Argument values. */
+    )
+{
+    TreeCtrl *tree = clientData;
+    static CONST char *whereNames[] = {
+	"firstchild", "lastchild", "nextsibling", "prevsibling",
+	(char *) NULL
+    };
+    enum {
+	WHERE_FIRSTCHILD, WHERE_LASTCHILD, WHERE_NEXTSIBLING,
+	WHERE_PREVSIBLING
+    };
+    TreeItemList items, moved;
+    TreeItem target, item, parent, prev, next, head = NULL, tail = NULL;
+    ItemForEach iter;
+    int where, i, count, result = TCL_OK;
+
+    if (objc != 6) {
+	Tcl_WrongNumArgs(interp, 3, objv, "itemDesc where target");
+	return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[4], whereNames, "where", 0,
+	    &where) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (TreeItem_FromObj(tree, objv[5], &target, IFO_NOT_NULL |
+	    ((where == WHERE_NEXTSIBLING || where == WHERE_PREVSIBLING) ?
+	    (IFO_NOT_ROOT | IFO_NOT_ORPHAN) : 0)) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (IS_DELETED(target)) {
+	FormatResult(interp, "item %s%d is being deleted",
+		tree->itemPrefix, target->id);
+	return TCL_ERROR;
+    }
+
+    TreeItemList_Init(tree, &items, 0);
+    TreeItemList_Init(tree, &moved, 0);
+    if (TreeItemList_FromObj(tree, objv[3], &items,
+	    IFO_NOT_NULL | IFO_NOT_ROOT) != TCL_OK) {
+	result = TCL_ERROR;
+	goto done;
+    }
+
+    /* Check every item before moving any of them. Duplicates are
+     * skipped. */
+    ITEM_FOR_EACH(item, &items, NULL, &iter) {
+	if (item->flags & ITEM_FLAG_MOVING)
+	    continue;
+	if (IS_DELETED(item)) {
+	    FormatResult(interp, "item %s%d is being deleted",
+		    tree->itemPrefix, item->id);
+	    result = TCL_ERROR;
+	    break;
+	}
+	if (item == target) {
+	    FormatResult(interp, "item %s%d same as second item",
+		    tree->itemPrefix, item->id);
+	    result = TCL_ERROR;
+	    break;
+	}
+	if (TreeItem_IsAncestor(tree, item, target)) {
+	    FormatResult(interp, "item %s%d is ancestor of item %s%d",
+		    tree->itemPrefix, item->id, tree->itemPrefix, target->id);
+	    result = TCL_ERROR;
+	    break;
+	}
+	item->flags |= ITEM_FLAG_MOVING;
+	TreeItemList_Append(&moved, item);
+    }
+    count = TreeItemList_Count(&moved);
+    for (i = 0; i < count; i++) {
+	item = TreeItemList_Nth(&moved, i);
+	item->flags &= ~ITEM_FLAG_MOVING;
+    }
+    if (result != TCL_OK || count == 0)
+	goto done;
+
+    /* Unlink each item and chain them together in the order given. */
+    for (i = 0; i < count; i++) {
+	item = TreeItemList_Nth(&moved, i);
+	parent = item->parent;
+#ifdef SELECTION_VISIBLE
+	Tree_SubtreeHidden(tree, item);
+#endif
+	if (parent != NULL) {
+	    if (item->prevSibling != NULL)
+		item->prevSibling->nextSibling = item->nextSibling;
+	    else
+		parent->firstChild = item->nextSibling;
+	    if (item->nextSibling != NULL)
+		item->nextSibling->prevSibling = item->prevSibling;
+	    else
+		parent->lastChild = item->prevSibling;
+	    parent->numChildren--;
+	}
+	item->prevSibling = tail;
+	item->nextSibling = NULL;
+	if (tail != NULL)
+	    tail->nextSibling = item;
+	else
+	    head = item;
+	tail = item;
+    }
+
+    /* The neighbors are found only now since they may have been among
+     * the moved items. */
+    switch (where) {
+	case WHERE_FIRSTCHILD:
+	    parent = target;
+	    prev = NULL;
+	    next = target->firstChild;
+	    break;
+	case WHERE_LASTCHILD:
+	    parent = target;
+	    prev = target->lastChild;
+	    next = NULL;
+	    break;
+	case WHERE_NEXTSIBLING:
+	    parent = target->parent;
+	    prev = target;
+	    next = target->nextSibling;
+	    break;
+	default: /* WHERE_PREVSIBLING */
+	    parent = target->parent;
+	    prev = target->prevSibling;
+	    next = target;
+	    break;
+    }
+    head->prevSibling = prev;
+    if (prev != NULL)
+	prev->nextSibling = head;
+    else
+	parent->firstChild = head;
+    tail->nextSibling = next;
+    if (next != NULL)
+	next->prevSibling = tail;
+    else
+	parent->lastChild = tail;
+    parent->numChildren += count;
+    for (item = head; item != next; item = item->nextSibling) {
+	item->parent = parent;
+	if (item->depth != parent->depth + 1)
+	    TreeItem_UpdateDepth(tree, item);
+    }
+
+    /* Everything that TreeItem_RemoveFromParent() and
+     * TreeItem_AddToParent() do for each item is done once here. */
+    tree->updateIndex = 1;
+    Tree_VisibilityChanged(tree);
+    Tree_DInfoChanged(tree, DINFO_INVALIDATE | DINFO_REDO_RANGES);
+    TreeColumns_InvalidateWidthOfItems(tree, NULL);
+    TreeColumns_InvalidateSpans(tree);
+#ifdef SELECTION_VISIBLE
+    Tree_DeselectHidden(tree);
+#endif
+    if (tree->debug.enable && tree->debug.data)
+	Tree_Debug(tree);
+
+done:
+    TreeItemList_Free(&items);
+    TreeItemList_Free(&moved);
+    return result;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ItemElementCmd --
+ *
+ *	This procedure is invoked to process the [item element] widget
+ *	command.  See the user documentation for details on what
+ *	it does.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	See the user documentation.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TreeItemCmd_Element(
+    TreeCtrl *tree,
+    int objc,			/* Number of arguments. */
+    Tcl_Obj *CONST objv[],	/* Argument values. */
+    int doHeaders		/* TRUE to operate on headers, FALSE
+				 * to operate on items. */
+    )
+{
+    Tcl_Interp *interp = tree->interp;
+    static CONST char *commandNames[] = {
+#ifdef DEPRECATED
+	"actual",
+#endif
+	"cget", "configure",
+	"perstate", (char *) NULL };
+    enum {
+#ifdef DEPRECATED
+    COMMAND_ACTUAL,
+#endif
+    COMMAND_CGET, COMMAND_CONFIGURE, COMMAND_PERSTATE };
+    int index;
+    int columnIndex;
+    TreeItemColumn column;
+    TreeItemList itemList;
+    TreeItem item;
+    int flags = IFO_NOT_NULL;
+    int result = TCL_OK;
+    int tailFlag = doHeaders ? 0 : CFO_NOT_TAIL; /* styles allowed in tail? */
+    int domain = doHeaders ? STATE_DOMAIN_HEADER : STATE_DOMAIN_ITEM;
+
+    if (objc < 7) {
+	Tcl_WrongNumArgs(interp, 3, objv,
+	    doHeaders ?
+		"command header column element ?arg ...?" :
+		"command item column element ?arg ...?");
+	return TCL_ERROR;
+    }
+
+    if (Tcl_GetIndexFromObj(interp, objv[3], commandNames, "command", 0,
+		&index) != TCL_OK)
+	return TCL_ERROR;
+
+    /*
+     * [configure] without an option-value pair can operate on a single item
+     * only. [cget] and [perstate] only operate on a single item.
+     */
+    if ((index != COMMAND_CONFIGURE) || (objc < 9))
+	flags |= IFO_NOT_MANY;
+
+    if (doHeaders) {
+	if (TreeHeaderList_FromObj(tree, objv[4], &itemList, flags) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+    } else {
+	if (TreeItemList_FromObj(tree, objv[4], &itemList, flags) != TCL_OK)
+	    return TCL_ERROR;
+    }
+    item = TreeItemList_Nth(&itemList, 0);
+
+    switch (index) {
+	/* T item element perstate I C E option ?stateList? */
+#ifdef DEPRECATED
+	case COMMAND_ACTUAL:
+#endif
+	case COMMAND_PERSTATE: {
+	    int state;
+
+	    if (objc < 8 || objc > 9) {
+		Tcl_WrongNumArgs(tree->interp, 4, objv,
+		    doHeaders ?
+			"header column element option ?stateList?" :
+			"item column element option ?stateList?");
+		result = TCL_ERROR;
+		break;
+	    }
+	    if (TreeItem_ColumnFromObj(tree, item, objv[5], &column,
+		    NULL, &columnIndex, CFO_NOT_NULL | CFO_NOT_TAIL) != TCL_OK) {
+		result = TCL_ERROR;
+		break;
+	    }
+	    if ((column == NULL) || (column->style == NULL) || TreeStyle_IsHeaderStyle(tree, column->style)) {
+		NoStyleMsg(tree, item, columnIndex);
+		result = TCL_ERROR;
+		break;
+	    }
+	    state = item->state | column->cstate;
+	    if (objc == 9) {
+		int states[3];
+
+		if (Tree_StateFromListObj(tree, domain, objv[8], states,
+			    SFO_NOT_OFF | SFO_NOT_TOGGLE) != TCL_OK) {
+		    result = TCL_ERROR;
+		    break;
+		}
+		state = states[STATE_OP_ON];
+	    }
+	    result = TreeStyle_ElementActual(tree, column->style,
+		    state, objv[6], objv[7]);
+	    break;
+	}
+
+	/* T item element cget I C E option */
+	case COMMAND_CGET: {
+	    if (objc != 8) {
+		Tcl_WrongNumArgs(tree->interp, 4, objv,
+		    doHeaders ?
+			"header column element option" :
+			"item column element option");
+		result = TCL_ERROR;
+		break;
+	    }
+	    if (TreeItem_ColumnFromObj(tree, item, objv[5], &column,
+		    NULL, &columnIndex, CFO_NOT_NULL | CFO_NOT_TAIL) != TCL_OK) {
+		result = TCL_ERROR;
+		break;
+	    }
+	    if ((column == NULL) || (column->style == NULL) || TreeStyle_IsHeaderStyle(tree, column->style)) {
+		NoStyleMsg(tree, item, columnIndex);
+		result = TCL_ERROR;
+		break;
+	    }
+	    result = TreeStyle_ElementCget(tree, item,
+		    column, column->style, objv[6], objv[7]);
+	    break;
+	}
+
+	/* T item element configure I C E ... */
+	case COMMAND_CONFIGURE: {
+	    struct columnObj {
+		TreeColumnList columns;
+		int isColumn;
+		int numArgs;
+	    } staticCO[STATIC_SIZE], *co = staticCO;
+	    int i, index, indexElem, prevColumn;
+	    ItemForEach iter;
+
+	    /* If no option-value pair is given, we can't specify more than
+	     * one column. */
+	    flags = CFO_NOT_NULL | tailFlag;
+	    if (objc < 9)
+		flags |= CFO_NOT_MANY;
+
+	    STATIC_ALLOC(co, struct columnObj, objc);
+	    for (i = 5; i < objc; i++) {
+		co[i].isColumn = FALSE;
+		co[i].numArgs = -1;
+	    }
+	    indexElem = 6;
+
+	    /* Get the first column(s) */
+	    i = indexElem - 1;
+	    if (TreeColumnList_FromObj(tree, objv[i], &co[i].columns,
+		    flags) != TCL_OK) {
+		result = TCL_ERROR;
+		break;
+	    }
+	    co[i].isColumn = TRUE;
+	    prevColumn = i;
+
+	    while (1) {
+		int numArgs = 0;
+		char breakChar = '\0';
+
+		/* Look for a + or , */
+		for (index = indexElem + 1; index < objc; index++) {
+		    if (numArgs % 2 == 0) {
+			int length;
+			char *s = Tcl_GetStringFromObj(objv[index], &length);
+
+			if ((length == 1) && ((s[0] == '+') || (s[0] == ','))) {
+			    breakChar = s[0];
+			    break;
+			}
+		    }
+		    numArgs++;
+		}
+
+		/* Require at least one option-value pair if more than one
+		* element is specified. */
+		if ((breakChar || indexElem != 6) && (numArgs < 2)) {
+		    FormatResult(interp,
+			"missing option-value pair after element \"%s\"",
+			Tcl_GetString(objv[indexElem]));
+		    result = TCL_ERROR;
+		    goto doneCONF;
+		}
+
+		co[indexElem].numArgs = numArgs;
+
+		if (!breakChar)
+		    break;
+
+		if (index == objc - 1) {
+		    FormatResult(interp, "missing %s after \"%c\"",
+			(breakChar == '+') ? "element name" : "column",
+			breakChar);
+		    result = TCL_ERROR;
+		    goto doneCONF;
+		}
+
+		/* + indicates start of another element */
+		if (breakChar == '+') {
+		    indexElem = index + 1;
+		}
+
+		/* , indicates start of another column */
+		else if (breakChar == ',') {
+		    co[prevColumn].numArgs = index - prevColumn;
+
+		    if (TreeColumnList_FromObj(tree, objv[index + 1],
+			    &co[index + 1].columns, CFO_NOT_NULL |
+			    tailFlag) != TCL_OK) {
+			result = TCL_ERROR;
+			goto doneCONF;
+		    }
+		    co[index + 1].isColumn = TRUE;
+		    prevColumn = index + 1;
+
+		    indexElem = index + 2;
+		    if (indexElem == objc) {
+			FormatResult(interp,
+			    "missing element name after column \"%s\"",
+			    Tcl_GetString(objv[index + 1]));
+			result = TCL_ERROR;
+			goto doneCONF;
+		    }
+		}
+	    }
+	    co[prevColumn].numArgs = index - prevColumn;
+
+	    ITEM_FOR_EACH(item, &itemList, NULL, &iter) {
+		/* T item element configure I C E option value \
+		*     + E option value , C E option value */
+		int iMask = 0;
+
+		/* co[index].numArgs is the number of arguments from the C
+		 * to the next separator (but not including that separator). */
+		for (index = 5; index < objc; index += co[index].numArgs + 1) {
+		    ColumnForEach citer;
+		    TreeColumn treeColumn;
+#ifdef TREECTRL_DEBUG
+if (!co[index].isColumn) panic("isColumn == FALSE");
+#endif
+		    COLUMN_FOR_EACH(treeColumn, &co[index].columns, NULL, &citer) {
+			int columnIndex, cMask = 0;
+
+			columnIndex = TreeColumn_Index(treeColumn);
+			column = TreeItem_FindColumn(tree, item, columnIndex);
+			if ((column == NULL) || (column->style == NULL) || TreeStyle_IsHeaderStyle(tree, column->style)) {
+			    NoStyleMsg(tree, item, columnIndex);
+			    result = TCL_ERROR;
+			    break;
+			}
+
+			indexElem = index + 1;
+
+			/* Do each element in this column */
+			while (1) {
+			    int eMask, index2;
+#ifdef TREECTRL_DEBUG
+if (co[indexElem].numArgs == -1) panic("indexElem=%d (%s) objc=%d numArgs == -1", indexElem, Tcl_GetString(objv[indexElem]), objc);
+#endif
+			    result = TreeStyle_ElementConfigureFromObj(tree, item,
+				    column, column->style, objv[indexElem],
+				    co[indexElem].numArgs, (Tcl_Obj **) objv + indexElem + 1, &eMask);
+			    if (result != TCL_OK)
+				break;
+
+			    cMask |= eMask;
+
+			    /* co[indexElem].numArgs is the number of
+			     * option-value arguments after the element. */
+			    index2 = indexElem + co[indexElem].numArgs;
+			    if (index2 == objc - 1)
+				break;
 
-    for (i = 3; i < objc; i += 2) {
-	if (Tcl_GetIndexFromObj(interp, objv[i], optionNames, "option", 0,
+			    /* Skip the '+' or ',' */
+			    index2 += 2;
+
+			    if (co[index2].isColumn)
+				break;
+
+			    indexElem = index2;
+			}
+
+			if (cMask & CS_LAYOUT) {
+			    TreeItemColumn_InvalidateSize(tree, column);
+			    TreeColumns_InvalidateWidthOfItems(tree, treeColumn);
+			} else if (cMask & CS_DISPLAY) {
+			    Tree_InvalidateItemDInfo(tree, treeColumn, item, NULL);
+			}
+			iMask |= cMask;
+			if (result != TCL_OK)
+			    break;
+		    }
+		    if (result != TCL_OK)
+			break;
+		}
+		if (iMask & CS_LAYOUT) {
+		    TreeItem_InvalidateHeight(tree, item);
+		    Tree_FreeItemDInfo(tree, item, NULL);
+		    if (ITEM_HEADER(item) == NULL)
+			Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
+		} else if (iMask & CS_DISPLAY) {
+		}
+		if (iMask != 0) {
+		    Item_SortKeyChanged(tree, item);
+		    TreeItem_FindTextChanged(tree, item);
+		}
+		if (result != TCL_OK)
+		    break;
+	    }
+doneCONF:
+	    for (i = 5; i < objc; i++) {
+		if (co[i].isColumn)
+		    TreeColumnList_Free(&co[i].columns);
+	    }
+	    STATIC_FREE(co, struct columnObj, objc);
+	    break;
+	}
+    }
+
+    TreeItemList_Free(&itemList);
+    return result;
+}
+
+static int
+ItemElementCmd(
+    ClientData clientData,	/* Widget info. */
+    Tcl_Interp *interp,		/* Current interpreter. */
+    int objc,			/* Number of arguments. */
+    Tcl_Obj *CONST objv[]	/* Argument values. */
+    )
+{
+    TreeCtrl *tree = clientData;
+    return TreeItemCmd_Element(tree, objc, objv, FALSE);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ItemStyleCmd --
+ *
+ *	This procedure is invoked to process the [item style] widget
+ *	command.  See the user documentation for details on what
+ *	it does.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	See the user documentation.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TreeItemCmd_Style(
+    TreeCtrl *tree,		/* Widget info. */
+    int objc,			/* Number of arguments. */
+    Tcl_Obj *CONST objv[],	/* Argument values. */
+    int doHeaders		/* TRUE to operate on headers, FALSE
+				 * to operate on items. */
+    )
+{
+    Tcl_Interp *interp = tree->interp;
+    int domain = doHeaders ? STATE_DOMAIN_HEADER : STATE_DOMAIN_ITEM;
+    int index;
+    TreeItemList itemList;
+    TreeItem item;
+    int flags = IFO_NOT_NULL;
+    int result = TCL_OK;
+    int tailFlag = doHeaders ? 0 : CFO_NOT_TAIL;
+    static CONST char *commandNames[] = {
+	"elements", "map", "set", (char *) NULL
+    };
+    enum { COMMAND_ELEMENTS, COMMAND_MAP, COMMAND_SET };
+
+    if (objc < 5) {
+	Tcl_WrongNumArgs(interp, 3, objv,
+	    doHeaders ?
+		"command header ?arg ...?" :
+		"command item ?arg ...?");
+	return TCL_ERROR;
+    }
+
+    if (Tcl_GetIndexFromObj(interp, objv[3], commandNames, "command", 0,
 		&index) != TCL_OK) {
+	return TCL_ERROR;
+    }
+
+    /* [style elements] only works on a single item.
+     * [style set] only works on a single item without a column-style pair. */
+    if ((index == COMMAND_ELEMENTS) || (index == COMMAND_SET && objc < 7))
+	flags |= IFO_NOT_MANY;
+    if (doHeaders) {
+	if (TreeHeaderList_FromObj(tree, objv[4], &itemList, flags) != TCL_OK) {
 	    return TCL_ERROR;
 	}
-	if (i + 1 == objc) {
-	    FormatResult(interp, "missing value for \"%s\" option",
-		    optionNames[index]);
+    } else {
+	if (TreeItemList_FromObj(tree, objv[4], &itemList, flags) != TCL_OK) {
 	    return TCL_ERROR;
 	}
-	switch (index) {
-	    case OPT_BUTTON: {
-		int length;
-		char *s = Tcl_GetStringFromObj(objv[i + 1], &length);
-		if (s[0] == 'a' && strncmp(s, "auto", length) == 0) {
-		    button = ITEM_FLAG_BUTTON_AUTO;
-		} else {
-		    if (Tcl_GetBooleanFromObj(interp, objv[i + 1], &button) != TCL_OK) {
-			FormatResult(interp, "expected boolean or auto but got \"%s\"", s);
-			return TCL_ERROR;
-		    }
-		    if (button) {
-			button = ITEM_FLAG_BUTTON;
-		    }
-		}
+    }
+    item = TreeItemList_Nth(&itemList, 0);
+
+    switch (index) {
+	/* T item style elements I C */
+	case COMMAND_ELEMENTS: {
+	    TreeItemColumn column;
+	    int columnIndex;
+
+	    if (objc != 6) {
+		Tcl_WrongNumArgs(interp, 4, objv,
+		    doHeaders ? "header column" : "item column");
+		result = TCL_ERROR;
 		break;
 	    }
-	    case OPT_COUNT:
-		if (Tcl_GetIntFromObj(interp, objv[i + 1], &count) != TCL_OK)
-		    return TCL_ERROR;
-		if (count <= 0) {
-		    FormatResult(interp, "bad count \"%d\": must be > 0",
-			    count);
-		    return TCL_ERROR;
-		}
-		break;
-	    case OPT_ENABLED:
-		if (Tcl_GetBooleanFromObj(interp, objv[i + 1], &enabled)
-			!= TCL_OK) {
-		    return TCL_ERROR;
-		}
+	    if (TreeItem_ColumnFromObj(tree, item, objv[5], &column,
+		    NULL, &columnIndex, CFO_NOT_NULL | CFO_NOT_TAIL) != TCL_OK) {
+		result = TCL_ERROR;
 		break;
-	    case OPT_HEIGHT:
-		if (Tk_GetPixelsFromObj(interp, tree->tkwin, objv[i + 1],
-			&height) != TCL_OK)
-		    return TCL_ERROR;
-		if (height < 0) {
-		    FormatResult(interp, "bad screen distance \"%s\": must be > 0",
-			    Tcl_GetString(objv[i + 1]));
-		    return TCL_ERROR;
-		}
+	    }
+	    if ((column == NULL) || (column->style == NULL) || TreeStyle_IsHeaderStyle(tree, column->style)) {
+		NoStyleMsg(tree, item, columnIndex);
+		result = TCL_ERROR;
 		break;
-	    case OPT_NEXTSIBLING:
-		if (TreeItem_FromObj(tree, objv[i + 1], &nextSibling,
-			IFO_NOT_NULL | IFO_NOT_ROOT | IFO_NOT_ORPHAN) != TCL_OK) {
-		    return TCL_ERROR;
-		}
-		parent = prevSibling = NULL;
+	    }
+	    TreeStyle_ListElements(tree, column->style);
+	    break;
+	}
+
+	/* T item style map I C S map */
+	case COMMAND_MAP: {
+	    TreeStyle style;
+	    TreeColumnList columns;
+	    TreeColumn treeColumn;
+	    TreeItemColumn column;
+	    int columnIndex;
+	    int objcM;
+	    Tcl_Obj **objvM;
+	    ItemForEach iter;
+	    ColumnForEach citer;
+	    int redoRanges = !doHeaders;
+
+	    if (objc != 8) {
+		Tcl_WrongNumArgs(interp, 4, objv,
+		    doHeaders ?
+			"header column style map" :
+			"item column style map");
+		return TCL_ERROR;
+	    }
+	    if (TreeColumnList_FromObj(tree, objv[5], &columns,
+		    CFO_NOT_NULL | tailFlag) != TCL_OK) {
+		result = TCL_ERROR;
 		break;
-	    case OPT_OPEN:
-		if (Tcl_GetBooleanFromObj(interp, objv[i + 1], &open)
-			!= TCL_OK) {
-		    return TCL_ERROR;
+	    }
+	    if (TreeStyle_FromObj(tree, objv[6], &style) != TCL_OK) {
+		result = TCL_ERROR;
+		goto doneMAP;
+	    }
+	    if (TreeStyle_GetStateDomain(tree, style) != domain) {
+		StateDomainErrMsg(tree, item, style);
+		result = TCL_ERROR;
+		goto doneMAP;
+	    }
+	    if (Tcl_ListObjGetElements(interp, objv[7], &objcM, &objvM)
+		    != TCL_OK) {
+		result = TCL_ERROR;
+		goto doneMAP;
+	    }
+	    if (objcM & 1) {
+		FormatResult(interp, "list must contain even number of elements");
+		result = TCL_ERROR;
+		goto doneMAP;
+	    }
+	    ITEM_FOR_EACH(item, &itemList, NULL, &iter) {
+		COLUMN_FOR_EACH(treeColumn, &columns, NULL, &citer) {
+		    columnIndex = TreeColumn_Index(treeColumn);
+		    column = Item_CreateColumn(tree, item, columnIndex, NULL);
+		    if ((column->style != NULL) && !TreeStyle_IsHeaderStyle(tree, column->style)) {
+			if (TreeStyle_Remap(tree, column->style, style, objcM,
+				objvM) != TCL_OK) {
+			    result = TCL_ERROR;
+			    break;
+			}
+		    } else {
+			TreeItemColumn_ForgetStyle(tree, column);
+			column->style = TreeStyle_NewInstance(tree, style);
+		    }
+		    TreeItemColumn_InvalidateSize(tree, column);
+		    TreeColumns_InvalidateWidthOfItems(tree, treeColumn);
 		}
-		break;
-	    case OPT_PARENT:
-		if (TreeItem_FromObj(tree, objv[i + 1], &parent, IFO_NOT_NULL) != TCL_OK) {
-		    return TCL_ERROR;
+		TreeItem_InvalidateHeight(tree, item);
+		Tree_FreeItemDInfo(tree, item, NULL);
+		Item_SortKeyChanged(tree, item);
+		TreeItem_FindTextChanged(tree, item);
+		if (result != TCL_OK)
+		    break;
+	    }
+	    if (redoRanges)
+		Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
+doneMAP:
+	    TreeColumnList_Free(&columns);
+	    break;
+	}
+
+	/* T item style set I ?C? ?S? ?C S ...?*/
+	case COMMAND_SET: {
+	    struct columnStyle {
+		TreeColumnList columns;
+		TreeStyle style;
+	    };
+	    struct columnStyle staticCS[STATIC_SIZE], *cs = staticCS;
+	    TreeColumn treeColumn;
+	    TreeItemColumn column;
+	    int i, count = 0, length, changed = FALSE, changedI;
+	    ItemForEach iter;
+	    ColumnForEach citer;
+
+	    if (objc < 5) {
+		Tcl_WrongNumArgs(interp, 4, objv,
+		    doHeaders ?
+			"header ?column? ?style? ?column style ...?" :
+			"item ?column? ?style? ?column style ...?");
+		return TCL_ERROR;
+	    }
+	    /* Return list of styles. */
+	    if (objc == 5) {
+		Tcl_Obj *listObj = Tcl_NewListObj(0, NULL);
+		int tailOK = ITEM_HEADER(item) != NULL;
+		treeColumn = Tree_FirstColumn(tree, -1, tailOK);
+		column = item->columns;
+		while (treeColumn != NULL) {
+		    if ((column != NULL) && (column->style != NULL) && !TreeStyle_IsHeaderStyle(tree, column->style))
+			Tcl_ListObjAppendElement(interp, listObj,
+				TreeStyle_ToObj(TreeStyle_GetMaster(
+				tree, column->style)));
+		    else
+			Tcl_ListObjAppendElement(interp, listObj,
+				Tcl_NewObj());
+		    treeColumn = Tree_ColumnToTheRight(treeColumn, FALSE, tailOK);
+		    if (column != NULL)
+			column = ITEM_COLUMN_NEXT(item, column);
 		}
-		prevSibling = nextSibling = NULL;
+		Tcl_SetObjResult(interp, listObj);
 		break;
-	    case OPT_PREVSIBLING:
-		if (TreeItem_FromObj(tree, objv[i + 1], &prevSibling,
-			IFO_NOT_NULL | IFO_NOT_ROOT | IFO_NOT_ORPHAN) != TCL_OK) {
+	    }
+	    /* Return style in one column. */
+	    if (objc == 6) {
+		if (TreeItem_ColumnFromObj(tree, item, objv[5], &column,
+			NULL, NULL, CFO_NOT_NULL | tailFlag) != TCL_OK)
 		    return TCL_ERROR;
-		}
-		parent = nextSibling = NULL;
+		if ((column != NULL) && (column->style != NULL) && !TreeStyle_IsHeaderStyle(tree, column->style))
+		    Tcl_SetObjResult(interp, TreeStyle_ToObj(
+			TreeStyle_GetMaster(tree, column->style)));
 		break;
-	    case OPT_RETURNID:
-		if (Tcl_GetBooleanFromObj(interp, objv[i + 1], &returnId)
-			!= TCL_OK) {
-		    return TCL_ERROR;
+	    }
+	    /* Get column/style pairs. */
+	    STATIC_ALLOC(cs, struct columnStyle, objc / 2);
+	    for (i = 5; i < objc; i += 2) {
+		if (TreeColumnList_FromObj(tree, objv[i], &cs[count].columns,
+			CFO_NOT_NULL | tailFlag) != TCL_OK) {
+		    result = TCL_ERROR;
+		    goto doneSET;
 		}
-		break;
-	    case OPT_TAGS:
-		tagsObj = objv[i + 1];
-		break;
-	    case OPT_VISIBLE:
-		if (Tcl_GetBooleanFromObj(interp, objv[i + 1], &visible)
-			!= TCL_OK) {
-		    return TCL_ERROR;
+		if (i + 1 == objc) {
+		    FormatResult(interp, "missing style for column \"%s\"",
+			Tcl_GetString(objv[i]));
+		    result = TCL_ERROR;
+		    goto doneSET;
 		}
-		break;
-	    case OPT_WRAP:
-		if (Tcl_GetBooleanFromObj(interp, objv[i + 1], &wrap)
-			!= TCL_OK) {
-		    return TCL_ERROR;
+		(void) Tcl_GetStringFromObj(objv[i + 1], &length);
+		if (length == 0) {
+		    cs[count].style = NULL;
+		} else {
+		    if (TreeStyle_FromObj(tree, objv[i + 1], &cs[count].style)
+			    != TCL_OK) {
+			result = TCL_ERROR;
+			goto doneSET;
+		    }
+		    if (TreeStyle_GetStateDomain(tree, cs[count].style) != domain) {
+			StateDomainErrMsg(tree, item, cs[count].style);
+			result = TCL_ERROR;
+			goto doneSET;
+		    }
 		}
-		break;
-	}
-    }
-
-    /* Do it here so I don't have to free it above if an error occurs. */
-    if (tagsObj != NULL) {
-	if (TagInfo_FromObj(tree, tagsObj, &tagInfo) != TCL_OK)
-	    return TCL_ERROR;
-    }
-
-    if (returnId)
-	listObj = Tcl_NewListObj(0, NULL);
-
-    /* Don't allow non-deleted items to become children of a
-    * deleted item. */
-    if ((parent && IS_DELETED(parent)) ||
-	(prevSibling && IS_DELETED(prevSibling->parent)) ||
-	(nextSibling && IS_DELETED(nextSibling->parent)))
-	parent = prevSibling = nextSibling = NULL;
-
-    for (i = 0; i < count; i++) {
-	item = Item_Alloc(tree, FALSE);
-	item->flags &= ~(ITEM_FLAG_BUTTON | ITEM_FLAG_BUTTON_AUTO);
-	item->flags |= button;
-	if (enabled) item->state |= STATE_ITEM_ENABLED;
-	else item->state &= ~STATE_ITEM_ENABLED;
-	if (open) item->state |= STATE_ITEM_OPEN;
-	else item->state &= ~STATE_ITEM_OPEN;
-	if (visible) item->flags |= ITEM_FLAG_VISIBLE;
-	else item->flags &= ~ITEM_FLAG_VISIBLE;
-	if (wrap) item->flags |= ITEM_FLAG_WRAP;
-	else item->flags &= ~ITEM_FLAG_WRAP;
-	item->fixedHeight = height;
-
-	/* Apply each column's -itemstyle option. */
-	for (treeColumn = tree->columns; treeColumn != NULL;
-		treeColumn = TreeColumn_Next(treeColumn)) {
-	    TreeStyle style = TreeColumn_ItemStyle(treeColumn);
-	    if (style != NULL) {
-		TreeItemColumn column = Item_CreateColumn(tree, item,
-			TreeColumn_Index(treeColumn), NULL);
-		column->style = TreeStyle_NewInstance(tree, style);
+		count++;
 	    }
-	}
-#ifdef DEPRECATED
-	/* Apply default styles */
-	if (tree->defaultStyle.numStyles) {
-	    int i, n = MIN(tree->columnCount, tree->defaultStyle.numStyles);
-
-	    for (i = 0; i < n; i++) {
-		TreeItemColumn column = Item_CreateColumn(tree, item, i, NULL);
-		if (column->style != NULL)
-		    continue;
-		if (tree->defaultStyle.styles[i] != NULL) {
-		    column->style = TreeStyle_NewInstance(tree,
-			    tree->defaultStyle.styles[i]);
+	    ITEM_FOR_EACH(item, &itemList, NULL, &iter) {
+		changedI = FALSE;
+		for (i = 0; i < count; i++) {
+		    COLUMN_FOR_EACH(treeColumn, &cs[i].columns, NULL, &citer) {
+			if (cs[i].style == NULL) {
+			    column = TreeItem_FindColumn(tree, item,
+				    TreeColumn_Index(treeColumn));
+			    if (column == NULL || column->style == NULL ||
+				    TreeStyle_IsHeaderStyle(tree, column->style))
+				continue;
+			    TreeItemColumn_ForgetStyle(tree, column);
+if (doHeaders) TreeHeaderColumn_EnsureStyleExists(ITEM_HEADER(item), column->headerColumn, treeColumn);
+			} else {
+			    column = Item_CreateColumn(tree, item,
+				    TreeColumn_Index(treeColumn), NULL);
+			    if (column->style != NULL) {
+				if (TreeStyle_GetMaster(tree, column->style)
+					== cs[i].style)
+				    continue;
+				TreeItemColumn_ForgetStyle(tree, column);
+			    }
+			    column->style = TreeStyle_NewInstance(tree,
+				    cs[i].style);
+			}
+			TreeItemColumn_InvalidateSize(tree, column);
+			TreeColumns_InvalidateWidthOfItems(tree, treeColumn);
+			changedI = TRUE;
+		    }
+		    if (changedI) {
+			TreeItem_InvalidateHeight(tree, item);
+			Tree_FreeItemDInfo(tree, item, NULL);
+			Item_SortKeyChanged(tree, item);
+			TreeItem_FindTextChanged(tree, item);
+			changed = TRUE;
+		    }
 		}
 	    }
+	    if (changed && !doHeaders)
+		Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
+doneSET:
+	    for (i = 0; i < count; i++) {
+		TreeColumnList_Free(&cs[i].columns);
+	    }
+	    STATIC_FREE(cs, struct columnStyle, objc / 2);
+	    break;
 	}
-#endif /* DEPRECATED */
-
-	if (tagInfo != NULL) {
-	    if (count == 1) {
-		item->tagInfo = tagInfo;
-		tagInfo = NULL;
-	    } else {
-		item->tagInfo = TagInfo_Copy(tree, tagInfo);
-	    }
-	}
-
-	/* Link the new items together as siblings */
-	if (parent || prevSibling || nextSibling) {
-	    if (head == NULL)
-		head = item;
-	    if (tail != NULL) {
-		tail->nextSibling = item;
-		item->prevSibling = tail;
-	    }
-	    tail = item;
-	}
-
-	if (returnId)
-	    Tcl_ListObjAppendElement(interp, listObj, TreeItem_ToObj(tree,
-		    item));
-    }
-
-    if (parent != NULL) {
-	head->prevSibling = parent->lastChild;
-	if (parent->lastChild != NULL)
-	    parent->lastChild->nextSibling = head;
-	else
-	    parent->firstChild = head;
-	parent->lastChild = tail;
-    } else if (prevSibling != NULL) {
-	parent = prevSibling->parent;
-	if (prevSibling->nextSibling != NULL)
-	    prevSibling->nextSibling->prevSibling = tail;
-	else
-	    parent->lastChild = tail;
-	head->prevSibling = prevSibling;
-	tail->nextSibling = prevSibling->nextSibling;
-	prevSibling->nextSibling = head;
-    } else if (nextSibling != NULL) {
-	parent = nextSibling->parent;
-	if (nextSibling->prevSibling != NULL)
-	    nextSibling->prevSibling->nextSibling = head;
-	else
-	    parent->firstChild = head;
-	head->prevSibling = nextSibling->prevSibling;
-	tail->nextSibling = nextSibling;
-	nextSibling->prevSibling = tail;
-    }
-
-    if (parent != NULL) {
-	for (item = head; item != NULL; item = item->nextSibling) {
-	    item->parent = parent;
-	    item->depth = parent->depth + 1;
-	}
-	parent->numChildren += count;
-	TreeItem_AddToParent(tree, head);
     }
 
-    TagInfo_Free(tree, tagInfo);
-
-    if (returnId)
-	Tcl_SetObjResult(interp, listObj);
+    TreeItemList_Free(&itemList);
+    return result;
+}
 
-    return TCL_OK;
+static int
+ItemStyleCmd(
+    ClientData clientData,	/* Widget info. */
+    Tcl_Interp *interp,		/* Current interpreter. */
+    int objc,			/* Number of arguments. */
+    Tcl_Obj *CONST objv[]	/* Argument values. */
+    )
+{
+    TreeCtrl *tree = clientData;
+    return TreeItemCmd_Style(tree, objc, objv, FALSE);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * ItemElementCmd --
+ * TreeItemCmd_ImageOrText --
  *
- *	This procedure is invoked to process the [item element] widget
- *	command.  See the user documentation for details on what
- *	it does.
+ *	This procedure is invoked to process the [item image] and
+ *	[item text] widget commands.  See the user documentation for
+ *	details on what it does.
  *
  * Results:
  *	A standard Tcl result.
@@ -5976,857 +9163,1255 @@ ItemCreateCmd(
  */
 
 int
-TreeItemCmd_Element(
-    TreeCtrl *tree,
+TreeItemCmd_ImageOrText(
+    TreeCtrl *tree,		/* Widget info. */
     int objc,			/* Number of arguments. */
     Tcl_Obj *CONST objv[],	/* Argument values. */
+    int doImage,		/* TRUE if this is [item image] */
     int doHeaders		/* TRUE to operate on headers, FALSE
 				 * to operate on items. */
     )
 {
     Tcl_Interp *interp = tree->interp;
-    static CONST char *commandNames[] = {
-#ifdef DEPRECATED
-	"actual",
-#endif
-	"cget", "configure",
-	"perstate", (char *) NULL };
-    enum {
-#ifdef DEPRECATED
-    COMMAND_ACTUAL,
-#endif
-    COMMAND_CGET, COMMAND_CONFIGURE, COMMAND_PERSTATE };
-    int index;
-    int columnIndex;
-    TreeItemColumn column;
+    TreeColumn treeColumn = tree->columns;
     TreeItemList itemList;
     TreeItem item;
-    int flags = IFO_NOT_NULL;
-    int result = TCL_OK;
-    int tailFlag = doHeaders ? 0 : CFO_NOT_TAIL; /* styles allowed in tail? */
-    int domain = doHeaders ? STATE_DOMAIN_HEADER : STATE_DOMAIN_ITEM;
+    TreeElement elem = NULL;
+    TreeItemColumn column;
+    Tcl_Obj *objPtr;
+    int isImage = doImage;
+    struct columnObj {
+	TreeColumnList columns;
+	Tcl_Obj *obj;
+    } staticCO[STATIC_SIZE], *co = staticCO;
+    int i, count = 0, changed = FALSE, columnIndex;
+    ItemForEach iter;
+    ColumnForEach citer;
+    int flags = 0, result = TCL_OK;
+    int tailFlag = /*doHeaders ? 0 : */CFO_NOT_TAIL;
 
-    if (objc < 7) {
+    /* T item text I ?C? ?text? ?C text ...? */
+    if (objc < 4) {
 	Tcl_WrongNumArgs(interp, 3, objv,
 	    doHeaders ?
-		"command header column element ?arg ...?" :
-		"command item column element ?arg ...?");
+		"header ?column? ?text? ?column text ...?" :
+		"item ?column? ?text? ?column text ...?");
 	return TCL_ERROR;
     }
 
-    if (Tcl_GetIndexFromObj(interp, objv[3], commandNames, "command", 0,
-		&index) != TCL_OK)
-	return TCL_ERROR;
-
-    /*
-     * [configure] without an option-value pair can operate on a single item
-     * only. [cget] and [perstate] only operate on a single item.
-     */
-    if ((index != COMMAND_CONFIGURE) || (objc < 9))
-	flags |= IFO_NOT_MANY;
-
+    if (objc < 6)
+	flags = IFO_NOT_NULL | IFO_NOT_MANY;
     if (doHeaders) {
-	if (TreeHeaderList_FromObj(tree, objv[4], &itemList, flags) != TCL_OK) {
+	if (TreeHeaderList_FromObj(tree, objv[3], &itemList, flags)
+		!= TCL_OK)
 	    return TCL_ERROR;
-	}
     } else {
-	if (TreeItemList_FromObj(tree, objv[4], &itemList, flags) != TCL_OK)
+	if (TreeItemList_FromObj(tree, objv[3], &itemList, flags)
+		!= TCL_OK)
 	    return TCL_ERROR;
     }
     item = TreeItemList_Nth(&itemList, 0);
 
-    switch (index) {
-	/* T item element perstate I C E option ?stateList? */
-#ifdef DEPRECATED
-	case COMMAND_ACTUAL:
-#endif
-	case COMMAND_PERSTATE: {
-	    int state;
-
-	    if (objc < 8 || objc > 9) {
-		Tcl_WrongNumArgs(tree->interp, 4, objv,
-		    doHeaders ?
-			"header column element option ?stateList?" :
-			"item column element option ?stateList?");
-		result = TCL_ERROR;
-		break;
-	    }
-	    if (TreeItem_ColumnFromObj(tree, item, objv[5], &column,
-		    NULL, &columnIndex, CFO_NOT_NULL | CFO_NOT_TAIL) != TCL_OK) {
-		result = TCL_ERROR;
-		break;
-	    }
-	    if ((column == NULL) || (column->style == NULL) || TreeStyle_IsHeaderStyle(tree, column->style)) {
-		NoStyleMsg(tree, item, columnIndex);
-		result = TCL_ERROR;
-		break;
-	    }
-	    state = item->state | column->cstate;
-	    if (objc == 9) {
-		int states[3];
-
-		if (Tree_StateFromListObj(tree, domain, objv[8], states,
-			    SFO_NOT_OFF | SFO_NOT_TOGGLE) != TCL_OK) {
-		    result = TCL_ERROR;
-		    break;
-		}
-		state = states[STATE_OP_ON];
-	    }
-	    result = TreeStyle_ElementActual(tree, column->style,
-		    state, objv[6], objv[7]);
-	    break;
+    if (objc == 4) {
+	Tcl_Obj *listObj = Tcl_NewListObj(0, NULL);
+	column = item->columns;
+	while (treeColumn != NULL) {
+	    if ((column != NULL) && (column->style != NULL) &&
+		    !TreeStyle_IsHeaderStyle(tree, column->style)) {
+		objPtr = isImage ?
+		    TreeStyle_GetImage(tree, column->style, &elem) :
+		    TreeStyle_GetText(tree, column->style, &elem);
+	    } else
+		objPtr = NULL;
+	    if (doHeaders && elem == NULL)
+		objPtr = TreeHeaderColumn_GetImageOrText(ITEM_HEADER(item),
+		    column->headerColumn, isImage);
+	    if (objPtr == NULL)
+		objPtr = Tcl_NewObj();
+	    Tcl_ListObjAppendElement(interp, listObj, objPtr);
+	    treeColumn = TreeColumn_Next(treeColumn);
+	    if (column != NULL)
+		column = ITEM_COLUMN_NEXT(item, column);
 	}
-
-	/* T item element cget I C E option */
-	case COMMAND_CGET: {
-	    if (objc != 8) {
-		Tcl_WrongNumArgs(tree->interp, 4, objv,
-		    doHeaders ?
-			"header column element option" :
-			"item column element option");
-		result = TCL_ERROR;
-		break;
-	    }
-	    if (TreeItem_ColumnFromObj(tree, item, objv[5], &column,
-		    NULL, &columnIndex, CFO_NOT_NULL | CFO_NOT_TAIL) != TCL_OK) {
-		result = TCL_ERROR;
-		break;
-	    }
-	    if ((column == NULL) || (column->style == NULL) || TreeStyle_IsHeaderStyle(tree, column->style)) {
-		NoStyleMsg(tree, item, columnIndex);
-		result = TCL_ERROR;
-		break;
-	    }
-	    result = TreeStyle_ElementCget(tree, item,
-		    column, column->style, objv[6], objv[7]);
-	    break;
+	Tcl_SetObjResult(interp, listObj);
+	goto okExit;
+    }
+    if (objc == 5) {
+	if (TreeItem_ColumnFromObj(tree, item, objv[4], &column, NULL, NULL,
+		CFO_NOT_NULL | CFO_NOT_TAIL) != TCL_OK) {
+	    goto errorExit;
 	}
-
-	/* T item element configure I C E ... */
-	case COMMAND_CONFIGURE: {
-	    struct columnObj {
-		TreeColumnList columns;
-		int isColumn;
-		int numArgs;
-	    } staticCO[STATIC_SIZE], *co = staticCO;
-	    int i, index, indexElem, prevColumn;
-	    ItemForEach iter;
-
-	    /* If no option-value pair is given, we can't specify more than
-	     * one column. */
-	    flags = CFO_NOT_NULL | tailFlag;
-	    if (objc < 9)
-		flags |= CFO_NOT_MANY;
-
-	    STATIC_ALLOC(co, struct columnObj, objc);
-	    for (i = 5; i < objc; i++) {
-		co[i].isColumn = FALSE;
-		co[i].numArgs = -1;
-	    }
-	    indexElem = 6;
-
-	    /* Get the first column(s) */
-	    i = indexElem - 1;
-	    if (TreeColumnList_FromObj(tree, objv[i], &co[i].columns,
-		    flags) != TCL_OK) {
-		result = TCL_ERROR;
-		break;
-	    }
-	    co[i].isColumn = TRUE;
-	    prevColumn = i;
-
-	    while (1) {
-		int numArgs = 0;
-		char breakChar = '\0';
-
-		/* Look for a + or , */
-		for (index = indexElem + 1; index < objc; index++) {
-		    if (numArgs % 2 == 0) {
-			int length;
-			char *s = Tcl_GetStringFromObj(objv[index], &length);
-
-			if ((length == 1) && ((s[0] == '+') || (s[0] == ','))) {
-			    breakChar = s[0];
-			    break;
-			}
+	if ((column != NULL) && (column->style != NULL) &&
+		!TreeStyle_IsHeaderStyle(tree, column->style)) {
+	    objPtr = isImage ?
+		TreeStyle_GetImage(tree, column->style, &elem) :
+		TreeStyle_GetText(tree, column->style, &elem);
+	 } else
+	    objPtr = NULL;
+	if (doHeaders && elem == NULL)
+	    objPtr = TreeHeaderColumn_GetImageOrText(ITEM_HEADER(item),
+		column->headerColumn, isImage);
+	if (objPtr != NULL)
+	    Tcl_SetObjResult(interp, objPtr);
+	goto okExit;
+    }
+    if ((objc - 4) & 1) {
+	FormatResult(interp, "missing argument after column \"%s\"",
+		Tcl_GetString(objv[objc - 1]));
+	goto errorExit;
+    }
+    /* Gather column/obj pairs. */
+    STATIC_ALLOC(co, struct columnObj, objc / 2);
+    for (i = 4; i < objc; i += 2) {
+	if (TreeColumnList_FromObj(tree, objv[i], &co[count].columns,
+		CFO_NOT_NULL | tailFlag) != TCL_OK) {
+	    result = TCL_ERROR;
+	    goto doneTEXT;
+	}
+	co[count].obj = objv[i + 1];
+	count++;
+    }
+    ITEM_FOR_EACH(item, &itemList, NULL, &iter) {
+	int changedI = FALSE;
+	for (i = 0; i < count; i++) {
+	    COLUMN_FOR_EACH(treeColumn, &co[i].columns, NULL, &citer) {
+		columnIndex = TreeColumn_Index(treeColumn);
+		column = TreeItem_FindColumn(tree, item, columnIndex);
+		if ((column == NULL) || (column->style == NULL) ||
+			TreeStyle_IsHeaderStyle(tree, column->style)) {
+		    if (doHeaders) {
+			result = TreeHeaderColumn_SetImageOrText(ITEM_HEADER(item),
+			    column->headerColumn, treeColumn, co[i].obj, isImage);
+			if (result != TCL_OK)
+			    goto doneTEXT;
+			continue;
 		    }
-		    numArgs++;
-		}
-
-		/* Require at least one option-value pair if more than one
-		* element is specified. */
-		if ((breakChar || indexElem != 6) && (numArgs < 2)) {
-		    FormatResult(interp,
-			"missing option-value pair after element \"%s\"",
-			Tcl_GetString(objv[indexElem]));
+		    NoStyleMsg(tree, item, columnIndex);
 		    result = TCL_ERROR;
-		    goto doneCONF;
+		    goto doneTEXT;
 		}
-
-		co[indexElem].numArgs = numArgs;
-
-		if (!breakChar)
-		    break;
-
-		if (index == objc - 1) {
-		    FormatResult(interp, "missing %s after \"%c\"",
-			(breakChar == '+') ? "element name" : "column",
-			breakChar);
-		    result = TCL_ERROR;
-		    goto doneCONF;
+		result = isImage ?
+		    TreeStyle_SetImage(tree, item, column, column->style,
+			co[i].obj, &elem) :
+		    TreeStyle_SetText(tree, item, column, column->style,
+			co[i].obj, &elem);
+		if (result != TCL_OK)
+		    goto doneTEXT;
+		if (elem == NULL) {
+		    if (doHeaders) {
+			result = TreeHeaderColumn_SetImageOrText(ITEM_HEADER(item),
+			    column->headerColumn, treeColumn, co[i].obj, isImage);
+			if (result != TCL_OK)
+			    goto doneTEXT;
+		    }
+		} else {
+		    TreeItemColumn_InvalidateSize(tree, column);
+		    TreeColumns_InvalidateWidthOfItems(tree, treeColumn);
+		    changedI = TRUE;
 		}
+	    }
+	}
+	if (changedI) {
+	    TreeItem_InvalidateHeight(tree, item);
+	    Tree_FreeItemDInfo(tree, item, NULL);
+	    if (!isImage) {
+		Item_SortKeyChanged(tree, item);
+		TreeItem_FindTextChanged(tree, item);
+	    }
+	    changed = TRUE;
+	}
+    }
+    if (changed && !doHeaders)
+	Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
+doneTEXT:
+    for (i = 0; i < count; i++) {
+	TreeColumnList_Free(&co[i].columns);
+    }
+    STATIC_FREE(co, struct columnObj, objc / 2);
+    TreeItemList_Free(&itemList);
+    return result;
 
-		/* + indicates start of another element */
-		if (breakChar == '+') {
-		    indexElem = index + 1;
-		}
+okExit:
+    TreeItemList_Free(&itemList);
+    return TCL_OK;
 
-		/* , indicates start of another column */
-		else if (breakChar == ',') {
-		    co[prevColumn].numArgs = index - prevColumn;
+errorExit:
+    TreeItemList_Free(&itemList);
+    return TCL_ERROR;
+}
 
-		    if (TreeColumnList_FromObj(tree, objv[index + 1],
-			    &co[index + 1].columns, CFO_NOT_NULL |
-			    tailFlag) != TCL_OK) {
-			result = TCL_ERROR;
-			goto doneCONF;
-		    }
-		    co[index + 1].isColumn = TRUE;
-		    prevColumn = index + 1;
+static int
+ItemImageCmd(
+    ClientData clientData,	/* Widget info. */
+    Tcl_Interp *interp,		/* Current interpreter. */
+    int objc,			/* Number of arguments. */
+    Tcl_Obj *CONST objv[]	/* Argument values. */
+    )
+{
+    TreeCtrl *tree = clientData;
+    return TreeItemCmd_ImageOrText(tree, objc, objv, TRUE, FALSE);
+}
 
-		    indexElem = index + 2;
-		    if (indexElem == objc) {
-			FormatResult(interp,
-			    "missing element name after column \"%s\"",
-			    Tcl_GetString(objv[index + 1]));
-			result = TCL_ERROR;
-			goto doneCONF;
-		    }
-		}
-	    }
-	    co[prevColumn].numArgs = index - prevColumn;
+static int
+ItemTextCmd(
+    ClientData clientData,	/* Widget info. */
+    Tcl_Interp *interp,		/* Current interpreter. */
+    int objc,			/* Number of arguments. */
+    Tcl_Obj *CONST objv[]	/* Argument values. */
+    )
+{
+    TreeCtrl *tree = clientData;
+    return TreeItemCmd_ImageOrText(tree, objc, objv, FALSE, FALSE);
+}
 
-	    ITEM_FOR_EACH(item, &itemList, NULL, &iter) {
-		/* T item element configure I C E option value \
-		*     + E option value , C E option value */
-		int iMask = 0;
+/* one per column per SortItem */
+struct SortItem1
+{
+    long longValue;
+    double doubleValue;
+    char *string;
+    Tcl_Obj *keyObj; /* Result of -keycommand, or NULL */
+};
 
-		/* co[index].numArgs is the number of arguments from the C
-		 * to the next separator (but not including that separator). */
-		for (index = 5; index < objc; index += co[index].numArgs + 1) {
-		    ColumnForEach citer;
-		    TreeColumn treeColumn;
-#ifdef TREECTRL_DEBUG
-if (!co[index].isColumn) panic("isColumn == FALSE");
-#endif
-		    COLUMN_FOR_EACH(treeColumn, &co[index].columns, NULL, &citer) {
-			int columnIndex, cMask = 0;
+/* one per Item */
+struct SortItem
+{
+    TreeItem item;
+    struct SortItem1 *item1;
+    Tcl_Obj *obj; /* TreeItem_ToObj() */
+};
 
-			columnIndex = TreeColumn_Index(treeColumn);
-			column = TreeItem_FindColumn(tree, item, columnIndex);
-			if ((column == NULL) || (column->style == NULL) || TreeStyle_IsHeaderStyle(tree, column->style)) {
-			    NoStyleMsg(tree, item, columnIndex);
-			    result = TCL_ERROR;
-			    break;
-			}
+typedef struct SortData SortData;
 
-			indexElem = index + 1;
+/* Used to process -element option */
+struct SortElement
+{
+    TreeStyle style;
+    TreeElement elem;
+    int elemIndex;
+};
 
-			/* Do each element in this column */
-			while (1) {
-			    int eMask, index2;
-#ifdef TREECTRL_DEBUG
-if (co[indexElem].numArgs == -1) panic("indexElem=%d (%s) objc=%d numArgs == -1", indexElem, Tcl_GetString(objv[indexElem]), objc);
-#endif
-			    result = TreeStyle_ElementConfigureFromObj(tree, item,
-				    column, column->style, objv[indexElem],
-				    co[indexElem].numArgs, (Tcl_Obj **) objv + indexElem + 1, &eMask);
-			    if (result != TCL_OK)
-				break;
+/* One per TreeColumn */
+struct SortColumn
+{
+    int (*proc)(SortData *, struct SortItem *, struct SortItem *, int);
+    int sortBy;
+    int column;
+    int order;
+    Tcl_Obj *command;
+    Tcl_Obj *keyCommand; /* -keycommand, or NULL */
+    struct SortElement elems[20];
+    int elemCount;
+};
 
-			    cMask |= eMask;
+/* Data for sort as a whole */
+struct SortData
+{
+    TreeCtrl *tree;
+    struct SortItem *items;
+    struct SortItem1 *item1s; /* SortItem.item1 points in here */
+#define MAX_SORT_COLUMNS 40
+    struct SortColumn columns[MAX_SORT_COLUMNS];
+    int columnCount; /* max number of columns to compare */
+    int result;
+};
 
-			    /* co[indexElem].numArgs is the number of
-			     * option-value arguments after the element. */
-			    index2 = indexElem + co[indexElem].numArgs;
-			    if (index2 == objc - 1)
-				break;
+/* from Tcl 8.4.0 */
+static int
+DictionaryCompare(
+    char *left,
+    char *right
+    )
+{
+    Tcl_UniChar uniLeft, uniRight, uniLeftLower, uniRightLower;
+    int diff, zeros;
+    int secondaryDiff = 0;
 
-			    /* Skip the '+' or ',' */
-			    index2 += 2;
+    while (1) {
+	if (isdigit(UCHAR(*right)) && isdigit(UCHAR(*left))) { /* INTL: digit */
+	    /*
+	     * There are decimal numbers embedded in the two
+	     * strings.  Compare them as numbers, rather than
+	     * strings.  If one number has more leading zeros than
+	     * the other, the number with more leading zeros sorts
+	     * later, but only as a secondary choice.
+	     */
 
-			    if (co[index2].isColumn)
-				break;
+	    zeros = 0;
+	    while ((*right == '0') && (isdigit(UCHAR(right[1])))) {
+		right++;
+		zeros--;
+	    }
+	    while ((*left == '0') && (isdigit(UCHAR(left[1])))) {
+		left++;
+		zeros++;
+	    }
+	    if (secondaryDiff == 0) {
+		secondaryDiff = zeros;
+	    }
+
+	    /*
+	     * The code below compares the numbers in the two
+	     * strings without ever converting them to integers.  It
+	     * does this by first comparing the lengths of the
+	     * numbers and then comparing the digit values.
+	     */
 
-			    indexElem = index2;
-			}
+	    diff = 0;
+	    while (1) {
+		if (diff == 0) {
+		    diff = UCHAR(*left) - UCHAR(*right);
+		}
+		right++;
+		left++;
+		if (!isdigit(UCHAR(*right))) {	/* INTL: digit */
+		    if (isdigit(UCHAR(*left))) {	/* INTL: digit */
+			return 1;
+		    } else {
+			/*
+			 * The two numbers have the same length. See
+			 * if their values are different.
+			 */
 
-			if (cMask & CS_LAYOUT) {
-			    TreeItemColumn_InvalidateSize(tree, column);
-			    TreeColumns_InvalidateWidthOfItems(tree, treeColumn);
-			} else if (cMask & CS_DISPLAY) {
-			    Tree_InvalidateItemDInfo(tree, treeColumn, item, NULL);
+			if (diff != 0) {
+			    return diff;
 			}
-			iMask |= cMask;
-			if (result != TCL_OK)
-			    break;
-		    }
-		    if (result != TCL_OK)
 			break;
+		    }
+		} else if (!isdigit(UCHAR(*left))) {	/* INTL: digit */
+		    return -1;
 		}
-		if (iMask & CS_LAYOUT) {
-		    TreeItem_InvalidateHeight(tree, item);
-		    Tree_FreeItemDInfo(tree, item, NULL);
-		    if (item->header == NULL)
-			Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
-		} else if (iMask & CS_DISPLAY) {
-		}
-		if (result != TCL_OK)
-		    break;
-	    }
-doneCONF:
-	    for (i = 5; i < objc; i++) {
-		if (co[i].isColumn)
-		    TreeColumnList_Free(&co[i].columns);
 	    }
-	    STATIC_FREE(co, struct columnObj, objc);
+	    continue;
+	}
+
+	/*
+	 * Convert character to Unicode for comparison purposes.  If either
+	 * string is at the terminating null, do a byte-wise comparison and
+	 * bail out immediately.
+	 */
+
+	if ((*left != '\0') && (*right != '\0')) {
+	    left += Tcl_UtfToUniChar(left, &uniLeft);
+	    right += Tcl_UtfToUniChar(right, &uniRight);
+	    /*
+	     * Convert both chars to lower for the comparison, because
+	     * dictionary sorts are case insensitve.  Covert to lower, not
+	     * upper, so chars between Z and a will sort before A (where most
+	     * other interesting punctuations occur)
+	     */
+	    uniLeftLower = Tcl_UniCharToLower(uniLeft);
+	    uniRightLower = Tcl_UniCharToLower(uniRight);
+	} else {
+	    diff = UCHAR(*left) - UCHAR(*right);
 	    break;
 	}
+
+	diff = uniLeftLower - uniRightLower;
+	if (diff) {
+	    return diff;
+	} else if (secondaryDiff == 0) {
+	    if (Tcl_UniCharIsUpper(uniLeft) &&
+		    Tcl_UniCharIsLower(uniRight)) {
+		secondaryDiff = -1;
+	    } else if (Tcl_UniCharIsUpper(uniRight) &&
+		    Tcl_UniCharIsLower(uniLeft)) {
+		secondaryDiff = 1;
+	    }
+	}
     }
+    if (diff == 0) {
+	diff = secondaryDiff;
+    }
+    return diff;
+}
 
-    TreeItemList_Free(&itemList);
-    return result;
+static int
+CompareAscii(
+    SortData *sortData,
+    struct SortItem *a,
+    struct SortItem *b,
+    int n			/* Column index. */
+    )
+{
+    char *left  = a->item1[n].string;
+    char *right = b->item1[n].string;
+
+    /* make sure to handle case where no string value has been set */
+    if (left == NULL) {
+	return ((right == NULL) ? 0 : (0 - UCHAR(*right)));
+    } else if (right == NULL) {
+	return UCHAR(*left);
+    } else {
+	return strcmp(left, right);
+    }
 }
 
 static int
-ItemElementCmd(
-    ClientData clientData,	/* Widget info. */
-    Tcl_Interp *interp,		/* Current interpreter. */
-    int objc,			/* Number of arguments. */
-    Tcl_Obj *CONST objv[]	/* Argument values. */
+CompareDict(
+    SortData *sortData,
+    struct SortItem *a,
+    struct SortItem *b,
+    int n			/* Column index. */
     )
 {
-    TreeCtrl *tree = clientData;
-    return TreeItemCmd_Element(tree, objc, objv, FALSE);
+    char *left  = a->item1[n].string;
+    char *right = b->item1[n].string;
+
+    /* make sure to handle case where no string value has been set */
+    if (left == NULL) {
+	return ((right == NULL) ? 0 : (0 - UCHAR(*right)));
+    } else if (right == NULL) {
+	return UCHAR(*left);
+    } else {
+	return DictionaryCompare(left, right);
+    }
 }
 
-/*
- *----------------------------------------------------------------------
- *
- * ItemStyleCmd --
- *
- *	This procedure is invoked to process the [item style] widget
- *	command.  See the user documentation for details on what
- *	it does.
- *
- * Results:
- *	A standard Tcl result.
- *
- * Side effects:
- *	See the user documentation.
- *
- *----------------------------------------------------------------------
- */
+static int
+CompareDouble(
+    SortData *sortData,
+    struct SortItem *a,
+    struct SortItem *b,
+    int n			/* Column index. */
+    )
+{
+    return (a->item1[n].doubleValue < b->item1[n].doubleValue) ? -1 :
+	((a->item1[n].doubleValue == b->item1[n].doubleValue) ? 0 : 1);
+}
 
-int
-TreeItemCmd_Style(
-    TreeCtrl *tree,		/* Widget info. */
-    int objc,			/* Number of arguments. */
-    Tcl_Obj *CONST objv[],	/* Argument values. */
-    int doHeaders		/* TRUE to operate on headers, FALSE
-				 * to operate on items. */
+static int
+CompareLong(
+    SortData *sortData,
+    struct SortItem *a,
+    struct SortItem *b,
+    int n			/* Column index. */
     )
 {
-    Tcl_Interp *interp = tree->interp;
-    int domain = doHeaders ? STATE_DOMAIN_HEADER : STATE_DOMAIN_ITEM;
-    int index;
-    TreeItemList itemList;
-    TreeItem item;
-    int flags = IFO_NOT_NULL;
-    int result = TCL_OK;
-    int tailFlag = doHeaders ? 0 : CFO_NOT_TAIL;
-    static CONST char *commandNames[] = {
-	"elements", "map", "set", (char *) NULL
-    };
-    enum { COMMAND_ELEMENTS, COMMAND_MAP, COMMAND_SET };
+    return (a->item1[n].longValue < b->item1[n].longValue) ? -1 :
+	((a->item1[n].longValue == b->item1[n].longValue) ? 0 : 1);
+}
 
-    if (objc < 5) {
-	Tcl_WrongNumArgs(interp, 3, objv,
-	    doHeaders ?
-		"command header ?arg ...?" :
-		"command item ?arg ...?");
-	return TCL_ERROR;
+static int
+CompareCmd(
+    SortData *sortData,
+    struct SortItem *a,
+    struct SortItem *b,
+    int n			/* Column index. */
+    )
+{
+    Tcl_Interp *interp = sortData->tree->interp;
+    Tcl_Obj **objv, *paramObjv[2];
+    int objc, v;
+
+    paramObjv[0] = a->obj;
+    paramObjv[1] = b->obj;
+
+    Tcl_ListObjLength(interp, sortData->columns[n].command, &objc);
+    Tcl_ListObjReplace(interp, sortData->columns[n].command, objc - 2,
+	    2, 2, paramObjv);
+    Tcl_ListObjGetElements(interp, sortData->columns[n].command,
+	    &objc, &objv);
+
+    sortData->result = Tcl_EvalObjv(interp, objc, objv, 0);
+
+    if (sortData->result != TCL_OK) {
+	Tcl_AddErrorInfo(interp, "\n    (evaluating item sort -command)");
+	return 0;
     }
 
-    if (Tcl_GetIndexFromObj(interp, objv[3], commandNames, "command", 0,
-		&index) != TCL_OK) {
-	return TCL_ERROR;
+    sortData->result = Tcl_GetIntFromObj(interp, Tcl_GetObjResult(interp), &v);
+    if (sortData->result != TCL_OK) {
+	Tcl_ResetResult(interp);
+	Tcl_AppendToObj(Tcl_GetObjResult(interp),
+		"-command returned non-numeric result", -1);
+	return 0;
     }
 
-    /* [style elements] only works on a single item.
-     * [style set] only works on a single item without a column-style pair. */
-    if ((index == COMMAND_ELEMENTS) || (index == COMMAND_SET && objc < 7))
-	flags |= IFO_NOT_MANY;
-    if (doHeaders) {
-	if (TreeHeaderList_FromObj(tree, objv[4], &itemList, flags) != TCL_OK) {
-	    return TCL_ERROR;
-	}
-    } else {
-	if (TreeItemList_FromObj(tree, objv[4], &itemList, flags) != TCL_OK) {
-	    return TCL_ERROR;
+    return v;
+}
+
+static int
+CompareProc(
+    SortData *sortData,
+    struct SortItem *a,
+    struct SortItem *b
+    )
+{
+    int i, v;
+
+    if (a->item == b->item)
+	return 0;
+
+    for (i = 0; i < sortData->columnCount; i++) {
+	v = (*sortData->columns[i].proc)(sortData, a, b, i);
+
+	/* -command returned error */
+	if (sortData->result != TCL_OK)
+	    return 0;
+
+	if (v != 0) {
+	    if (i && (sortData->columns[i].order != sortData->columns[0].order))
+		v *= -1;
+	    return v;
 	}
     }
-    item = TreeItemList_Nth(&itemList, 0);
+    return 0;
+}
 
-    switch (index) {
-	/* T item style elements I C */
-	case COMMAND_ELEMENTS: {
-	    TreeItemColumn column;
-	    int columnIndex;
+/*
+ *----------------------------------------------------------------------
+ *
+ * SortKeyCmd --
+ *
+ *	Evaluate the -keycommand of a sort column for one item and
+ *	convert the result to the kind of value the column compares.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	Any side effects of the -keycommand.
+ *
+ *----------------------------------------------------------------------
+ */
 
-	    if (objc != 6) {
-		Tcl_WrongNumArgs(interp, 4, objv,
-		    doHeaders ? "header column" : "item column");
-		result = TCL_ERROR;
+static int
+SortKeyCmd(
+    TreeCtrl *tree,		/* Widget info. */
+    struct SortColumn *sortColumn, /* Column with a -keycommand. */
+    TreeItem item,		/* Item to get the sort key of. */
+    struct SortItem1 *sortItem1	/* Gets the sort key. */
+    )
+{
+    Tcl_Interp *interp = tree->interp;
+    Tcl_Obj **objv, *itemObj;
+    int objc, result;
+
+    itemObj = TreeItem_ToObj(tree, item);
+    Tcl_ListObjLength(interp, sortColumn->keyCommand, &objc);
+    Tcl_ListObjReplace(interp, sortColumn->keyCommand, objc - 1, 1, 1,
+	    &itemObj);
+    Tcl_ListObjGetElements(interp, sortColumn->keyCommand, &objc, &objv);
+
+    result = Tcl_EvalObjv(interp, objc, objv, 0);
+    if (result == TCL_OK) {
+	sortItem1->keyObj = Tcl_GetObjResult(interp);
+	Tcl_IncrRefCount(sortItem1->keyObj);
+	Tcl_ResetResult(interp);
+	switch (sortColumn->sortBy) {
+	    case SORT_ASCII:
+	    case SORT_DICT:
+		sortItem1->string = Tcl_GetString(sortItem1->keyObj);
 		break;
-	    }
-	    if (TreeItem_ColumnFromObj(tree, item, objv[5], &column,
-		    NULL, &columnIndex, CFO_NOT_NULL | CFO_NOT_TAIL) != TCL_OK) {
-		result = TCL_ERROR;
+	    case SORT_DOUBLE:
+		result = Tcl_GetDoubleFromObj(interp, sortItem1->keyObj,
+			&sortItem1->doubleValue);
 		break;
-	    }
-	    if ((column == NULL) || (column->style == NULL) || TreeStyle_IsHeaderStyle(tree, column->style)) {
-		NoStyleMsg(tree, item, columnIndex);
-		result = TCL_ERROR;
+	    case SORT_LONG:
+		result = Tcl_GetLongFromObj(interp, sortItem1->keyObj,
+			&sortItem1->longValue);
 		break;
-	    }
-	    TreeStyle_ListElements(tree, column->style);
-	    break;
 	}
+    }
+    if (result != TCL_OK) {
+	Tcl_AddErrorInfo(interp, "\n    (evaluating item sort -keycommand)");
+	return TCL_ERROR;
+    }
+    return TCL_OK;
+}
 
-	/* T item style map I C S map */
-	case COMMAND_MAP: {
-	    TreeStyle style;
-	    TreeColumnList columns;
-	    TreeColumn treeColumn;
-	    TreeItemColumn column;
-	    int columnIndex;
-	    int objcM;
-	    Tcl_Obj **objvM;
-	    ItemForEach iter;
-	    ColumnForEach citer;
-	    int redoRanges = !doHeaders;
-
-	    if (objc != 8) {
-		Tcl_WrongNumArgs(interp, 4, objv,
-		    doHeaders ?
-			"header column style map" :
-			"item column style map");
-		return TCL_ERROR;
-	    }
-	    if (TreeColumnList_FromObj(tree, objv[5], &columns,
-		    CFO_NOT_NULL | tailFlag) != TCL_OK) {
-		result = TCL_ERROR;
-		break;
-	    }
-	    if (TreeStyle_FromObj(tree, objv[6], &style) != TCL_OK) {
-		result = TCL_ERROR;
-		goto doneMAP;
-	    }
-	    if (TreeStyle_GetStateDomain(tree, style) != domain) {
-		StateDomainErrMsg(tree, item, style);
-		result = TCL_ERROR;
-		goto doneMAP;
-	    }
-	    if (Tcl_ListObjGetElements(interp, objv[7], &objcM, &objvM)
-		    != TCL_OK) {
-		result = TCL_ERROR;
-		goto doneMAP;
-	    }
-	    if (objcM & 1) {
-		FormatResult(interp, "list must contain even number of elements");
-		result = TCL_ERROR;
-		goto doneMAP;
-	    }
-	    ITEM_FOR_EACH(item, &itemList, NULL, &iter) {
-		COLUMN_FOR_EACH(treeColumn, &columns, NULL, &citer) {
-		    columnIndex = TreeColumn_Index(treeColumn);
-		    column = Item_CreateColumn(tree, item, columnIndex, NULL);
-		    if ((column->style != NULL) && !TreeStyle_IsHeaderStyle(tree, column->style)) {
-			if (TreeStyle_Remap(tree, column->style, style, objcM,
-				objvM) != TCL_OK) {
-			    result = TCL_ERROR;
-			    break;
-			}
-		    } else {
-			TreeItemColumn_ForgetStyle(tree, column);
-			column->style = TreeStyle_NewInstance(tree, style);
-		    }
-		    TreeItemColumn_InvalidateSize(tree, column);
-		    TreeColumns_InvalidateWidthOfItems(tree, treeColumn);
-		}
-		TreeItem_InvalidateHeight(tree, item);
-		Tree_FreeItemDInfo(tree, item, NULL);
-		if (result != TCL_OK)
-		    break;
-	    }
-	    if (redoRanges)
-		Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
-doneMAP:
-	    TreeColumnList_Free(&columns);
-	    break;
-	}
 
-	/* T item style set I ?C? ?S? ?C S ...?*/
-	case COMMAND_SET: {
-	    struct columnStyle {
-		TreeColumnList columns;
-		TreeStyle style;
-	    };
-	    struct columnStyle staticCS[STATIC_SIZE], *cs = staticCS;
-	    TreeColumn treeColumn;
-	    TreeItemColumn column;
-	    int i, count = 0, length, changed = FALSE, changedI;
-	    ItemForEach iter;
-	    ColumnForEach citer;
+static int (*sortProcs[5])(SortData *, struct SortItem *, struct SortItem *, int) =
+    { CompareAscii, CompareDict, CompareDouble, CompareLong, CompareCmd };
 
-	    if (objc < 5) {
-		Tcl_WrongNumArgs(interp, 4, objv,
-		    doHeaders ?
-			"header ?column? ?style? ?column style ...?" :
-			"item ?column? ?style? ?column style ...?");
-		return TCL_ERROR;
-	    }
-	    /* Return list of styles. */
-	    if (objc == 5) {
-		Tcl_Obj *listObj = Tcl_NewListObj(0, NULL);
-		int tailOK = item->header != NULL;
-		treeColumn = Tree_FirstColumn(tree, -1, tailOK);
-		column = item->columns;
-		while (treeColumn != NULL) {
-		    if ((column != NULL) && (column->style != NULL) && !TreeStyle_IsHeaderStyle(tree, column->style))
-			Tcl_ListObjAppendElement(interp, listObj,
-				TreeStyle_ToObj(TreeStyle_GetMaster(
-				tree, column->style)));
-		    else
-			Tcl_ListObjAppendElement(interp, listObj,
-				Tcl_NewObj());
-		    treeColumn = Tree_ColumnToTheRight(treeColumn, FALSE, tailOK);
-		    if (column != NULL)
-			column = column->next;
-		}
-		Tcl_SetObjResult(interp, listObj);
-		break;
-	    }
-	    /* Return style in one column. */
-	    if (objc == 6) {
-		if (TreeItem_ColumnFromObj(tree, item, objv[5], &column,
-			NULL, NULL, CFO_NOT_NULL | tailFlag) != TCL_OK)
-		    return TCL_ERROR;
-		if ((column != NULL) && (column->style != NULL) && !TreeStyle_IsHeaderStyle(tree, column->style))
-		    Tcl_SetObjResult(interp, TreeStyle_ToObj(
-			TreeStyle_GetMaster(tree, column->style)));
-		break;
-	    }
-	    /* Get column/style pairs. */
-	    STATIC_ALLOC(cs, struct columnStyle, objc / 2);
-	    for (i = 5; i < objc; i += 2) {
-		if (TreeColumnList_FromObj(tree, objv[i], &cs[count].columns,
-			CFO_NOT_NULL | tailFlag) != TCL_OK) {
-		    result = TCL_ERROR;
-		    goto doneSET;
-		}
-		if (i + 1 == objc) {
-		    FormatResult(interp, "missing style for column \"%s\"",
-			Tcl_GetString(objv[i]));
-		    result = TCL_ERROR;
-		    goto doneSET;
-		}
-		(void) Tcl_GetStringFromObj(objv[i + 1], &length);
-		if (length == 0) {
-		    cs[count].style = NULL;
-		} else {
-		    if (TreeStyle_FromObj(tree, objv[i + 1], &cs[count].style)
-			    != TCL_OK) {
-			result = TCL_ERROR;
-			goto doneSET;
-		    }
-		    if (TreeStyle_GetStateDomain(tree, cs[count].style) != domain) {
-			StateDomainErrMsg(tree, item, cs[count].style);
-			result = TCL_ERROR;
-			goto doneSET;
-		    }
-		}
-		count++;
-	    }
-	    ITEM_FOR_EACH(item, &itemList, NULL, &iter) {
-		changedI = FALSE;
-		for (i = 0; i < count; i++) {
-		    COLUMN_FOR_EACH(treeColumn, &cs[i].columns, NULL, &citer) {
-			if (cs[i].style == NULL) {
-			    column = TreeItem_FindColumn(tree, item,
-				    TreeColumn_Index(treeColumn));
-			    if (column == NULL || column->style == NULL ||
-				    TreeStyle_IsHeaderStyle(tree, column->style))
-				continue;
-			    TreeItemColumn_ForgetStyle(tree, column);
-if (doHeaders) TreeHeaderColumn_EnsureStyleExists(item->header, column->headerColumn, treeColumn);
-			} else {
-			    column = Item_CreateColumn(tree, item,
-				    TreeColumn_Index(treeColumn), NULL);
-			    if (column->style != NULL) {
-				if (TreeStyle_GetMaster(tree, column->style)
-					== cs[i].style)
-				    continue;
-				TreeItemColumn_ForgetStyle(tree, column);
-			    }
-			    column->style = TreeStyle_NewInstance(tree,
-				    cs[i].style);
-			}
-			TreeItemColumn_InvalidateSize(tree, column);
-			TreeColumns_InvalidateWidthOfItems(tree, treeColumn);
-			changedI = TRUE;
-		    }
-		    if (changedI) {
-			TreeItem_InvalidateHeight(tree, item);
-			Tree_FreeItemDInfo(tree, item, NULL);
-			changed = TRUE;
-		    }
-		}
-	    }
-	    if (changed && !doHeaders)
-		Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
-doneSET:
-	    for (i = 0; i < count; i++) {
-		TreeColumnList_Free(&cs[i].columns);
-	    }
-	    STATIC_FREE(cs, struct columnStyle, objc / 2);
-	    break;
-	}
-    }
+/*
+ *----------------------------------------------------------------------
+ *
+ * SortData_Init --
+ *
+ *	Set the default sort order: ascii strings in column 0 only.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-    TreeItemList_Free(&itemList);
-    return result;
+static void
+SortData_Init(
+    TreeCtrl *tree,		/* Widget info. */
+    SortData *sortData		/* Sort info to initialize. */
+    )
+{
+    sortData->tree = tree;
+    sortData->columnCount = 1;
+    sortData->columns[0].column = 0;
+    sortData->columns[0].sortBy = SORT_ASCII;
+    sortData->columns[0].order = 1;
+    sortData->columns[0].keyCommand = NULL;
+    sortData->columns[0].elemCount = 0;
+    sortData->result = TCL_OK;
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * SortData_ColumnOption --
+ *
+ *	Process the -column option of [item sort] or [item sortspec].
+ *	The first -column sets the first column compared, each one after
+ *	that adds another column to compare.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
 static int
-ItemStyleCmd(
-    ClientData clientData,	/* Widget info. */
-    Tcl_Interp *interp,		/* Current interpreter. */
-    int objc,			/* Number of arguments. */
-    Tcl_Obj *CONST objv[]	/* Argument values. */
+SortData_ColumnOption(
+    SortData *sortData,		/* Sort info. */
+    Tcl_Obj *objPtr,		/* Column description. */
+    int *sawColumnPtr		/* In/out: TRUE if -column was seen
+				 * before. */
     )
 {
-    TreeCtrl *tree = clientData;
-    return TreeItemCmd_Style(tree, objc, objv, FALSE);
+    TreeCtrl *tree = sortData->tree;
+    TreeColumn treeColumn;
+    struct SortColumn *sortColumn;
+
+    if (TreeColumn_FromObj(tree, objPtr, &treeColumn,
+		CFO_NOT_NULL | CFO_NOT_TAIL) != TCL_OK)
+	return TCL_ERROR;
+    if (*sawColumnPtr) {
+	if (sortData->columnCount + 1 > MAX_SORT_COLUMNS) {
+	    FormatResult(tree->interp, "can't compare more than %d columns",
+		    MAX_SORT_COLUMNS);
+	    return TCL_ERROR;
+	}
+	sortData->columnCount++;
+	/* Defaults for this column */
+	sortColumn = &sortData->columns[sortData->columnCount - 1];
+	sortColumn->sortBy = SORT_ASCII;
+	sortColumn->order = 1;
+	sortColumn->keyCommand = NULL;
+	sortColumn->elemCount = 0;
+    }
+    sortData->columns[sortData->columnCount - 1].column =
+	TreeColumn_Index(treeColumn);
+    *sawColumnPtr = TRUE;
+    return TCL_OK;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * TreeItemCmd_ImageOrText --
+ * SortData_ElementOption --
  *
- *	This procedure is invoked to process the [item image] and
- *	[item text] widget commands.  See the user documentation for
- *	details on what it does.
+ *	Process the -element option of [item sort] or [item sortspec]
+ *	for the last column specified.
  *
  * Results:
  *	A standard Tcl result.
  *
  * Side effects:
- *	See the user documentation.
+ *	None.
  *
  *----------------------------------------------------------------------
  */
 
-int
-TreeItemCmd_ImageOrText(
-    TreeCtrl *tree,		/* Widget info. */
-    int objc,			/* Number of arguments. */
-    Tcl_Obj *CONST objv[],	/* Argument values. */
-    int doImage,		/* TRUE if this is [item image] */
-    int doHeaders		/* TRUE to operate on headers, FALSE
-				 * to operate on items. */
+static int
+SortData_ElementOption(
+    SortData *sortData,		/* Sort info. */
+    Tcl_Obj *objPtr		/* Element name, or list of style/element
+				 * pairs. */
     )
 {
+    TreeCtrl *tree = sortData->tree;
     Tcl_Interp *interp = tree->interp;
-    TreeColumn treeColumn = tree->columns;
-    TreeItemList itemList;
-    TreeItem item;
-    TreeElement elem = NULL;
-    TreeItemColumn column;
-    Tcl_Obj *objPtr;
-    int isImage = doImage;
-    struct columnObj {
-	TreeColumnList columns;
-	Tcl_Obj *obj;
-    } staticCO[STATIC_SIZE], *co = staticCO;
-    int i, count = 0, changed = FALSE, columnIndex;
-    ItemForEach iter;
-    ColumnForEach citer;
-    int flags = 0, result = TCL_OK;
-    int tailFlag = /*doHeaders ? 0 : */CFO_NOT_TAIL;
+    struct SortColumn *sortColumn;
+    struct SortElement *elemPtr;
+    int listObjc, j;
+    Tcl_Obj **listObjv;
 
-    /* T item text I ?C? ?text? ?C text ...? */
-    if (objc < 4) {
-	Tcl_WrongNumArgs(interp, 3, objv,
-	    doHeaders ?
-		"header ?column? ?text? ?column text ...?" :
-		"item ?column? ?text? ?column text ...?");
+    if (Tcl_ListObjGetElements(interp, objPtr, &listObjc,
+		&listObjv) != TCL_OK)
 	return TCL_ERROR;
-    }
-
-    if (objc < 6)
-	flags = IFO_NOT_NULL | IFO_NOT_MANY;
-    if (doHeaders) {
-	if (TreeHeaderList_FromObj(tree, objv[3], &itemList, flags)
-		!= TCL_OK)
+    sortColumn = &sortData->columns[sortData->columnCount - 1];
+    elemPtr = sortColumn->elems;
+    sortColumn->elemCount = 0;
+    if (listObjc == 0) {
+    } else if (listObjc == 1) {
+	if (TreeElement_FromObj(tree, listObjv[0], &elemPtr->elem)
+		!= TCL_OK) {
+	    Tcl_AddErrorInfo(interp,
+		    "\n    (processing -element option)");
+	    return TCL_ERROR;
+	}
+	if (!TreeElement_IsType(tree, elemPtr->elem, "text")) {
+	    FormatResult(interp,
+		    "element %s is not of type \"text\"",
+		    Tcl_GetString(listObjv[0]));
+	    Tcl_AddErrorInfo(interp,
+		    "\n    (processing -element option)");
 	    return TCL_ERROR;
+	}
+	elemPtr->style = NULL;
+	elemPtr->elemIndex = -1;
+	sortColumn->elemCount++;
     } else {
-	if (TreeItemList_FromObj(tree, objv[3], &itemList, flags)
-		!= TCL_OK)
+	if (listObjc & 1) {
+	    FormatResult(interp,
+		    "list must have even number of elements");
+	    Tcl_AddErrorInfo(interp,
+		    "\n    (processing -element option)");
 	    return TCL_ERROR;
-    }
-    item = TreeItemList_Nth(&itemList, 0);
-
-    if (objc == 4) {
-	Tcl_Obj *listObj = Tcl_NewListObj(0, NULL);
-	column = item->columns;
-	while (treeColumn != NULL) {
-	    if ((column != NULL) && (column->style != NULL) &&
-		    !TreeStyle_IsHeaderStyle(tree, column->style)) {
-		objPtr = isImage ?
-		    TreeStyle_GetImage(tree, column->style, &elem) :
-		    TreeStyle_GetText(tree, column->style, &elem);
-	    } else
-		objPtr = NULL;
-	    if (doHeaders && elem == NULL)
-		objPtr = TreeHeaderColumn_GetImageOrText(item->header,
-		    column->headerColumn, isImage);
-	    if (objPtr == NULL)
-		objPtr = Tcl_NewObj();
-	    Tcl_ListObjAppendElement(interp, listObj, objPtr);
-	    treeColumn = TreeColumn_Next(treeColumn);
-	    if (column != NULL)
-		column = column->next;
 	}
-	Tcl_SetObjResult(interp, listObj);
-	goto okExit;
-    }
-    if (objc == 5) {
-	if (TreeItem_ColumnFromObj(tree, item, objv[4], &column, NULL, NULL,
-		CFO_NOT_NULL | CFO_NOT_TAIL) != TCL_OK) {
-	    goto errorExit;
+	for (j = 0; j < listObjc; j += 2) {
+	    if ((TreeStyle_FromObj(tree, listObjv[j],
+			 &elemPtr->style) != TCL_OK) ||
+		    (TreeElement_FromObj(tree, listObjv[j + 1],
+			    &elemPtr->elem) != TCL_OK) ||
+		    (TreeStyle_FindElement(tree, elemPtr->style,
+			    elemPtr->elem, &elemPtr->elemIndex) != TCL_OK)) {
+		Tcl_AddErrorInfo(interp,
+			"\n    (processing -element option)");
+		return TCL_ERROR;
+	    }
+	    if (!TreeElement_IsType(tree, elemPtr->elem, "text")) {
+		FormatResult(interp,
+			"element %s is not of type \"text\"",
+			Tcl_GetString(listObjv[j + 1]));
+		Tcl_AddErrorInfo(interp,
+			"\n    (processing -element option)");
+		return TCL_ERROR;
+	    }
+	    sortColumn->elemCount++;
+	    elemPtr++;
 	}
-	if ((column != NULL) && (column->style != NULL) &&
-		!TreeStyle_IsHeaderStyle(tree, column->style)) {
-	    objPtr = isImage ?
-		TreeStyle_GetImage(tree, column->style, &elem) :
-		TreeStyle_GetText(tree, column->style, &elem);
-	 } else
-	    objPtr = NULL;
-	if (doHeaders && elem == NULL)
-	    objPtr = TreeHeaderColumn_GetImageOrText(item->header,
-		column->headerColumn, isImage);
-	if (objPtr != NULL)
-	    Tcl_SetObjResult(interp, objPtr);
-	goto okExit;
     }
-    if ((objc - 4) & 1) {
-	FormatResult(interp, "missing argument after column \"%s\"",
-		Tcl_GetString(objv[objc - 1]));
-	goto errorExit;
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SortData_GetKey --
+ *
+ *	Get the value an item is sorted by in one of the sort columns,
+ *	from the text element chosen by the -element option.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+SortData_GetKey(
+    SortData *sortData,		/* Sort info. */
+    int i,			/* Index in sortData->columns[]. */
+    TreeItem item,		/* Item to get the key of. */
+    struct SortItem1 *sortItem1	/* Gets the key. */
+    )
+{
+    TreeCtrl *tree = sortData->tree;
+    struct SortColumn *sortColumn = &sortData->columns[i];
+    TreeItemColumn column;
+    int j, elemIndex;
+
+    column = TreeItem_FindColumn(tree, item, sortColumn->column);
+    if ((column == NULL) || (column->style == NULL)) {
+	NoStyleMsg(tree, item, sortColumn->column);
+	return TCL_ERROR;
     }
-    /* Gather column/obj pairs. */
-    STATIC_ALLOC(co, struct columnObj, objc / 2);
-    for (i = 4; i < objc; i += 2) {
-	if (TreeColumnList_FromObj(tree, objv[i], &co[count].columns,
-		CFO_NOT_NULL | tailFlag) != TCL_OK) {
-	    result = TCL_ERROR;
-	    goto doneTEXT;
+
+    /* -element was empty. Find the first text element in the style */
+    if (sortColumn->elemCount == 0)
+	elemIndex = -1;
+
+    /* -element was element name. Find the element in the style */
+    else if ((sortColumn->elemCount == 1) &&
+	    (sortColumn->elems[0].style == NULL)) {
+	if (TreeStyle_FindElement(tree, column->style,
+		    sortColumn->elems[0].elem, &elemIndex) != TCL_OK)
+	    return TCL_ERROR;
+    }
+
+    /* -element was style/element pair list */
+    else {
+	TreeStyle masterStyle = TreeStyle_GetMaster(tree, column->style);
+
+	/* If the item style does not match any in the -element list,
+	 * we will use the first text element in the item style. */
+	elemIndex = -1;
+
+	/* Match a style from the -element list. Look in reverse order
+	 * to handle duplicates. */
+	for (j = sortColumn->elemCount - 1; j >= 0; j--) {
+	    if (sortColumn->elems[j].style == masterStyle) {
+		elemIndex = sortColumn->elems[j].elemIndex;
+		break;
+	    }
 	}
-	co[count].obj = objv[i + 1];
-	count++;
     }
-    ITEM_FOR_EACH(item, &itemList, NULL, &iter) {
-	int changedI = FALSE;
-	for (i = 0; i < count; i++) {
-	    COLUMN_FOR_EACH(treeColumn, &co[i].columns, NULL, &citer) {
-		columnIndex = TreeColumn_Index(treeColumn);
-		column = TreeItem_FindColumn(tree, item, columnIndex);
-		if ((column == NULL) || (column->style == NULL) ||
-			TreeStyle_IsHeaderStyle(tree, column->style)) {
-		    if (doHeaders) {
-			result = TreeHeaderColumn_SetImageOrText(item->header,
-			    column->headerColumn, treeColumn, co[i].obj, isImage);
-			if (result != TCL_OK)
-			    goto doneTEXT;
-			continue;
-		    }
-		    NoStyleMsg(tree, item, columnIndex);
-		    result = TCL_ERROR;
-		    goto doneTEXT;
-		}
-		result = isImage ?
-		    TreeStyle_SetImage(tree, item, column, column->style,
-			co[i].obj, &elem) :
-		    TreeStyle_SetText(tree, item, column, column->style,
-			co[i].obj, &elem);
-		if (result != TCL_OK)
-		    goto doneTEXT;
-		if (elem == NULL) {
-		    if (doHeaders) {
-			result = TreeHeaderColumn_SetImageOrText(item->header,
-			    column->headerColumn, treeColumn, co[i].obj, isImage);
-			if (result != TCL_OK)
-			    goto doneTEXT;
-		    }
-		} else {
-		    TreeItemColumn_InvalidateSize(tree, column);
-		    TreeColumns_InvalidateWidthOfItems(tree, treeColumn);
-		    changedI = TRUE;
-		}
+    return TreeStyle_GetSortData(tree, column->style, elemIndex,
+	    sortColumn->sortBy, &sortItem1->longValue,
+	    &sortItem1->doubleValue, &sortItem1->string);
+}
+
+/* BEGIN natural merge sort */
+
+/*
+ * The sort is a bottom-up merge sort that starts from the runs of items
+ * that are already in order, so sorting a list that is already sorted
+ * (or sorted backwards) takes one pass. It is stable: items that compare
+ * equal keep their relative order. Unlike quicksort it never goes out of
+ * bounds when a -command gives inconsistent answers.
+ */
+
+static void
+merge_runs(
+    SortData *sortData,
+    struct SortItem *src,	/* Two adjacent sorted runs. */
+    int mid,			/* Index of the start of the second run. */
+    int end,			/* Number of items in both runs. */
+    struct SortItem *dst	/* Gets the merged run. */
+    )
+{
+    int i = 0, j = mid, k = 0, v;
+
+    while (i < mid && j < end) {
+	v = CompareProc(sortData, &src[j], &src[i]);
+	if (sortData->result != TCL_OK)
+	    return;
+	/* Take from the left run unless the right item is smaller, so
+	 * equal items keep their order. */
+	if (v < 0)
+	    dst[k++] = src[j++];
+	else
+	    dst[k++] = src[i++];
+    }
+    while (i < mid)
+	dst[k++] = src[i++];
+    while (j < end)
+	dst[k++] = src[j++];
+}
+
+static void
+natural_mergesort(
+    SortData *sortData,
+    struct SortItem *items,	/* Items to sort in place. */
+    int count			/* Number of items. */
+    )
+{
+    struct SortItem *src = items, *dst, *tmp, swap;
+    int *runs, numRuns = 0, start, end, i, j, v;
+
+    if (count < 2)
+	return;
+
+    /* Find the runs. A strictly decreasing run is reversed in place;
+     * equal items never appear in one so stability is kept. */
+    runs = (int *) ckalloc(sizeof(int) * (count + 1));
+    for (start = 0; start < count; start = end) {
+	runs[numRuns++] = start;
+	end = start + 1;
+	if (end == count)
+	    break;
+	v = CompareProc(sortData, &src[start], &src[end]);
+	if (sortData->result != TCL_OK)
+	    goto done;
+	if (v > 0) {
+	    for (end++; end < count; end++) {
+		v = CompareProc(sortData, &src[end - 1], &src[end]);
+		if (sortData->result != TCL_OK)
+		    goto done;
+		if (v <= 0)
+		    break;
+	    }
+	    for (i = start, j = end - 1; i < j; i++, j--) {
+		swap = src[i];
+		src[i] = src[j];
+		src[j] = swap;
+	    }
+	} else {
+	    for (end++; end < count; end++) {
+		v = CompareProc(sortData, &src[end - 1], &src[end]);
+		if (sortData->result != TCL_OK)
+		    goto done;
+		if (v > 0)
+		    break;
 	    }
 	}
-	if (changedI) {
-	    TreeItem_InvalidateHeight(tree, item);
-	    Tree_FreeItemDInfo(tree, item, NULL);
-	    changed = TRUE;
+    }
+    runs[numRuns] = count;
+    if (numRuns == 1)
+	goto done;
+
+    /* Merge pairs of neighboring runs until one is left. */
+    dst = (struct SortItem *) ckalloc(sizeof(struct SortItem) * count);
+    while (numRuns > 1) {
+	for (i = 0, j = 0; i < numRuns; i += 2, j++) {
+	    start = runs[i];
+	    if (i + 1 == numRuns) {
+		memcpy(dst + start, src + start,
+			sizeof(struct SortItem) * (count - start));
+	    } else {
+		merge_runs(sortData, src + start, runs[i + 1] - start,
+			runs[i + 2] - start, dst + start);
+		if (sortData->result != TCL_OK)
+		    break;
+	    }
+	    runs[j] = start;
 	}
+	if (sortData->result != TCL_OK)
+	    break;
+	runs[j] = count;
+	numRuns = j;
+	tmp = src;
+	src = dst;
+	dst = tmp;
+    }
+    if (src != items) {
+	/* Even after an error 'src' holds every item exactly once, which
+	 * the caller needs to release the Tcl_Objs. */
+	memcpy(items, src, sizeof(struct SortItem) * count);
+	ckfree((char *) src);
+    } else {
+	ckfree((char *) dst);
     }
-    if (changed && !doHeaders)
-	Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
-doneTEXT:
-    for (i = 0; i < count; i++) {
-	TreeColumnList_Free(&co[i].columns);
+
+done:
+    ckfree((char *) runs);
+}
+
+#ifdef TCL_THREADS
+
+/*
+ * Sorting by keys that are already extracted runs no Tcl code, so a big
+ * list is split into one chunk per processor. Each chunk is sorted by its
+ * own thread and then neighboring chunks are merged, also in parallel,
+ * until one is left. Because the merge sort is stable the result is
+ * exactly the same as sorting in one thread.
+ */
+
+#define SORT_THREAD_MIN 50000	/* Fewest items for each thread. */
+#define SORT_THREAD_MAX 16
+
+typedef struct SortJob {
+    SortData *sortData;
+    struct SortItem *src;	/* Items to sort, or two runs to merge. */
+    int mid;			/* Start of the second run. */
+    int count;			/* Number of items. */
+    struct SortItem *dst;	/* NULL to sort src in place, otherwise
+				 * gets the merged runs. */
+} SortJob;
+
+static Tcl_ThreadCreateType
+SortJobProc(
+    ClientData clientData
+    )
+{
+    SortJob *job = clientData;
+
+    if (job->dst == NULL)
+	natural_mergesort(job->sortData, job->src, job->count);
+    else
+	merge_runs(job->sortData, job->src, job->mid, job->count, job->dst);
+    TCL_THREAD_CREATE_RETURN;
+}
+
+static void
+run_sort_jobs(
+    SortJob *jobs,
+    int numJobs
+    )
+{
+    Tcl_ThreadId ids[SORT_THREAD_MAX];
+    int started[SORT_THREAD_MAX], i, result;
+
+    /* The first job runs in this thread. If a thread can't be created
+     * its job runs here too. */
+    for (i = 1; i < numJobs; i++) {
+	started[i] = Tcl_CreateThread(&ids[i], SortJobProc,
+		(ClientData) &jobs[i], TCL_THREAD_STACK_DEFAULT,
+		TCL_THREAD_JOINABLE) == TCL_OK;
     }
-    STATIC_FREE(co, struct columnObj, objc / 2);
-    TreeItemList_Free(&itemList);
-    return result;
+    (void) SortJobProc((ClientData) &jobs[0]);
+    for (i = 1; i < numJobs; i++) {
+	if (started[i])
+	    Tcl_JoinThread(ids[i], &result);
+	else
+	    (void) SortJobProc((ClientData) &jobs[i]);
+    }
+}
 
-okExit:
-    TreeItemList_Free(&itemList);
-    return TCL_OK;
+static void
+parallel_mergesort(
+    SortData *sortData,
+    struct SortItem *items,	/* Items to sort. */
+    int count			/* Number of items. */
+    )
+{
+    struct SortItem *src = items, *dst, *tmp;
+    SortJob jobs[SORT_THREAD_MAX];
+    int bounds[SORT_THREAD_MAX + 1];
+    int numChunks, numJobs, i, j;
 
-errorExit:
-    TreeItemList_Free(&itemList);
-    return TCL_ERROR;
+    numChunks = MIN(Tree_NumProcessors(), count / SORT_THREAD_MIN);
+    numChunks = MIN(numChunks, SORT_THREAD_MAX);
+    if (numChunks < 2) {
+	natural_mergesort(sortData, items, count);
+	return;
+    }
+
+    for (i = 0; i <= numChunks; i++)
+	bounds[i] = (int) (((Tcl_WideInt) count * i) / numChunks);
+    for (i = 0; i < numChunks; i++) {
+	jobs[i].sortData = sortData;
+	jobs[i].src = src + bounds[i];
+	jobs[i].count = bounds[i + 1] - bounds[i];
+	jobs[i].dst = NULL;
+    }
+    run_sort_jobs(jobs, numChunks);
+
+    dst = (struct SortItem *) ckalloc(sizeof(struct SortItem) * count);
+    while (numChunks > 1) {
+	for (i = 0, numJobs = 0; i + 1 < numChunks; i += 2, numJobs++) {
+	    jobs[numJobs].sortData = sortData;
+	    jobs[numJobs].src = src + bounds[i];
+	    jobs[numJobs].mid = bounds[i + 1] - bounds[i];
+	    jobs[numJobs].count = bounds[i + 2] - bounds[i];
+	    jobs[numJobs].dst = dst + bounds[i];
+	}
+	if (i < numChunks) {
+	    memcpy(dst + bounds[i], src + bounds[i],
+		    sizeof(struct SortItem) * (count - bounds[i]));
+	}
+	run_sort_jobs(jobs, numJobs);
+	for (i = 0, j = 0; i < numChunks; i += 2, j++)
+	    bounds[j] = bounds[i];
+	bounds[j] = count;
+	numChunks = j;
+	tmp = src;
+	src = dst;
+	dst = tmp;
+    }
+    if (src != items) {
+	memcpy(items, src, sizeof(struct SortItem) * count);
+	ckfree((char *) src);
+    } else {
+	ckfree((char *) dst);
+    }
 }
 
+#endif /* TCL_THREADS */
+
+/* END natural merge sort */
+
+/* A run of siblings sorted by [item sort]. With -recurse there is one of
+ * these for every item in the subtree with more than one child. */
+typedef struct SortSegment {
+    TreeItem parent;		/* Parent of the sorted items. */
+    TreeItem first, last;	/* First and last sibling to sort. */
+    int start;			/* Index of first sorted item in
+				 * SortData.items. */
+    int count;			/* Number of sorted items. */
+} SortSegment;
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SortSegment_Gather --
+ *
+ *	Find the runs of siblings to sort. The first run is first..last.
+ *	If recurse is TRUE, the children of every descendant of those
+ *	items follow in depth-first order.
+ *
+ * Results:
+ *	The number of runs. The total number of items in all the runs
+ *	is stored in countPtr. If segs is not NULL it is filled in; it
+ *	must have room for the number of runs returned by an earlier
+ *	call with segs == NULL.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
 static int
-ItemImageCmd(
-    ClientData clientData,	/* Widget info. */
-    Tcl_Interp *interp,		/* Current interpreter. */
-    int objc,			/* Number of arguments. */
-    Tcl_Obj *CONST objv[]	/* Argument values. */
+SortSegment_Gather(
+    TreeItem first,		/* First sibling to sort. */
+    TreeItem last,		/* Last sibling to sort. */
+    int recurse,		/* TRUE to sort the descendants too. */
+    SortSegment *segs,		/* Returned runs, or NULL. */
+    int *countPtr		/* Returned total number of items. */
+    )
+{
+    TreeItem top, walk, stop = last->nextSibling;
+    int numSegs = 0, count = 0, n = 0;
+
+    for (walk = first; walk != stop; walk = walk->nextSibling)
+	n++;
+    if (n > 1) {
+	if (segs != NULL) {
+	    segs[numSegs].parent = first->parent;
+	    segs[numSegs].first = first;
+	    segs[numSegs].last = last;
+	    segs[numSegs].start = count;
+	    segs[numSegs].count = n;
+	}
+	numSegs++;
+	count += n;
+    }
+
+    if (recurse) {
+	for (top = first; top != stop; top = top->nextSibling) {
+	    walk = top;
+	    while (1) {
+		if (walk->numChildren > 1) {
+		    if (segs != NULL) {
+			segs[numSegs].parent = walk;
+			segs[numSegs].first = walk->firstChild;
+			segs[numSegs].last = walk->lastChild;
+			segs[numSegs].start = count;
+			segs[numSegs].count = walk->numChildren;
+		    }
+		    numSegs++;
+		    count += walk->numChildren;
+		}
+		if (walk->firstChild != NULL) {
+		    walk = walk->firstChild;
+		    continue;
+		}
+		while ((walk != top) && (walk->nextSibling == NULL))
+		    walk = walk->parent;
+		if (walk == top)
+		    break;
+		walk = walk->nextSibling;
+	    }
+	}
+    }
+
+    (*countPtr) = count;
+    return numSegs;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SortSegment_Relink --
+ *
+ *	Put a run of sorted siblings back into their parent's list of
+ *	children in sorted order.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The sibling links of the items change. The caller must update
+ *	the item indexes.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SortSegment_Relink(
+    TreeCtrl *tree,		/* Widget info. */
+    SortData *sortData,		/* Sorted items. */
+    SortSegment *seg		/* Run to relink. */
     )
 {
-    TreeCtrl *tree = clientData;
-    return TreeItemCmd_ImageOrText(tree, objc, objv, TRUE, FALSE);
+    struct SortItem *items = sortData->items + seg->start;
+    TreeItem item = seg->parent, first, last, lastChild;
+    int i, count = seg->count, indexF, indexL;
+
+    first = seg->first->prevSibling;
+    last = seg->last->nextSibling;
+
+    /* Smallest to largest */
+    if (sortData->columns[0].order == 1) {
+	for (i = 0; i < count - 1; i++) {
+	    items[i].item->nextSibling = items[i + 1].item;
+	    items[i + 1].item->prevSibling = items[i].item;
+	}
+	indexF = 0;
+	indexL = count - 1;
+    }
+
+    /* Largest to smallest */
+    else {
+	for (i = count - 1; i > 0; i--) {
+	    items[i].item->nextSibling = items[i - 1].item;
+	    items[i - 1].item->prevSibling = items[i].item;
+	}
+	indexF = count - 1;
+	indexL = 0;
+    }
+
+    lastChild = item->lastChild;
+
+    items[indexF].item->prevSibling = first;
+    if (first)
+	first->nextSibling = items[indexF].item;
+    else
+	item->firstChild = items[indexF].item;
+
+    items[indexL].item->nextSibling = last;
+    if (last)
+	last->prevSibling = items[indexL].item;
+    else
+	item->lastChild = items[indexL].item;
+
+    /* Redraw the lines of the old/new lastchild */
+    if ((item->lastChild != lastChild) && tree->showLines && (tree->columnTree != NULL)) {
+	if (ITEM_DINFO(lastChild) != NULL)
+	    Tree_InvalidateItemDInfo(tree, tree->columnTree,
+		    lastChild,
+		    NULL);
+	if (ITEM_DINFO(item->lastChild) != NULL)
+	    Tree_InvalidateItemDInfo(tree, tree->columnTree,
+		    item->lastChild,
+		    NULL);
+    }
+
+    /* Rebuild the [item sortspec] order next time it is needed. */
+    if (ITEM_SORTSPEC(item) != NULL)
+	ITEM_SORTSPEC(item)->epoch = 0;
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * ItemSortCmd --
+ *
+ *	This procedure is invoked to process the [item sort] widget
+ *	command.  See the user documentation for details on what
+ *	it does.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	See the user documentation.
+ *
+ *----------------------------------------------------------------------
+ */
+
 static int
-ItemTextCmd(
+ItemSortCmd(
     ClientData clientData,	/* Widget info. */
     Tcl_Interp *interp,		/* Current interpreter. */
     int objc,			/* Number of arguments. */
@@ -6834,481 +10419,1030 @@ ItemTextCmd(
     )
 {
     TreeCtrl *tree = clientData;
-    return TreeItemCmd_ImageOrText(tree, objc, objv, FALSE, FALSE);
-}
+    TreeItem item, first, last, walk;
+    int i, j, s, count, index, indexF = 0, indexL = 0;
+    int sawColumn = FALSE, sawCmd = FALSE, sawKeyCmd = FALSE;
+    SortData sortData;
+    SortSegment *segs;
+    int numSegs, notReally = FALSE, recurse = FALSE;
+    int result = TCL_OK;
+
+    if (objc < 4) {
+	Tcl_WrongNumArgs(interp, 3, objv, "item ?option ...?");
+	return TCL_ERROR;
+    }
+
+    if (TreeItem_FromObj(tree, objv[3], &item, IFO_NOT_NULL) != TCL_OK)
+	return TCL_ERROR;
+
+    /* If the item has no children, then nothing is done and no error
+     * is generated. */
+    if (item->numChildren < 1)
+	return TCL_OK;
+
+    SortData_Init(tree, &sortData);
+
+    first = item->firstChild;
+    last = item->lastChild;
+
+    for (i = 4; i < objc; ) {
+	static CONST char *optionName[] = { "-ascii", "-column", "-command",
+					    "-decreasing", "-dictionary", "-element", "-first", "-increasing",
+					    "-integer", "-keycommand", "-last", "-notreally", "-real",
+					    "-recurse", NULL };
+	int numArgs[] = { 1, 2, 2, 1, 1, 2, 2, 1, 1, 2, 2, 1, 1, 1 };
+	enum { OPT_ASCII, OPT_COLUMN, OPT_COMMAND, OPT_DECREASING, OPT_DICT,
+	       OPT_ELEMENT, OPT_FIRST, OPT_INCREASING, OPT_INTEGER,
+	       OPT_KEYCOMMAND, OPT_LAST, OPT_NOT_REALLY, OPT_REAL,
+	       OPT_RECURSE };
+
+	if (Tcl_GetIndexFromObj(interp, objv[i], optionName, "option", 0,
+		    &index) != TCL_OK)
+	    return TCL_ERROR;
+	if (objc - i < numArgs[index]) {
+	    FormatResult(interp, "missing value for \"%s\" option",
+		    optionName[index]);
+	    return TCL_ERROR;
+	}
+	switch (index) {
+	    case OPT_ASCII:
+		sortData.columns[sortData.columnCount - 1].sortBy = SORT_ASCII;
+		break;
+	    case OPT_COLUMN:
+		if (SortData_ColumnOption(&sortData, objv[i + 1],
+			&sawColumn) != TCL_OK)
+		    return TCL_ERROR;
+		break;
+	    case OPT_COMMAND:
+		sortData.columns[sortData.columnCount - 1].command = objv[i + 1];
+		sortData.columns[sortData.columnCount - 1].sortBy = SORT_COMMAND;
+		sortData.columns[sortData.columnCount - 1].keyCommand = NULL;
+		sawCmd = TRUE;
+		break;
+	    case OPT_DECREASING:
+		sortData.columns[sortData.columnCount - 1].order = 0;
+		break;
+	    case OPT_DICT:
+		sortData.columns[sortData.columnCount - 1].sortBy = SORT_DICT;
+		break;
+	    case OPT_ELEMENT:
+		if (SortData_ElementOption(&sortData, objv[i + 1]) != TCL_OK)
+		    return TCL_ERROR;
+		break;
+	    case OPT_FIRST:
+		if (TreeItem_FromObj(tree, objv[i + 1], &first, IFO_NOT_NULL) != TCL_OK)
+		    return TCL_ERROR;
+		if (first->parent != item) {
+		    FormatResult(interp,
+			    "item %s%d is not a child of item %s%d",
+			    tree->itemPrefix, first->id, tree->itemPrefix, item->id);
+		    return TCL_ERROR;
+		}
+		break;
+	    case OPT_INCREASING:
+		sortData.columns[sortData.columnCount - 1].order = 1;
+		break;
+	    case OPT_INTEGER:
+		sortData.columns[sortData.columnCount - 1].sortBy = SORT_LONG;
+		break;
+	    case OPT_KEYCOMMAND: {
+		int length;
+
+		if (Tcl_ListObjLength(interp, objv[i + 1], &length) != TCL_OK)
+		    return TCL_ERROR;
+		sortData.columns[sortData.columnCount - 1].keyCommand = objv[i + 1];
+		if (sortData.columns[sortData.columnCount - 1].sortBy == SORT_COMMAND)
+		    sortData.columns[sortData.columnCount - 1].sortBy = SORT_ASCII;
+		sawKeyCmd = TRUE;
+		break;
+	    }
+	    case OPT_LAST:
+		if (TreeItem_FromObj(tree, objv[i + 1], &last, IFO_NOT_NULL) != TCL_OK)
+		    return TCL_ERROR;
+		if (last->parent != item) {
+		    FormatResult(interp,
+			    "item %s%d is not a child of item %s%d",
+			    tree->itemPrefix, last->id, tree->itemPrefix, item->id);
+		    return TCL_ERROR;
+		}
+		break;
+	    case OPT_NOT_REALLY:
+		notReally = TRUE;
+		break;
+	    case OPT_REAL:
+		sortData.columns[sortData.columnCount - 1].sortBy = SORT_DOUBLE;
+		break;
+	    case OPT_RECURSE:
+		recurse = TRUE;
+		break;
+	}
+	i += numArgs[index];
+    }
 
-/* Quicksort is not a "stable" sorting algorithm, but it can become a
- * stable sort by using the pre-sort order of two items as a tie-breaker
- * for items that would otherwise be considered equal. */
-#define STABLE_SORT
+    /* The result of -notreally is a single list of siblings. */
+    if (notReally && recurse) {
+	FormatResult(interp, "can't use -notreally with -recurse");
+	return TCL_ERROR;
+    }
 
-/* one per column per SortItem */
-struct SortItem1
-{
-    long longValue;
-    double doubleValue;
-    char *string;
-};
+    /* If there are no columns, we cannot perform a sort unless -command
+     * or -keycommand is specified. */
+    if ((tree->columnCount < 1) && (sortData.columns[0].sortBy != SORT_COMMAND)
+	    && (sortData.columns[0].keyCommand == NULL)) {
+	FormatResult(interp, "there are no columns");
+	return TCL_ERROR;
+    }
 
-/* one per Item */
-struct SortItem
-{
-    TreeItem item;
-    struct SortItem1 *item1;
-    Tcl_Obj *obj; /* TreeItem_ToObj() */
-#ifdef STABLE_SORT
-    int index; /* The pre-sort order of the item */
-#endif
-};
+    /* If there is only one item to sort, then return early. */
+    if ((first == last) && !recurse) {
+	if (notReally)
+	    Tcl_SetObjResult(interp, TreeItem_ToObj(tree, first));
+	return TCL_OK;
+    }
 
-typedef struct SortData SortData;
+    index = 0;
+    walk = item->firstChild;
+    while (walk != NULL) {
+	if (walk == first)
+	    indexF = index;
+	if (walk == last)
+	    indexL = index;
+	index++;
+	walk = walk->nextSibling;
+    }
+    if (indexF > indexL) {
+	walk = last;
+	last = first;
+	first = walk;
+    }
 
-/* Used to process -element option */
-struct SortElement
-{
-    TreeStyle style;
-    TreeElement elem;
-    int elemIndex;
-};
+    /* With -recurse every level of the subtree is sorted, but the keys
+     * of all the items are gathered into one array and the items are
+     * relinked and reindexed once. */
+    numSegs = SortSegment_Gather(first, last, recurse, NULL, &count);
+    if (numSegs == 0)
+	return TCL_OK;
+    segs = (SortSegment *) ckalloc(sizeof(SortSegment) * numSegs);
+    (void) SortSegment_Gather(first, last, recurse, segs, &count);
 
-/* One per TreeColumn */
-struct SortColumn
-{
-    int (*proc)(SortData *, struct SortItem *, struct SortItem *, int);
-    int sortBy;
-    int column;
-    int order;
-    Tcl_Obj *command;
-    struct SortElement elems[20];
-    int elemCount;
-};
+    for (i = 0; i < sortData.columnCount; i++) {
 
-/* Data for sort as a whole */
-struct SortData
-{
-    TreeCtrl *tree;
-    struct SortItem *items;
-    struct SortItem1 *item1s; /* SortItem.item1 points in here */
-#define MAX_SORT_COLUMNS 40
-    struct SortColumn columns[MAX_SORT_COLUMNS];
-    int columnCount; /* max number of columns to compare */
-    int result;
-};
+	/* Initialize the sort procedure for this column. */
+	sortData.columns[i].proc = sortProcs[sortData.columns[i].sortBy];
 
-/* from Tcl 8.4.0 */
-static int
-DictionaryCompare(
-    char *left,
-    char *right
-    )
-{
-    Tcl_UniChar uniLeft, uniRight, uniLeftLower, uniRightLower;
-    int diff, zeros;
-    int secondaryDiff = 0;
+	/* Append two dummy args to the -command argument. These two dummy
+	 * args are replaced by the 2 item ids being compared. See
+	 * CompareCmd(). */
+	if (sortData.columns[i].sortBy == SORT_COMMAND) {
+	    Tcl_Obj *obj = Tcl_DuplicateObj(sortData.columns[i].command);
+	    Tcl_Obj *obj2 = Tcl_NewObj();
+	    Tcl_IncrRefCount(obj);
+	    if (Tcl_ListObjAppendElement(interp, obj, obj2) != TCL_OK) {
+		Tcl_DecrRefCount(obj);
+		Tcl_IncrRefCount(obj2);
+		Tcl_DecrRefCount(obj2);
 
-    while (1) {
-	if (isdigit(UCHAR(*right)) && isdigit(UCHAR(*left))) { /* INTL: digit */
-	    /*
-	     * There are decimal numbers embedded in the two
-	     * strings.  Compare them as numbers, rather than
-	     * strings.  If one number has more leading zeros than
-	     * the other, the number with more leading zeros sorts
-	     * later, but only as a secondary choice.
-	     */
+		for (j = 0; j < i; j++) {
+		    if (sortData.columns[j].sortBy == SORT_COMMAND) {
+			Tcl_DecrRefCount(sortData.columns[j].command);
+		    }
+		    else if (sortData.columns[j].keyCommand != NULL) {
+			Tcl_DecrRefCount(sortData.columns[j].keyCommand);
+		    }
+		}
+		ckfree((char *) segs);
 
-	    zeros = 0;
-	    while ((*right == '0') && (isdigit(UCHAR(right[1])))) {
-		right++;
-		zeros--;
-	    }
-	    while ((*left == '0') && (isdigit(UCHAR(left[1])))) {
-		left++;
-		zeros++;
-	    }
-	    if (secondaryDiff == 0) {
-		secondaryDiff = zeros;
+		return TCL_ERROR;
 	    }
+	    (void) Tcl_ListObjAppendElement(interp, obj, obj2);
+	    sortData.columns[i].command = obj;
+	}
 
-	    /*
-	     * The code below compares the numbers in the two
-	     * strings without ever converting them to integers.  It
-	     * does this by first comparing the lengths of the
-	     * numbers and then comparing the digit values.
-	     */
+	/* Append one dummy arg to the -keycommand argument. It is replaced
+	 * by the id of each item in turn. See SortKeyCmd(). The list was
+	 * validated when parsing options. */
+	else if (sortData.columns[i].keyCommand != NULL) {
+	    Tcl_Obj *obj = Tcl_DuplicateObj(sortData.columns[i].keyCommand);
+	    Tcl_IncrRefCount(obj);
+	    (void) Tcl_ListObjAppendElement(interp, obj, Tcl_NewObj());
+	    sortData.columns[i].keyCommand = obj;
+	}
+    }
 
-	    diff = 0;
-	    while (1) {
-		if (diff == 0) {
-		    diff = UCHAR(*left) - UCHAR(*right);
-		}
-		right++;
-		left++;
-		if (!isdigit(UCHAR(*right))) {	/* INTL: digit */
-		    if (isdigit(UCHAR(*left))) {	/* INTL: digit */
-			return 1;
-		    } else {
-			/*
-			 * The two numbers have the same length. See
-			 * if their values are different.
-			 */
+    sortData.item1s = (struct SortItem1 *) ckalloc(sizeof(struct SortItem1) * count * sortData.columnCount);
+    sortData.items = (struct SortItem *) ckalloc(sizeof(struct SortItem) * count);
+    for (i = 0; i < count; i++) {
+	sortData.items[i].item1 = sortData.item1s + i * sortData.columnCount;
+	sortData.items[i].obj = NULL;
+    }
+    for (i = 0; i < count * sortData.columnCount; i++)
+	sortData.item1s[i].keyObj = NULL;
+
+    /* When sorting largest to smallest the sorted array is read
+     * backwards, so fill it backwards too. Then equal items keep their
+     * order and an already-sorted list is a single run. */
+    for (s = 0; s < numSegs; s++) {
+	index = 0;
+	walk = segs[s].first;
+	while (walk != segs[s].last->nextSibling) {
+	    struct SortItem *sortItem = &sortData.items[segs[s].start +
+		    ((sortData.columns[0].order == 1) ? index :
+		    segs[s].count - 1 - index)];
+
+	    sortItem->item = walk;
+	    if (sawCmd) {
+		Tcl_Obj *obj = TreeItem_ToObj(tree, walk);
+		Tcl_IncrRefCount(obj);
+		sortItem->obj = obj;
+	    }
+	    for (i = 0; i < sortData.columnCount; i++) {
+		struct SortItem1 *sortItem1 = sortItem->item1 + i;
+
+		if (sortData.columns[i].sortBy == SORT_COMMAND)
+		    continue;
 
-			if (diff != 0) {
-			    return diff;
-			}
-			break;
+		if (sortData.columns[i].keyCommand != NULL) {
+		    if (SortKeyCmd(tree, &sortData.columns[i], walk,
+			    sortItem1) != TCL_OK) {
+			result = TCL_ERROR;
+			goto done;
 		    }
-		} else if (!isdigit(UCHAR(*left))) {	/* INTL: digit */
-		    return -1;
+		    continue;
+		}
+
+		if (SortData_GetKey(&sortData, i, walk, sortItem1) != TCL_OK) {
+		    char msg[128];
+		    sprintf(msg, "\n    (preparing to sort item %s%d column %s%d)",
+			    tree->itemPrefix, walk->id,
+			    tree->columnPrefix, TreeColumn_GetID(
+			    Tree_FindColumn(tree, sortData.columns[i].column)));
+		    Tcl_AddErrorInfo(interp, msg);
+		    result = TCL_ERROR;
+		    goto done;
 		}
 	    }
-	    continue;
+	    index++;
+	    walk = walk->nextSibling;
 	}
+    }
 
-	/*
-	 * Convert character to Unicode for comparison purposes.  If either
-	 * string is at the terminating null, do a byte-wise comparison and
-	 * bail out immediately.
-	 */
+    for (s = 0; s < numSegs; s++) {
+#ifdef TCL_THREADS
+	/* Comparing extracted keys runs no Tcl code, so threads can help. */
+	if (!sawCmd)
+	    parallel_mergesort(&sortData, sortData.items + segs[s].start,
+		    segs[s].count);
+	else
+	    natural_mergesort(&sortData, sortData.items + segs[s].start,
+		    segs[s].count);
+#else
+	natural_mergesort(&sortData, sortData.items + segs[s].start,
+		segs[s].count);
+#endif
 
-	if ((*left != '\0') && (*right != '\0')) {
-	    left += Tcl_UtfToUniChar(left, &uniLeft);
-	    right += Tcl_UtfToUniChar(right, &uniRight);
-	    /*
-	     * Convert both chars to lower for the comparison, because
-	     * dictionary sorts are case insensitve.  Covert to lower, not
-	     * upper, so chars between Z and a will sort before A (where most
-	     * other interesting punctuations occur)
-	     */
-	    uniLeftLower = Tcl_UniCharToLower(uniLeft);
-	    uniRightLower = Tcl_UniCharToLower(uniRight);
-	} else {
-	    diff = UCHAR(*left) - UCHAR(*right);
-	    break;
+	if (sortData.result != TCL_OK) {
+	    result = sortData.result;
+	    goto done;
 	}
+    }
 
-	diff = uniLeftLower - uniRightLower;
-	if (diff) {
-	    return diff;
-	} else if (secondaryDiff == 0) {
-	    if (Tcl_UniCharIsUpper(uniLeft) &&
-		    Tcl_UniCharIsLower(uniRight)) {
-		secondaryDiff = -1;
-	    } else if (Tcl_UniCharIsUpper(uniRight) &&
-		    Tcl_UniCharIsLower(uniLeft)) {
-		secondaryDiff = 1;
+    if (sawCmd)
+	Tcl_ResetResult(interp);
+
+    if (notReally) {
+	Tcl_Obj *listObj = Tcl_NewListObj(0, NULL);
+	Tcl_Obj *itemObj;
+
+	/* Smallest to largest */
+	if (sortData.columns[0].order == 1) {
+	    for (i = 0; i < count; i++) {
+		itemObj = sortData.items[i].obj;
+		if (itemObj == NULL)
+		    itemObj = TreeItem_ToObj(tree,
+			    sortData.items[i].item);
+		Tcl_ListObjAppendElement(interp, listObj, itemObj);
 	    }
 	}
+
+	/* Largest to smallest */
+	else {
+	    for (i = count - 1; i >= 0; i--) {
+		itemObj = sortData.items[i].obj;
+		if (itemObj == NULL)
+		    itemObj = TreeItem_ToObj(tree,
+			    sortData.items[i].item);
+		Tcl_ListObjAppendElement(interp, listObj, itemObj);
+	    }
+	}
+
+	Tcl_SetObjResult(interp, listObj);
+	goto done;
+    }
+    for (s = 0; s < numSegs; s++)
+	SortSegment_Relink(tree, &sortData, &segs[s]);
+
+    tree->updateIndex = 1;
+    Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
+
+    done:
+    for (i = 0; i < count; i++) {
+	if (sortData.items[i].obj != NULL) {
+	    Tcl_DecrRefCount(sortData.items[i].obj);
+	}
+    }
+    for (i = 0; i < sortData.columnCount; i++) {
+	if (sortData.columns[i].sortBy == SORT_COMMAND) {
+	    Tcl_DecrRefCount(sortData.columns[i].command);
+	}
+	else if (sortData.columns[i].keyCommand != NULL) {
+	    Tcl_DecrRefCount(sortData.columns[i].keyCommand);
+	}
+    }
+    if (sawKeyCmd) {
+	for (i = 0; i < count * sortData.columnCount; i++) {
+	    if (sortData.item1s[i].keyObj != NULL)
+		Tcl_DecrRefCount(sortData.item1s[i].keyObj);
+	}
     }
-    if (diff == 0) {
-	diff = secondaryDiff;
+    ckfree((char *) sortData.item1s);
+    ckfree((char *) sortData.items);
+    ckfree((char *) segs);
+
+    if (tree->debug.enable && tree->debug.data) {
+	Tree_Debug(tree);
     }
-    return diff;
+
+    return result;
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * SortSpec_Parse --
+ *
+ *	Convert the options given to [item sortspec] into sort info.
+ *	This is done each time the spec is used, so columns, styles and
+ *	elements that were deleted are noticed.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
 static int
-CompareAscii(
-    SortData *sortData,
-    struct SortItem *a,
-    struct SortItem *b,
-    int n			/* Column index. */
+SortSpec_Parse(
+    TreeCtrl *tree,		/* Widget info. */
+    Tcl_Obj *specObj,		/* List of options. */
+    SortData *sortData		/* Gets the sort info. */
     )
 {
-    char *left  = a->item1[n].string;
-    char *right = b->item1[n].string;
+    Tcl_Interp *interp = tree->interp;
+    static CONST char *optionName[] = { "-ascii", "-column",
+	"-decreasing", "-dictionary", "-element", "-increasing",
+	"-integer", "-real", NULL };
+    enum { OPT_ASCII, OPT_COLUMN, OPT_DECREASING, OPT_DICT, OPT_ELEMENT,
+	OPT_INCREASING, OPT_INTEGER, OPT_REAL };
+    int objc, i, index, sawColumn = FALSE;
+    Tcl_Obj **objv;
+    struct SortColumn *sortColumn;
+
+    if (Tcl_ListObjGetElements(interp, specObj, &objc, &objv) != TCL_OK)
+	return TCL_ERROR;
 
-    /* make sure to handle case where no string value has been set */
-    if (left == NULL) {
-	return ((right == NULL) ? 0 : (0 - UCHAR(*right)));
-    } else if (right == NULL) {
-	return UCHAR(*left);
-    } else {
-	return strcmp(left, right);
+    SortData_Init(tree, sortData);
+
+    for (i = 0; i < objc; i++) {
+	if (Tcl_GetIndexFromObj(interp, objv[i], optionName, "option", 0,
+		    &index) != TCL_OK)
+	    return TCL_ERROR;
+	if ((index == OPT_COLUMN || index == OPT_ELEMENT) && (i + 1 == objc)) {
+	    FormatResult(interp, "missing value for \"%s\" option",
+		    optionName[index]);
+	    return TCL_ERROR;
+	}
+	sortColumn = &sortData->columns[sortData->columnCount - 1];
+	switch (index) {
+	    case OPT_ASCII:
+		sortColumn->sortBy = SORT_ASCII;
+		break;
+	    case OPT_COLUMN:
+		if (SortData_ColumnOption(sortData, objv[++i],
+			&sawColumn) != TCL_OK)
+		    return TCL_ERROR;
+		break;
+	    case OPT_DECREASING:
+		sortColumn->order = 0;
+		break;
+	    case OPT_DICT:
+		sortColumn->sortBy = SORT_DICT;
+		break;
+	    case OPT_ELEMENT:
+		if (SortData_ElementOption(sortData, objv[++i]) != TCL_OK)
+		    return TCL_ERROR;
+		break;
+	    case OPT_INCREASING:
+		sortColumn->order = 1;
+		break;
+	    case OPT_INTEGER:
+		sortColumn->sortBy = SORT_LONG;
+		break;
+	    case OPT_REAL:
+		sortColumn->sortBy = SORT_DOUBLE;
+		break;
+	}
+    }
+
+    if (tree->columnCount < 1) {
+	FormatResult(interp, "there are no columns");
+	return TCL_ERROR;
     }
+
+    for (i = 0; i < sortData->columnCount; i++)
+	sortData->columns[i].proc = sortProcs[sortData->columns[i].sortBy];
+    return TCL_OK;
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * SortSpec_Compare --
+ *
+ *	Compare two items in the order of an [item sortspec].
+ *
+ * Results:
+ *	< 0 if a comes before b, 0 if they are equal, > 0 otherwise.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
 static int
-CompareDict(
-    SortData *sortData,
-    struct SortItem *a,
-    struct SortItem *b,
-    int n			/* Column index. */
+SortSpec_Compare(
+    SortData *sortData,		/* Sort info. */
+    struct SortItem *a,		/* First item. */
+    struct SortItem *b		/* Second item. */
     )
 {
-    char *left  = a->item1[n].string;
-    char *right = b->item1[n].string;
+    int v = CompareProc(sortData, a, b);
 
-    /* make sure to handle case where no string value has been set */
-    if (left == NULL) {
-	return ((right == NULL) ? 0 : (0 - UCHAR(*right)));
-    } else if (right == NULL) {
-	return UCHAR(*left);
-    } else {
-	return DictionaryCompare(left, right);
-    }
+    return sortData->columns[0].order ? v : -v;
 }
 
-static int
-CompareDouble(
-    SortData *sortData,
-    struct SortItem *a,
-    struct SortItem *b,
-    int n			/* Column index. */
+/*
+ *----------------------------------------------------------------------
+ *
+ * SortSpec_GetKeys --
+ *
+ *	Get the values an item is sorted by for an [item sortspec].
+ *	Unlike [item sort] it is not an error if an item has no style,
+ *	element, or a number where one is expected; the item is sorted as
+ *	if the text were empty or zero.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The interpreter result may be changed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SortSpec_GetKeys(
+    SortData *sortData,		/* Sort info. */
+    TreeItem item,		/* Item to get the keys of. */
+    struct SortItem1 *item1	/* Gets one key per sort column. */
     )
 {
-    return (a->item1[n].doubleValue < b->item1[n].doubleValue) ? -1 :
-	((a->item1[n].doubleValue == b->item1[n].doubleValue) ? 0 : 1);
+    int i;
+
+    for (i = 0; i < sortData->columnCount; i++) {
+	item1[i].keyObj = NULL;
+	if (SortData_GetKey(sortData, i, item, &item1[i]) != TCL_OK) {
+	    item1[i].longValue = 0;
+	    item1[i].doubleValue = 0.0;
+	    item1[i].string = NULL;
+	}
+    }
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * SortSpec_InOrder --
+ *
+ *	Determine if a child is in order with respect to its siblings.
+ *
+ * Results:
+ *	TRUE if neither sibling is waiting to be placed and the item
+ *	belongs between them, FALSE otherwise.
+ *
+ * Side effects:
+ *	The interpreter result may be changed.
+ *
+ *----------------------------------------------------------------------
+ */
+
 static int
-CompareLong(
-    SortData *sortData,
-    struct SortItem *a,
-    struct SortItem *b,
-    int n			/* Column index. */
+SortSpec_InOrder(
+    SortData *sortData,		/* Sort info. */
+    TreeItem item		/* Child of an item with an [item sortspec]. */
     )
 {
-    return (a->item1[n].longValue < b->item1[n].longValue) ? -1 :
-	((a->item1[n].longValue == b->item1[n].longValue) ? 0 : 1);
+    struct SortItem1 keys[2][MAX_SORT_COLUMNS];
+    struct SortItem a, b;
+    TreeItem prev = item->prevSibling, next = item->nextSibling;
+
+    if (((prev != NULL) && (prev->flags & ITEM_FLAG_SORT_PENDING)) ||
+	    ((next != NULL) && (next->flags & ITEM_FLAG_SORT_PENDING)))
+	return FALSE;
+
+    a.item = item;
+    a.item1 = keys[0];
+    a.obj = NULL;
+    SortSpec_GetKeys(sortData, item, a.item1);
+    b.item1 = keys[1];
+    b.obj = NULL;
+    if (prev != NULL) {
+	b.item = prev;
+	SortSpec_GetKeys(sortData, prev, b.item1);
+	if (SortSpec_Compare(sortData, &b, &a) > 0)
+	    return FALSE;
+    }
+    if (next != NULL) {
+	b.item = next;
+	SortSpec_GetKeys(sortData, next, b.item1);
+	if (SortSpec_Compare(sortData, &a, &b) > 0)
+	    return FALSE;
+    }
+    return TRUE;
 }
 
-static int
-CompareCmd(
-    SortData *sortData,
-    struct SortItem *a,
-    struct SortItem *b,
-    int n			/* Column index. */
+/*
+ *----------------------------------------------------------------------
+ *
+ * SortSpec_Place --
+ *
+ *	Move the children of one item that are on the pending list to
+ *	their sorted positions among the other children, which are
+ *	assumed to be in order already.
+ *
+ *	The pending children are sorted among themselves, then each one is
+ *	placed by a binary search of the others, so only O(k log n)
+ *	sort keys are looked at for k pending items and n children.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The children are relinked. The interpreter result may be changed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SortSpec_Place(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem parent,		/* Item with an [item sortspec]. */
+    int start			/* Index in TreeCtrl.sortPendingList of the
+				 * first pending child of parent. */
     )
 {
-    Tcl_Interp *interp = sortData->tree->interp;
-    Tcl_Obj **objv, *paramObjv[2];
-    int objc, v;
+    TreeItemList *pending = &tree->sortPendingList;
+    ItemSortSpec *spec = ITEM_SORTSPEC(parent);
+    SortData sortData;
+    struct SortItem *sortItem, other;
+    struct SortItem1 *otherKeys;
+    TreeItem item, walk, lastChild, *merged;
+    int *pos;
+    int i, j, k, count = 0, m, lo, hi, mid, increasing, ok;
+
+    ok = SortSpec_Parse(tree, spec->specObj, &sortData) == TCL_OK;
+
+    for (i = start; ok && (i < TreeItemList_Count(pending)); i++) {
+	item = TreeItemList_Nth(pending, i);
+	if (!(item->flags & ITEM_FLAG_SORT_PENDING) ||
+		(item->parent != parent) || IS_DELETED(item))
+	    continue;
 
-    paramObjv[0] = a->obj;
-    paramObjv[1] = b->obj;
+	/* An item whose text changed but is still in order stays put, so
+	 * it doesn't move past its equals. */
+	if (!(item->flags & ITEM_FLAG_SORT_NEW) &&
+		SortSpec_InOrder(&sortData, item)) {
+	    item->flags &= ~ITEM_FLAGS_SORT;
+	    continue;
+	}
+	count++;
+    }
 
-    Tcl_ListObjLength(interp, sortData->columns[n].command, &objc);
-    Tcl_ListObjReplace(interp, sortData->columns[n].command, objc - 2,
-	    2, 2, paramObjv);
-    Tcl_ListObjGetElements(interp, sortData->columns[n].command,
-	    &objc, &objv);
+    /* Nothing needs to move, or the spec refers to a column, style or
+     * element that was deleted and the items are left where they are. */
+    if (!ok || (count == 0)) {
+	for (i = start; i < TreeItemList_Count(pending); i++) {
+	    item = TreeItemList_Nth(pending, i);
+	    if (item->parent == parent)
+		item->flags &= ~ITEM_FLAGS_SORT;
+	}
+	return;
+    }
 
-    sortData->result = Tcl_EvalObjv(interp, objc, objv, 0);
+    /* Get the children that are not pending, in order. The cached list
+     * is used if the children haven't been relinked since it was made,
+     * otherwise it is rebuilt by walking the children. */
+    if ((spec->epoch == tree->visEpoch) &&
+	    (spec->count + count != parent->numChildren)) {
+	for (i = 0, m = 0; i < spec->count; i++) {
+	    if (!(spec->children[i]->flags & ITEM_FLAG_SORT_PENDING))
+		spec->children[m++] = spec->children[i];
+	}
+	spec->count = m;
+    }
+    if ((spec->epoch != tree->visEpoch) ||
+	    (spec->count + count != parent->numChildren)) {
+	if (spec->children != NULL)
+	    ckfree((char *) spec->children);
+	spec->children = (TreeItem *) ckalloc(sizeof(TreeItem) *
+		MAX(parent->numChildren, 1));
+	m = 0;
+	for (walk = parent->firstChild; walk != NULL; walk = walk->nextSibling) {
+	    if (!(walk->flags & ITEM_FLAG_SORT_PENDING))
+		spec->children[m++] = walk;
+	}
+	spec->count = m;
+    }
+    m = spec->count;
+
+    /* Get the keys of the pending children and sort them. As in
+     * [item sort] the array is filled backwards for -decreasing so
+     * equal items keep their order. */
+    increasing = sortData.columns[0].order;
+    sortData.items = (struct SortItem *) ckalloc(sizeof(struct SortItem) *
+	    count);
+    sortData.item1s = (struct SortItem1 *) ckalloc(sizeof(struct SortItem1) *
+	    (count + 1) * sortData.columnCount);
+    for (i = start, j = 0; i < TreeItemList_Count(pending); i++) {
+	item = TreeItemList_Nth(pending, i);
+	if (item->parent != parent)
+	    continue;
+	if ((item->flags & ITEM_FLAG_SORT_PENDING) && !IS_DELETED(item)) {
+	    sortItem = &sortData.items[increasing ? j : count - 1 - j];
+	    sortItem->item = item;
+	    sortItem->item1 = sortData.item1s + j * sortData.columnCount;
+	    sortItem->obj = NULL;
+	    SortSpec_GetKeys(&sortData, item, sortItem->item1);
+	    j++;
+	}
+	item->flags &= ~ITEM_FLAGS_SORT;
+    }
+#ifdef TCL_THREADS
+    parallel_mergesort(&sortData, sortData.items, count);
+#else
+    natural_mergesort(&sortData, sortData.items, count);
+#endif
+    if (!increasing) {
+	for (i = 0, j = count - 1; i < j; i++, j--) {
+	    other = sortData.items[i];
+	    sortData.items[i] = sortData.items[j];
+	    sortData.items[j] = other;
+	}
+    }
+
+    /* Find where each pending child goes. Since they are in order each
+     * search starts where the previous one ended. */
+    otherKeys = sortData.item1s + count * sortData.columnCount;
+    other.item1 = otherKeys;
+    other.obj = NULL;
+    pos = (int *) ckalloc(sizeof(int) * count);
+    lo = 0;
+    for (k = 0; k < count; k++) {
+	hi = m;
+	while (lo < hi) {
+	    mid = lo + (hi - lo) / 2;
+	    other.item = spec->children[mid];
+	    SortSpec_GetKeys(&sortData, other.item, otherKeys);
+	    if (SortSpec_Compare(&sortData, &sortData.items[k], &other) < 0)
+		hi = mid;
+	    else
+		lo = mid + 1;
+	}
+	pos[k] = lo;
+    }
 
-    if (sortData->result != TCL_OK) {
-	Tcl_AddErrorInfo(interp, "\n    (evaluating item sort -command)");
-	return 0;
+    /* Unlink the pending children, then link each one in front of the
+     * child it goes before. */
+    lastChild = parent->lastChild;
+    for (k = 0; k < count; k++) {
+	item = sortData.items[k].item;
+	if (item->prevSibling != NULL)
+	    item->prevSibling->nextSibling = item->nextSibling;
+	else
+	    parent->firstChild = item->nextSibling;
+	if (item->nextSibling != NULL)
+	    item->nextSibling->prevSibling = item->prevSibling;
+	else
+	    parent->lastChild = item->prevSibling;
+    }
+    for (k = 0; k < count; k++) {
+	item = sortData.items[k].item;
+	walk = (pos[k] < m) ? spec->children[pos[k]] : NULL;
+	item->nextSibling = walk;
+	item->prevSibling = (walk != NULL) ? walk->prevSibling :
+	    parent->lastChild;
+	if (item->prevSibling != NULL)
+	    item->prevSibling->nextSibling = item;
+	else
+	    parent->firstChild = item;
+	if (walk != NULL)
+	    walk->prevSibling = item;
+	else
+	    parent->lastChild = item;
     }
 
-    sortData->result = Tcl_GetIntFromObj(interp, Tcl_GetObjResult(interp), &v);
-    if (sortData->result != TCL_OK) {
-	Tcl_ResetResult(interp);
-	Tcl_AppendToObj(Tcl_GetObjResult(interp),
-		"-command returned non-numeric result", -1);
-	return 0;
+    /* Merge the pending children into the cached order. */
+    merged = (TreeItem *) ckalloc(sizeof(TreeItem) * (m + count));
+    for (i = 0, j = 0, k = 0; k < count; k++) {
+	while (i < pos[k])
+	    merged[j++] = spec->children[i++];
+	merged[j++] = sortData.items[k].item;
     }
+    while (i < m)
+	merged[j++] = spec->children[i++];
+    if (spec->children != NULL)
+	ckfree((char *) spec->children);
+    spec->children = merged;
+    spec->count = m + count;
+    spec->epoch = tree->visEpoch;
 
-    return v;
+    /* Redraw the lines of the old/new lastchild */
+    if ((parent->lastChild != lastChild) && tree->showLines &&
+	    (tree->columnTree != NULL)) {
+	if (ITEM_DINFO(lastChild) != NULL)
+	    Tree_InvalidateItemDInfo(tree, tree->columnTree, lastChild, NULL);
+	if (ITEM_DINFO(parent->lastChild) != NULL)
+	    Tree_InvalidateItemDInfo(tree, tree->columnTree,
+		    parent->lastChild, NULL);
+    }
+
+    ckfree((char *) pos);
+    ckfree((char *) sortData.item1s);
+    ckfree((char *) sortData.items);
 }
 
-static int
-CompareProc(
-    SortData *sortData,
-    struct SortItem *a,
-    struct SortItem *b
+/*
+ *----------------------------------------------------------------------
+ *
+ * Item_PlaceSorted --
+ *
+ *	Move every item on the pending list to its sorted position
+ *	among the children of its parent. This is called when an [item]
+ *	command finishes, so a command that creates or changes many items
+ *	relinks them and invalidates the display once.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Items are relinked.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+Item_PlaceSorted(
+    TreeCtrl *tree		/* Widget info. */
     )
 {
-    int i, v;
-
-    if (a->item == b->item)
-	return 0;
-
-    for (i = 0; i < sortData->columnCount; i++) {
-	v = (*sortData->columns[i].proc)(sortData, a, b, i);
+    TreeItemList *pending = &tree->sortPendingList;
+    Tcl_SavedResult savedResult;
+    TreeItem item;
+    int i;
 
-	/* -command returned error */
-	if (sortData->result != TCL_OK)
-	    return 0;
+    if (TreeItemList_Count(pending) == 0)
+	return;
 
-	if (v != 0) {
-	    if (i && (sortData->columns[i].order != sortData->columns[0].order))
-		v *= -1;
-	    return v;
+    /* Items with no style or text in the sort column set an error
+     * message that is not wanted. */
+    Tcl_SaveResult(tree->interp, &savedResult);
+    for (i = 0; i < TreeItemList_Count(pending); i++) {
+	item = TreeItemList_Nth(pending, i);
+	if (!(item->flags & ITEM_FLAG_SORT_PENDING))
+	    continue;
+	if (IS_DELETED(item) || (item->parent == NULL) ||
+		(ITEM_SORTSPEC(item->parent) == NULL)) {
+	    item->flags &= ~ITEM_FLAGS_SORT;
+	    continue;
 	}
+	SortSpec_Place(tree, item->parent, i);
     }
-#ifdef STABLE_SORT
-    return ((a->index < b->index) == sortData->columns[0].order) ? -1 : 1;
-#else
-    return 0;
-#endif
+    Tcl_RestoreResult(tree->interp, &savedResult);
+    TreeItemList_Free(pending);
+
+    tree->updateIndex = 1;
+    Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
+    if (tree->debug.enable && tree->debug.data)
+	Tree_Debug(tree);
 }
 
-/* BEGIN custom quicksort() */
+/*
+ *----------------------------------------------------------------------
+ *
+ * ItemSortSpecCmd --
+ *
+ *	This procedure is invoked to process the [item sortspec] widget
+ *	command.  See the user documentation for details on what
+ *	it does.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	See the user documentation.
+ *
+ *----------------------------------------------------------------------
+ */
 
 static int
-find_pivot(
-    SortData *sortData,
-    struct SortItem *left,
-    struct SortItem *right,
-    struct SortItem *pivot
+ItemSortSpecCmd(
+    ClientData clientData,	/* Widget info. */
+    Tcl_Interp *interp,		/* Current interpreter. */
+    int objc,			/* Number of arguments. */
+    Tcl_Obj *CONST objv[]	/* Argument values. */
     )
 {
-    struct SortItem *a, *b, *c, *p, *tmp;
-    int v;
-
-    a = left;
-    b = (left + (right - left) / 2);
-    c = right;
+    TreeCtrl *tree = clientData;
+    TreeItem item, child;
+    ItemSortSpec *spec;
+    SortData sortData;
+    int length;
 
-    /* Arrange a <= b <= c. */
-    v = CompareProc(sortData, a, b);
-    if (sortData->result != TCL_OK)
-	return 0;
-    if (v > 0) { tmp = a; a = b; b = tmp; }
+    if (objc < 4 || objc > 5) {
+	Tcl_WrongNumArgs(interp, 3, objv, "item ?spec?");
+	return TCL_ERROR;
+    }
+    if (TreeItem_FromObj(tree, objv[3], &item, IFO_NOT_NULL) != TCL_OK)
+	return TCL_ERROR;
+    spec = ITEM_SORTSPEC(item);
 
-    v = CompareProc(sortData, a, c);
-    if (sortData->result != TCL_OK)
-	return 0;
-    if (v > 0) { tmp = a; a = c; c = tmp; }
+    if (objc == 4) {
+	if (spec != NULL)
+	    Tcl_SetObjResult(interp, spec->specObj);
+	return TCL_OK;
+    }
 
-    v = CompareProc(sortData, b, c);
-    if (sortData->result != TCL_OK)
-	return 0;
-    if (v > 0) { tmp = b; b = c; c = tmp; }
+    if (Tcl_ListObjLength(interp, objv[4], &length) != TCL_OK)
+	return TCL_ERROR;
 
-    /* if (a < b) pivot = b */
-    v = CompareProc(sortData, a, b);
-    if (sortData->result != TCL_OK)
-	return 0;
-    if (v < 0) {
-	(*pivot) = *b;
-	return 1;
+    /* An empty spec turns it off. */
+    if (length == 0) {
+	if (spec != NULL) {
+	    Tcl_DecrRefCount(spec->specObj);
+	    if (spec->children != NULL)
+		ckfree((char *) spec->children);
+	    ckfree((char *) spec);
+	    item->extra->sortSpec = NULL;
+	    Item_FreeExtraIfUnused(tree, item);
+	}
+	return TCL_OK;
     }
 
-    /* if (b < c) pivot = c */
-    v = CompareProc(sortData, b, c);
-    if (sortData->result != TCL_OK)
-	return 0;
-    if (v < 0) {
-	(*pivot) = *c;
-	return 1;
+    if (IS_DELETED(item)) {
+	FormatResult(interp, "item %s%d is being deleted",
+		tree->itemPrefix, item->id);
+	return TCL_ERROR;
     }
+    if (SortSpec_Parse(tree, objv[4], &sortData) != TCL_OK)
+	return TCL_ERROR;
 
-    for (p = left + 1; p <= right; p++) {
-	int v = CompareProc(sortData, p, left);
-	if (sortData->result != TCL_OK)
-	    return 0;
-	if (v != 0) {
-	    (*pivot) = (v < 0) ? *left : *p;
-	    return 1;
-	}
+    if (spec == NULL) {
+	spec = (ItemSortSpec *) ckalloc(sizeof(ItemSortSpec));
+	spec->children = NULL;
+	spec->count = 0;
+	Item_GetExtra(tree, item)->sortSpec = spec;
+    } else {
+	Tcl_DecrRefCount(spec->specObj);
     }
-    return 0;
+    spec->specObj = objv[4];
+    Tcl_IncrRefCount(spec->specObj);
+    spec->epoch = 0;
+
+    /* Put the existing children in order now. They are all placed when
+     * the [item] command finishes. */
+    for (child = item->firstChild; child != NULL; child = child->nextSibling)
+	Item_SortKeyChanged(tree, child);
+    return TCL_OK;
 }
 
-/* If the user provides a -command which does not properly compare two
- * elements, quicksort may go into an infinite loop or access illegal memory.
- * This #define indicates parts of the code which are not part of a normal
- * quicksort, but are present to detect the aforementioned bugs. */
-#define BUGGY_COMMAND
+/* How [item filter] matches the text in a column. */
+#define FILTER_GLOB 0
+#define FILTER_REGEXP 1
+#define FILTER_SUBSTRING 2
 
-static struct SortItem *
-partition(
-    SortData *sortData,
-    struct SortItem *left,
-    struct SortItem *right,
-    struct SortItem *pivot
-    )
-{
-    int v;
-#ifdef BUGGY_COMMAND
-    struct SortItem *min = left, *max = right;
-#endif
+struct FilterColumn {
+    int match;			/* FILTER_xxx constant. */
+    int nocase;			/* TRUE for -nocase. */
+    Tcl_Obj *patternObj;	/* -glob, -regexp or -substring value,
+				 * NULL if any text matches. */
+    Tcl_Obj *lowerObj;		/* Lower-case copy of patternObj for
+				 * -nocase -glob and -substring. */
+    Tcl_RegExp regExp;		/* Compiled -regexp pattern. */
+};
 
-    while (left <= right) {
-	/*
-	  while (*left < *pivot)
-	    ++left;
-	*/
-	while (1) {
-	    v = CompareProc(sortData, left, pivot);
-	    if (sortData->result != TCL_OK)
-		return NULL;
-	    if (v >= 0)
-		break;
-#ifdef BUGGY_COMMAND
-	    /* If -command always returns < 0, 'left' becomes invalid */
-	    if (left == max)
-		goto buggy;
-#endif
-	    left++;
-	}
-	/*
-	  while (*right >= *pivot)
-	    --right;
-	*/
-	while (1) {
-	    v = CompareProc(sortData, right, pivot);
-	    if (sortData->result != TCL_OK)
-		return NULL;
-	    if (v < 0)
-		break;
-#ifdef BUGGY_COMMAND
-	    /* If -command always returns >= 0, 'right' becomes invalid */
-	    if (right == min)
-		goto buggy;
-#endif
-	    right--;
-	}
-	if (left < right) {
-	    struct SortItem tmp = *left;
-	    *left = *right;
-	    *right = tmp;
-	    left++;
-	    right--;
-	}
-    }
-    return left;
-#ifdef BUGGY_COMMAND
-    buggy:
-    FormatResult(sortData->tree->interp, "buggy item sort -command detected");
-    sortData->result = TCL_ERROR;
-    return NULL;
-#endif
-}
+typedef struct FilterData {
+    SortData sortData;		/* Column and -element of each column that
+				 * is matched. */
+    struct FilterColumn columns[MAX_SORT_COLUMNS];
+    TagExpr expr;		/* -tag expression. */
+    int exprOK;			/* TRUE if -tag was given. */
+    Tcl_DString dString;	/* Lower-case item text for -nocase. */
+} FilterData;
 
-static void
-quicksort(
-    SortData *sortData,
-    struct SortItem *left,
-    struct SortItem *right
+/*
+ *----------------------------------------------------------------------
+ *
+ * FilterData_Match --
+ *
+ *	Determine if an item matches all the conditions given to
+ *	[item filter]. A column with no style or text element is matched
+ *	as if its text were empty.
+ *
+ * Results:
+ *	1 if the item matches, 0 if it doesn't, -1 if an error occurred
+ *	matching a regular expression.
+ *
+ * Side effects:
+ *	The interpreter result may be changed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+FilterData_Match(
+    FilterData *filterData,	/* Filter info. */
+    TreeItem item		/* Item to test. */
     )
 {
-    struct SortItem *p, pivot;
+    SortData *sortData = &filterData->sortData;
+    Tcl_Interp *interp = sortData->tree->interp;
+    struct FilterColumn *filterColumn;
+    struct SortItem1 sortItem1;
+    char *text, *pattern;
+    int i, r;
 
-    if (sortData->result != TCL_OK)
-	return;
+    if (filterData->exprOK && !TagExpr_Eval(&filterData->expr,
+	    item->tagInfo))
+	return 0;
 
-    if (left == right)
-	return;
+    for (i = 0; i < sortData->columnCount; i++) {
+	filterColumn = &filterData->columns[i];
+	if (filterColumn->patternObj == NULL)
+	    continue;
 
-    /* FIXME: switch to insertion sort or similar when the number of
-     * elements is small. */
+	if ((SortData_GetKey(sortData, i, item, &sortItem1) != TCL_OK) ||
+		(sortItem1.string == NULL))
+	    text = "";
+	else
+	    text = sortItem1.string;
+
+	if (filterColumn->match == FILTER_REGEXP) {
+	    r = Tcl_RegExpExec(interp, filterColumn->regExp, text, text);
+	    if (r <= 0)
+		return r;
+	    continue;
+	}
 
-    if (find_pivot(sortData, left, right, &pivot) == 1) {
-	p = partition(sortData, left, right, &pivot);
-	quicksort(sortData, left, p - 1);
-	quicksort(sortData, p, right);
+	if (filterColumn->nocase) {
+	    Tcl_DStringSetLength(&filterData->dString, 0);
+	    Tcl_DStringAppend(&filterData->dString, text, -1);
+	    Tcl_DStringSetLength(&filterData->dString, Tcl_UtfToLower(
+		    Tcl_DStringValue(&filterData->dString)));
+	    text = Tcl_DStringValue(&filterData->dString);
+	    pattern = Tcl_GetString(filterColumn->lowerObj);
+	} else {
+	    pattern = Tcl_GetString(filterColumn->patternObj);
+	}
+	if (filterColumn->match == FILTER_GLOB) {
+	    if (!Tcl_StringMatch(text, pattern))
+		return 0;
+	} else {
+	    if (strstr(text, pattern) == NULL)
+		return 0;
+	}
     }
+    return 1;
 }
 
-/* END custom quicksort() */
-
 /*
  *----------------------------------------------------------------------
  *
- * ItemSortCmd --
+ * ItemFilterCmd --
  *
- *	This procedure is invoked to process the [item sort] widget
+ *	This procedure is invoked to process the [item filter] widget
  *	command.  See the user documentation for details on what
  *	it does.
  *
@@ -7322,7 +11456,7 @@ quicksort(
  */
 
 static int
-ItemSortCmd(
+ItemFilterCmd(
     ClientData clientData,	/* Widget info. */
     Tcl_Interp *interp,		/* Current interpreter. */
     int objc,			/* Number of arguments. */
@@ -7330,16 +11464,13 @@ ItemSortCmd(
     )
 {
     TreeCtrl *tree = clientData;
-    TreeItem item, first, last, walk, lastChild;
-    TreeItemColumn column;
-    int i, j, count, elemIndex, index, indexF = 0, indexL = 0;
-    int sawColumn = FALSE, sawCmd = FALSE;
-    static int (*sortProc[5])(SortData *, struct SortItem *, struct SortItem *, int) =
-	{ CompareAscii, CompareDict, CompareDouble, CompareLong, CompareCmd };
-    SortData sortData;
-    TreeColumn treeColumn;
-    struct SortElement *elemPtr;
-    int notReally = FALSE;
+    FilterData filterData;
+    struct FilterColumn *filterColumn;
+    TreeItemList items;
+    TreeItem item, parent;
+    ItemForEach iter;
+    int i, index, length, match, count = 0;
+    int sawColumn = FALSE, ancestors = FALSE, changed = FALSE;
     int result = TCL_OK;
 
     if (objc < 4) {
@@ -7347,437 +11478,745 @@ ItemSortCmd(
 	return TCL_ERROR;
     }
 
-    if (TreeItem_FromObj(tree, objv[3], &item, IFO_NOT_NULL) != TCL_OK)
+    if (TreeItemList_FromObj(tree, objv[3], &items, IFO_NOT_NULL) != TCL_OK)
 	return TCL_ERROR;
 
-    /* If the item has no children, then nothing is done and no error
-     * is generated. */
-    if (item->numChildren < 1)
-	return TCL_OK;
-
-    /* Defaults: sort ascii strings in column 0 only */
-    sortData.tree = tree;
-    sortData.columnCount = 1;
-    sortData.columns[0].column = 0;
-    sortData.columns[0].sortBy = SORT_ASCII;
-    sortData.columns[0].order = 1;
-    sortData.columns[0].elemCount = 0;
-    sortData.result = TCL_OK;
-
-    first = item->firstChild;
-    last = item->lastChild;
+    SortData_Init(tree, &filterData.sortData);
+    for (i = 0; i < MAX_SORT_COLUMNS; i++) {
+	filterData.columns[i].match = FILTER_GLOB;
+	filterData.columns[i].nocase = FALSE;
+	filterData.columns[i].patternObj = NULL;
+	filterData.columns[i].lowerObj = NULL;
+    }
+    filterData.exprOK = FALSE;
+    Tcl_DStringInit(&filterData.dString);
 
     for (i = 4; i < objc; ) {
-	static CONST char *optionName[] = { "-ascii", "-column", "-command",
-					    "-decreasing", "-dictionary", "-element", "-first", "-increasing",
-					    "-integer", "-last", "-notreally", "-real", NULL };
-	int numArgs[] = { 1, 2, 2, 1, 1, 2, 2, 1, 1, 2, 1, 1 };
-	enum { OPT_ASCII, OPT_COLUMN, OPT_COMMAND, OPT_DECREASING, OPT_DICT,
-	       OPT_ELEMENT, OPT_FIRST, OPT_INCREASING, OPT_INTEGER, OPT_LAST,
-	       OPT_NOT_REALLY, OPT_REAL };
+	static CONST char *optionName[] = { "-ancestors", "-column",
+					    "-element", "-glob", "-nocase", "-regexp", "-substring",
+					    "-tag", NULL };
+	int numArgs[] = { 1, 2, 2, 2, 1, 2, 2, 2 };
+	enum { OPT_ANCESTORS, OPT_COLUMN, OPT_ELEMENT, OPT_GLOB, OPT_NOCASE,
+	       OPT_REGEXP, OPT_SUBSTRING, OPT_TAG };
 
 	if (Tcl_GetIndexFromObj(interp, objv[i], optionName, "option", 0,
-		    &index) != TCL_OK)
-	    return TCL_ERROR;
+		    &index) != TCL_OK) {
+	    result = TCL_ERROR;
+	    goto done;
+	}
 	if (objc - i < numArgs[index]) {
 	    FormatResult(interp, "missing value for \"%s\" option",
 		    optionName[index]);
-	    return TCL_ERROR;
+	    result = TCL_ERROR;
+	    goto done;
 	}
+	filterColumn = &filterData.columns[filterData.sortData.columnCount - 1];
+
+	/* Options given before any -column are for column 0, and the
+	 * first -column adds another column. */
+	if (index != OPT_ANCESTORS && index != OPT_COLUMN && index != OPT_TAG)
+	    sawColumn = TRUE;
 	switch (index) {
-	    case OPT_ASCII:
-		sortData.columns[sortData.columnCount - 1].sortBy = SORT_ASCII;
+	    case OPT_ANCESTORS:
+		ancestors = TRUE;
 		break;
 	    case OPT_COLUMN:
-		if (TreeColumn_FromObj(tree, objv[i + 1], &treeColumn,
-			    CFO_NOT_NULL | CFO_NOT_TAIL) != TCL_OK)
-		    return TCL_ERROR;
-		/* The first -column we see is the first column we compare */
-		if (sawColumn) {
-		    if (sortData.columnCount + 1 > MAX_SORT_COLUMNS) {
-			FormatResult(interp,
-				"can't compare more than %d columns",
-				MAX_SORT_COLUMNS);
-			return TCL_ERROR;
-		    }
-		    sortData.columnCount++;
-		    /* Defaults for this column */
-		    sortData.columns[sortData.columnCount - 1].sortBy = SORT_ASCII;
-		    sortData.columns[sortData.columnCount - 1].order = 1;
-		    sortData.columns[sortData.columnCount - 1].elemCount = 0;
-		}
-		sortData.columns[sortData.columnCount - 1].column = TreeColumn_Index(treeColumn);
-		sawColumn = TRUE;
-		break;
-	    case OPT_COMMAND:
-		sortData.columns[sortData.columnCount - 1].command = objv[i + 1];
-		sortData.columns[sortData.columnCount - 1].sortBy = SORT_COMMAND;
-		sawCmd = TRUE;
-		break;
-	    case OPT_DECREASING:
-		sortData.columns[sortData.columnCount - 1].order = 0;
-		break;
-	    case OPT_DICT:
-		sortData.columns[sortData.columnCount - 1].sortBy = SORT_DICT;
-		break;
-	    case OPT_ELEMENT: {
-		int listObjc;
-		Tcl_Obj **listObjv;
-
-		if (Tcl_ListObjGetElements(interp, objv[i + 1], &listObjc,
-			    &listObjv) != TCL_OK)
-		    return TCL_ERROR;
-		elemPtr = sortData.columns[sortData.columnCount - 1].elems;
-		sortData.columns[sortData.columnCount - 1].elemCount = 0;
-		if (listObjc == 0) {
-		} else if (listObjc == 1) {
-		    if (TreeElement_FromObj(tree, listObjv[0], &elemPtr->elem)
-			    != TCL_OK) {
-			Tcl_AddErrorInfo(interp,
-				"\n    (processing -element option)");
-			return TCL_ERROR;
-		    }
-		    if (!TreeElement_IsType(tree, elemPtr->elem, "text")) {
-			FormatResult(interp,
-				"element %s is not of type \"text\"",
-				Tcl_GetString(listObjv[0]));
-			Tcl_AddErrorInfo(interp,
-				"\n    (processing -element option)");
-			return TCL_ERROR;
-		    }
-		    elemPtr->style = NULL;
-		    elemPtr->elemIndex = -1;
-		    sortData.columns[sortData.columnCount - 1].elemCount++;
-		} else {
-		    if (listObjc & 1) {
-			FormatResult(interp,
-				"list must have even number of elements");
-			Tcl_AddErrorInfo(interp,
-				"\n    (processing -element option)");
-			return TCL_ERROR;
-		    }
-		    for (j = 0; j < listObjc; j += 2) {
-			if ((TreeStyle_FromObj(tree, listObjv[j],
-				     &elemPtr->style) != TCL_OK) ||
-				(TreeElement_FromObj(tree, listObjv[j + 1],
-					&elemPtr->elem) != TCL_OK) ||
-				(TreeStyle_FindElement(tree, elemPtr->style,
-					elemPtr->elem, &elemPtr->elemIndex) != TCL_OK)) {
-			    Tcl_AddErrorInfo(interp,
-				    "\n    (processing -element option)");
-			    return TCL_ERROR;
-			}
-			if (!TreeElement_IsType(tree, elemPtr->elem, "text")) {
-			    FormatResult(interp,
-				    "element %s is not of type \"text\"",
-				    Tcl_GetString(listObjv[j + 1]));
-			    Tcl_AddErrorInfo(interp,
-				    "\n    (processing -element option)");
-			    return TCL_ERROR;
-			}
-			sortData.columns[sortData.columnCount - 1].elemCount++;
-			elemPtr++;
-		    }
+		if (SortData_ColumnOption(&filterData.sortData, objv[i + 1],
+			&sawColumn) != TCL_OK) {
+		    result = TCL_ERROR;
+		    goto done;
 		}
 		break;
-	    }
-	    case OPT_FIRST:
-		if (TreeItem_FromObj(tree, objv[i + 1], &first, IFO_NOT_NULL) != TCL_OK)
-		    return TCL_ERROR;
-		if (first->parent != item) {
-		    FormatResult(interp,
-			    "item %s%d is not a child of item %s%d",
-			    tree->itemPrefix, first->id, tree->itemPrefix, item->id);
-		    return TCL_ERROR;
+	    case OPT_ELEMENT:
+		if (SortData_ElementOption(&filterData.sortData,
+			objv[i + 1]) != TCL_OK) {
+		    result = TCL_ERROR;
+		    goto done;
 		}
 		break;
-	    case OPT_INCREASING:
-		sortData.columns[sortData.columnCount - 1].order = 1;
+	    case OPT_GLOB:
+		filterColumn->match = FILTER_GLOB;
+		filterColumn->patternObj = objv[i + 1];
 		break;
-	    case OPT_INTEGER:
-		sortData.columns[sortData.columnCount - 1].sortBy = SORT_LONG;
+	    case OPT_NOCASE:
+		filterColumn->nocase = TRUE;
 		break;
-	    case OPT_LAST:
-		if (TreeItem_FromObj(tree, objv[i + 1], &last, IFO_NOT_NULL) != TCL_OK)
-		    return TCL_ERROR;
-		if (last->parent != item) {
-		    FormatResult(interp,
-			    "item %s%d is not a child of item %s%d",
-			    tree->itemPrefix, last->id, tree->itemPrefix, item->id);
-		    return TCL_ERROR;
-		}
+	    case OPT_REGEXP:
+		filterColumn->match = FILTER_REGEXP;
+		filterColumn->patternObj = objv[i + 1];
 		break;
-	    case OPT_NOT_REALLY:
-		notReally = TRUE;
+	    case OPT_SUBSTRING:
+		filterColumn->match = FILTER_SUBSTRING;
+		filterColumn->patternObj = objv[i + 1];
 		break;
-	    case OPT_REAL:
-		sortData.columns[sortData.columnCount - 1].sortBy = SORT_DOUBLE;
+	    case OPT_TAG:
+		if (filterData.exprOK)
+		    TagExpr_Free(&filterData.expr);
+		filterData.exprOK = FALSE;
+		if (TagExpr_Init(tree, objv[i + 1], &filterData.expr)
+			!= TCL_OK) {
+		    result = TCL_ERROR;
+		    goto done;
+		}
+		filterData.exprOK = TRUE;
 		break;
 	}
 	i += numArgs[index];
     }
 
-    /* If there are no columns, we cannot perform a sort unless -command
-     * is specified. */
-    if ((tree->columnCount < 1) && (sortData.columns[0].sortBy != SORT_COMMAND)) {
-	FormatResult(interp, "there are no columns");
-	return TCL_ERROR;
-    }
+    /* Compile the regular expressions and make lower-case copies of the
+     * other patterns once, not once per item. */
+    for (i = 0; i < filterData.sortData.columnCount; i++) {
+	filterColumn = &filterData.columns[i];
+	if (filterColumn->patternObj == NULL)
+	    continue;
+	if (filterColumn->match == FILTER_REGEXP) {
+	    filterColumn->regExp = Tcl_GetRegExpFromObj(interp,
+		    filterColumn->patternObj, TCL_REG_ADVANCED |
+		    (filterColumn->nocase ? TCL_REG_NOCASE : 0));
+	    if (filterColumn->regExp == NULL) {
+		result = TCL_ERROR;
+		goto done;
+	    }
+	} else if (filterColumn->nocase) {
+	    filterColumn->lowerObj = Tcl_NewStringObj(
+		    Tcl_GetString(filterColumn->patternObj), -1);
+	    Tcl_IncrRefCount(filterColumn->lowerObj);
+	    length = Tcl_UtfToLower(Tcl_GetString(filterColumn->lowerObj));
+	    Tcl_SetObjLength(filterColumn->lowerObj, length);
+	}
+    }
+
+    /* Find the matching items first so nothing changes if a regular
+     * expression fails. The root item is never hidden. */
+    ITEM_FOR_EACH(item, &items, NULL, &iter) {
+	if (item == tree->root)
+	    continue;
+	match = FilterData_Match(&filterData, item);
+	if (match < 0) {
+	    result = TCL_ERROR;
+	    break;
+	}
+	if (match) {
+	    item->flags |= ITEM_FLAG_FILTER_MATCH;
+	    count++;
+	}
+    }
+
+    if (result == TCL_OK) {
+	ITEM_FOR_EACH(item, &items, NULL, &iter) {
+	    if (item == tree->root)
+		continue;
+	    match = (item->flags & ITEM_FLAG_FILTER_MATCH) != 0;
+	    if (match != IS_VISIBLE(item)) {
+		item->flags ^= ITEM_FLAG_VISIBLE;
+		changed = TRUE;
+#ifdef SELECTION_VISIBLE
+		if (!match)
+		    Tree_SubtreeHidden(tree, item);
+#endif
+	    }
+	}
+
+	/* Show the ancestors of each match. An ancestor that is already
+	 * marked was shown by an earlier match, or is a match itself,
+	 * so the walk stops there. */
+	if (ancestors) {
+	    ITEM_FOR_EACH(item, &items, NULL, &iter) {
+		if (!(item->flags & ITEM_FLAG_FILTER_MATCH))
+		    continue;
+		for (parent = item->parent;
+			(parent != NULL) && (parent != tree->root) &&
+			!(parent->flags & ITEM_FLAG_FILTER_MATCH);
+			parent = parent->parent) {
+		    parent->flags |= ITEM_FLAG_FILTER_MATCH;
+		    if (!IS_VISIBLE(parent)) {
+			parent->flags |= ITEM_FLAG_VISIBLE;
+			changed = TRUE;
+		    }
+		}
+	    }
+	}
+    }
+
+    ITEM_FOR_EACH(item, &items, NULL, &iter) {
+	for (parent = item;
+		(parent != NULL) && (parent->flags & ITEM_FLAG_FILTER_MATCH);
+		parent = parent->parent)
+	    parent->flags &= ~ITEM_FLAG_FILTER_MATCH;
+    }
+
+    /* Everything that changing -visible does for each item is done once
+     * here. */
+    if (changed) {
+	tree->updateIndex = 1;
+	Tree_VisibilityChanged(tree);
+	TreeColumns_InvalidateWidthOfItems(tree, NULL);
+	TreeColumns_InvalidateSpans(tree);
+	Tree_DInfoChanged(tree, DINFO_INVALIDATE | DINFO_REDO_RANGES |
+		DINFO_REDO_SELECTION);
+#ifdef SELECTION_VISIBLE
+	Tree_DeselectHidden(tree);
+#endif
+    }
+
+    if (result == TCL_OK)
+	Tcl_SetObjResult(interp, Tcl_NewIntObj(count));
 
-    /* If there is only one item to sort, then return early. */
-    if (first == last) {
-	if (notReally)
-	    Tcl_SetObjResult(interp, TreeItem_ToObj(tree, first));
-	return TCL_OK;
+done:
+    for (i = 0; i < filterData.sortData.columnCount; i++) {
+	if (filterData.columns[i].lowerObj != NULL)
+	    Tcl_DecrRefCount(filterData.columns[i].lowerObj);
     }
+    if (filterData.exprOK)
+	TagExpr_Free(&filterData.expr);
+    Tcl_DStringFree(&filterData.dString);
+    TreeItemList_Free(&items);
+    return result;
+}
 
-    for (i = 0; i < sortData.columnCount; i++) {
+/* BEGIN [item find] index */
 
-	/* Initialize the sort procedure for this column. */
-	sortData.columns[i].proc = sortProc[sortData.columns[i].sortBy];
+/*
+ * When the -findindex option is true, [item find] uses an index that
+ * maps each trigram (three bytes) of the lower-case text of an item's
+ * text elements to the ids of the items containing it. A search only
+ * looks at the items listed for the rarest trigram of the string.
+ *
+ * The lists are only appended to. When the text of an item changes, the
+ * item is queued and indexed again by the next [item find], and its old
+ * entries are left behind. Every candidate is checked against its
+ * current text, so stale entries cost time but never give a wrong
+ * answer. The whole index is rebuilt when it has grown to twice its
+ * size after the last rebuild, or after a change that can affect the
+ * text of many items, such as configuring a master element.
+ */
 
-	/* Append two dummy args to the -command argument. These two dummy
-	 * args are replaced by the 2 item ids being compared. See
-	 * CompareCmd(). */
-	if (sortData.columns[i].sortBy == SORT_COMMAND) {
-	    Tcl_Obj *obj = Tcl_DuplicateObj(sortData.columns[i].command);
-	    Tcl_Obj *obj2 = Tcl_NewObj();
-	    Tcl_IncrRefCount(obj);
-	    if (Tcl_ListObjAppendElement(interp, obj, obj2) != TCL_OK) {
-		Tcl_DecrRefCount(obj);
-		Tcl_IncrRefCount(obj2);
-		Tcl_DecrRefCount(obj2);
+#define FIND_REBUILD_MIN 100000	/* Don't rebuild a small index because it
+				 * has doubled. */
 
-		for (j = 0; j < i; j++) {
-		    if (sortData.columns[j].sortBy == SORT_COMMAND) {
-			Tcl_DecrRefCount(sortData.columns[j].command);
-		    }
-		}
+struct TreeFindIndex_ {
+    Tcl_HashTable trigramHash;	/* Trigram -> IdPosting. */
+    int valid;			/* FALSE if the index must be rebuilt. */
+    int *dirty;			/* Ids of items to index again. */
+    int dirtyCount;		/* Number of ids in dirty[]. */
+    int dirtyAlloc;		/* Room in dirty[]. */
+    long entries;		/* Number of ids in all the lists. */
+    long builtEntries;		/* Value of entries after the last
+				 * rebuild. */
+};
 
-		return TCL_ERROR;
-	    }
-	    (void) Tcl_ListObjAppendElement(interp, obj, obj2);
-	    sortData.columns[i].command = obj;
-	}
-    }
+#define FIND_TRIGRAM(p) ((((unsigned char) (p)[0]) << 16) | \
+	(((unsigned char) (p)[1]) << 8) | ((unsigned char) (p)[2]))
 
-    index = 0;
-    walk = item->firstChild;
-    while (walk != NULL) {
-	if (walk == first)
-	    indexF = index;
-	if (walk == last)
-	    indexL = index;
-	index++;
-	walk = walk->nextSibling;
-    }
-    if (indexF > indexL) {
-	walk = last;
-	last = first;
-	first = walk;
+/*
+ *----------------------------------------------------------------------
+ *
+ * Item_FindTexts --
+ *
+ *	Get the text of every text element of an item.
+ *
+ * Results:
+ *	The texts are appended to dString, each followed by a NUL byte.
+ *	If lower is TRUE, they are converted to lower case.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+Item_FindTexts(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item,		/* Item record. */
+    int columnIndex,		/* Only look in this column, or -1 for
+				 * every column. */
+    int lower,			/* TRUE to convert to lower case. */
+    Tcl_DString *dString	/* Texts are appended here. */
+    )
+{
+    TreeItemColumn column;
+    int i, start = Tcl_DStringLength(dString), length;
+    char *p, *end;
 
-	index = indexL;
-	indexL = indexF;
-	indexF = index;
+    for (i = 0, column = item->columns; column != NULL;
+	    i++, column = ITEM_COLUMN_NEXT(item, column)) {
+	if ((columnIndex != -1) && (i != columnIndex))
+	    continue;
+	if (column->style != NULL)
+	    TreeStyle_AppendTexts(tree, column->style, dString);
     }
-    count = indexL - indexF + 1;
+    if (!lower)
+	return;
 
-    sortData.item1s = (struct SortItem1 *) ckalloc(sizeof(struct SortItem1) * count * sortData.columnCount);
-    sortData.items = (struct SortItem *) ckalloc(sizeof(struct SortItem) * count);
-    for (i = 0; i < count; i++) {
-	sortData.items[i].item1 = sortData.item1s + i * sortData.columnCount;
-	sortData.items[i].obj = NULL;
+    /* Converting to lower case can make a text shorter. Keep the NUL
+     * byte where it was and put another one after the shorter text. */
+    p = Tcl_DStringValue(dString) + start;
+    end = Tcl_DStringValue(dString) + Tcl_DStringLength(dString);
+    while (p < end) {
+	length = (int) strlen(p);
+	(void) Tcl_UtfToLower(p);
+	p += length + 1;
     }
+}
 
-    index = 0;
-    walk = first;
-    while (walk != last->nextSibling) {
-	struct SortItem *sortItem = &sortData.items[index];
+/*
+ *----------------------------------------------------------------------
+ *
+ * FindIndex_AddItem --
+ *
+ *	Add an item to the lists of the trigrams in its text.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Memory is allocated.
+ *
+ *----------------------------------------------------------------------
+ */
 
-	sortItem->item = walk;
-#ifdef STABLE_SORT
-	sortItem->index = index;
-#endif
-	if (sawCmd) {
-	    Tcl_Obj *obj = TreeItem_ToObj(tree, walk);
-	    Tcl_IncrRefCount(obj);
-	    sortData.items[index].obj = obj;
+static void
+FindIndex_AddItem(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item,		/* Item to index. */
+    Tcl_DString *dString	/* Scratch space. */
+    )
+{
+    TreeFindIndex index = tree->findIndex;
+    char *p, *end;
+    int i, length;
+
+    Tcl_DStringSetLength(dString, 0);
+    Item_FindTexts(tree, item, -1, TRUE, dString);
+    p = Tcl_DStringValue(dString);
+    end = p + Tcl_DStringLength(dString);
+    for (; p < end; p += length + 1) {
+	length = (int) strlen(p);
+	for (i = 0; i + 3 <= length; i++) {
+	    index->entries += IdPosting_Add(&index->trigramHash,
+		    (char *) (size_t) FIND_TRIGRAM(p + i), item->id);
 	}
-	for (i = 0; i < sortData.columnCount; i++) {
-	    struct SortItem1 *sortItem1 = sortItem->item1 + i;
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FindIndex_Clear --
+ *
+ *	Remove every list from the index.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Memory is deallocated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FindIndex_Clear(
+    TreeFindIndex index		/* The index. */
+    )
+{
+    IdPostings_Clear(&index->trigramHash);
+    index->entries = 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FindIndex_Update --
+ *
+ *	Bring the index up to date before a search.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Items whose text changed are indexed again, or the whole index
+ *	is rebuilt.
+ *
+ *----------------------------------------------------------------------
+ */
 
-	    if (sortData.columns[i].sortBy == SORT_COMMAND)
+static void
+FindIndex_Update(
+    TreeCtrl *tree		/* Widget info. */
+    )
+{
+    TreeFindIndex index = tree->findIndex;
+    TreeItem item;
+    Tcl_DString dString;
+    int i, search;
+
+    if (index->valid && (index->entries > FIND_REBUILD_MIN) &&
+	    (index->entries > index->builtEntries * 2))
+	index->valid = FALSE;
+
+    Tcl_DStringInit(&dString);
+    if (!index->valid) {
+	FindIndex_Clear(index);
+	item = Tree_FirstItem(tree, &search);
+	while (item != NULL) {
+	    item->flags &= ~ITEM_FLAG_FIND_DIRTY;
+	    if (!IS_DELETED(item))
+		FindIndex_AddItem(tree, item, &dString);
+	    item = Tree_NextItem(tree, &search);
+	}
+	index->builtEntries = index->entries;
+	index->valid = TRUE;
+    } else {
+	for (i = 0; i < index->dirtyCount; i++) {
+	    item = Tree_FindItem(tree, index->dirty[i]);
+	    if ((item == NULL) || !(item->flags & ITEM_FLAG_FIND_DIRTY))
 		continue;
+	    item->flags &= ~ITEM_FLAG_FIND_DIRTY;
+	    if (!IS_DELETED(item))
+		FindIndex_AddItem(tree, item, &dString);
+	}
+    }
+    index->dirtyCount = 0;
+    Tcl_DStringFree(&dString);
+}
 
-	    column = TreeItem_FindColumn(tree, walk, sortData.columns[i].column);
-	    if ((column == NULL) || (column->style == NULL)) {
-		NoStyleMsg(tree, walk, sortData.columns[i].column);
-		result = TCL_ERROR;
-		goto done;
-	    }
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeItem_FindIndexConfigure --
+ *
+ *	Create or free the [item find] index after the -findindex option
+ *	changes.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Memory is allocated or deallocated. A new index is built by the
+ *	next [item find].
+ *
+ *----------------------------------------------------------------------
+ */
 
-	    /* -element was empty. Find the first text element in the style */
-	    if (sortData.columns[i].elemCount == 0)
-		elemIndex = -1;
+void
+TreeItem_FindIndexConfigure(
+    TreeCtrl *tree		/* Widget info. */
+    )
+{
+    TreeFindIndex index = tree->findIndex;
 
-	    /* -element was element name. Find the element in the style */
-	    else if ((sortData.columns[i].elemCount == 1) &&
-		    (sortData.columns[i].elems[0].style == NULL)) {
-		if (TreeStyle_FindElement(tree, column->style,
-			    sortData.columns[i].elems[0].elem, &elemIndex) != TCL_OK) {
-		    result = TCL_ERROR;
-		    goto done;
-		}
-	    }
+    if (tree->findIndexOn && (index == NULL)) {
+	index = (TreeFindIndex) ckalloc(sizeof(struct TreeFindIndex_));
+	Tcl_InitHashTable(&index->trigramHash, TCL_ONE_WORD_KEYS);
+	index->valid = FALSE;
+	index->dirty = NULL;
+	index->dirtyCount = index->dirtyAlloc = 0;
+	index->entries = index->builtEntries = 0;
+	tree->findIndex = index;
+    } else if (!tree->findIndexOn && (index != NULL)) {
+	FindIndex_Clear(index);
+	Tcl_DeleteHashTable(&index->trigramHash);
+	if (index->dirty != NULL)
+	    ckfree((char *) index->dirty);
+	ckfree((char *) index);
+	tree->findIndex = NULL;
+    }
+}
 
-	    /* -element was style/element pair list */
-	    else {
-		TreeStyle masterStyle = TreeStyle_GetMaster(tree, column->style);
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeItem_FindTextChanged --
+ *
+ *	Called when the text displayed by an item may have changed.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	If there is an [item find] index the item is queued to be
+ *	indexed again.
+ *
+ *----------------------------------------------------------------------
+ */
 
-		/* If the item style does not match any in the -element list,
-		 * we will use the first text element in the item style. */
-		elemIndex = -1;
+void
+TreeItem_FindTextChanged(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item		/* Item record. */
+    )
+{
+    TreeFindIndex index = tree->findIndex;
 
-		/* Match a style from the -element list. Look in reverse order
-		 * to handle duplicates. */
-		for (j = sortData.columns[i].elemCount - 1; j >= 0; j--) {
-		    if (sortData.columns[i].elems[j].style == masterStyle) {
-			elemIndex = sortData.columns[i].elems[j].elemIndex;
-			break;
-		    }
-		}
-	    }
-	    if (TreeStyle_GetSortData(tree, column->style, elemIndex,
-			sortData.columns[i].sortBy,
-			&sortItem1->longValue,
-			&sortItem1->doubleValue,
-			&sortItem1->string) != TCL_OK) {
-		char msg[128];
-		sprintf(msg, "\n    (preparing to sort item %s%d column %s%d)",
-			tree->itemPrefix, walk->id,
-			tree->columnPrefix, TreeColumn_GetID(
-			Tree_FindColumn(tree, sortData.columns[i].column)));
-		Tcl_AddErrorInfo(interp, msg);
-		result = TCL_ERROR;
-		goto done;
-	    }
-	}
-	index++;
-	walk = walk->nextSibling;
+    if ((index == NULL) || !index->valid ||
+	    (item->flags & ITEM_FLAG_FIND_DIRTY) || (ITEM_HEADER(item) != NULL))
+	return;
+    if (index->dirtyCount == index->dirtyAlloc) {
+	index->dirtyAlloc = index->dirtyAlloc ? index->dirtyAlloc * 2 : 64;
+	index->dirty = (int *) ckrealloc((char *) index->dirty,
+		sizeof(int) * index->dirtyAlloc);
+    }
+    index->dirty[index->dirtyCount++] = item->id;
+    item->flags |= ITEM_FLAG_FIND_DIRTY;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeItem_FindIndexInvalidate --
+ *
+ *	Called after a change that may affect the text of many items.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	If there is an [item find] index it is rebuilt by the next
+ *	[item find].
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TreeItem_FindIndexInvalidate(
+    TreeCtrl *tree		/* Widget info. */
+    )
+{
+    if (tree->findIndex != NULL) {
+	tree->findIndex->valid = FALSE;
+	tree->findIndex->dirtyCount = 0;
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Item_FindMatch --
+ *
+ *	Determine if a text element of an item contains a string.
+ *
+ * Results:
+ *	TRUE if the string was found.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+Item_FindMatch(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item,		/* Item to look in. */
+    int columnIndex,		/* Only look in this column, or -1. */
+    int nocase,			/* TRUE if string is in lower case and
+				 * case should be ignored. */
+    CONST char *string,		/* String to look for. */
+    Tcl_DString *dString	/* Scratch space. */
+    )
+{
+    char *p, *end;
+
+    Tcl_DStringSetLength(dString, 0);
+    Item_FindTexts(tree, item, columnIndex, nocase, dString);
+    p = Tcl_DStringValue(dString);
+    end = p + Tcl_DStringLength(dString);
+    for (; p < end; p += strlen(p) + 1) {
+	if (strstr(p, string) != NULL)
+	    return TRUE;
     }
+    return FALSE;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ItemFindCmd --
+ *
+ *	This procedure is invoked to process the [item find] widget
+ *	command.  See the user documentation for details on what
+ *	it does.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	See the user documentation.
+ *
+ *----------------------------------------------------------------------
+ */
 
-    quicksort(&sortData, sortData.items, sortData.items + count - 1);
+static int
+ItemFindCmd(
+    ClientData clientData,	/* Widget info. */
+    Tcl_Interp *interp,		/* Current interpreter. */
+    int objc,			/* Number of arguments. */
+    Tcl_Obj *CONST objv[]	/* Argument values. */
+    )
+{
+    TreeCtrl *tree = clientData;
+    TreeFindIndex index = tree->findIndex;
+    TreeItem item, from = NULL, ancestor;
+    TreeColumn treeColumn;
+    TreeItemList items;
+    Tcl_DString dString, lower;
+    Tcl_Obj *listObj;
+    CONST char *string;
+    IdPosting *posting = NULL, *posting2;
+    Tcl_HashEntry *hPtr;
+    int i, j, length, limit = -1, nocase = FALSE, columnIndex = -1;
 
-    if (sortData.result != TCL_OK) {
-	result = sortData.result;
-	goto done;
+    if (objc < 4) {
+	Tcl_WrongNumArgs(interp, 3, objv, "string ?option ...?");
+	return TCL_ERROR;
     }
 
-    if (sawCmd)
-	Tcl_ResetResult(interp);
-
-    if (notReally) {
-	Tcl_Obj *listObj = Tcl_NewListObj(0, NULL);
-	Tcl_Obj *itemObj;
+    for (i = 4; i < objc; ) {
+	static CONST char *optionName[] = { "-column", "-from", "-limit",
+					    "-nocase", NULL };
+	int numArgs[] = { 2, 2, 2, 1 };
+	enum { OPT_COLUMN, OPT_FROM, OPT_LIMIT, OPT_NOCASE };
+	int index2;
 
-	/* Smallest to largest */
-	if (sortData.columns[0].order == 1) {
-	    for (i = 0; i < count; i++) {
-		itemObj = sortData.items[i].obj;
-		if (itemObj == NULL)
-		    itemObj = TreeItem_ToObj(tree,
-			    sortData.items[i].item);
-		Tcl_ListObjAppendElement(interp, listObj, itemObj);
-	    }
+	if (Tcl_GetIndexFromObj(interp, objv[i], optionName, "option", 0,
+		    &index2) != TCL_OK)
+	    return TCL_ERROR;
+	if (objc - i < numArgs[index2]) {
+	    FormatResult(interp, "missing value for \"%s\" option",
+		    optionName[index2]);
+	    return TCL_ERROR;
 	}
-
-	/* Largest to smallest */
-	else {
-	    for (i = count - 1; i >= 0; i--) {
-		itemObj = sortData.items[i].obj;
-		if (itemObj == NULL)
-		    itemObj = TreeItem_ToObj(tree,
-			    sortData.items[i].item);
-		Tcl_ListObjAppendElement(interp, listObj, itemObj);
-	    }
+	switch (index2) {
+	    case OPT_COLUMN:
+		if (TreeColumn_FromObj(tree, objv[i + 1], &treeColumn,
+			CFO_NOT_NULL | CFO_NOT_TAIL) != TCL_OK)
+		    return TCL_ERROR;
+		columnIndex = TreeColumn_Index(treeColumn);
+		break;
+	    case OPT_FROM:
+		if (TreeItem_FromObj(tree, objv[i + 1], &from,
+			IFO_NOT_MANY | IFO_NOT_NULL) != TCL_OK)
+		    return TCL_ERROR;
+		break;
+	    case OPT_LIMIT:
+		if (Tcl_GetIntFromObj(interp, objv[i + 1], &limit) != TCL_OK)
+		    return TCL_ERROR;
+		if (limit < 0) {
+		    FormatResult(interp, "bad limit \"%d\": must be >= 0",
+			    limit);
+		    return TCL_ERROR;
+		}
+		break;
+	    case OPT_NOCASE:
+		nocase = TRUE;
+		break;
 	}
+	i += numArgs[index2];
+    }
 
-	Tcl_SetObjResult(interp, listObj);
-	goto done;
+    Tcl_DStringInit(&dString);
+    Tcl_DStringInit(&lower);
+    string = Tcl_GetStringFromObj(objv[3], &length);
+    if (nocase) {
+	Tcl_DStringAppend(&lower, string, length);
+	length = Tcl_UtfToLower(Tcl_DStringValue(&lower));
+	Tcl_DStringSetLength(&lower, length);
+	string = Tcl_DStringValue(&lower);
     }
-    first = first->prevSibling;
-    last = last->nextSibling;
+    listObj = Tcl_NewListObj(0, NULL);
+    if (limit == 0)
+	goto done;
 
-    /* Smallest to largest */
-    if (sortData.columns[0].order == 1) {
-	for (i = 0; i < count - 1; i++) {
-	    sortData.items[i].item->nextSibling = sortData.items[i + 1].item;
-	    sortData.items[i + 1].item->prevSibling = sortData.items[i].item;
+    /* Only items in the tree are searched. */
+    if (from != NULL) {
+	for (ancestor = from; ancestor->parent != NULL;
+		ancestor = ancestor->parent) {
 	}
-	indexF = 0;
-	indexL = count - 1;
+	if (ancestor != tree->root)
+	    goto done;
     }
 
-    /* Largest to smallest */
-    else {
-	for (i = count - 1; i > 0; i--) {
-	    sortData.items[i].item->nextSibling = sortData.items[i - 1].item;
-	    sortData.items[i - 1].item->prevSibling = sortData.items[i].item;
+    /* Only the items listed for the rarest trigram of the string can
+     * match. If a trigram is not in the index nothing matches. */
+    if ((index != NULL) && (length >= 3)) {
+	if (!nocase) {
+	    Tcl_DStringAppend(&lower, string, length);
+	    Tcl_DStringSetLength(&lower,
+		    Tcl_UtfToLower(Tcl_DStringValue(&lower)));
+	}
+	FindIndex_Update(tree);
+	for (i = 0; i + 3 <= Tcl_DStringLength(&lower); i++) {
+	    hPtr = Tcl_FindHashEntry(&index->trigramHash,
+		    (char *) (size_t) FIND_TRIGRAM(Tcl_DStringValue(&lower) + i));
+	    if (hPtr == NULL)
+		goto done;
+	    posting2 = (IdPosting *) Tcl_GetHashValue(hPtr);
+	    if ((posting == NULL) || (posting2->count < posting->count))
+		posting = posting2;
 	}
-	indexF = count - 1;
-	indexL = 0;
     }
 
-    lastChild = item->lastChild;
-
-    sortData.items[indexF].item->prevSibling = first;
-    if (first)
-	first->nextSibling = sortData.items[indexF].item;
-    else
-	item->firstChild = sortData.items[indexF].item;
-
-    sortData.items[indexL].item->nextSibling = last;
-    if (last)
-	last->prevSibling = sortData.items[indexL].item;
-    else
-	item->lastChild = sortData.items[indexL].item;
-
-    /* Redraw the lines of the old/new lastchild */
-    if ((item->lastChild != lastChild) && tree->showLines && (tree->columnTree != NULL)) {
-	if (lastChild->dInfo != NULL)
-	    Tree_InvalidateItemDInfo(tree, tree->columnTree,
-		    lastChild,
-		    NULL);
-	if (item->lastChild->dInfo != NULL)
-	    Tree_InvalidateItemDInfo(tree, tree->columnTree,
-		    item->lastChild,
-		    NULL);
+    /* Without an index, or for a string that is too short, look at
+     * every item in order. */
+    if (posting == NULL) {
+	item = (from != NULL) ? TreeItem_Next(tree, from) : tree->root;
+	for (; item != NULL; item = TreeItem_Next(tree, item)) {
+	    if (Item_FindMatch(tree, item, columnIndex, nocase, string,
+		    &dString)) {
+		Tcl_ListObjAppendElement(interp, listObj,
+			TreeItem_ToObj(tree, item));
+		if (--limit == 0)
+		    break;
+	    }
+	}
+	goto done;
     }
 
-    tree->updateIndex = 1;
-    Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
+    Tree_UpdateItemIndex(tree);
+    TreeItemList_Init(tree, &items, 0);
+    for (i = 0; i < posting->count; i++) {
+	item = Tree_FindItem(tree, posting->ids[i]);
+	if ((item == NULL) || IS_DELETED(item))
+	    continue;
+	if ((from != NULL) && (item->index <= from->index))
+	    continue;
+	if (!Item_FindMatch(tree, item, columnIndex, nocase, string,
+		&dString))
+	    continue;
 
-    done:
-    for (i = 0; i < count; i++) {
-	if (sortData.items[i].obj != NULL) {
-	    Tcl_DecrRefCount(sortData.items[i].obj);
-	}
-    }
-    for (i = 0; i < sortData.columnCount; i++) {
-	if (sortData.columns[i].sortBy == SORT_COMMAND) {
-	    Tcl_DecrRefCount(sortData.columns[i].command);
+	/* Skip orphans, which are not in tree order. */
+	for (ancestor = item; ancestor->parent != NULL;
+		ancestor = ancestor->parent) {
 	}
+	if (ancestor != tree->root)
+	    continue;
+	TreeItemList_Append(&items, item);
     }
-    ckfree((char *) sortData.item1s);
-    ckfree((char *) sortData.items);
+    TreeItemList_Sort(&items);
+    for (i = 0, j = 0; i < TreeItemList_Count(&items); i++) {
+	item = TreeItemList_Nth(&items, i);
 
-    if (tree->debug.enable && tree->debug.data) {
-	Tree_Debug(tree);
+	/* An item that was indexed again is listed twice. */
+	if ((i > 0) && (item == TreeItemList_Nth(&items, i - 1)))
+	    continue;
+	Tcl_ListObjAppendElement(interp, listObj, TreeItem_ToObj(tree, item));
+	if (++j == limit)
+	    break;
     }
+    TreeItemList_Free(&items);
 
-    return result;
+done:
+    Tcl_DStringFree(&dString);
+    Tcl_DStringFree(&lower);
+    Tcl_SetObjResult(interp, listObj);
+    return TCL_OK;
 }
 
+/* END [item find] index */
+
 /*
  *----------------------------------------------------------------------
  *
@@ -7887,7 +12326,7 @@ TreeItemCmd_Span(
 		    Tcl_NewIntObj(column ? column->span : 1));
 	    treeColumn = TreeColumn_Next(treeColumn);
 	    if (column != NULL)
-		column = column->next;
+		column = ITEM_COLUMN_NEXT(item, column);
 	}
 	Tcl_SetObjResult(interp, listObj);
 	goto okExit;
@@ -8398,6 +12837,7 @@ TreeItemCmd_Tag(
 	    }
 	    ITEM_FOR_EACH(item, &items, NULL, &iter) {
 		item->tagInfo = TagInfo_Add(tree, item->tagInfo, tags, numTags);
+		Item_TagsChanged(tree, item);
 	    }
 	    STATIC_FREE(tags, Tk_Uid, numTags);
 	    break;
@@ -8551,13 +12991,117 @@ TreeItem_GetTagInfo(
 
 #ifdef SELECTION_VISIBLE
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * Tree_SubtreeHidden --
+ *
+ *	Remember an item whose descendants, or the item itself, may
+ *	no longer be ReallyVisible(), so the next call to
+ *	Tree_DeselectHidden() looks only at that subtree.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Memory may be allocated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+Tree_SubtreeHidden(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item		/* Item token. */
+    )
+{
+    /* Hidden items are never selected, so nothing can become
+     * selected-but-hidden while the selection is empty. */
+    if ((tree->selectCount < 1) || tree->hiddenAll)
+	return;
+
+    if (tree->hiddenCount > 0 &&
+	    tree->hiddenIds[tree->hiddenCount - 1] == item->id)
+	return;
+
+    /* Once there are more subtrees than selected items, checking each
+     * selected item is cheaper. */
+    if (tree->hiddenCount >= tree->selectCount) {
+	tree->hiddenAll = TRUE;
+	tree->hiddenCount = 0;
+	return;
+    }
+
+    if (tree->hiddenCount == tree->hiddenAlloc) {
+	tree->hiddenAlloc = tree->hiddenAlloc ? tree->hiddenAlloc * 2 : 16;
+	tree->hiddenIds = (int *) ckrealloc((char *) tree->hiddenIds,
+		sizeof(int) * tree->hiddenAlloc);
+    }
+    tree->hiddenIds[tree->hiddenCount++] = item->id;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Item_DeselectHiddenSubtree --
+ *
+ *	Remove any selected items in a subtree which are no longer
+ *	ReallyVisible() from the selection.
+ *
+ * Results:
+ *	Each deselected item is appended to the given list.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+Item_DeselectHiddenSubtree(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem root,		/* Top of the subtree. */
+    TreeItemList *items		/* List of deselected items. */
+    )
+{
+    TreeItem item = root;
+    int descend;
+
+    while (item != NULL) {
+	if (TreeItem_GetSelected(tree, item) &&
+		!TreeItem_ReallyVisible(tree, item)) {
+	    Tree_RemoveFromSelection(tree, item);
+	    TreeItemList_Append(items, item);
+	}
+
+	/* The descendants of a closed or hidden item were hidden before
+	 * this change, and so weren't selected, unless the item was
+	 * closed or hidden since the last call; then it is a subtree of
+	 * its own in tree->hiddenIds. */
+	descend = (item == root) ||
+		(IS_VISIBLE(item) && (item->state & STATE_ITEM_OPEN));
+
+	if (descend && (item->firstChild != NULL)) {
+	    item = item->firstChild;
+	    continue;
+	}
+	while ((item != root) && (item->nextSibling == NULL))
+	    item = item->parent;
+	if (item == root)
+	    break;
+	item = item->nextSibling;
+    }
+}
+
 /*
  *----------------------------------------------------------------------
  *
  * Tree_DeselectHidden --
  *
  *	Removes any selected items which are no longer ReallyVisible()
- *	from the selection.
+ *	from the selection. Nothing is done inside a [$T batch] script;
+ *	the batch calls Tree_DeselectHiddenNow() when the script
+ *	returns.
  *
  * Results:
  *	None.
@@ -8568,38 +13112,76 @@ TreeItem_GetTagInfo(
  *----------------------------------------------------------------------
  */
 
+void
+Tree_DeselectHidden(
+    TreeCtrl *tree		/* Widget info. */
+    )
+{
+    /* Inside [$T batch] this is done once at the end. */
+    if (tree->batchDepth > 0)
+	return;
+
+    Tree_DeselectHiddenNow(tree);
+}
+
 /*
- * FIXME: optimize all calls to this routine.
- * Optionally call Tree_DInfoChanged(tree, DINFO_REDO_SELECTION) instead.
+ *----------------------------------------------------------------------
+ *
+ * Tree_DeselectHiddenNow --
+ *
+ *	Removes any selected items which are no longer ReallyVisible()
+ *	from the selection, even inside a [$T batch] script. Only the
+ *	subtrees passed to Tree_SubtreeHidden() since the last call are
+ *	checked, unless there were too many of them.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	<Selection> event may be generated, or the change is recorded
+ *	for the <Selection> event of the batch.
+ *
+ *----------------------------------------------------------------------
  */
+
 void
-Tree_DeselectHidden(
+Tree_DeselectHiddenNow(
     TreeCtrl *tree		/* Widget info. */
     )
 {
     TreeItemList items;
-    Tcl_HashEntry *hPtr;
-    Tcl_HashSearch search;
     TreeItem item;
-    int i;
+    int i, search;
 
-    if (tree->selectCount < 1)
+    if (tree->selectCount < 1 ||
+	    (!tree->hiddenAll && (tree->hiddenCount == 0))) {
+	tree->hiddenCount = 0;
+	tree->hiddenAll = FALSE;
 	return;
+    }
 
-    /* This call is slow for large lists. */
-    Tree_UpdateItemIndex(tree);
-
-    TreeItemList_Init(tree, &items, tree->selectCount);
+    TreeItemList_Init(tree, &items, 0);
 
-    hPtr = Tcl_FirstHashEntry(&tree->selection, &search);
-    while (hPtr != NULL) {
-	item = (TreeItem) Tcl_GetHashKey(&tree->selection, hPtr);
-	if (!TreeItem_ReallyVisible(tree, item))
-	    TreeItemList_Append(&items, item);
-	hPtr = Tcl_NextHashEntry(&search);
+    if (tree->hiddenAll) {
+	item = Tree_FirstSelected(tree, &search);
+	while (item != NULL) {
+	    if (!TreeItem_ReallyVisible(tree, item))
+		TreeItemList_Append(&items, item);
+	    item = Tree_NextSelected(tree, &search);
+	}
+	for (i = 0; i < TreeItemList_Count(&items); i++)
+	    Tree_RemoveFromSelection(tree, TreeItemList_Nth(&items, i));
+    } else {
+	for (i = 0; i < tree->hiddenCount; i++) {
+	    /* The item may have been deleted since. */
+	    item = Tree_FindItem(tree, tree->hiddenIds[i]);
+	    if (item != NULL)
+		Item_DeselectHiddenSubtree(tree, item, &items);
+	}
     }
-    for (i = 0; i < TreeItemList_Count(&items); i++)
-	Tree_RemoveFromSelection(tree, TreeItemList_Nth(&items, i));
+    tree->hiddenCount = 0;
+    tree->hiddenAll = FALSE;
+
     if (TreeItemList_Count(&items)) {
 	TreeNotify_Selection(tree, NULL, &items);
     }
@@ -8655,12 +13237,16 @@ TreeItemCmd(
 	COMMAND_ELEMENT,
 	COMMAND_ENABLED,
 	COMMAND_EXPAND,
+	COMMAND_FILTER,
+	COMMAND_FIND,
 	COMMAND_FIRSTCHILD,
 	COMMAND_ID,
 	COMMAND_IMAGE,
+	COMMAND_IMPORT,
 	COMMAND_ISANCESTOR,
 	COMMAND_ISOPEN,
 	COMMAND_LASTCHILD,
+	COMMAND_MOVE,
 	COMMAND_NEXTSIBLING,
 	COMMAND_NUMCHILDREN,
 	COMMAND_ORDER,
@@ -8670,6 +13256,7 @@ TreeItemCmd(
 	COMMAND_REMOVE,
 	COMMAND_RNC,
 	COMMAND_SORT,
+	COMMAND_SORTSPEC,
 	COMMAND_SPAN,
 	COMMAND_STATE,
 	COMMAND_STYLE,
@@ -8729,18 +13316,22 @@ TreeItemCmd(
 		NULL },
 	{ "expand", 1, 2, IFO_NOT_NULL, AF_NOT_ITEM, 0, "item ?-recurse?",
 		NULL},
+	{ "filter", 0, 0, 0, 0, 0, NULL, ItemFilterCmd },
+	{ "find", 0, 0, 0, 0, 0, NULL, ItemFindCmd },
 	{ "firstchild", 1, 2, IFO_NOT_MANY | IFO_NOT_NULL | AF_NOT_DELETED,
 		IFO_NOT_MANY | IFO_NOT_NULL | IFO_NOT_ROOT | AF_NOT_ANCESTOR |
 		AF_NOT_EQUAL | AF_NOT_DELETED, 0, "item ?newFirstChild?",
 		NULL },
 	{ "id", 1, 1, 0, 0, 0, "item", NULL },
 	{ "image", 0, 0, 0, 0, 0, NULL, ItemImageCmd },
+	{ "import", 0, 0, 0, 0, 0, NULL, ItemImportCmd },
 	{ "isancestor", 2, 2, IFO_NOT_MANY | IFO_NOT_NULL, IFO_NOT_MANY |
 		IFO_NOT_NULL, 0, "item item2", NULL },
 	{ "isopen", 1, 1, IFO_NOT_MANY | IFO_NOT_NULL, 0, 0, "item", NULL },
 	{ "lastchild", 1, 2, IFO_NOT_MANY | IFO_NOT_NULL | AF_NOT_DELETED,
 		IFO_NOT_MANY | IFO_NOT_NULL | IFO_NOT_ROOT | AF_NOT_ANCESTOR |
 		AF_NOT_EQUAL | AF_NOT_DELETED, 0, "item ?newLastChild?", NULL },
+	{ "move", 0, 0, 0, 0, 0, NULL, ItemMoveCmd },
 	{ "nextsibling", 1, 2, IFO_NOT_MANY | IFO_NOT_NULL | IFO_NOT_ROOT |
 		IFO_NOT_ORPHAN, IFO_NOT_MANY | IFO_NOT_NULL | IFO_NOT_ROOT |
 		AF_NOT_ANCESTOR | AF_NOT_EQUAL, 0, "item ?newNextSibling?",
@@ -8759,6 +13350,7 @@ TreeItemCmd(
 	{ "remove", 1, 1, IFO_NOT_NULL | IFO_NOT_ROOT, 0, 0, "item", NULL },
 	{ "rnc", 1, 1, IFO_NOT_MANY | IFO_NOT_NULL, 0, 0, "item", NULL },
 	{ "sort", 0, 0, 0, 0, 0, NULL, ItemSortCmd },
+	{ "sortspec", 0, 0, 0, 0, 0, NULL, ItemSortSpecCmd },
 	{ "span", 0, 0, 0, 0, 0, NULL, ItemSpanCmd },
 	{ "state", 0, 0, 0, 0, 0, NULL, ItemStateCmd },
 	{ "style", 0, 0, 0, 0, 0, NULL, ItemStyleCmd },
@@ -8785,8 +13377,11 @@ TreeItemCmd(
 	return TCL_ERROR;
     }
 
-    if (argInfo[index].proc != NULL)
-	return argInfo[index].proc(clientData, interp, objc, objv);
+    if (argInfo[index].proc != NULL) {
+	result = argInfo[index].proc(clientData, interp, objc, objv);
+	Item_PlaceSorted(tree);
+	return result;
+    }
 
     if ((numArgs < argInfo[index].minArgs) ||
 	    (numArgs > argInfo[index].maxArgs)) {
@@ -8936,7 +13531,7 @@ reqSameRoot:
 	    int animate = 0;
 	    int recurse = 0;
 	    int mode = 0; /* lint */
-	    int i, count;
+	    int i;
 	    TreeItemList items;
 
 	    if (numArgs > 1) {
@@ -8998,11 +13593,7 @@ reqSameRoot:
 		    TreeItem_ListDescendants(tree, item, &items);
 		}
 	    }
-	    count = TreeItemList_Count(&items);
-	    for (i = 0; i < count; i++) {
-		item = TreeItemList_Nth(&items, i);
-		TreeItem_OpenClose(tree, item, mode);
-	    }
+	    TreeItem_OpenCloseList(tree, &items, mode);
 	    TreeItemList_Free(&items);
 #ifdef SELECTION_VISIBLE
 	    Tree_DeselectHidden(tree);
@@ -9121,6 +13712,10 @@ reqSameRoot:
 		    TreeItemColumn_InvalidateSize(tree, column);
 	    }
 	    doneComplex:
+	    if (iMask != 0) {
+		Item_SortKeyChanged(tree, item);
+		TreeItem_FindTextChanged(tree, item);
+	    }
 	    if (iMask & CS_DISPLAY)
 		Tree_InvalidateItemDInfo(tree, NULL, item, NULL);
 	    if (iMask & CS_LAYOUT) {
@@ -9248,10 +13843,14 @@ reqSameRoot:
 		/* Generate <ItemDelete> event for items being deleted. */
 		TreeNotify_ItemDeleted(tree, &deleted);
 
-		/* Remove every item from its parent. Needed because items
-		 * are deleted recursively. */
+		/* Unlink the topmost deleted items from their parents.
+		 * Descendants of deleted items go away with them so
+		 * they don't need to be renumbered or unlinked one at a
+		 * time. */
 		for (i = 0; i < count; i++) {
 		    item = TreeItemList_Nth(&deleted, i);
+		    if (item->parent != NULL && IS_DELETED(item->parent))
+			continue;
 
 		    /* Deleting a visible item may change the needed width
 		     * of any column. */
@@ -9266,6 +13865,12 @@ reqSameRoot:
 		 * by commands from this point on. */
 		for (i = 0; i < count; i++) {
 		    item = TreeItemList_Nth(&deleted, i);
+		    if (item->parent != NULL) {
+			item->parent = NULL;
+			item->prevSibling = item->nextSibling = NULL;
+		    }
+		    item->firstChild = item->lastChild = NULL;
+		    item->numChildren = 0;
 		    TreeItem_Delete(tree, item);
 		}
 
@@ -9528,11 +14133,13 @@ reqSameRoot:
 
     TreeItemList_Free(&itemList);
     TreeItemList_Free(&item2List);
+    Item_PlaceSorted(tree);
     return result;
 
 errorExit:
     TreeItemList_Free(&itemList);
     TreeItemList_Free(&item2List);
+    Item_PlaceSorted(tree);
     return TCL_ERROR;
 }
 
@@ -9749,7 +14356,7 @@ SpanWalkProc_Identify(
 	TreeElement *elemPtr;
     } *data = clientData;
 
-    if (item->header != NULL) {
+    if (ITEM_HEADER(item) != NULL) {
 	if ((data->x < drawArgs->x /*+ drawArgs->indent*/) ||
 		(data->x >= drawArgs->x + drawArgs->width))
 	    return 0;
@@ -9973,7 +14580,7 @@ SpanWalkProc_GetRects(
 	data->rects[0].width = drawArgs->width - drawArgs->indent;
 	data->rects[0].height = drawArgs->height;
 #if 1
-	if (item->header != NULL) {
+	if (ITEM_HEADER(item) != NULL) {
 	    data->rects[0].x = drawArgs->x;
 	    data->rects[0].width = drawArgs->width;
 	}
@@ -10133,7 +14740,7 @@ TreeItem_CreateHeader(
     header = TreeHeader_CreateWithItem(tree, item);
     if (header == NULL) {
     }
-    item->header = header;
+    Item_GetExtra(tree, item)->header = header;
     /* This will create a TreeItemColumn and TreeHeaderColumn for every
      * TreeColumn, including the tail column. */
     (void) Item_CreateColumn(tree, item, tree->columnCount, NULL);
@@ -10172,7 +14779,7 @@ TreeItem_GetHeader(
     TreeItem item		/* Item token. */
     )
 {
-    return item->header;
+    return ITEM_HEADER(item);
 }
 
 /*
@@ -10373,6 +14980,80 @@ TreeItem_GetHeaderOptionInfo(
     return TCL_OK;
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeItem_AllocStats --
+ *
+ *	Describe the memory used by item records, for the [debug alloc]
+ *	widget command.  Style and element storage is not included.
+ *
+ * Results:
+ *	Lines of text are appended to the given string.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TreeItem_AllocStats(
+    TreeCtrl *tree,		/* Widget info. */
+    Tcl_DString *dString	/* Text is appended here. */
+    )
+{
+    TreeItem item;
+    int search, numItems = 0, numColumns = 0, numExtra = 0, spanBytes = 0;
+    int numTrigrams = 0;
+    long itemBytes, columnBytes, extraBytes, findBytes = 0, total;
+    int numTags = 0;
+    long tagBytes = 0;
+
+    item = Tree_FirstItem(tree, &search);
+    while (item != NULL) {
+	numItems++;
+	numColumns += item->columnCount;
+	if (item->extra != NULL) {
+	    numExtra++;
+	    spanBytes += item->extra->spanAlloc * (int) sizeof(int);
+	}
+	item = Tree_NextItem(tree, &search);
+    }
+
+    itemBytes = (long) numItems * sizeof(TreeItem_);
+    columnBytes = (long) numColumns * sizeof(TreeItemColumn_);
+    extraBytes = (long) numExtra * sizeof(ItemExtra) + spanBytes;
+
+    if (tree->findIndex != NULL) {
+	TreeFindIndex index = tree->findIndex;
+
+	findBytes = sizeof(struct TreeFindIndex_) +
+		(long) index->dirtyAlloc * sizeof(int) +
+		IdPostings_Bytes(&index->trigramHash, &numTrigrams);
+    }
+    if (tree->tagIndex != NULL) {
+	tagBytes = sizeof(struct TreeTagIndex_) +
+		IdPostings_Bytes(&tree->tagIndex->tagHash, &numTags);
+    }
+    total = itemBytes + columnBytes + extraBytes + findBytes + tagBytes;
+
+    DStringAppendf(dString, "%-20s: %8d : %8ld B %5ld KB\n", "Item",
+	    numItems, itemBytes, (itemBytes + 1023) / 1024);
+    DStringAppendf(dString, "%-20s: %8d : %8ld B %5ld KB\n", "ItemColumn",
+	    numColumns, columnBytes, (columnBytes + 1023) / 1024);
+    DStringAppendf(dString, "%-20s: %8d : %8ld B %5ld KB\n", "ItemExtra",
+	    numExtra, extraBytes, (extraBytes + 1023) / 1024);
+    DStringAppendf(dString, "%-20s: %8d : %8ld B %5ld KB\n", "FindIndex",
+	    numTrigrams, findBytes, (findBytes + 1023) / 1024);
+    DStringAppendf(dString, "%-20s: %8d : %8ld B %5ld KB\n", "TagIndex",
+	    numTags, tagBytes, (tagBytes + 1023) / 1024);
+    DStringAppendf(dString, "%-31s: %8d B\n", "Item record size",
+	    (int) sizeof(TreeItem_));
+    DStringAppendf(dString, "%-31s: %8ld B\n", "Bytes per item",
+	    numItems ? total / numItems : 0L);
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -10397,6 +15078,7 @@ TreeItem_InitWidget(
 {
     ItemButtonCO_Init(itemOptionSpecs, "-button", ITEM_FLAG_BUTTON,
 	    ITEM_FLAG_BUTTON_AUTO);
+    BooleanFlagCO_Init(itemOptionSpecs, "-populate", ITEM_FLAG_POPULATE);
     BooleanFlagCO_Init(itemOptionSpecs, "-visible", ITEM_FLAG_VISIBLE);
     BooleanFlagCO_Init(itemOptionSpecs, "-wrap", ITEM_FLAG_WRAP);
 
@@ -10406,6 +15088,8 @@ TreeItem_InitWidget(
     tree->activeItem = tree->root; /* always non-null */
     tree->anchorItem = tree->root; /* always non-null */
 
+    TreeItem_InvalidateDescriptions(tree);
+
     return TCL_OK;
 }
 
@@ -10432,6 +15116,14 @@ TreeItem_FreeWidget(
 {
     SpanInfoStack *siStack = tree->itemSpanPriv;
 
+    TreeItemList_Free(&tree->sortPendingList);
+
+    /* Free the [item find] and tag indexes. */
+    tree->findIndexOn = FALSE;
+    TreeItem_FindIndexConfigure(tree);
+    tree->tagIndexOn = FALSE;
+    TreeItem_TagIndexConfigure(tree);
+
     while (siStack != NULL) {
 	SpanInfoStack *next = siStack->next;
 	if (siStack->spans != NULL)
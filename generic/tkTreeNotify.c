@@ -23,6 +23,7 @@ static int EVENT_SCROLL,
     DETAIL_SCROLL_Y;
 static int EVENT_ITEM_DELETE;
 static int EVENT_ITEM_VISIBILITY;
+static int EVENT_POPULATE;
 
 /*
  *----------------------------------------------------------------------
@@ -94,6 +95,83 @@ ExpandItemList(
     }
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * CompareIds --
+ *
+ *	qsort() callback to sort item IDs in increasing order.
+ *
+ * Results:
+ *	Negative, zero or positive.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+CompareIds(
+    CONST VOID *a,
+    CONST VOID *b
+    )
+{
+    int ia = *(int *) a, ib = *(int *) b;
+
+    return (ia < ib) ? -1 : ((ia > ib) ? 1 : 0);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ExpandItemRanges --
+ *
+ *	Append a list of {first last} pairs of item IDs to a dynamic
+ *	string, one pair for each run of consecutive IDs in a list of
+ *	items.
+ *
+ * Results:
+ *	DString gets longer.
+ *
+ * Side effects:
+ *	Memory may be allocated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ExpandItemRanges(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItemList *itemList,	/* list of item IDs */
+    Tcl_DString *result		/* Gets appended. Caller must initialize. */
+    )
+{
+    int i, first, count;
+    int *ids;
+
+    Tcl_DStringStartSublist(result);
+    count = itemList ? TreeItemList_Count(itemList) : 0;
+    if (count > 0) {
+	ids = (int *) ckalloc(sizeof(int) * count);
+	for (i = 0; i < count; i++)
+	    ids[i] = TreeItem_GetID(tree, TreeItemList_Nth(itemList, i));
+	qsort((VOID *) ids, (size_t) count, sizeof(int), CompareIds);
+	for (first = i = 0; i < count; i++) {
+	    if (i + 1 < count && ids[i + 1] == ids[i] + 1)
+		continue;
+	    Tcl_DStringStartSublist(result);
+	    ExpandItem(tree, ids[first], result);
+	    Tcl_DStringAppend(result, " ", 1);
+	    ExpandItem(tree, ids[i], result);
+	    Tcl_DStringEndSublist(result);
+	    first = i + 1;
+	}
+	ckfree((char *) ids);
+    }
+    Tcl_DStringEndSublist(result);
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -280,6 +358,67 @@ Percents_ItemVisibility(
     }
 }
 
+/*
+ * The clientData of a <Selection> event.
+ */
+
+typedef struct SelectionData {
+    TreeCtrl *tree; /* Must be first. See Percents_Any(). */
+    TreeItemList *select;	/* Newly-selected items or NULL. */
+    TreeItemList *deselect;	/* Newly-deselected items or NULL. */
+    int *deletedIds;		/* Ids of deselected items that were
+				 * deleted, in increasing order. */
+    int deletedCount;		/* Number of ids in deletedIds. */
+    int count;			/* Number of selected items. */
+} SelectionData;
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ExpandItemListAndIds --
+ *
+ *	Append a list of item IDs to a dynamic string. The IDs of a
+ *	list of items and an array of IDs of deleted items are merged
+ *	in increasing order.
+ *
+ * Results:
+ *	DString gets longer.
+ *
+ * Side effects:
+ *	Memory may be allocated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ExpandItemListAndIds(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItemList *itemList,	/* Items in increasing order of ID, or
+				 * NULL. */
+    int *ids,			/* IDs in increasing order. */
+    int idCount,		/* Number of IDs. */
+    Tcl_DString *result		/* Gets appended. Caller must initialize. */
+    )
+{
+    int i = 0, j = 0, id, count;
+    char buf[10 + TCL_INTEGER_SPACE];
+
+    count = (itemList != NULL) ? TreeItemList_Count(itemList) : 0;
+    Tcl_DStringStartSublist(result);
+    while (i < count || j < idCount) {
+	if (j == idCount || (i < count &&
+		TreeItem_GetID(tree, TreeItemList_Nth(itemList, i)) < ids[j])) {
+	    id = TreeItem_GetID(tree, TreeItemList_Nth(itemList, i++));
+	} else {
+	    id = ids[j++];
+	}
+	(void) sprintf(buf, "%s%d",
+		(tree->itemPrefixLen ? tree->itemPrefix : ""), id);
+	Tcl_DStringAppendElement(result, buf);
+    }
+    Tcl_DStringEndSublist(result);
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -301,12 +440,7 @@ Percents_Selection(
     QE_ExpandArgs *args		/* %-substitution args. */
     )
 {
-    struct {
-	TreeCtrl *tree; /* Must be first. See Percents_Any(). */
-	TreeItemList *select;
-	TreeItemList *deselect;
-	int count;
-    } *data = args->clientData;
+    SelectionData *data = args->clientData;
     TreeItemList *itemList;
 
     switch (args->which) {
@@ -315,6 +449,12 @@ Percents_Selection(
 	    break;
 
 	case 'D':
+	    if (data->deletedCount > 0) {
+		ExpandItemListAndIds(data->tree, data->deselect,
+			data->deletedIds, data->deletedCount, args->result);
+		break;
+	    }
+	    /* fall through */
 	case 'S':
 	    itemList = (args->which == 'D') ? data->deselect : data->select;
 	    ExpandItemList(data->tree, itemList, args->result);
@@ -556,6 +696,75 @@ TreeNotify_OpenClose(
     (void) QE_BindEvent(tree->bindingTable, &event);
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeNotify_Populate --
+ *
+ *	Generate a <Populate> event.
+ *
+ * Results:
+ *	Any scripts bound to the event are evaluated.
+ *
+ * Side effects:
+ *	Whatever binding scripts do.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TreeNotify_Populate(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item		/* Item token. */
+    )
+{
+    QE_Event event;
+    struct {
+	TreeCtrl *tree; /* Must be first. See Percents_Any(). */
+	int id;
+    } data;
+
+    data.tree = tree;
+    data.id = TreeItem_GetID(tree, item);
+
+    event.type = EVENT_POPULATE;
+    event.detail = 0;
+    event.clientData = (ClientData) &data;
+    (void) QE_BindEvent(tree->bindingTable, &event);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeNotify_OpenCloseBound --
+ *
+ *	Tell whether any script is bound to the <Expand>, <Collapse> or
+ *	<Populate> events.
+ *
+ * Results:
+ *	TRUE if TreeNotify_OpenClose() or TreeNotify_Populate() might
+ *	evaluate a script, otherwise FALSE.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TreeNotify_OpenCloseBound(
+    TreeCtrl *tree		/* Widget info. */
+    )
+{
+    QE_BindingTable bindingTable = tree->bindingTable;
+
+    return QE_IsBound(bindingTable, EVENT_EXPAND, DETAIL_EXPAND_BEFORE) ||
+	QE_IsBound(bindingTable, EVENT_EXPAND, DETAIL_EXPAND_AFTER) ||
+	QE_IsBound(bindingTable, EVENT_COLLAPSE, DETAIL_COLLAPSE_BEFORE) ||
+	QE_IsBound(bindingTable, EVENT_COLLAPSE, DETAIL_COLLAPSE_AFTER) ||
+	QE_IsBound(bindingTable, EVENT_POPULATE, 0);
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -578,18 +787,56 @@ TreeNotify_Selection(
     TreeItemList *select,	/* List of items or NULL. */
     TreeItemList *deselect	/* List of items or NULL. */
     )
+{
+    /* Inside [$T batch] the changes are reported once at the end. */
+    if (tree->batchDepth > 0) {
+	Tree_BatchSelection(tree, select, deselect);
+	return;
+    }
+
+    TreeNotify_BatchSelection(tree, select, deselect, NULL, 0);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeNotify_BatchSelection --
+ *
+ *	Generate the <Selection> event at the end of a [$T batch]
+ *	script. Items that were selected when the script began and
+ *	were deleted by it are reported as deselected by id.
+ *
+ * Results:
+ *	Any scripts bound to the event are evaluated.
+ *
+ * Side effects:
+ *	Whatever binding scripts do. deletedIds is sorted.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TreeNotify_BatchSelection(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItemList *select,	/* List of items or NULL. */
+    TreeItemList *deselect,	/* List of items or NULL. */
+    int *deletedIds,		/* Ids of deleted items or NULL. */
+    int deletedCount		/* Number of ids in deletedIds. */
+    )
 {
     QE_Event event;
-    struct {
-	TreeCtrl *tree; /* Must be first. See Percents_Any(). */
-	TreeItemList *select;
-	TreeItemList *deselect;
-	int count;
-    } data;
+    SelectionData data;
+
+    if (deletedCount > 1) {
+	qsort((VOID *) deletedIds, (size_t) deletedCount, sizeof(int),
+		CompareIds);
+    }
 
     data.tree = tree;
     data.select = select;
     data.deselect = deselect;
+    data.deletedIds = deletedIds;
+    data.deletedCount = deletedCount;
     data.count = tree->selectCount;
 
     event.type = EVENT_SELECTION;
@@ -714,8 +961,12 @@ Percents_ItemDelete(
 	    ExpandItemList(data->tree, data->items, args->result);
 	    break;
 
+	case 'r':
+	    ExpandItemRanges(data->tree, data->items, args->result);
+	    break;
+
 	default:
-	    Percents_Any(args, Percents_ItemDelete, "i");
+	    Percents_Any(args, Percents_ItemDelete, "ir");
 	    break;
     }
 }
@@ -843,6 +1094,8 @@ TreeNotify_InitWidget(
 
     EVENT_ITEM_VISIBILITY = QE_InstallEvent(tree->bindingTable, "ItemVisibility", Percents_ItemVisibility);
 
+    EVENT_POPULATE = QE_InstallEvent(tree->bindingTable, "Populate", Percents_Expand);
+
     return TCL_OK;
 }
 
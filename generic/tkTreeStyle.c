@@ -4144,6 +4144,49 @@ TreeStyle_ToObj(
     return Tcl_NewStringObj(masterStyle->name, -1);
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * FirstItemOrHeader --
+ * NextItemOrHeader --
+ *
+ *	Walk every item followed by every header. Used when something
+ *	changes that may affect any style instance.
+ *
+ * Results:
+ *	The next item or header, or NULL when all have been seen.
+ *
+ * Side effects:
+ *	The search cursor is updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static TreeItem
+FirstItemOrHeader(
+    TreeCtrl *tree,		/* Widget info. */
+    int *searchPtr		/* Search cursor to initialize. */
+    )
+{
+    TreeItem item = Tree_FirstItem(tree, searchPtr);
+
+    return (item != NULL) ? item : tree->headerItems;
+}
+
+static TreeItem
+NextItemOrHeader(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item,		/* The current item or header. */
+    int *searchPtr		/* Search cursor initialized by
+				 * FirstItemOrHeader(). */
+    )
+{
+    if (TreeItem_GetHeader(tree, item) != NULL)
+	return TreeItem_GetNextSibling(tree, item);
+    item = Tree_NextItem(tree, searchPtr);
+    return (item != NULL) ? item : tree->headerItems;
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -4171,21 +4214,14 @@ Style_Changed(
     TreeItem item;
     TreeItemColumn column;
     TreeColumn treeColumn;
-    Tcl_HashTable *tablePtr = &tree->itemHash;
-    Tcl_HashEntry *hPtr;
-    Tcl_HashSearch search;
+    int itemSearch;
     int columnIndex, layout;
     int updateDInfo = FALSE;
     IStyle *style;
     int tailOK;
 
-    hPtr = Tcl_FirstHashEntry(tablePtr, &search);
-    if (hPtr == NULL) {
-	tablePtr = &tree->headerHash;
-	hPtr = Tcl_FirstHashEntry(tablePtr, &search);
-    }
-    while (hPtr != NULL) {
-	item = (TreeItem) Tcl_GetHashValue(hPtr);
+    item = FirstItemOrHeader(tree, &itemSearch);
+    while (item != NULL) {
 	tailOK = TreeItem_GetHeader(tree, item) != NULL;
 	treeColumn = Tree_FirstColumn(tree, -1, TreeItem_GetHeader(tree, item) != NULL);
 	column = TreeItem_GetFirstColumn(tree, item);
@@ -4208,7 +4244,7 @@ Style_Changed(
 		layout = TRUE;
 	    }
 	    columnIndex++;
-	    column = TreeItemColumn_GetNext(tree, column);
+	    column = TreeItemColumn_GetNext(tree, item, column);
 	    treeColumn = Tree_ColumnToTheRight(treeColumn, FALSE, tailOK);
 	}
 	if (layout) {
@@ -4216,11 +4252,7 @@ Style_Changed(
 	    Tree_FreeItemDInfo(tree, item, NULL);
 	    updateDInfo = TRUE;
 	}
-	hPtr = Tcl_NextHashEntry(&search);
-	if (hPtr == NULL && tablePtr == &tree->itemHash) {
-	    tablePtr = &tree->headerHash;
-	    hPtr = Tcl_FirstHashEntry(tablePtr, &search);
-	}
+	item = NextItemOrHeader(tree, item, &itemSearch);
     }
     if (updateDInfo)
 	Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
@@ -4430,15 +4462,16 @@ Style_ChangeElements(
     TreeItem item;
     TreeItemColumn column;
     TreeColumn treeColumn;
-    Tcl_HashTable *tablePtr = &tree->itemHash;
-    Tcl_HashEntry *hPtr;
-    Tcl_HashSearch search;
+    int itemSearch;
     int columnIndex, layout;
     int updateDInfo = FALSE;
     IStyle *style;
     int i, j, k, oldCount;
     int tailOK;
 
+    /* Items using this style may display different text now. */
+    TreeItem_FindIndexInvalidate(tree);
+
     /* Update -union lists */
     for (i = 0; i < masterStyle->numElements; i++) {
 	MElementLink *eLink = &masterStyle->elements[i];
@@ -4490,13 +4523,8 @@ Style_ChangeElements(
     oldCount = masterStyle->numElements;
     MStyle_ChangeElementsAux(tree, masterStyle, count, elemList, map);
 
-    hPtr = Tcl_FirstHashEntry(tablePtr, &search);
-    if (hPtr == NULL) {
-	tablePtr = &tree->headerHash;
-	hPtr = Tcl_FirstHashEntry(tablePtr, &search);
-    }
-    while (hPtr != NULL) {
-	item = (TreeItem) Tcl_GetHashValue(hPtr);
+    item = FirstItemOrHeader(tree, &itemSearch);
+    while (item != NULL) {
 	tailOK = TreeItem_GetHeader(tree, item) != NULL;
 	treeColumn = Tree_FirstColumn(tree, -1, TreeItem_GetHeader(tree, item) != NULL);
 	column = TreeItem_GetFirstColumn(tree, item);
@@ -4512,7 +4540,7 @@ Style_ChangeElements(
 		layout = TRUE;
 	    }
 	    columnIndex++;
-	    column = TreeItemColumn_GetNext(tree, column);
+	    column = TreeItemColumn_GetNext(tree, item, column);
 	    treeColumn = Tree_ColumnToTheRight(treeColumn, FALSE, tailOK);
 	}
 	if (layout) {
@@ -4520,11 +4548,7 @@ Style_ChangeElements(
 	    Tree_FreeItemDInfo(tree, item, NULL);
 	    updateDInfo = TRUE;
 	}
-	hPtr = Tcl_NextHashEntry(&search);
-	if (hPtr == NULL && tablePtr == &tree->itemHash) {
-	    tablePtr = &tree->headerHash;
-	    hPtr = Tcl_FirstHashEntry(tablePtr, &search);
-	}
+	item = NextItemOrHeader(tree, item, &itemSearch);
     }
     if (updateDInfo)
 	Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
@@ -4567,9 +4591,7 @@ Style_ElemChanged(
     TreeItem item;
     TreeItemColumn column;
     TreeColumn treeColumn;
-    Tcl_HashTable *tablePtr = &tree->itemHash;
-    Tcl_HashEntry *hPtr;
-    Tcl_HashSearch search;
+    int itemSearch;
     IElementLink *eLink;
     int columnIndex;
     TreeElementArgs args;
@@ -4582,13 +4604,8 @@ Style_ElemChanged(
     args.change.flagMaster = flagM;
     args.change.flagSelf = 0;
 
-    hPtr = Tcl_FirstHashEntry(tablePtr, &search);
-    if (hPtr == NULL) {
-	tablePtr = &tree->headerHash;
-	hPtr = Tcl_FirstHashEntry(tablePtr, &search);
-    }
-    while (hPtr != NULL) {
-	item = (TreeItem) Tcl_GetHashValue(hPtr);
+    item = FirstItemOrHeader(tree, &itemSearch);
+    while (item != NULL) {
 	tailOK = TreeItem_GetHeader(tree, item) != NULL;
 	treeColumn = Tree_FirstColumn(tree, -1, tailOK);
 	column = TreeItem_GetFirstColumn(tree, item);
@@ -4627,7 +4644,7 @@ Style_ElemChanged(
 		}
 	    }
 	    columnIndex++;
-	    column = TreeItemColumn_GetNext(tree, column);
+	    column = TreeItemColumn_GetNext(tree, item, column);
 	    treeColumn = Tree_ColumnToTheRight(treeColumn, FALSE, tailOK);
 	}
 	if (iMask & CS_LAYOUT) {
@@ -4637,11 +4654,7 @@ Style_ElemChanged(
 	}
 	else if (iMask & CS_DISPLAY) {
 	}
-	hPtr = Tcl_NextHashEntry(&search);
-	if (hPtr == NULL && tablePtr == &tree->itemHash) {
-	    tablePtr = &tree->headerHash;
-	    hPtr = Tcl_FirstHashEntry(tablePtr, &search);
-	}
+	item = NextItemOrHeader(tree, item, &itemSearch);
     }
     if (updateDInfo)
 	Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
@@ -4976,7 +4989,8 @@ TreeStyle_SetImage(
  *
  * Side effects:
  *	Size of the element and style will be marked out-of-date.
- *	A Tcl_Obj may be allocated.
+ *	A Tcl_Obj may be allocated. The item is queued to be indexed
+ *	again by [item find].
  *
  *----------------------------------------------------------------------
  */
@@ -4991,6 +5005,8 @@ TreeStyle_SetText(
     TreeElement *elemPtr	/* Returned element or NULL. */
     )
 {
+    if (item != NULL)
+	TreeItem_FindTextChanged(tree, item);
     return Style_SetImageOrText(tree, item, column, (IStyle *) style_,
 	&treeElemTypeText, tree->textOptionNameObj, valueObj, elemPtr);
 }
@@ -5023,20 +5039,15 @@ Style_Deleted(
     TreeItem item;
     TreeItemColumn column;
     TreeColumn treeColumn;
-    Tcl_HashTable *tablePtr = &tree->itemHash;
-    Tcl_HashEntry *hPtr;
-    Tcl_HashSearch search;
+    int itemSearch;
     IStyle *style;
     int columnIndex;
     int tailOK;
 
-    hPtr = Tcl_FirstHashEntry(tablePtr, &search);
-    if (hPtr == NULL) {
-	tablePtr = &tree->headerHash;
-	hPtr = Tcl_FirstHashEntry(tablePtr, &search);
-    }
-    while (hPtr != NULL) {
-	item = (TreeItem) Tcl_GetHashValue(hPtr);
+    TreeItem_FindIndexInvalidate(tree);
+
+    item = FirstItemOrHeader(tree, &itemSearch);
+    while (item != NULL) {
 	tailOK = TreeItem_GetHeader(tree, item) != NULL;
 	treeColumn = Tree_FirstColumn(tree, -1, tailOK);
 	column = TreeItem_GetFirstColumn(tree, item);
@@ -5050,14 +5061,10 @@ Style_Deleted(
 		Tree_FreeItemDInfo(tree, item, NULL);
 	    }
 	    columnIndex++;
-	    column = TreeItemColumn_GetNext(tree, column);
+	    column = TreeItemColumn_GetNext(tree, item, column);
 	    treeColumn = Tree_ColumnToTheRight(treeColumn, FALSE, tailOK);
 	}
-	hPtr = Tcl_NextHashEntry(&search);
-	if (hPtr == NULL && tablePtr == &tree->itemHash) {
-	    tablePtr = &tree->headerHash;
-	    hPtr = Tcl_FirstHashEntry(tablePtr, &search);
-	}
+	item = NextItemOrHeader(tree, item, &itemSearch);
     }
 
     /* Update each column's -itemstyle option */
@@ -5129,6 +5136,11 @@ Element_Changed(
     MElementLink *eLink;
     int i;
 
+    /* Instances without their own -text display the master's text. */
+    if ((flagM != 0) && ELEMENT_TYPE_MATCHES(masterElem->typePtr,
+	    &treeElemTypeText))
+	TreeItem_FindIndexInvalidate(tree);
+
     hPtr = Tcl_FirstHashEntry(&tree->styleHash, &search);
     while (hPtr != NULL) {
 	masterStyle = (MStyle *) Tcl_GetHashValue(hPtr);
@@ -5245,8 +5257,7 @@ typedef struct Iterate
     IStyle *style;
     TreeElementType *elemTypePtr;
     IElementLink *eLink;
-    Tcl_HashSearch search;
-    Tcl_HashEntry *hPtr;
+    int search;
 } Iterate;
 
 static int IterateItem(Iterate *iter)
@@ -5262,7 +5273,7 @@ static int IterateItem(Iterate *iter)
 		    return 1;
 	    }
 	}
-	iter->column = TreeItemColumn_GetNext(iter->tree, iter->column);
+	iter->column = TreeItemColumn_GetNext(iter->tree, iter->item, iter->column);
 	iter->columnIndex++;
     }
     return 0;
@@ -5278,14 +5289,13 @@ Tree_ElementIterateBegin(
     iter = (Iterate *) ckalloc(sizeof(Iterate));
     iter->tree = tree;
     iter->elemTypePtr = elemTypePtr;
-    iter->hPtr = Tcl_FirstHashEntry(&tree->itemHash, &iter->search);
-    while (iter->hPtr != NULL) {
-	iter->item = (TreeItem) Tcl_GetHashValue(iter->hPtr);
+    iter->item = Tree_FirstItem(tree, &iter->search);
+    while (iter->item != NULL) {
 	iter->column = TreeItem_GetFirstColumn(tree, iter->item);
 	iter->columnIndex = 0;
 	if (IterateItem(iter))
 	    return (TreeIterate) iter;
-	iter->hPtr = Tcl_NextHashEntry(&iter->search);
+	iter->item = Tree_NextItem(tree, &iter->search);
     }
     ckfree((char *) iter);
     return NULL;
@@ -5297,23 +5307,67 @@ Tree_ElementIterateNext(
 {
     Iterate *iter = (Iterate *) iter_;
 
-    iter->column = TreeItemColumn_GetNext(iter->tree, iter->column);
+    iter->column = TreeItemColumn_GetNext(iter->tree, iter->item, iter->column);
     iter->columnIndex++;
     if (IterateItem(iter))
 	return iter_;
-    iter->hPtr = Tcl_NextHashEntry(&iter->search);
-    while (iter->hPtr != NULL) {
-	iter->item = (TreeItem) Tcl_GetHashValue(iter->hPtr);
+    iter->item = Tree_NextItem(iter->tree, &iter->search);
+    while (iter->item != NULL) {
 	iter->column = TreeItem_GetFirstColumn(iter->tree, iter->item);
 	iter->columnIndex = 0;
 	if (IterateItem(iter))
 	    return iter_;
-	iter->hPtr = Tcl_NextHashEntry(&iter->search);
+	iter->item = Tree_NextItem(iter->tree, &iter->search);
     }
     ckfree((char *) iter);
     return NULL;
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * Element_FindItemColumn --
+ *
+ *	Find the item-column whose style holds an element instance.
+ *	An item's item-columns are kept in an array that is reallocated
+ *	and rearranged when columns are created, deleted or moved, so
+ *	elements must not remember them.
+ *
+ * Results:
+ *	The item-column, or NULL if the item has no style holding the
+ *	element.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static TreeItemColumn
+Element_FindItemColumn(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeItem item,		/* Item containing the element. */
+    TreeElement elem		/* Element instance. */
+    )
+{
+    TreeItemColumn column;
+    IStyle *style;
+    int i;
+
+    column = TreeItem_GetFirstColumn(tree, item);
+    while (column != NULL) {
+	style = (IStyle *) TreeItemColumn_GetStyle(tree, column);
+	if (style != NULL) {
+	    for (i = 0; i < style->master->numElements; i++) {
+		if (style->elements[i].elem == elem)
+		    return column;
+	    }
+	}
+	column = TreeItemColumn_GetNext(tree, item, column);
+    }
+    return NULL;
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -5337,7 +5391,8 @@ void
 Tree_ElementChangedItself(
     TreeCtrl *tree,		/* Widget info. */
     TreeItem item,		/* Item containing the element. */
-    TreeItemColumn column,	/* Item-column containing the element. */
+    TreeItemColumn column,	/* Item-column containing the element, or
+				 * NULL to look it up. */
     TreeElement elem,		/* The element that changed. */
     int flags,			/* Element-specific configuration flags. */
     int csM			/* CS_xxx flags detailing the effects of
@@ -5349,6 +5404,13 @@ Tree_ElementChangedItself(
 	Element_Changed(tree, elem, flags, 0, csM);
 	return;
     }
+    if (column == NULL) {
+	column = Element_FindItemColumn(tree, item, elem);
+	if (column == NULL)
+	    return;
+    }
+    if (ELEMENT_TYPE_MATCHES(elem->typePtr, &treeElemTypeText))
+	TreeItem_FindTextChanged(tree, item);
     if (csM & CS_LAYOUT) {
 	IStyle *style = (IStyle *) TreeItemColumn_GetStyle(tree, column);
 	int i;
@@ -5777,6 +5839,10 @@ TreeElementCmd(
 	return TCL_ERROR;
     }
 
+    /* The styles of deleted items still point to the master elements. */
+    if (index == COMMAND_CONFIGURE || index == COMMAND_DELETE)
+	TreeItem_FreeDeadItems(tree);
+
     switch (index) {
 	case COMMAND_CGET: {
 	    Tcl_Obj *resultObjPtr = NULL;
@@ -6770,6 +6836,11 @@ TreeStyleCmd(
 	return TCL_ERROR;
     }
 
+    /* The styles of deleted items still point to the master styles. */
+    if (index != COMMAND_CGET && index != COMMAND_CREATE &&
+	    index != COMMAND_NAMES)
+	TreeItem_FreeDeadItems(tree);
+
     switch (index) {
 	case COMMAND_CGET: {
 	    Tcl_Obj *resultObjPtr;
@@ -7421,6 +7492,45 @@ TreeStyle_GetSortData(
     return TCL_ERROR;
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeStyle_AppendTexts --
+ *
+ *	Append the text of every text element in a style to a string.
+ *	Used by [item find].
+ *
+ * Results:
+ *	Each text is appended followed by a NUL byte.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TreeStyle_AppendTexts(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeStyle style_,		/* The style. */
+    Tcl_DString *dString	/* Texts are appended here. */
+    )
+{
+    IStyle *style = (IStyle *) style_;
+    IElementLink *eLink = style->elements;
+    char *text;
+    int i, length;
+
+    for (i = 0; i < style->master->numElements; i++, eLink++) {
+	if (!ELEMENT_TYPE_MATCHES(eLink->elem->typePtr, &treeElemTypeText))
+	    continue;
+	text = TreeElement_GetText(tree, eLink->elem, &length);
+	if (text != NULL)
+	    Tcl_DStringAppend(dString, text, length);
+	Tcl_DStringAppend(dString, "", 1);
+    }
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -7658,13 +7768,15 @@ Tree_UndefineState(
 {
     TreeItem item;
     TreeItemColumn column;
-    Tcl_HashTable *tablePtr = &tree->itemHash;
+    int itemSearch;
     Tcl_HashEntry *hPtr;
     Tcl_HashSearch search;
     IElementLink *eLink;
     int i, columnIndex;
     TreeElementArgs args;
 
+    TreeItem_FreeDeadItems(tree);
+
     /* Undefine the state for the -draw and -visible style layout
      * options for each element of this style. */
     hPtr = Tcl_FirstHashEntry(&tree->styleHash, &search);
@@ -7681,13 +7793,8 @@ Tree_UndefineState(
     args.tree = tree;
     args.state = state;
 
-    hPtr = Tcl_FirstHashEntry(tablePtr, &search);
-    if (hPtr == NULL) {
-	tablePtr = &tree->headerHash;
-	hPtr = Tcl_FirstHashEntry(tablePtr, &search);
-    }
-    while (hPtr != NULL) {
-	item = (TreeItem) Tcl_GetHashValue(hPtr);
+    item = FirstItemOrHeader(tree, &itemSearch);
+    while (item != NULL) {
 	column = TreeItem_GetFirstColumn(tree, item);
 	columnIndex = 0;
 	while (column != NULL) {
@@ -7708,16 +7815,12 @@ Tree_UndefineState(
 		TreeItemColumn_InvalidateSize(tree, column);
 	    }
 	    columnIndex++;
-	    column = TreeItemColumn_GetNext(tree, column);
+	    column = TreeItemColumn_GetNext(tree, item, column);
 	}
 	TreeItem_InvalidateHeight(tree, item);
 	Tree_FreeItemDInfo(tree, item, NULL);
 	TreeItem_UndefineState(tree, item, state);
-	hPtr = Tcl_NextHashEntry(&search);
-	if (hPtr == NULL && tablePtr == &tree->itemHash) {
-	    tablePtr = &tree->headerHash;
-	    hPtr = Tcl_FirstHashEntry(tablePtr, &search);
-	}
+	item = NextItemOrHeader(tree, item, &itemSearch);
     }
     TreeColumns_InvalidateWidthOfItems(tree, NULL);
     Tree_DInfoChanged(tree, DINFO_REDO_RANGES);
@@ -7759,6 +7862,45 @@ TreeStyle_NumElements(
 	style->master->numElements;
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * TreeStyle_NeedsPromptFree --
+ *
+ *	Determine if an instance style holds an element that must be
+ *	deleted as soon as the style's item is deleted, such as a window
+ *	element with a window or a text element with a -textvariable.
+ *
+ * Results:
+ *	TRUE or FALSE.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TreeStyle_NeedsPromptFree(
+    TreeCtrl *tree,		/* Widget info. */
+    TreeStyle style_		/* Instance style. */
+    )
+{
+    IStyle *style = (IStyle *) style_;
+    IElementLink *eLink;
+    int i;
+
+    for (i = 0; i < style->master->numElements; i++) {
+	eLink = &style->elements[i];
+	/* Only element instances have per-item windows and traces. */
+	if (eLink->elem->master == NULL)
+	    continue;
+	if (TreeElement_NeedsPromptDelete(tree, eLink->elem))
+	    return TRUE;
+    }
+    return FALSE;
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -112,6 +112,46 @@ TreeCtrl_BreakIntoDebugger(
 }
 #endif /* TREECTRL_DEBUG */
 
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Tree_NumProcessors --
+ *
+ *	Determine how many processors are available to run threads.
+ *
+ * Results:
+ *	The number of online processors, or 1 if unknown.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+Tree_NumProcessors(void)
+{
+#if defined(WIN32)
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+    if (info.dwNumberOfProcessors > 0)
+	return (int) info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n > 0)
+	return (int) n;
+#endif
+    return 1;
+}
+
 /*
  * Forward declarations for procedures defined later in this file:
  */
@@ -4303,6 +4343,95 @@ TagExpr_Eval(
     return _TagExpr_Eval(expr, tagInfo);
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * TagExpr_Cover --
+ *
+ *	Find which combinations of tags can match a tag expression, so a
+ *	caller with an index from tags to items can list only the items
+ *	that could match instead of testing every item.
+ *
+ *	Every combination of the (at most TAG_EXPR_COVER_MAX) distinct
+ *	tags in the expression is tested. An item with none of those
+ *	tags matches only if the empty combination does; otherwise the
+ *	tags of a matching item include one of the matching
+ *	combinations.
+ *
+ * Results:
+ *	FALSE if the expression has too many tags, or if it matches an
+ *	item with none of its tags. Otherwise TRUE, the tags are stored
+ *	in uids[] and each matching combination is stored in masks[] as
+ *	a bit mask of uids[] indexes.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TagExpr_Cover(
+    TagExpr *expr,		/* Info about a tag expression. */
+    Tk_Uid uids[],		/* Out: TAG_EXPR_COVER_MAX tags. */
+    int *numUidsPtr,		/* Out: number of tags in uids[]. */
+    int masks[],		/* Out: 1 << TAG_EXPR_COVER_MAX masks. */
+    int *numMasksPtr		/* Out: number of masks in masks[]. */
+    )
+{
+    SearchUids *searchUids;
+    struct {
+	TagInfo tagInfo;
+	Tk_Uid more[TAG_EXPR_COVER_MAX];
+    } combo;
+    Tk_Uid uid;
+    int i, j, mask, numUids = 0, numMasks = 0;
+
+    *numUidsPtr = *numMasksPtr = 0;
+
+    /* An empty expression matches nothing. */
+    if (expr->stringLength == 0)
+	return TRUE;
+
+    if (expr->simple) {
+	uids[numUids++] = expr->uid;
+    } else {
+	searchUids = GetStaticUids();
+	for (i = 0; i < expr->length; i++) {
+	    uid = expr->uids[i];
+	    if ((uid != searchUids->tagvalUid) &&
+		    (uid != searchUids->negtagvalUid))
+		continue;
+	    uid = expr->uids[++i];
+	    for (j = 0; j < numUids; j++) {
+		if (uids[j] == uid)
+		    break;
+	    }
+	    if (j < numUids)
+		continue;
+	    if (numUids == TAG_EXPR_COVER_MAX)
+		return FALSE;
+	    uids[numUids++] = uid;
+	}
+    }
+
+    for (mask = 0; mask < (1 << numUids); mask++) {
+	combo.tagInfo.numTags = 0;
+	for (j = 0; j < numUids; j++) {
+	    if (mask & (1 << j))
+		combo.tagInfo.tagPtr[combo.tagInfo.numTags++] = uids[j];
+	}
+	if (!TagExpr_Eval(expr, &combo.tagInfo))
+	    continue;
+	if (mask == 0)
+	    return FALSE;
+	masks[numMasks++] = mask;
+    }
+    *numUidsPtr = numUids;
+    *numMasksPtr = numMasks;
+    return TRUE;
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -0,0 +1,67 @@
+# all.tcl --
+#
+# This file contains a top-level script to run the treectrl benchmarks.
+# Execute it by invoking "make bench", or by sourcing it into wish with
+# the treectrl package on the auto_path. Each *.bench file in this
+# directory is sourced in turn and reports timings with the [bench]
+# command defined below.
+#
+# Command-line options:
+#	-match pattern	Only run benchmarks whose name matches the pattern.
+#	-scale N	Multiply the default item counts by N (may be a
+#			fraction, e.g. 0.1 for a quick run).
+#
+# See the file "license.terms" for information on usage and redistribution
+# of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+
+package require Tk
+package require treectrl
+
+namespace eval ::bench {
+    variable match *
+    variable scale 1.0
+}
+
+foreach {option value} $argv {
+    switch -- $option {
+	-match { set ::bench::match $value }
+	-scale { set ::bench::scale $value }
+	default {
+	    puts stderr "unknown option \"$option\": must be -match or -scale"
+	    exit 1
+	}
+    }
+}
+
+# ::bench::count --
+#
+#	Return a default item count multiplied by the -scale option.
+
+proc ::bench::count {n} {
+    variable scale
+    set n [expr {int($n * $scale)}]
+    return [expr {($n < 1) ? 1 : $n}]
+}
+
+# bench --
+#
+#	Run the setup script, then time the body script once and print the
+#	elapsed time. The cleanup script is always run.
+
+proc bench {name description args} {
+    array set opts {-setup {} -body {} -cleanup {}}
+    array set opts $args
+    if {![string match $::bench::match $name]} return
+    uplevel #0 $opts(-setup)
+    set usec [lindex [time {uplevel #0 $opts(-body)}] 0]
+    uplevel #0 $opts(-cleanup)
+    puts [format "%-24s %10.1f ms  %s" $name [expr {$usec / 1000.0}] \
+	$description]
+    update
+}
+
+puts "treectrl [package provide treectrl], Tk [package provide Tk]"
+foreach file [lsort [glob -directory [file dirname [info script]] *.bench]] {
+    source $file
+}
+exit